@@ -6,42 +6,107 @@
  */
 
 #include <config.h>
-#include <stdio.h>
+#include <string.h>
 
 #include "mbim-common.h"
 
 /*****************************************************************************/
 
-gchar *
-mbim_common_str_hex (gconstpointer mem,
-                     gsize size,
-                     gchar delimiter)
+/* Two uppercase hex digits for every possible byte value */
+static const gchar hex_pairs[] =
+    "000102030405060708090A0B0C0D0E0F"
+    "101112131415161718191A1B1C1D1E1F"
+    "202122232425262728292A2B2C2D2E2F"
+    "303132333435363738393A3B3C3D3E3F"
+    "404142434445464748494A4B4C4D4E4F"
+    "505152535455565758595A5B5C5D5E5F"
+    "606162636465666768696A6B6C6D6E6F"
+    "707172737475767778797A7B7C7D7E7F"
+    "808182838485868788898A8B8C8D8E8F"
+    "909192939495969798999A9B9C9D9E9F"
+    "A0A1A2A3A4A5A6A7A8A9AAABACADAEAF"
+    "B0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+    "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECF"
+    "D0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+    "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEF"
+    "F0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+/* Writes the hex representation of @size bytes (@size > 0) followed by a
+ * NUL, and returns a pointer to that NUL. The output takes exactly 3 bytes
+ * per input byte: two digits and either the delimiter or the final NUL. */
+static gchar *
+str_hex_write (const guint8 *data,
+               gsize         size,
+               gchar         delimiter,
+               gchar        *out)
 {
-    const guint8 *data = mem;
     gsize i;
-    gsize j;
-    gsize new_str_length;
+
+    for (i = 0; i < size; i++, out += 3) {
+        memcpy (out, &hex_pairs[2 * data[i]], 2);
+        out[2] = delimiter;
+    }
+    out[-1] = '\0';
+    return &out[-1];
+}
+
+gsize
+mbim_common_str_hex_to_buffer (gconstpointer  mem,
+                               gsize          size,
+                               gchar          delimiter,
+                               gchar         *out,
+                               gsize          out_size)
+{
+    gsize n;
+
+    if (!out_size)
+        return 0;
+
+    n = MIN (size, out_size / 3);
+    if (!n) {
+        out[0] = '\0';
+        return 0;
+    }
+
+    str_hex_write (mem, n, delimiter, out);
+    return n;
+}
+
+gchar *
+mbim_common_str_hex_truncated (gconstpointer mem,
+                               gsize         size,
+                               gsize         max_size,
+                               gchar         delimiter)
+{
     gchar *new_str;
+    gchar *end;
 
-    /* Get new string length. If input string has N bytes, we need:
-     * - 1 byte for last NUL char
-     * - 2N bytes for hexadecimal char representation of each byte...
-     * - N-1 bytes for the separator ':'
-     * So... a total of (1+2N+N-1) = 3N bytes are needed... */
-    new_str_length =  3 * size;
-
-    /* Allocate memory for new array and initialize contents to NUL */
-    new_str = g_malloc0 (new_str_length);
-
-    /* Print hexadecimal representation of each byte... */
-    for (i = 0, j = 0; i < size; i++, j += 3) {
-        /* Print character in output string... */
-        snprintf (&new_str[j], 3, "%02X", data[i]);
-        /* And if needed, add separator */
-        if (i != (size - 1) )
-            new_str[j + 2] = delimiter;
+    if (!size)
+        return NULL;
+
+    if (size <= max_size) {
+        /* If input string has N bytes, we need 2N bytes for the hexadecimal
+         * representation, N-1 bytes for the delimiters and 1 byte for the
+         * last NUL char; a total of 3N bytes. */
+        new_str = g_malloc (3 * size);
+        str_hex_write (mem, size, delimiter, new_str);
+        return new_str;
     }
 
-    /* Set output string */
+    if (!max_size)
+        return g_strdup ("...");
+
+    /* Same as above, plus the ellipsis replacing the last NUL */
+    new_str = g_malloc (3 * max_size + 3);
+    end = str_hex_write (mem, max_size, delimiter, new_str);
+    memcpy (end, "...", 4);
     return new_str;
 }
+
+gchar *
+mbim_common_str_hex (gconstpointer mem,
+                     gsize size,
+                     gchar delimiter)
+{
+    return mbim_common_str_hex_truncated (mem, size, size, delimiter);
+}
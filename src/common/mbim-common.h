@@ -14,4 +14,20 @@ gchar *mbim_common_str_hex (gconstpointer mem,
                             gsize         size,
                             gchar         delimiter);
 
+/* Like mbim_common_str_hex(), but printing at most @max_size bytes, and
+ * appending "..." if the input was longer. */
+gchar *mbim_common_str_hex_truncated (gconstpointer mem,
+                                      gsize         size,
+                                      gsize         max_size,
+                                      gchar         delimiter);
+
+/* Writes the hex representation of as many bytes of @mem as fit in @out
+ * (3 bytes of output per input byte, including the final NUL), and returns
+ * the number of input bytes written. */
+gsize mbim_common_str_hex_to_buffer (gconstpointer  mem,
+                                     gsize          size,
+                                     gchar          delimiter,
+                                     gchar         *out,
+                                     gsize          out_size);
+
 #endif /* _COMMON_MBIM_COMMON_H_ */
@@ -33,6 +33,50 @@ test_common_str_hex (void)
     g_free (str);
 }
 
+static void
+test_common_str_hex_truncated (void)
+{
+    static const guint8 buffer [] = { 0x00, 0xDE, 0xAD, 0xC0, 0xDE };
+    gchar *str;
+
+    str = mbim_common_str_hex_truncated (buffer, 0, 2, ':');
+    g_assert (str == NULL);
+
+    str = mbim_common_str_hex_truncated (buffer, 5, 0, ':');
+    g_assert_cmpstr (str, ==, "...");
+    g_free (str);
+
+    str = mbim_common_str_hex_truncated (buffer, 5, 2, ':');
+    g_assert_cmpstr (str, ==, "00:DE...");
+    g_free (str);
+
+    str = mbim_common_str_hex_truncated (buffer, 5, 5, ':');
+    g_assert_cmpstr (str, ==, "00:DE:AD:C0:DE");
+    g_free (str);
+
+    str = mbim_common_str_hex_truncated (buffer, 5, G_MAXSIZE, ':');
+    g_assert_cmpstr (str, ==, "00:DE:AD:C0:DE");
+    g_free (str);
+}
+
+static void
+test_common_str_hex_to_buffer (void)
+{
+    static const guint8 buffer [] = { 0x00, 0xDE, 0xAD, 0xC0, 0xDE };
+    gchar out[16];
+
+    g_assert_cmpuint (mbim_common_str_hex_to_buffer (buffer, 5, ':', out, 0), ==, 0);
+
+    g_assert_cmpuint (mbim_common_str_hex_to_buffer (buffer, 5, ':', out, 2), ==, 0);
+    g_assert_cmpstr (out, ==, "");
+
+    g_assert_cmpuint (mbim_common_str_hex_to_buffer (buffer, 5, ':', out, 8), ==, 2);
+    g_assert_cmpstr (out, ==, "00:DE");
+
+    g_assert_cmpuint (mbim_common_str_hex_to_buffer (buffer, 5, ' ', out, sizeof (out)), ==, 5);
+    g_assert_cmpstr (out, ==, "00 DE AD C0 DE");
+}
+
 /*****************************************************************************/
 
 int main (int argc, char **argv)
@@ -40,6 +84,8 @@ int main (int argc, char **argv)
     g_test_init (&argc, &argv, NULL);
 
     g_test_add_func ("/common/str_hex", test_common_str_hex);
+    g_test_add_func ("/common/str_hex_truncated", test_common_str_hex_truncated);
+    g_test_add_func ("/common/str_hex_to_buffer", test_common_str_hex_to_buffer);
 
     return g_test_run ();
 }
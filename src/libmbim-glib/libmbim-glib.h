@@ -20,6 +20,7 @@
 #include "mbim-cid.h"
 #include "mbim-message.h"
 #include "mbim-device.h"
+#include "mbim-device-manager.h"
 #include "mbim-enums.h"
 #include "mbim-proxy.h"
 #include "mbim-tlv.h"
@@ -0,0 +1,565 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * libmbim-glib -- GLib/GIO based library to control MBIM devices
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "config.h"
+#include "mbim-capture.h"
+#include "mbim-error-types.h"
+#include "mbim-errors.h"
+
+/*****************************************************************************/
+/* pcapng format */
+
+#define PCAPNG_BLOCK_TYPE_SHB    0x0A0D0D0A
+#define PCAPNG_BLOCK_TYPE_IDB    0x00000001
+#define PCAPNG_BLOCK_TYPE_EPB    0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC  0x1A2B3C4D
+
+#define PCAPNG_OPT_ENDOFOPT      0
+#define PCAPNG_OPT_SHB_USERAPPL  4
+#define PCAPNG_OPT_IF_NAME       2
+#define PCAPNG_OPT_IF_TSRESOL    9
+#define PCAPNG_OPT_EPB_FLAGS     2
+
+#define PCAPNG_EPB_FLAGS_INBOUND  0x1
+#define PCAPNG_EPB_FLAGS_OUTBOUND 0x2
+
+/* Wireshark exported PDUs, with the name of the dissector to use as tag */
+#define LINKTYPE_WIRESHARK_UPPER_PDU 252
+#define EXP_PDU_TAG_END_OF_OPT       0
+#define EXP_PDU_TAG_PROTO_NAME       12
+#define EXP_PDU_DISSECTOR            "mbim.control"
+
+#define PAD4(len) (((len) + 3) & ~3)
+
+/*****************************************************************************/
+
+#define QUEUE_SIZE            4096 /* power of 2 */
+#define WRITER_IDLE_WAIT_USEC (100 * G_TIME_SPAN_MILLISECOND)
+
+typedef struct {
+    guint32 interface_id;
+    guint32 direction;
+    gint64  timestamp;
+    gsize   length;
+    guint8  data[];
+} Record;
+
+typedef struct {
+    gint     sequence;
+    Record  *record;
+} Cell;
+
+struct _MbimCapture {
+    volatile gint ref_count;
+
+    gchar   *path;
+    guint64  max_file_size;
+    guint    max_files;
+
+    /* Wall clock time matching the monotonic start time */
+    gint64   start_real_time;
+    gint64   start_monotonic_time;
+
+    /* Bounded multi-producer single-consumer queue of records */
+    Cell     cells[QUEUE_SIZE];
+    gint     enqueue_pos;
+    guint    dequeue_pos;
+    gint     n_dropped;
+
+    /* Interfaces added but not yet known by the writer */
+    GMutex     interfaces_lock;
+    GPtrArray *pending_interfaces;
+    guint32    n_interfaces;
+
+    /* Writer thread */
+    GThread  *writer;
+    GMutex    writer_lock;
+    GCond     writer_cond;
+    GCond     flush_cond;
+    gint      writer_sleeping;
+    gint      stopping;
+    guint     flush_requested;
+    guint     flush_done;
+
+    /* Owned by the writer thread */
+    FILE      *file;
+    guint64    file_size;
+    GPtrArray *interfaces;
+    gboolean   write_error_reported;
+};
+
+/*****************************************************************************/
+/* Queue */
+
+static gboolean
+queue_push (MbimCapture *self,
+            Record      *record)
+{
+    Cell  *cell;
+    guint  pos;
+
+    pos = (guint) g_atomic_int_get (&self->enqueue_pos);
+    for (;;) {
+        gint diff;
+
+        cell = &self->cells[pos & (QUEUE_SIZE - 1)];
+        diff = (gint) ((guint) g_atomic_int_get (&cell->sequence) - pos);
+        if (diff == 0) {
+            if (g_atomic_int_compare_and_exchange (&self->enqueue_pos, (gint) pos, (gint) (pos + 1)))
+                break;
+            pos = (guint) g_atomic_int_get (&self->enqueue_pos);
+        } else if (diff < 0) {
+            /* Full */
+            return FALSE;
+        } else
+            pos = (guint) g_atomic_int_get (&self->enqueue_pos);
+    }
+
+    cell->record = record;
+    g_atomic_int_set (&cell->sequence, (gint) (pos + 1));
+    return TRUE;
+}
+
+/* Only run by the writer thread */
+static gboolean
+queue_is_empty (MbimCapture *self)
+{
+    Cell *cell;
+
+    cell = &self->cells[self->dequeue_pos & (QUEUE_SIZE - 1)];
+    return (gint) ((guint) g_atomic_int_get (&cell->sequence) - (self->dequeue_pos + 1)) < 0;
+}
+
+static Record *
+queue_pop (MbimCapture *self)
+{
+    Cell   *cell;
+    Record *record;
+
+    if (queue_is_empty (self))
+        return NULL;
+
+    cell = &self->cells[self->dequeue_pos & (QUEUE_SIZE - 1)];
+    record = cell->record;
+    cell->record = NULL;
+    g_atomic_int_set (&cell->sequence, (gint) (self->dequeue_pos + QUEUE_SIZE));
+    self->dequeue_pos++;
+    return record;
+}
+
+/*****************************************************************************/
+/* File writing, only run by the writer thread */
+
+static void
+append_option (GByteArray   *block,
+               guint16       code,
+               gconstpointer value,
+               guint16       length)
+{
+    static const guint8 padding[3] = { 0 };
+
+    g_byte_array_append (block, (const guint8 *)&code, sizeof (code));
+    g_byte_array_append (block, (const guint8 *)&length, sizeof (length));
+    if (length) {
+        g_byte_array_append (block, value, length);
+        g_byte_array_append (block, padding, PAD4 (length) - length);
+    }
+}
+
+static void
+append_guint32 (GByteArray *block,
+                guint32     value)
+{
+    g_byte_array_append (block, (const guint8 *)&value, sizeof (value));
+}
+
+/* Blocks are built with type and length placeholders */
+static GByteArray *
+block_new (guint32 type)
+{
+    GByteArray *block;
+
+    block = g_byte_array_sized_new (64);
+    append_guint32 (block, type);
+    append_guint32 (block, 0);
+    return block;
+}
+
+static gboolean
+block_write (MbimCapture *self,
+             GByteArray  *block)
+{
+    guint32 total;
+
+    append_guint32 (block, 0);
+    total = block->len;
+    memcpy (&block->data[4], &total, sizeof (total));
+    memcpy (&block->data[total - 4], &total, sizeof (total));
+
+    if (!self->file)
+        return FALSE;
+
+    if (fwrite (block->data, block->len, 1, self->file) != 1) {
+        if (!self->write_error_reported) {
+            g_warning ("couldn't write to capture file '%s': %s", self->path, g_strerror (errno));
+            self->write_error_reported = TRUE;
+        }
+        return FALSE;
+    }
+    self->file_size += block->len;
+    return TRUE;
+}
+
+static void
+write_section_header (MbimCapture *self)
+{
+    g_autoptr(GByteArray) block = NULL;
+    guint16               version[2] = { 1, 0 };
+    gint64                section_length = -1;
+    static const gchar   *userappl = "libmbim-glib " PACKAGE_VERSION;
+
+    block = block_new (PCAPNG_BLOCK_TYPE_SHB);
+    append_guint32 (block, PCAPNG_BYTE_ORDER_MAGIC);
+    g_byte_array_append (block, (const guint8 *)version, sizeof (version));
+    g_byte_array_append (block, (const guint8 *)&section_length, sizeof (section_length));
+    append_option (block, PCAPNG_OPT_SHB_USERAPPL, userappl, strlen (userappl));
+    append_option (block, PCAPNG_OPT_ENDOFOPT, NULL, 0);
+    block_write (self, block);
+}
+
+static void
+write_interface (MbimCapture *self,
+                 const gchar *name)
+{
+    g_autoptr(GByteArray) block = NULL;
+    guint16               linktype[2] = { LINKTYPE_WIRESHARK_UPPER_PDU, 0 };
+    guint8                tsresol = 6; /* microseconds */
+
+    block = block_new (PCAPNG_BLOCK_TYPE_IDB);
+    g_byte_array_append (block, (const guint8 *)linktype, sizeof (linktype));
+    append_guint32 (block, 0); /* snaplen */
+    append_option (block, PCAPNG_OPT_IF_NAME, name, strlen (name));
+    append_option (block, PCAPNG_OPT_IF_TSRESOL, &tsresol, sizeof (tsresol));
+    append_option (block, PCAPNG_OPT_ENDOFOPT, NULL, 0);
+    block_write (self, block);
+}
+
+static void
+write_record (MbimCapture *self,
+              Record      *record)
+{
+    g_autoptr(GByteArray) block = NULL;
+    guint64               timestamp;
+    guint32               packet_length;
+    guint32               flags;
+    guint16               tag[2];
+    static const guint8   padding[3] = { 0 };
+
+    block = block_new (PCAPNG_BLOCK_TYPE_EPB);
+
+    timestamp = self->start_real_time + (record->timestamp - self->start_monotonic_time);
+    packet_length = 2 * sizeof (tag) + PAD4 (strlen (EXP_PDU_DISSECTOR)) + record->length;
+    append_guint32 (block, record->interface_id);
+    append_guint32 (block, (guint32) (timestamp >> 32));
+    append_guint32 (block, (guint32) (timestamp & 0xFFFFFFFF));
+    append_guint32 (block, packet_length);
+    append_guint32 (block, packet_length);
+
+    /* Exported PDU tags are always big endian */
+    tag[0] = GUINT16_TO_BE (EXP_PDU_TAG_PROTO_NAME);
+    tag[1] = GUINT16_TO_BE (PAD4 (strlen (EXP_PDU_DISSECTOR)));
+    g_byte_array_append (block, (const guint8 *)tag, sizeof (tag));
+    g_byte_array_append (block, (const guint8 *)EXP_PDU_DISSECTOR, strlen (EXP_PDU_DISSECTOR));
+    g_byte_array_append (block, padding, PAD4 (strlen (EXP_PDU_DISSECTOR)) - strlen (EXP_PDU_DISSECTOR));
+    tag[0] = GUINT16_TO_BE (EXP_PDU_TAG_END_OF_OPT);
+    tag[1] = 0;
+    g_byte_array_append (block, (const guint8 *)tag, sizeof (tag));
+
+    g_byte_array_append (block, record->data, record->length);
+    g_byte_array_append (block, padding, PAD4 (packet_length) - packet_length);
+
+    flags = (record->direction == MBIM_CAPTURE_DIRECTION_IN) ? PCAPNG_EPB_FLAGS_INBOUND : PCAPNG_EPB_FLAGS_OUTBOUND;
+    append_option (block, PCAPNG_OPT_EPB_FLAGS, &flags, sizeof (flags));
+    append_option (block, PCAPNG_OPT_ENDOFOPT, NULL, 0);
+    block_write (self, block);
+}
+
+static gboolean
+open_file (MbimCapture  *self,
+           GError      **error)
+{
+    guint i;
+
+    self->file = g_fopen (self->path, "wb");
+    if (!self->file) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "Couldn't open capture file '%s': %s", self->path, g_strerror (errno));
+        return FALSE;
+    }
+    self->file_size = 0;
+
+    /* Every file must be readable on its own */
+    write_section_header (self);
+    for (i = 0; i < self->interfaces->len; i++)
+        write_interface (self, g_ptr_array_index (self->interfaces, i));
+    return TRUE;
+}
+
+static void
+rotate_file (MbimCapture *self)
+{
+    g_autoptr(GError) error = NULL;
+    guint             i;
+
+    fclose (self->file);
+    self->file = NULL;
+
+    /* path.N-2 -> path.N-1, ..., path -> path.1; the oldest is overwritten */
+    for (i = self->max_files - 1; i > 0; i--) {
+        g_autofree gchar *from = NULL;
+        g_autofree gchar *to = NULL;
+
+        from = (i > 1) ? g_strdup_printf ("%s.%u", self->path, i - 1) : g_strdup (self->path);
+        to = g_strdup_printf ("%s.%u", self->path, i);
+        if (g_rename (from, to) < 0 && errno != ENOENT)
+            g_warning ("couldn't rotate capture file '%s': %s", from, g_strerror (errno));
+    }
+
+    if (!open_file (self, &error))
+        g_warning ("%s", error->message);
+}
+
+static void
+load_pending_interfaces (MbimCapture *self)
+{
+    guint i;
+
+    g_mutex_lock (&self->interfaces_lock);
+    for (i = 0; i < self->pending_interfaces->len; i++) {
+        gchar *name;
+
+        name = g_ptr_array_index (self->pending_interfaces, i);
+        g_ptr_array_add (self->interfaces, name);
+        write_interface (self, name);
+    }
+    /* Names now owned by the interfaces array */
+    g_ptr_array_set_size (self->pending_interfaces, 0);
+    g_mutex_unlock (&self->interfaces_lock);
+}
+
+static guint
+writer_drain (MbimCapture *self)
+{
+    Record *record;
+    guint   n_records = 0;
+
+    while ((record = queue_pop (self)) != NULL) {
+        /* Interfaces are always added before their first record */
+        if (record->interface_id >= self->interfaces->len)
+            load_pending_interfaces (self);
+
+        if (self->max_file_size && self->file_size >= self->max_file_size)
+            rotate_file (self);
+        write_record (self, record);
+        g_free (record);
+        n_records++;
+    }
+    return n_records;
+}
+
+static gpointer
+writer_thread (MbimCapture *self)
+{
+    for (;;) {
+        guint flush_target;
+
+        /* Records added before a flush request are in the queue by now */
+        g_mutex_lock (&self->writer_lock);
+        flush_target = self->flush_requested;
+        g_mutex_unlock (&self->writer_lock);
+
+        load_pending_interfaces (self);
+        if (writer_drain (self) > 0)
+            continue;
+
+        /* Idle: make everything written so far visible */
+        if (self->file)
+            fflush (self->file);
+
+        g_mutex_lock (&self->writer_lock);
+        if (self->flush_done != flush_target) {
+            self->flush_done = flush_target;
+            g_cond_broadcast (&self->flush_cond);
+        }
+        if (g_atomic_int_get (&self->stopping)) {
+            g_mutex_unlock (&self->writer_lock);
+            break;
+        }
+        /* Sleeping flag set before checking the queue once more, so that
+         * producers either see it or their record is seen here */
+        g_atomic_int_set (&self->writer_sleeping, TRUE);
+        if (queue_is_empty (self) && self->flush_done == self->flush_requested)
+            g_cond_wait_until (&self->writer_cond, &self->writer_lock, g_get_monotonic_time () + WRITER_IDLE_WAIT_USEC);
+        g_atomic_int_set (&self->writer_sleeping, FALSE);
+        g_mutex_unlock (&self->writer_lock);
+    }
+
+    return NULL;
+}
+
+static void
+writer_wakeup (MbimCapture *self)
+{
+    g_mutex_lock (&self->writer_lock);
+    g_cond_signal (&self->writer_cond);
+    g_mutex_unlock (&self->writer_lock);
+}
+
+/*****************************************************************************/
+
+guint32
+_mbim_capture_add_interface (MbimCapture *self,
+                             const gchar *name)
+{
+    guint32 interface_id;
+
+    g_mutex_lock (&self->interfaces_lock);
+    interface_id = self->n_interfaces++;
+    g_ptr_array_add (self->pending_interfaces, g_strdup (name));
+    g_mutex_unlock (&self->interfaces_lock);
+
+    return interface_id;
+}
+
+void
+_mbim_capture_add (MbimCapture          *self,
+                   guint32               interface_id,
+                   MbimCaptureDirection  direction,
+                   const guint8         *data,
+                   gsize                 length)
+{
+    Record *record;
+
+    record = g_malloc (sizeof (Record) + length);
+    record->interface_id = interface_id;
+    record->direction = direction;
+    record->timestamp = g_get_monotonic_time ();
+    record->length = length;
+    memcpy (record->data, data, length);
+
+    if (!queue_push (self, record)) {
+        g_atomic_int_inc (&self->n_dropped);
+        g_free (record);
+        return;
+    }
+
+    if (g_atomic_int_get (&self->writer_sleeping))
+        writer_wakeup (self);
+}
+
+void
+_mbim_capture_flush (MbimCapture *self)
+{
+    guint target;
+
+    g_mutex_lock (&self->writer_lock);
+    target = ++self->flush_requested;
+    g_cond_signal (&self->writer_cond);
+    while ((gint) (self->flush_done - target) < 0)
+        g_cond_wait (&self->flush_cond, &self->writer_lock);
+    g_mutex_unlock (&self->writer_lock);
+}
+
+guint64
+_mbim_capture_get_n_dropped (MbimCapture *self)
+{
+    return (guint) g_atomic_int_get (&self->n_dropped);
+}
+
+/*****************************************************************************/
+
+MbimCapture *
+_mbim_capture_ref (MbimCapture *self)
+{
+    g_atomic_int_inc (&self->ref_count);
+    return self;
+}
+
+static void
+capture_free (MbimCapture *self)
+{
+    if (self->file)
+        fclose (self->file);
+    g_ptr_array_unref (self->interfaces);
+    g_ptr_array_foreach (self->pending_interfaces, (GFunc)g_free, NULL);
+    g_ptr_array_unref (self->pending_interfaces);
+    g_mutex_clear (&self->interfaces_lock);
+    g_mutex_clear (&self->writer_lock);
+    g_cond_clear (&self->writer_cond);
+    g_cond_clear (&self->flush_cond);
+    g_free (self->path);
+    g_free (self);
+}
+
+void
+_mbim_capture_unref (MbimCapture *self)
+{
+    if (!g_atomic_int_dec_and_test (&self->ref_count))
+        return;
+
+    /* The writer drains the queue before exiting */
+    g_atomic_int_set (&self->stopping, TRUE);
+    writer_wakeup (self);
+    g_thread_join (self->writer);
+
+    if (self->n_dropped)
+        g_debug ("capture '%s' finished: %u messages dropped", self->path, (guint) self->n_dropped);
+
+    capture_free (self);
+}
+
+MbimCapture *
+_mbim_capture_new (const gchar  *path,
+                   guint64       max_file_size,
+                   guint         max_files,
+                   GError      **error)
+{
+    MbimCapture *self;
+    guint        i;
+
+    g_assert (path);
+
+    self = g_new0 (MbimCapture, 1);
+    self->ref_count = 1;
+    self->path = g_strdup (path);
+    self->max_file_size = max_file_size;
+    self->max_files = MAX (max_files, 1);
+    self->start_real_time = g_get_real_time ();
+    self->start_monotonic_time = g_get_monotonic_time ();
+    for (i = 0; i < QUEUE_SIZE; i++)
+        self->cells[i].sequence = (gint) i;
+    g_mutex_init (&self->interfaces_lock);
+    self->pending_interfaces = g_ptr_array_new ();
+    self->interfaces = g_ptr_array_new_with_free_func (g_free);
+    g_mutex_init (&self->writer_lock);
+    g_cond_init (&self->writer_cond);
+    g_cond_init (&self->flush_cond);
+
+    if (!open_file (self, error)) {
+        capture_free (self);
+        return NULL;
+    }
+
+    self->writer = g_thread_new ("mbim-capture", (GThreadFunc)writer_thread, self);
+    return self;
+}
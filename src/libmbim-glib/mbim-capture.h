@@ -0,0 +1,62 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * libmbim-glib -- GLib/GIO based library to control MBIM devices
+ *
+ * This is a private non-installed header
+ */
+
+#ifndef _LIBMBIM_GLIB_MBIM_CAPTURE_H_
+#define _LIBMBIM_GLIB_MBIM_CAPTURE_H_
+
+#if !defined (LIBMBIM_GLIB_COMPILATION)
+#error "This is a private header!!"
+#endif
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Capture of raw MBIM messages into a pcapng file.
+ *
+ * Each message is stored as an Enhanced Packet Block using the Wireshark
+ * "exported PDU" link type, tagged to be decoded by the 'mbim.control'
+ * dissector, with the direction in the packet flags. Each device is a
+ * different interface in the file, named after the device path.
+ *
+ * Adding messages never blocks: they're copied into a bounded lock-free
+ * queue and written to disk by a separate thread. Messages are dropped (and
+ * counted) if the writer can't keep up. Once a file reaches the maximum
+ * size, it is rotated into 'path.1', 'path.2'... up to the maximum number
+ * of files.
+ */
+
+typedef struct _MbimCapture MbimCapture;
+
+typedef enum {
+    MBIM_CAPTURE_DIRECTION_IN,
+    MBIM_CAPTURE_DIRECTION_OUT,
+} MbimCaptureDirection;
+
+MbimCapture *_mbim_capture_new           (const gchar          *path,
+                                          guint64               max_file_size,
+                                          guint                 max_files,
+                                          GError              **error);
+MbimCapture *_mbim_capture_ref           (MbimCapture          *self);
+void         _mbim_capture_unref         (MbimCapture          *self);
+guint32      _mbim_capture_add_interface (MbimCapture          *self,
+                                          const gchar          *name);
+void         _mbim_capture_add           (MbimCapture          *self,
+                                          guint32               interface_id,
+                                          MbimCaptureDirection  direction,
+                                          const guint8         *data,
+                                          gsize                 length);
+void         _mbim_capture_flush         (MbimCapture          *self);
+guint64      _mbim_capture_get_n_dropped (MbimCapture          *self);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (MbimCapture, _mbim_capture_unref)
+
+G_END_DECLS
+
+#endif /* _LIBMBIM_GLIB_MBIM_CAPTURE_H_ */
@@ -121,10 +121,12 @@ static const CidConfig cid_ms_sar_config [MBIM_CID_MS_SAR_LAST] = {
 };
 
 /* Note: index of the array is CID-1 */
-#define MBIM_CID_PROXY_CONTROL_LAST MBIM_CID_PROXY_CONTROL_VERSION
+#define MBIM_CID_PROXY_CONTROL_LAST MBIM_CID_PROXY_CONTROL_MEMORY_USAGE
 static const CidConfig cid_proxy_control_config [MBIM_CID_PROXY_CONTROL_LAST] = {
     { SET,    NO_QUERY, NO_NOTIFY }, /* MBIM_CID_PROXY_CONTROL_CONFIGURATION */
     { NO_SET, NO_QUERY, NOTIFY    }, /* MBIM_CID_PROXY_CONTROL_VERSION */
+    { SET,    NO_QUERY, NO_NOTIFY }, /* MBIM_CID_PROXY_CONTROL_TRANSPORT */
+    { NO_SET, QUERY,    NO_NOTIFY }, /* MBIM_CID_PROXY_CONTROL_MEMORY_USAGE */
 };
 
 /* Note: index of the array is CID-1 */
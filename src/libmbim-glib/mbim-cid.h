@@ -240,6 +240,8 @@ typedef enum { /*< since=1.26 >*/
  * @MBIM_CID_PROXY_CONTROL_UNKNOWN: Unknown command.
  * @MBIM_CID_PROXY_CONTROL_CONFIGURATION: Configuration.
  * @MBIM_CID_PROXY_CONTROL_VERSION: MBIM and MBIMEx Version reporting.
+ * @MBIM_CID_PROXY_CONTROL_TRANSPORT: Transport negotiation. Since 1.30.
+ * @MBIM_CID_PROXY_CONTROL_MEMORY_USAGE: Memory usage of the device and clients. Since 1.30.
  *
  * MBIM commands in the %MBIM_SERVICE_PROXY_CONTROL service.
  *
@@ -249,6 +251,8 @@ typedef enum { /*< since=1.10 >*/
     MBIM_CID_PROXY_CONTROL_UNKNOWN       = 0,
     MBIM_CID_PROXY_CONTROL_CONFIGURATION = 1,
     MBIM_CID_PROXY_CONTROL_VERSION       = 2,
+    MBIM_CID_PROXY_CONTROL_TRANSPORT     = 3,
+    MBIM_CID_PROXY_CONTROL_MEMORY_USAGE  = 4,
 } MbimCidProxyControl;
 
 /**
@@ -0,0 +1,136 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * libmbim-glib -- GLib/GIO based library to control MBIM devices
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "config.h"
+#include "mbim-device-cache.h"
+
+#define CACHE_KEY                       "key"
+#define CACHE_MAX_CONTROL_TRANSFER      "max-control-transfer"
+#define CACHE_MS_MBIMEX_VERSION_SUPPORT "ms-mbimex-version-support"
+#define CACHE_MS_MBIMEX_VERSION         "ms-mbimex-version"
+
+/*****************************************************************************/
+
+gchar *
+_mbim_device_cache_get_default_path (void)
+{
+    return g_build_filename (g_get_user_cache_dir (), "libmbim", "device-open.cache", NULL);
+}
+
+static GKeyFile *
+cache_open (const gchar *cache_path)
+{
+    GKeyFile *keyfile;
+
+    /* A missing or corrupted cache is just an empty one */
+    keyfile = g_key_file_new ();
+    g_key_file_load_from_file (keyfile, cache_path, G_KEY_FILE_NONE, NULL);
+    return keyfile;
+}
+
+gboolean
+_mbim_device_cache_load (const gchar          *cache_path,
+                         const gchar          *device_path,
+                         const gchar          *key,
+                         MbimDeviceCacheEntry *out_entry)
+{
+    g_autoptr(GKeyFile)  keyfile = NULL;
+    g_autofree gchar    *stored_key = NULL;
+    g_autofree gchar    *version = NULL;
+    guint64              max_control_transfer;
+    guint                major = 0;
+    guint                minor = 0;
+
+    keyfile = cache_open (cache_path);
+
+    stored_key = g_key_file_get_string (keyfile, device_path, CACHE_KEY, NULL);
+    if (g_strcmp0 (stored_key, key) != 0)
+        return FALSE;
+
+    max_control_transfer = g_key_file_get_uint64 (keyfile, device_path, CACHE_MAX_CONTROL_TRANSFER, NULL);
+    if (max_control_transfer == 0 || max_control_transfer > G_MAXUINT16)
+        return FALSE;
+
+    memset (out_entry, 0, sizeof (MbimDeviceCacheEntry));
+    out_entry->max_control_transfer = (guint16) max_control_transfer;
+    out_entry->ms_mbimex_version_support = (MbimDeviceCacheSupport) g_key_file_get_integer (keyfile, device_path, CACHE_MS_MBIMEX_VERSION_SUPPORT, NULL);
+    if (out_entry->ms_mbimex_version_support > MBIM_DEVICE_CACHE_SUPPORT_YES)
+        out_entry->ms_mbimex_version_support = MBIM_DEVICE_CACHE_SUPPORT_UNKNOWN;
+
+    version = g_key_file_get_string (keyfile, device_path, CACHE_MS_MBIMEX_VERSION, NULL);
+    if (version && sscanf (version, "%x.%x", &major, &minor) == 2 && major <= G_MAXUINT8 && minor <= G_MAXUINT8) {
+        out_entry->ms_mbimex_version_major = (guint8) major;
+        out_entry->ms_mbimex_version_minor = (guint8) minor;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+cache_save (GKeyFile     *keyfile,
+            const gchar  *cache_path,
+            GError      **error)
+{
+    g_autofree gchar *dir = NULL;
+    g_autofree gchar *data = NULL;
+    gsize             data_length;
+
+    dir = g_path_get_dirname (cache_path);
+    if (g_mkdir_with_parents (dir, 0700) < 0) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "Couldn't create cache directory '%s': %s", dir, g_strerror (errno));
+        return FALSE;
+    }
+
+    /* Written atomically, so that concurrent readers never see partial
+     * contents */
+    data = g_key_file_to_data (keyfile, &data_length, NULL);
+    return g_file_set_contents (cache_path, data, data_length, error);
+}
+
+gboolean
+_mbim_device_cache_store (const gchar                 *cache_path,
+                          const gchar                 *device_path,
+                          const gchar                 *key,
+                          const MbimDeviceCacheEntry  *entry,
+                          GError                     **error)
+{
+    g_autoptr(GKeyFile)  keyfile = NULL;
+    g_autofree gchar    *version = NULL;
+
+    keyfile = cache_open (cache_path);
+
+    g_key_file_remove_group (keyfile, device_path, NULL);
+    g_key_file_set_string (keyfile, device_path, CACHE_KEY, key);
+    g_key_file_set_uint64 (keyfile, device_path, CACHE_MAX_CONTROL_TRANSFER, entry->max_control_transfer);
+    g_key_file_set_integer (keyfile, device_path, CACHE_MS_MBIMEX_VERSION_SUPPORT, entry->ms_mbimex_version_support);
+    version = g_strdup_printf ("%x.%02x", entry->ms_mbimex_version_major, entry->ms_mbimex_version_minor);
+    g_key_file_set_string (keyfile, device_path, CACHE_MS_MBIMEX_VERSION, version);
+
+    return cache_save (keyfile, cache_path, error);
+}
+
+void
+_mbim_device_cache_invalidate (const gchar *cache_path,
+                               const gchar *device_path)
+{
+    g_autoptr(GKeyFile) keyfile = NULL;
+    g_autoptr(GError)   error = NULL;
+
+    keyfile = cache_open (cache_path);
+    if (!g_key_file_remove_group (keyfile, device_path, NULL))
+        return;
+
+    if (!cache_save (keyfile, cache_path, &error))
+        g_debug ("couldn't invalidate device open cache: %s", error->message);
+}
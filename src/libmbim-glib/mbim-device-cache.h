@@ -0,0 +1,58 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * libmbim-glib -- GLib/GIO based library to control MBIM devices
+ *
+ * This is a private non-installed header
+ */
+
+#ifndef _LIBMBIM_GLIB_MBIM_DEVICE_CACHE_H_
+#define _LIBMBIM_GLIB_MBIM_DEVICE_CACHE_H_
+
+#if !defined (LIBMBIM_GLIB_COMPILATION)
+#error "This is a private header!!"
+#endif
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Persistent cache of the information learnt while opening a device, used
+ * to skip some of the steps of the open sequence the next time the same
+ * device is opened.
+ *
+ * Entries are stored per device path, along with a key identifying the exact
+ * device and firmware (e.g. a checksum of the USB descriptors); entries with
+ * a different key are ignored.
+ */
+
+typedef enum {
+    MBIM_DEVICE_CACHE_SUPPORT_UNKNOWN   = 0,
+    MBIM_DEVICE_CACHE_SUPPORT_NO        = 1,
+    MBIM_DEVICE_CACHE_SUPPORT_YES       = 2,
+} MbimDeviceCacheSupport;
+
+typedef struct {
+    guint16                max_control_transfer;
+    MbimDeviceCacheSupport ms_mbimex_version_support;
+    guint8                 ms_mbimex_version_major;
+    guint8                 ms_mbimex_version_minor;
+} MbimDeviceCacheEntry;
+
+gchar    *_mbim_device_cache_get_default_path (void);
+gboolean  _mbim_device_cache_load             (const gchar                 *cache_path,
+                                               const gchar                 *device_path,
+                                               const gchar                 *key,
+                                               MbimDeviceCacheEntry        *out_entry);
+gboolean  _mbim_device_cache_store            (const gchar                 *cache_path,
+                                               const gchar                 *device_path,
+                                               const gchar                 *key,
+                                               const MbimDeviceCacheEntry  *entry,
+                                               GError                     **error);
+void      _mbim_device_cache_invalidate       (const gchar                 *cache_path,
+                                               const gchar                 *device_path);
+
+G_END_DECLS
+
+#endif /* _LIBMBIM_GLIB_MBIM_DEVICE_CACHE_H_ */
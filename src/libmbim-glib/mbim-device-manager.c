@@ -0,0 +1,927 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * libmbim-glib -- GLib/GIO based library to control MBIM devices
+ */
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "config.h"
+#include "mbim-device-manager.h"
+#include "mbim-helpers.h"
+
+/* Default maximum number of devices being opened at the same time */
+#define DEFAULT_MAX_CONCURRENT_OPENS 8
+
+/* Timeout to close the devices still managed when the manager is disposed */
+#define DISPOSE_CLOSE_TIMEOUT_SECS 1
+
+G_DEFINE_TYPE (MbimDeviceManager, mbim_device_manager, G_TYPE_OBJECT)
+
+/* I/O thread running its own main context */
+typedef struct {
+    guint         index;
+    GMainContext *context;
+    GMainLoop    *loop;
+    GThread      *thread;
+} IoThread;
+
+/* Device managed, and the I/O thread handling it, if any */
+typedef struct {
+    MbimDevice *device;
+    IoThread   *io;
+} ManagedDevice;
+
+struct _MbimDeviceManagerPrivate {
+    /* Main context, where the operations are completed */
+    GMainContext *context;
+
+    /* I/O threads */
+    GPtrArray *io_threads;
+    guint      next_io_thread;
+
+    /* Managed devices, keyed by path. Only modified in the main context, but
+     * the lock allows reading it from any thread */
+    GMutex      lock;
+    GHashTable *devices;
+
+    /* Open settings and statistics */
+    guint   max_concurrent_opens;
+    guint   n_failed_opens;
+    guint64 last_open_time;
+};
+
+/*****************************************************************************/
+/* I/O threads */
+
+static gpointer
+io_thread_run (IoThread *io)
+{
+    g_main_context_push_thread_default (io->context);
+    g_main_loop_run (io->loop);
+    g_main_context_pop_thread_default (io->context);
+    return NULL;
+}
+
+static gboolean
+io_thread_quit_cb (IoThread *io)
+{
+    g_main_loop_quit (io->loop);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+io_thread_free (IoThread *io)
+{
+    /* Quit the loop from within its own context, as it may not be running
+     * yet */
+    g_main_context_invoke (io->context, (GSourceFunc)io_thread_quit_cb, io);
+    g_thread_join (io->thread);
+    g_debug ("I/O thread %u stopped", io->index);
+
+    g_main_loop_unref (io->loop);
+    g_main_context_unref (io->context);
+    g_slice_free (IoThread, io);
+}
+
+static IoThread *
+io_thread_new (guint index)
+{
+    IoThread         *io;
+    g_autofree gchar *name = NULL;
+
+    io = g_slice_new0 (IoThread);
+    io->index = index;
+    io->context = g_main_context_new ();
+    io->loop = g_main_loop_new (io->context, FALSE);
+    name = g_strdup_printf ("mbim-io-%u", index);
+    io->thread = g_thread_new (name, (GThreadFunc)io_thread_run, io);
+    g_debug ("I/O thread %u started", index);
+    return io;
+}
+
+static IoThread *
+io_thread_next (MbimDeviceManager *self)
+{
+    IoThread *io;
+
+    if (!self->priv->io_threads->len)
+        return NULL;
+
+    io = g_ptr_array_index (self->priv->io_threads, self->priv->next_io_thread);
+    self->priv->next_io_thread = (self->priv->next_io_thread + 1) % self->priv->io_threads->len;
+    return io;
+}
+
+/* Run the given function in the context of the I/O thread, or in the main
+ * context if none */
+static void
+io_thread_invoke (MbimDeviceManager *self,
+                  IoThread          *io,
+                  GSourceFunc        func,
+                  gpointer           data)
+{
+    g_main_context_invoke (io ? io->context : self->priv->context, func, data);
+}
+
+/*****************************************************************************/
+/* Managed devices */
+
+static void
+managed_device_free (ManagedDevice *managed)
+{
+    g_object_unref (managed->device);
+    g_slice_free (ManagedDevice, managed);
+}
+
+static void
+manager_add_device (MbimDeviceManager *self,
+                    MbimDevice        *device,
+                    IoThread          *io)
+{
+    ManagedDevice *managed;
+
+    managed = g_slice_new0 (ManagedDevice);
+    managed->device = g_object_ref (device);
+    managed->io = io;
+
+    g_mutex_lock (&self->priv->lock);
+    g_hash_table_insert (self->priv->devices, g_strdup (mbim_device_get_path (device)), managed);
+    g_mutex_unlock (&self->priv->lock);
+}
+
+static gboolean
+manager_has_device (MbimDeviceManager *self,
+                    const gchar       *path)
+{
+    gboolean found;
+
+    g_mutex_lock (&self->priv->lock);
+    found = g_hash_table_contains (self->priv->devices, path);
+    g_mutex_unlock (&self->priv->lock);
+    return found;
+}
+
+GList *
+mbim_device_manager_get_devices (MbimDeviceManager *self)
+{
+    GHashTableIter  iter;
+    ManagedDevice  *managed;
+    GList          *list = NULL;
+
+    g_return_val_if_fail (MBIM_IS_DEVICE_MANAGER (self), NULL);
+
+    g_mutex_lock (&self->priv->lock);
+    g_hash_table_iter_init (&iter, self->priv->devices);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&managed))
+        list = g_list_prepend (list, g_object_ref (managed->device));
+    g_mutex_unlock (&self->priv->lock);
+
+    return list;
+}
+
+guint
+mbim_device_manager_get_n_devices (MbimDeviceManager *self)
+{
+    guint n_devices;
+
+    g_return_val_if_fail (MBIM_IS_DEVICE_MANAGER (self), 0);
+
+    g_mutex_lock (&self->priv->lock);
+    n_devices = g_hash_table_size (self->priv->devices);
+    g_mutex_unlock (&self->priv->lock);
+
+    return n_devices;
+}
+
+void
+mbim_device_manager_get_statistics (MbimDeviceManager *self,
+                                    guint             *out_n_devices,
+                                    guint             *out_n_failed_opens,
+                                    guint64           *out_last_open_time,
+                                    guint             *out_consecutive_timeouts)
+{
+    GHashTableIter  iter;
+    ManagedDevice  *managed;
+    guint           consecutive_timeouts = 0;
+
+    g_return_if_fail (MBIM_IS_DEVICE_MANAGER (self));
+
+    g_mutex_lock (&self->priv->lock);
+    g_hash_table_iter_init (&iter, self->priv->devices);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&managed))
+        consecutive_timeouts += mbim_device_get_consecutive_timeouts (managed->device);
+    if (out_n_devices)
+        *out_n_devices = g_hash_table_size (self->priv->devices);
+    g_mutex_unlock (&self->priv->lock);
+
+    if (out_n_failed_opens)
+        *out_n_failed_opens = self->priv->n_failed_opens;
+    if (out_last_open_time)
+        *out_last_open_time = self->priv->last_open_time;
+    if (out_consecutive_timeouts)
+        *out_consecutive_timeouts = consecutive_timeouts;
+}
+
+/*****************************************************************************/
+
+gchar **
+mbim_device_manager_discover (GError **error)
+{
+    GPtrArray *ports;
+
+    ports = mbim_helpers_list_control_ports (NULL, error);
+    if (!ports)
+        return NULL;
+
+    g_ptr_array_add (ports, NULL);
+    return (gchar **) g_ptr_array_free (ports, FALSE);
+}
+
+/*****************************************************************************/
+/* Open devices
+ *
+ * Each device is created and opened in the context of the I/O thread it's
+ * assigned to, so that it ends up bound to that context. Once done, the
+ * result is reported back in the main context, where the next pending device
+ * is started.
+ */
+
+typedef struct {
+    GQueue              *pending; /* OpenEntry */
+    guint                n_running;
+    guint                n_failed;
+    GError              *first_error;
+    MbimDeviceOpenFlags  flags;
+    guint                timeout;
+    gint64               start_time;
+} OpenContext;
+
+typedef struct {
+    GTask      *task;
+    gchar      *path;
+    IoThread   *io;
+    MbimDevice *device;
+    GError     *error;
+} OpenEntry;
+
+static void
+open_entry_free (OpenEntry *entry)
+{
+    g_clear_object (&entry->device);
+    g_clear_error (&entry->error);
+    g_free (entry->path);
+    g_slice_free (OpenEntry, entry);
+}
+
+static gint
+open_entry_cmp_path (const OpenEntry *entry,
+                     const gchar     *path)
+{
+    return g_strcmp0 (entry->path, path);
+}
+
+static void
+open_context_free (OpenContext *ctx)
+{
+    g_assert (ctx->n_running == 0);
+    g_queue_free_full (ctx->pending, (GDestroyNotify)open_entry_free);
+    g_clear_error (&ctx->first_error);
+    g_slice_free (OpenContext, ctx);
+}
+
+gboolean
+mbim_device_manager_open_finish (MbimDeviceManager  *self,
+                                 GAsyncResult       *res,
+                                 GError            **error)
+{
+    return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+static void open_context_next (GTask *task);
+
+static gboolean
+open_entry_done_cb (OpenEntry *entry)
+{
+    GTask             *task;
+    MbimDeviceManager *self;
+    OpenContext       *ctx;
+
+    task = entry->task;
+    self = g_task_get_source_object (task);
+    ctx = g_task_get_task_data (task);
+
+    ctx->n_running--;
+    if (entry->error) {
+        g_debug ("[%s] couldn't open device: %s", entry->path, entry->error->message);
+        ctx->n_failed++;
+        self->priv->n_failed_opens++;
+        if (!ctx->first_error)
+            ctx->first_error = g_steal_pointer (&entry->error);
+    } else {
+        g_debug ("[%s] device open and managed", entry->path);
+        manager_add_device (self, entry->device, entry->io);
+    }
+
+    open_entry_free (entry);
+    open_context_next (task);
+    g_object_unref (task);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+open_entry_done (OpenEntry *entry)
+{
+    MbimDeviceManager *self;
+
+    /* Back to the main context */
+    self = g_task_get_source_object (entry->task);
+    g_main_context_invoke (self->priv->context, (GSourceFunc)open_entry_done_cb, entry);
+}
+
+static void
+device_open_ready (MbimDevice   *device,
+                   GAsyncResult *res,
+                   OpenEntry    *entry)
+{
+    if (!mbim_device_open_full_finish (device, res, &entry->error))
+        g_clear_object (&entry->device);
+    open_entry_done (entry);
+}
+
+static void
+device_new_ready (GObject      *source,
+                  GAsyncResult *res,
+                  OpenEntry    *entry)
+{
+    OpenContext *ctx;
+
+    entry->device = mbim_device_new_finish (res, &entry->error);
+    if (!entry->device) {
+        open_entry_done (entry);
+        return;
+    }
+
+    ctx = g_task_get_task_data (entry->task);
+    mbim_device_open_full (entry->device,
+                           ctx->flags,
+                           ctx->timeout,
+                           g_task_get_cancellable (entry->task),
+                           (GAsyncReadyCallback)device_open_ready,
+                           entry);
+}
+
+static gboolean
+open_entry_start_cb (OpenEntry *entry)
+{
+    g_autoptr(GFile) file = NULL;
+
+    /* Running in the I/O thread, where the device is bound to */
+    file = g_file_new_for_path (entry->path);
+    mbim_device_new (file,
+                     g_task_get_cancellable (entry->task),
+                     (GAsyncReadyCallback)device_new_ready,
+                     entry);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+open_context_next (GTask *task)
+{
+    MbimDeviceManager *self;
+    OpenContext       *ctx;
+    OpenEntry         *entry;
+    GError            *error;
+
+    self = g_task_get_source_object (task);
+    ctx = g_task_get_task_data (task);
+
+    while ((!self->priv->max_concurrent_opens || ctx->n_running < self->priv->max_concurrent_opens) &&
+           (entry = g_queue_pop_head (ctx->pending)) != NULL) {
+        ctx->n_running++;
+        entry->task = g_object_ref (task);
+        entry->io = io_thread_next (self);
+        io_thread_invoke (self, entry->io, (GSourceFunc)open_entry_start_cb, entry);
+    }
+
+    if (ctx->n_running > 0)
+        return;
+
+    self->priv->last_open_time = (g_get_monotonic_time () - ctx->start_time) / 1000;
+    g_debug ("devices opened in %" G_GUINT64_FORMAT " ms (%u failed)",
+             self->priv->last_open_time, ctx->n_failed);
+
+    if (ctx->first_error) {
+        error = g_steal_pointer (&ctx->first_error);
+        if (ctx->n_failed > 1)
+            g_prefix_error (&error, "%u devices failed to open, first error: ", ctx->n_failed);
+        g_task_return_error (task, error);
+    } else
+        g_task_return_boolean (task, TRUE);
+}
+
+void
+mbim_device_manager_open (MbimDeviceManager    *self,
+                          const gchar * const  *paths,
+                          MbimDeviceOpenFlags   flags,
+                          guint                 timeout,
+                          GCancellable         *cancellable,
+                          GAsyncReadyCallback   callback,
+                          gpointer              user_data)
+{
+    g_auto(GStrv)      discovered = NULL;
+    g_autoptr(GError)  error = NULL;
+    OpenContext       *ctx;
+    GTask             *task;
+    guint              i;
+
+    g_return_if_fail (MBIM_IS_DEVICE_MANAGER (self));
+    g_return_if_fail (timeout > 0);
+
+    task = g_task_new (self, cancellable, callback, user_data);
+
+    if (!paths) {
+        discovered = mbim_device_manager_discover (&error);
+        if (!discovered) {
+            g_task_return_error (task, g_steal_pointer (&error));
+            g_object_unref (task);
+            return;
+        }
+        paths = (const gchar * const *) discovered;
+    }
+
+    ctx = g_slice_new0 (OpenContext);
+    ctx->pending = g_queue_new ();
+    ctx->flags = flags;
+    ctx->timeout = timeout;
+    ctx->start_time = g_get_monotonic_time ();
+    g_task_set_task_data (task, ctx, (GDestroyNotify)open_context_free);
+
+    for (i = 0; paths[i]; i++) {
+        OpenEntry        *entry;
+        g_autofree gchar *path = NULL;
+        g_autoptr(GError) inner_error = NULL;
+
+        /* Symlinks (e.g. udev rules) and the real node are the same device */
+        path = mbim_helpers_get_devpath (paths[i], &inner_error);
+        if (!path) {
+            g_debug ("[%s] ignoring device: %s", paths[i], inner_error->message);
+            continue;
+        }
+
+        if (manager_has_device (self, path) ||
+            g_queue_find_custom (ctx->pending, path, (GCompareFunc)open_entry_cmp_path))
+            continue;
+
+        entry = g_slice_new0 (OpenEntry);
+        entry->path = g_steal_pointer (&path);
+        g_queue_push_tail (ctx->pending, entry);
+    }
+
+    /* Takes a full reference while devices are being opened */
+    open_context_next (task);
+    g_object_unref (task);
+}
+
+/*****************************************************************************/
+/* Close devices */
+
+typedef struct {
+    guint   n_running;
+    guint   timeout;
+    GError *first_error;
+} CloseContext;
+
+typedef struct {
+    GTask         *task;
+    ManagedDevice *managed;
+    GError        *error;
+} CloseEntry;
+
+static void
+close_context_free (CloseContext *ctx)
+{
+    g_clear_error (&ctx->first_error);
+    g_slice_free (CloseContext, ctx);
+}
+
+gboolean
+mbim_device_manager_close_finish (MbimDeviceManager  *self,
+                                  GAsyncResult       *res,
+                                  GError            **error)
+{
+    return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+static gboolean
+close_entry_done_cb (CloseEntry *entry)
+{
+    CloseContext *ctx;
+    GTask        *task;
+
+    task = entry->task;
+    ctx = g_task_get_task_data (task);
+
+    if (entry->error && !ctx->first_error)
+        ctx->first_error = g_steal_pointer (&entry->error);
+    g_clear_error (&entry->error);
+    managed_device_free (entry->managed);
+    g_slice_free (CloseEntry, entry);
+
+    if (--ctx->n_running == 0) {
+        if (ctx->first_error)
+            g_task_return_error (task, g_steal_pointer (&ctx->first_error));
+        else
+            g_task_return_boolean (task, TRUE);
+    }
+    g_object_unref (task);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+device_close_ready (MbimDevice   *device,
+                    GAsyncResult *res,
+                    CloseEntry   *entry)
+{
+    MbimDeviceManager *self;
+
+    mbim_device_close_finish (device, res, &entry->error);
+
+    self = g_task_get_source_object (entry->task);
+    g_main_context_invoke (self->priv->context, (GSourceFunc)close_entry_done_cb, entry);
+}
+
+static gboolean
+close_entry_start_cb (CloseEntry *entry)
+{
+    CloseContext *ctx;
+
+    ctx = g_task_get_task_data (entry->task);
+    mbim_device_close (entry->managed->device,
+                       ctx->timeout,
+                       g_task_get_cancellable (entry->task),
+                       (GAsyncReadyCallback)device_close_ready,
+                       entry);
+    return G_SOURCE_REMOVE;
+}
+
+void
+mbim_device_manager_close (MbimDeviceManager   *self,
+                           guint                timeout,
+                           GCancellable        *cancellable,
+                           GAsyncReadyCallback  callback,
+                           gpointer             user_data)
+{
+    CloseContext   *ctx;
+    GTask          *task;
+    GHashTableIter  iter;
+    ManagedDevice  *managed;
+    GList          *entries = NULL;
+    GList          *l;
+
+    g_return_if_fail (MBIM_IS_DEVICE_MANAGER (self));
+
+    task = g_task_new (self, cancellable, callback, user_data);
+    ctx = g_slice_new0 (CloseContext);
+    ctx->timeout = timeout;
+    g_task_set_task_data (task, ctx, (GDestroyNotify)close_context_free);
+
+    /* Devices are no longer managed right away */
+    g_mutex_lock (&self->priv->lock);
+    g_hash_table_iter_init (&iter, self->priv->devices);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&managed)) {
+        CloseEntry *entry;
+
+        g_hash_table_iter_steal (&iter);
+        entry = g_slice_new0 (CloseEntry);
+        entry->task = g_object_ref (task);
+        entry->managed = managed;
+        entries = g_list_prepend (entries, entry);
+        ctx->n_running++;
+    }
+    g_mutex_unlock (&self->priv->lock);
+
+    if (!entries) {
+        g_task_return_boolean (task, TRUE);
+        g_object_unref (task);
+        return;
+    }
+
+    for (l = entries; l; l = g_list_next (l)) {
+        CloseEntry *entry = l->data;
+
+        io_thread_invoke (self, entry->managed->io, (GSourceFunc)close_entry_start_cb, entry);
+    }
+    g_list_free (entries);
+    g_object_unref (task);
+}
+
+/*****************************************************************************/
+/* Broadcast commands
+ *
+ * mbim_device_command() may be called from any thread, so the commands are
+ * submitted right away from the main context, where the responses are
+ * received.
+ */
+
+typedef struct {
+    GHashTable *responses;
+    GHashTable *errors;
+    guint       n_pending;
+} CommandContext;
+
+typedef struct {
+    GHashTable *responses;
+    GHashTable *errors;
+} CommandResult;
+
+static void
+command_context_free (CommandContext *ctx)
+{
+    g_hash_table_unref (ctx->responses);
+    g_hash_table_unref (ctx->errors);
+    g_slice_free (CommandContext, ctx);
+}
+
+static void
+command_result_free (CommandResult *result)
+{
+    g_hash_table_unref (result->responses);
+    g_hash_table_unref (result->errors);
+    g_slice_free (CommandResult, result);
+}
+
+GHashTable *
+mbim_device_manager_command_finish (MbimDeviceManager  *self,
+                                    GAsyncResult       *res,
+                                    GHashTable        **out_errors,
+                                    GError            **error)
+{
+    CommandResult *result;
+    GHashTable    *responses;
+
+    result = g_task_propagate_pointer (G_TASK (res), error);
+    if (!result)
+        return NULL;
+
+    responses = g_hash_table_ref (result->responses);
+    if (out_errors)
+        *out_errors = g_hash_table_ref (result->errors);
+    command_result_free (result);
+    return responses;
+}
+
+static void
+command_context_complete (GTask *task)
+{
+    CommandContext *ctx;
+    CommandResult  *result;
+
+    ctx = g_task_get_task_data (task);
+    result = g_slice_new0 (CommandResult);
+    result->responses = g_hash_table_ref (ctx->responses);
+    result->errors = g_hash_table_ref (ctx->errors);
+    g_task_return_pointer (task, result, (GDestroyNotify)command_result_free);
+}
+
+static void
+device_command_ready (MbimDevice   *device,
+                      GAsyncResult *res,
+                      GTask        *task)
+{
+    CommandContext *ctx;
+    MbimMessage    *response;
+    GError         *error = NULL;
+
+    ctx = g_task_get_task_data (task);
+
+    response = mbim_device_command_finish (device, res, &error);
+    if (response)
+        g_hash_table_insert (ctx->responses, g_strdup (mbim_device_get_path (device)), response);
+    else
+        g_hash_table_insert (ctx->errors, g_strdup (mbim_device_get_path (device)), error);
+
+    if (--ctx->n_pending == 0)
+        command_context_complete (task);
+    g_object_unref (task);
+}
+
+void
+mbim_device_manager_command (MbimDeviceManager   *self,
+                             MbimMessage         *message,
+                             guint                timeout,
+                             GCancellable        *cancellable,
+                             GAsyncReadyCallback  callback,
+                             gpointer             user_data)
+{
+    CommandContext *ctx;
+    GTask          *task;
+    GList          *devices;
+    GList          *l;
+
+    g_return_if_fail (MBIM_IS_DEVICE_MANAGER (self));
+    g_return_if_fail (message != NULL);
+
+    task = g_task_new (self, cancellable, callback, user_data);
+    ctx = g_slice_new0 (CommandContext);
+    ctx->responses = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)mbim_message_unref);
+    ctx->errors = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_error_free);
+    g_task_set_task_data (task, ctx, (GDestroyNotify)command_context_free);
+
+    devices = mbim_device_manager_get_devices (self);
+    ctx->n_pending = g_list_length (devices);
+    if (!ctx->n_pending) {
+        command_context_complete (task);
+        g_object_unref (task);
+        return;
+    }
+
+    for (l = devices; l; l = g_list_next (l)) {
+        g_autoptr(MbimMessage) request = NULL;
+
+        /* Each device allocates its own transaction id */
+        request = mbim_message_dup (message);
+        mbim_message_set_transaction_id (request, 0);
+        mbim_device_command (MBIM_DEVICE (l->data),
+                             request,
+                             timeout,
+                             cancellable,
+                             (GAsyncReadyCallback)device_command_ready,
+                             g_object_ref (task));
+    }
+
+    g_list_free_full (devices, g_object_unref);
+    g_object_unref (task);
+}
+
+/*****************************************************************************/
+/* Close devices on dispose
+ *
+ * The devices handled in I/O threads are closed before the threads are
+ * stopped, waiting for them in the main context. The ones handled in the main
+ * context itself can't be waited for, so their close is left running.
+ */
+
+typedef struct {
+    GMutex mutex;
+    GCond  cond;
+    guint  n_running;
+} DisposeCloseContext;
+
+typedef struct {
+    DisposeCloseContext *ctx;
+    MbimDevice          *device;
+} DisposeCloseEntry;
+
+static void
+dispose_close_ready (MbimDevice          *device,
+                     GAsyncResult        *res,
+                     DisposeCloseContext *ctx)
+{
+    mbim_device_close_finish (device, res, NULL);
+
+    g_mutex_lock (&ctx->mutex);
+    ctx->n_running--;
+    g_cond_signal (&ctx->cond);
+    g_mutex_unlock (&ctx->mutex);
+}
+
+static gboolean
+dispose_close_start_cb (DisposeCloseEntry *entry)
+{
+    mbim_device_close (entry->device,
+                       DISPOSE_CLOSE_TIMEOUT_SECS,
+                       NULL,
+                       (GAsyncReadyCallback)dispose_close_ready,
+                       entry->ctx);
+    g_slice_free (DisposeCloseEntry, entry);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+manager_dispose_devices (MbimDeviceManager *self)
+{
+    DisposeCloseContext ctx;
+    GHashTableIter      iter;
+    ManagedDevice      *managed;
+    gint64              deadline;
+
+    g_mutex_init (&ctx.mutex);
+    g_cond_init (&ctx.cond);
+    ctx.n_running = 0;
+
+    g_mutex_lock (&self->priv->lock);
+    if (g_hash_table_size (self->priv->devices) > 0)
+        g_debug ("closing %u devices still managed", g_hash_table_size (self->priv->devices));
+    g_hash_table_iter_init (&iter, self->priv->devices);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&managed)) {
+        DisposeCloseEntry *entry;
+
+        if (!managed->io) {
+            mbim_device_close (managed->device, DISPOSE_CLOSE_TIMEOUT_SECS, NULL, NULL, NULL);
+            continue;
+        }
+
+        g_mutex_lock (&ctx.mutex);
+        ctx.n_running++;
+        g_mutex_unlock (&ctx.mutex);
+
+        entry = g_slice_new (DisposeCloseEntry);
+        entry->ctx = &ctx;
+        entry->device = managed->device;
+        io_thread_invoke (self, managed->io, (GSourceFunc)dispose_close_start_cb, entry);
+    }
+    g_mutex_unlock (&self->priv->lock);
+
+    /* The close operations time out on their own, the margin is just in case
+     * an I/O thread is stuck */
+    deadline = g_get_monotonic_time () + (DISPOSE_CLOSE_TIMEOUT_SECS + 1) * G_USEC_PER_SEC;
+    g_mutex_lock (&ctx.mutex);
+    while (ctx.n_running > 0) {
+        if (!g_cond_wait_until (&ctx.cond, &ctx.mutex, deadline))
+            break;
+    }
+    g_mutex_unlock (&ctx.mutex);
+
+    /* No close callback may run once the I/O threads are stopped */
+    g_clear_pointer (&self->priv->io_threads, g_ptr_array_unref);
+
+    g_mutex_lock (&self->priv->lock);
+    g_hash_table_remove_all (self->priv->devices);
+    g_mutex_unlock (&self->priv->lock);
+
+    g_mutex_clear (&ctx.mutex);
+    g_cond_clear (&ctx.cond);
+}
+
+/*****************************************************************************/
+
+void
+mbim_device_manager_set_max_concurrent_opens (MbimDeviceManager *self,
+                                              guint              max_concurrent_opens)
+{
+    g_return_if_fail (MBIM_IS_DEVICE_MANAGER (self));
+
+    self->priv->max_concurrent_opens = max_concurrent_opens;
+}
+
+MbimDeviceManager *
+mbim_device_manager_new (guint n_io_threads)
+{
+    MbimDeviceManager *self;
+    guint              i;
+
+    self = g_object_new (MBIM_TYPE_DEVICE_MANAGER, NULL);
+    for (i = 0; i < n_io_threads; i++)
+        g_ptr_array_add (self->priv->io_threads, io_thread_new (i));
+    return self;
+}
+
+static void
+mbim_device_manager_init (MbimDeviceManager *self)
+{
+    self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, MBIM_TYPE_DEVICE_MANAGER, MbimDeviceManagerPrivate);
+    self->priv->context = g_main_context_ref_thread_default ();
+    self->priv->io_threads = g_ptr_array_new_with_free_func ((GDestroyNotify)io_thread_free);
+    self->priv->devices = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)managed_device_free);
+    self->priv->max_concurrent_opens = DEFAULT_MAX_CONCURRENT_OPENS;
+    g_mutex_init (&self->priv->lock);
+}
+
+static void
+dispose (GObject *object)
+{
+    MbimDeviceManager *self = MBIM_DEVICE_MANAGER (object);
+
+    /* Close the devices left open, and stop the I/O threads before releasing
+     * the devices they handle; pending operations keep a reference to the
+     * manager, so there are none */
+    if (self->priv->io_threads)
+        manager_dispose_devices (self);
+    g_clear_pointer (&self->priv->context, g_main_context_unref);
+
+    G_OBJECT_CLASS (mbim_device_manager_parent_class)->dispose (object);
+}
+
+static void
+finalize (GObject *object)
+{
+    MbimDeviceManager *self = MBIM_DEVICE_MANAGER (object);
+
+    g_hash_table_unref (self->priv->devices);
+    g_mutex_clear (&self->priv->lock);
+
+    G_OBJECT_CLASS (mbim_device_manager_parent_class)->finalize (object);
+}
+
+static void
+mbim_device_manager_class_init (MbimDeviceManagerClass *manager_class)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (manager_class);
+
+    g_type_class_add_private (object_class, sizeof (MbimDeviceManagerPrivate));
+
+    object_class->dispose = dispose;
+    object_class->finalize = finalize;
+}
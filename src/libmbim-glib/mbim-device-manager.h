@@ -0,0 +1,307 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * libmbim-glib -- GLib/GIO based library to control MBIM devices
+ */
+
+#ifndef _LIBMBIM_GLIB_MBIM_DEVICE_MANAGER_H_
+#define _LIBMBIM_GLIB_MBIM_DEVICE_MANAGER_H_
+
+#if !defined (__LIBMBIM_GLIB_H_INSIDE__) && !defined (LIBMBIM_GLIB_COMPILATION)
+#error "Only <libmbim-glib.h> can be included directly."
+#endif
+
+#include <glib-object.h>
+#include <gio/gio.h>
+
+#include "mbim-message.h"
+#include "mbim-device.h"
+
+G_BEGIN_DECLS
+
+/**
+ * SECTION:mbim-device-manager
+ * @title: MbimDeviceManager
+ * @short_description: Management of multiple MBIM devices
+ *
+ * The #MbimDeviceManager allows handling a large number of #MbimDevice
+ * objects at once: discovering the MBIM control ports available in the
+ * system, opening them in parallel with a limit in the number of concurrent
+ * open operations, and sending the same command to all of them.
+ *
+ * The devices may be run in a configurable number of I/O threads, each one
+ * running its own #GMainContext, so that the processing of the messages of
+ * one device doesn't delay the ones of the others. The #MbimDeviceManager
+ * methods must be called from the thread-default #GMainContext in use when
+ * the #MbimDeviceManager was created, where all asynchronous operations are
+ * completed.
+ *
+ * The #MbimDevice objects given by the #MbimDeviceManager support
+ * mbim_device_command() from any thread, but any other operation must be
+ * run in the #GMainContext of the I/O thread handling it.
+ *
+ * Devices still managed when the #MbimDeviceManager is disposed are closed
+ * with a short timeout, blocking until the ones handled in I/O threads are
+ * done. Use mbim_device_manager_close() to close them without blocking.
+ */
+
+#define MBIM_TYPE_DEVICE_MANAGER            (mbim_device_manager_get_type ())
+#define MBIM_DEVICE_MANAGER(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), MBIM_TYPE_DEVICE_MANAGER, MbimDeviceManager))
+#define MBIM_DEVICE_MANAGER_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass),  MBIM_TYPE_DEVICE_MANAGER, MbimDeviceManagerClass))
+#define MBIM_IS_DEVICE_MANAGER(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), MBIM_TYPE_DEVICE_MANAGER))
+#define MBIM_IS_DEVICE_MANAGER_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass),  MBIM_TYPE_DEVICE_MANAGER))
+#define MBIM_DEVICE_MANAGER_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj),  MBIM_TYPE_DEVICE_MANAGER, MbimDeviceManagerClass))
+
+typedef struct _MbimDeviceManager MbimDeviceManager;
+typedef struct _MbimDeviceManagerClass MbimDeviceManagerClass;
+typedef struct _MbimDeviceManagerPrivate MbimDeviceManagerPrivate;
+
+/**
+ * MbimDeviceManager:
+ *
+ * The #MbimDeviceManager structure contains private data and should only be
+ * accessed using the provided API.
+ *
+ * Since: 1.30
+ */
+struct _MbimDeviceManager {
+    GObject parent;
+    MbimDeviceManagerPrivate *priv;
+};
+
+struct _MbimDeviceManagerClass {
+    GObjectClass parent;
+};
+
+GType mbim_device_manager_get_type (void);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (MbimDeviceManager, g_object_unref)
+
+/**
+ * mbim_device_manager_new:
+ * @n_io_threads: number of I/O threads to run the devices in, or 0 to run
+ *   them in the thread-default #GMainContext of the caller.
+ *
+ * Creates a #MbimDeviceManager object.
+ *
+ * Devices are assigned to the I/O threads in a round-robin fashion.
+ *
+ * Returns: (transfer full): a newly created #MbimDeviceManager.
+ *
+ * Since: 1.30
+ */
+MbimDeviceManager *mbim_device_manager_new (guint n_io_threads);
+
+/**
+ * mbim_device_manager_set_max_concurrent_opens:
+ * @self: a #MbimDeviceManager.
+ * @max_concurrent_opens: maximum number of devices being opened at the same
+ *   time, or 0 for no limit.
+ *
+ * Sets the maximum number of devices being opened at the same time by
+ * mbim_device_manager_open().
+ *
+ * Since: 1.30
+ */
+void mbim_device_manager_set_max_concurrent_opens (MbimDeviceManager *self,
+                                                   guint              max_concurrent_opens);
+
+/**
+ * mbim_device_manager_discover:
+ * @error: Return location for error or %NULL.
+ *
+ * Lists the MBIM control ports available in the system, i.e. the cdc-wdm
+ * ports handled by the cdc_mbim driver and the MBIM ports in the wwan
+ * subsystem.
+ *
+ * Returns: (transfer full): a %NULL-terminated array of device paths, or
+ * %NULL if @error is set. The returned value should be freed with
+ * g_strfreev().
+ *
+ * Since: 1.30
+ */
+gchar **mbim_device_manager_discover (GError **error);
+
+/**
+ * mbim_device_manager_open:
+ * @self: a #MbimDeviceManager.
+ * @paths: (nullable) (array zero-terminated=1): a %NULL-terminated array of
+ *   device paths, or %NULL to open all the ones found by
+ *   mbim_device_manager_discover().
+ * @flags: a set of #MbimDeviceOpenFlags.
+ * @timeout: maximum time, in seconds, to wait for each device to be opened.
+ * @cancellable: optional #GCancellable object, #NULL to ignore.
+ * @callback: a #GAsyncReadyCallback to call when the operation is finished.
+ * @user_data: the data to pass to callback function.
+ *
+ * Asynchronously creates and opens a #MbimDevice for each of the given
+ * paths, and starts managing them. Paths already managed are ignored.
+ *
+ * When the operation is finished @callback will be called. You can then call
+ * mbim_device_manager_open_finish() to get the result of the operation.
+ *
+ * Since: 1.30
+ */
+void mbim_device_manager_open (MbimDeviceManager    *self,
+                               const gchar * const  *paths,
+                               MbimDeviceOpenFlags   flags,
+                               guint                 timeout,
+                               GCancellable         *cancellable,
+                               GAsyncReadyCallback   callback,
+                               gpointer              user_data);
+
+/**
+ * mbim_device_manager_open_finish:
+ * @self: a #MbimDeviceManager.
+ * @res: a #GAsyncResult.
+ * @error: Return location for error or %NULL.
+ *
+ * Finishes an asynchronous open operation started with
+ * mbim_device_manager_open().
+ *
+ * The devices successfully opened are managed even if the operation fails
+ * for some others.
+ *
+ * Returns: %TRUE if all devices were opened, %FALSE if @error is set.
+ *
+ * Since: 1.30
+ */
+gboolean mbim_device_manager_open_finish (MbimDeviceManager  *self,
+                                          GAsyncResult       *res,
+                                          GError            **error);
+
+/**
+ * mbim_device_manager_close:
+ * @self: a #MbimDeviceManager.
+ * @timeout: maximum time, in seconds, to wait for each device to be closed.
+ * @cancellable: optional #GCancellable object, #NULL to ignore.
+ * @callback: a #GAsyncReadyCallback to call when the operation is finished.
+ * @user_data: the data to pass to callback function.
+ *
+ * Asynchronously closes all the managed devices, and stops managing them.
+ *
+ * When the operation is finished @callback will be called. You can then call
+ * mbim_device_manager_close_finish() to get the result of the operation.
+ *
+ * Since: 1.30
+ */
+void mbim_device_manager_close (MbimDeviceManager   *self,
+                                guint                timeout,
+                                GCancellable        *cancellable,
+                                GAsyncReadyCallback  callback,
+                                gpointer             user_data);
+
+/**
+ * mbim_device_manager_close_finish:
+ * @self: a #MbimDeviceManager.
+ * @res: a #GAsyncResult.
+ * @error: Return location for error or %NULL.
+ *
+ * Finishes an asynchronous close operation started with
+ * mbim_device_manager_close().
+ *
+ * Returns: %TRUE if all devices were closed cleanly, %FALSE if @error is set.
+ *
+ * Since: 1.30
+ */
+gboolean mbim_device_manager_close_finish (MbimDeviceManager  *self,
+                                           GAsyncResult       *res,
+                                           GError            **error);
+
+/**
+ * mbim_device_manager_get_devices:
+ * @self: a #MbimDeviceManager.
+ *
+ * Gets the list of managed devices.
+ *
+ * Returns: (transfer full) (element-type MbimDevice): a #GList of
+ * #MbimDevice objects. The returned value should be freed with
+ * g_list_free_full() and g_object_unref().
+ *
+ * Since: 1.30
+ */
+GList *mbim_device_manager_get_devices (MbimDeviceManager *self);
+
+/**
+ * mbim_device_manager_get_n_devices:
+ * @self: a #MbimDeviceManager.
+ *
+ * Gets the number of managed devices.
+ *
+ * Returns: a #guint.
+ *
+ * Since: 1.30
+ */
+guint mbim_device_manager_get_n_devices (MbimDeviceManager *self);
+
+/**
+ * mbim_device_manager_command:
+ * @self: a #MbimDeviceManager.
+ * @message: the message to send.
+ * @timeout: maximum time, in seconds, to wait for each response.
+ * @cancellable: a #GCancellable, or %NULL.
+ * @callback: a #GAsyncReadyCallback to call when the operation is finished.
+ * @user_data: the data to pass to callback function.
+ *
+ * Asynchronously sends a copy of @message to all the managed devices, e.g. to
+ * query the signal state of all of them.
+ *
+ * When the operation is finished @callback will be called. You can then call
+ * mbim_device_manager_command_finish() to get the result of the operation.
+ *
+ * Since: 1.30
+ */
+void mbim_device_manager_command (MbimDeviceManager   *self,
+                                  MbimMessage         *message,
+                                  guint                timeout,
+                                  GCancellable        *cancellable,
+                                  GAsyncReadyCallback  callback,
+                                  gpointer             user_data);
+
+/**
+ * mbim_device_manager_command_finish:
+ * @self: a #MbimDeviceManager.
+ * @res: a #GAsyncResult.
+ * @out_errors: (out) (optional) (transfer full) (element-type utf8 GError):
+ *   return location for a #GHashTable with the errors of the devices that
+ *   didn't reply, keyed by device path, or %NULL.
+ * @error: Return location for error or %NULL.
+ *
+ * Finishes an operation started with mbim_device_manager_command().
+ *
+ * Returns: (transfer full) (element-type utf8 MbimMessage): a #GHashTable
+ * with the responses received, keyed by device path, or %NULL if @error is
+ * set. The returned value should be freed with g_hash_table_unref().
+ *
+ * Since: 1.30
+ */
+GHashTable *mbim_device_manager_command_finish (MbimDeviceManager  *self,
+                                                GAsyncResult       *res,
+                                                GHashTable        **out_errors,
+                                                GError            **error);
+
+/**
+ * mbim_device_manager_get_statistics:
+ * @self: a #MbimDeviceManager.
+ * @out_n_devices: (out) (optional): return location for the number of
+ *   managed devices, or %NULL.
+ * @out_n_failed_opens: (out) (optional): return location for the number of
+ *   devices that failed to open, or %NULL.
+ * @out_last_open_time: (out) (optional): return location for the time, in
+ *   milliseconds, taken by the last mbim_device_manager_open() operation, or
+ *   %NULL.
+ * @out_consecutive_timeouts: (out) (optional): return location for the sum
+ *   of the consecutive timeouts of all the managed devices, or %NULL.
+ *
+ * Gets fleet-wide statistics of the managed devices.
+ *
+ * Since: 1.30
+ */
+void mbim_device_manager_get_statistics (MbimDeviceManager *self,
+                                         guint             *out_n_devices,
+                                         guint             *out_n_failed_opens,
+                                         guint64           *out_last_open_time,
+                                         guint             *out_consecutive_timeouts);
+
+G_END_DECLS
+
+#endif /* _LIBMBIM_GLIB_MBIM_DEVICE_MANAGER_H_ */
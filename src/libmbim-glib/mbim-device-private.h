@@ -0,0 +1,56 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * libmbim-glib -- GLib/GIO based library to control MBIM devices
+ *
+ * This is a private non-installed header
+ */
+
+#ifndef _LIBMBIM_GLIB_MBIM_DEVICE_PRIVATE_H_
+#define _LIBMBIM_GLIB_MBIM_DEVICE_PRIVATE_H_
+
+#if !defined (LIBMBIM_GLIB_COMPILATION)
+#error "This is a private header!!"
+#endif
+
+#include <glib.h>
+
+#include "mbim-device.h"
+#include "mbim-capture.h"
+
+G_BEGIN_DECLS
+
+/*
+ * Support to move an open device between processes (e.g. mbim-proxy
+ * handoff): the fd of the open device file is passed to the new process,
+ * which adopts it without running the open sequence again.
+ */
+
+gint          _mbim_device_get_fd                   (MbimDevice    *self);
+guint16       _mbim_device_get_max_control_transfer (MbimDevice    *self);
+gboolean      _mbim_device_adopt_fd                 (MbimDevice    *self,
+                                                     gint           fd,
+                                                     guint32        transaction_id,
+                                                     guint16        max_control_transfer,
+                                                     const guint8  *partial_response,
+                                                     gsize          partial_response_length,
+                                                     GError       **error);
+
+/* While the fd is being passed, nothing must be read from it; whatever part
+ * of a message was already read is passed along to the new process */
+void          _mbim_device_suspend_reading          (MbimDevice    *self);
+void          _mbim_device_resume_reading           (MbimDevice    *self);
+const guint8 *_mbim_device_peek_partial_response    (MbimDevice    *self,
+                                                     gsize         *out_length);
+/* The fragments of a message being collected can't be passed along, so the
+ * fd can't be passed until all the collected messages are complete */
+gboolean      _mbim_device_has_partial_transactions (MbimDevice    *self);
+
+/* Capture shared among several devices (e.g. all the ones in the proxy),
+ * or %NULL to stop capturing */
+void          _mbim_device_set_capture              (MbimDevice    *self,
+                                                     MbimCapture   *capture);
+
+G_END_DECLS
+
+#endif /* _LIBMBIM_GLIB_MBIM_DEVICE_PRIVATE_H_ */
@@ -21,16 +21,26 @@
 #include <termios.h>
 #include <unistd.h>
 #include <gio/gio.h>
+#include <glib-unix.h>
 #include <gio/gunixsocketaddress.h>
+#include <gio/gunixfdmessage.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #define IOCTL_WDM_MAX_COMMAND _IOR('H', 0xA0, guint16)
 
 #define OPEN_RETRY_TIMEOUT_SECS 5
 #define OPEN_CLOSE_TIMEOUT_SECS 2
+#define PROXY_TRANSPORT_TIMEOUT_MS 2000
+
+/* Maximum amount of data pending to be written to the shared memory channel
+ * with the proxy, if the send buffer size of the socket is unknown */
+#define SHM_OUTBOUND_LIMIT_DEFAULT (208 * 1024)
+#define PROXY_READY_TIMEOUT_MS 2000
 
 #include "mbim-common.h"
 #include "mbim-utils.h"
 #include "mbim-device.h"
+#include "mbim-device-private.h"
 #include "mbim-message.h"
 #include "mbim-message-private.h"
 #include "mbim-error-types.h"
@@ -38,6 +48,15 @@
 #include "mbim-helpers.h"
 #include "mbim-proxy.h"
 #include "mbim-proxy-control.h"
+#include "mbim-proxy-helpers.h"
+#include "mbim-shm-channel.h"
+#if defined IO_URING_ENABLED
+# include "mbim-uring-channel.h"
+#endif
+#include "mbim-device-cache.h"
+#include "mbim-latency-histogram.h"
+#include "mbim-probes.h"
+#include "mbim-capture.h"
 #include "mbim-net-port-manager.h"
 #include "mbim-net-port-manager-wdm.h"
 #include "mbim-net-port-manager-wwan.h"
@@ -68,6 +87,7 @@ enum {
     SIGNAL_INDICATE_STATUS,
     SIGNAL_ERROR,
     SIGNAL_REMOVED,
+    SIGNAL_RECOVERED,
     SIGNAL_LAST
 };
 
@@ -86,6 +106,26 @@ typedef enum {
     OPEN_STATUS_OPEN    = 2
 } OpenStatus;
 
+/* Automatic recovery of a device gone away unexpectedly */
+typedef struct {
+    GSource  *source;
+    gint64    start_time;
+    gboolean  reopening;
+    guint     n_failures;
+    guint     backoff_ms;
+    gint64    next_attempt_time;
+    GQueue   *held; /* MbimMessage */
+} DeviceRecovery;
+
+/* Command submitted from a thread not owning the device context */
+typedef struct _DeviceCommandRequest DeviceCommandRequest;
+struct _DeviceCommandRequest {
+    DeviceCommandRequest *next;
+    GTask                *task;
+    MbimMessage          *message;
+    guint                 timeout;
+};
+
 struct _MbimDevicePrivate {
     /* File */
     GFile *file;
@@ -105,6 +145,22 @@ struct _MbimDevicePrivate {
     /* Support for mbim-proxy */
     GSocketClient *socket_client;
     GSocketConnection *socket_connection;
+    guint proxy_request_timeout;
+    guint proxy_max_pending_requests;
+
+    /* Shared memory channel with mbim-proxy, if negotiated, and the bytes
+     * pending to be written to it while the ring is full, up to the size of
+     * the send buffer of the socket it replaces */
+    MbimShmChannel *shm;
+    GSource *shm_source;
+    GByteArray *shm_outbound;
+    guint shm_outbound_limit;
+
+#if defined IO_URING_ENABLED
+    /* io_uring based I/O on the control port, if available */
+    MbimUringChannel *uring;
+    GSource *uring_source;
+#endif
 
     /* HT to keep track of ongoing host/function transactions
      *  Host transactions:  created by us
@@ -130,15 +186,378 @@ struct _MbimDevicePrivate {
 
     /* Number of consecutive timeouts detected */
     guint consecutive_timeouts;
+
+    /* Last successful open settings, and last service subscribe list set,
+     * used for the automatic recovery */
+    MbimDeviceOpenFlags open_flags;
+    guint open_timeout;
+    MbimMessage *subscribe_list;
+    DeviceRecovery *recovery;
+    guint64 last_recovery_time;
+
+    /* Context where the device I/O sources are attached */
+    GMainContext *io_context;
+    GMutex io_context_lock;
+
+    /* Lock to serialize the synchronous operations */
+    GRecMutex sync_lock;
+
+    /* Lock-free LIFO of DeviceCommandRequest, filled from any thread and
+     * drained in the device context */
+    gpointer command_queue;
+
+    /* Control plane counters, updated in the device context and read from
+     * any thread with the lock held */
+    MbimDeviceStatistics statistics;
+    GMutex statistics_lock;
+
+    /* Memory accounting, updated in the device context */
+    MbimDeviceMemoryUsage memory;
+
+    /* RequestStatistics per service and CID */
+    GHashTable *requests;
+    GMutex requests_lock;
+
+    /* Capture of the control traffic, and interface of the device in it. The
+     * capture is read without locking; the lock only serializes the updates,
+     * which wait until no message is being added to the previous capture */
+    MbimCapture *capture;
+    guint32 capture_interface;
+    volatile gint capture_users;
+    GMutex capture_lock;
 };
 
 #define MAX_SPAWN_RETRIES             10
 #define MAX_CONTROL_TRANSFER          4096
+#define MAX_READ_SIZE                 (16 * MAX_CONTROL_TRANSFER)
+#define MAX_READS_PER_WAKEUP          16
 #define MAX_TIME_BETWEEN_FRAGMENTS_MS 1250
 
+/* Adaptive timeouts: the timeout is twice the latency not exceeded by 99% of
+ * the requests plus a fixed margin, once there are enough samples */
+#define ADAPTIVE_TIMEOUT_MIN_SAMPLES  16
+#define ADAPTIVE_TIMEOUT_PERCENTILE   99
+#define ADAPTIVE_TIMEOUT_MARGIN_MS    1000
+#define ADAPTIVE_TIMEOUT_MIN_MS       2000
+#define EXPECTED_LATENCY_PERCENTILE   50
+/* Requests are tracked per service, CID and command type, as e.g. a set may
+ * take much longer than a query of the same CID */
+#define REQUEST_KEY(service, cid, command_type) \
+    (((gint64)(service) << 33) | ((gint64)((command_type) & 0x1) << 32) | (guint32)(cid))
+#define REQUEST_KEY_GET_SERVICE(key)      ((MbimService) ((key) >> 33))
+#define REQUEST_KEY_GET_COMMAND_TYPE(key) ((MbimMessageCommandType) (((key) >> 32) & 0x1))
+#define REQUEST_KEY_GET_CID(key)          ((guint) ((key) & 0xFFFFFFFF))
+
 static void device_report_error (MbimDevice   *self,
                                  guint32       transaction_id,
                                  const GError *error);
+static gboolean destroy_iochannel (MbimDevice  *self,
+                                   GError     **error);
+static void          device_set_io_context (MbimDevice   *self);
+static GMainContext *device_ref_io_context (MbimDevice   *self);
+static gboolean device_recovery_start        (MbimDevice   *self);
+static void     device_recovery_stop         (MbimDevice   *self,
+                                              const gchar  *reason);
+static void     device_recovery_hold_command (MbimDevice   *self,
+                                              GTask        *task,
+                                              MbimMessage  *message,
+                                              guint         timeout);
+
+/*****************************************************************************/
+/* Statistics (private) */
+
+/* The 64-bit counters can't be read atomically in every platform, so they're
+ * always updated with the lock held */
+static void
+device_statistics_add (MbimDevice *self,
+                       guint64    *counter,
+                       guint64     value)
+{
+    g_mutex_lock (&self->priv->statistics_lock);
+    *counter += value;
+    g_mutex_unlock (&self->priv->statistics_lock);
+}
+
+typedef struct {
+    guint64               n_requests;
+    guint                 max_latency_ms;
+    MbimLatencyHistogram *histogram;
+} RequestStatistics;
+
+static void
+request_statistics_free (RequestStatistics *stats)
+{
+    _mbim_latency_histogram_free (stats->histogram);
+    g_slice_free (RequestStatistics, stats);
+}
+
+/* Must be called with the lock held */
+static RequestStatistics *
+device_request_statistics_get (MbimDevice *self,
+                               gint64      key)
+{
+    RequestStatistics *stats;
+
+    if (G_UNLIKELY (!self->priv->requests))
+        self->priv->requests = g_hash_table_new_full (g_int64_hash,
+                                                      g_int64_equal,
+                                                      g_free,
+                                                      (GDestroyNotify)request_statistics_free);
+    stats = g_hash_table_lookup (self->priv->requests, &key);
+    if (!stats) {
+        stats = g_slice_new0 (RequestStatistics);
+        stats->histogram = _mbim_latency_histogram_new ();
+        g_hash_table_insert (self->priv->requests, g_memdup (&key, sizeof (key)), stats);
+    }
+    return stats;
+}
+
+static void
+device_request_statistics_sent (MbimDevice *self,
+                                gint64      key)
+{
+    g_mutex_lock (&self->priv->requests_lock);
+    device_request_statistics_get (self, key)->n_requests++;
+    g_mutex_unlock (&self->priv->requests_lock);
+}
+
+static void
+device_request_statistics_completed (MbimDevice *self,
+                                     gint64      key,
+                                     guint       latency_ms)
+{
+    RequestStatistics *stats;
+
+    g_mutex_lock (&self->priv->requests_lock);
+    stats = device_request_statistics_get (self, key);
+    stats->max_latency_ms = MAX (stats->max_latency_ms, latency_ms);
+    _mbim_latency_histogram_add (stats->histogram, latency_ms);
+    g_mutex_unlock (&self->priv->requests_lock);
+}
+
+static gboolean
+device_latency_get_percentile (MbimDevice *self,
+                               gint64      key,
+                               guint       percentile,
+                               guint      *out_latency_ms)
+{
+    RequestStatistics *stats = NULL;
+    gboolean           found = FALSE;
+
+    g_mutex_lock (&self->priv->requests_lock);
+    if (self->priv->requests)
+        stats = g_hash_table_lookup (self->priv->requests, &key);
+    if (stats && _mbim_latency_histogram_get_n_samples (stats->histogram) >= ADAPTIVE_TIMEOUT_MIN_SAMPLES)
+        found = _mbim_latency_histogram_get_percentile (stats->histogram, percentile, out_latency_ms);
+    g_mutex_unlock (&self->priv->requests_lock);
+
+    return found;
+}
+
+static guint
+device_latency_get_timeout (MbimDevice *self,
+                            gint64      key,
+                            guint       max_timeout_ms)
+{
+    guint latency_ms;
+    guint timeout_ms;
+
+    /* Not enough information yet, use the one given by the caller */
+    if (!device_latency_get_percentile (self, key, ADAPTIVE_TIMEOUT_PERCENTILE, &latency_ms))
+        return max_timeout_ms;
+
+    timeout_ms = MAX (2 * latency_ms + ADAPTIVE_TIMEOUT_MARGIN_MS, ADAPTIVE_TIMEOUT_MIN_MS);
+    return MIN (timeout_ms, max_timeout_ms);
+}
+
+gboolean
+mbim_device_get_expected_latency (MbimDevice             *self,
+                                  MbimService             service,
+                                  guint                   cid,
+                                  MbimMessageCommandType  command_type,
+                                  guint                  *out_typical,
+                                  guint                  *out_high)
+{
+    gint64 key;
+    guint  typical;
+    guint  high;
+
+    g_return_val_if_fail (MBIM_IS_DEVICE (self), FALSE);
+    g_return_val_if_fail (command_type == MBIM_MESSAGE_COMMAND_TYPE_QUERY ||
+                          command_type == MBIM_MESSAGE_COMMAND_TYPE_SET, FALSE);
+
+    key = REQUEST_KEY (service, cid, command_type);
+    if (!device_latency_get_percentile (self, key, EXPECTED_LATENCY_PERCENTILE, &typical) ||
+        !device_latency_get_percentile (self, key, ADAPTIVE_TIMEOUT_PERCENTILE, &high))
+        return FALSE;
+
+    if (out_typical)
+        *out_typical = typical;
+    if (out_high)
+        *out_high = high;
+    return TRUE;
+}
+
+static gint
+request_statistics_cmp (const MbimDeviceRequestStatistics *a,
+                        const MbimDeviceRequestStatistics *b)
+{
+    if (a->service != b->service)
+        return (a->service < b->service) ? -1 : 1;
+    if (a->cid != b->cid)
+        return (a->cid < b->cid) ? -1 : 1;
+    return (a->command_type < b->command_type) ? -1 : (a->command_type > b->command_type);
+}
+
+void
+mbim_device_get_statistics (MbimDevice            *self,
+                            MbimDeviceStatistics  *out_statistics,
+                            GArray               **out_request_statistics)
+{
+    g_return_if_fail (MBIM_IS_DEVICE (self));
+
+    if (out_statistics) {
+        g_mutex_lock (&self->priv->statistics_lock);
+        *out_statistics = self->priv->statistics;
+        g_mutex_unlock (&self->priv->statistics_lock);
+    }
+
+    if (out_request_statistics) {
+        GArray            *array;
+        GHashTableIter     iter;
+        gint64            *key;
+        RequestStatistics *stats;
+
+        array = g_array_new (FALSE, TRUE, sizeof (MbimDeviceRequestStatistics));
+        g_mutex_lock (&self->priv->requests_lock);
+        if (self->priv->requests) {
+            g_hash_table_iter_init (&iter, self->priv->requests);
+            while (g_hash_table_iter_next (&iter, (gpointer *)&key, (gpointer *)&stats)) {
+                MbimDeviceRequestStatistics item = { 0 };
+
+                item.service = REQUEST_KEY_GET_SERVICE (*key);
+                item.cid = REQUEST_KEY_GET_CID (*key);
+                item.command_type = REQUEST_KEY_GET_COMMAND_TYPE (*key);
+                item.n_requests = stats->n_requests;
+                item.latency_max = stats->max_latency_ms;
+                _mbim_latency_histogram_get_percentile (stats->histogram, 50, &item.latency_p50);
+                _mbim_latency_histogram_get_percentile (stats->histogram, 90, &item.latency_p90);
+                _mbim_latency_histogram_get_percentile (stats->histogram, 99, &item.latency_p99);
+                g_array_append_val (array, item);
+            }
+        }
+        g_mutex_unlock (&self->priv->requests_lock);
+        g_array_sort (array, (GCompareFunc)request_statistics_cmp);
+        *out_request_statistics = array;
+    }
+}
+
+/*****************************************************************************/
+/* Memory usage */
+
+/* Updated with the statistics lock held, as the counters */
+static void
+device_memory_usage_update (MbimDevice *self,
+                            guint64    *current,
+                            guint64    *peak,
+                            guint64     value)
+{
+    g_mutex_lock (&self->priv->statistics_lock);
+    *current = value;
+    if (value > *peak)
+        *peak = value;
+    g_mutex_unlock (&self->priv->statistics_lock);
+}
+
+void
+mbim_device_get_memory_usage (MbimDevice            *self,
+                              MbimDeviceMemoryUsage *out_memory_usage)
+{
+    g_return_if_fail (MBIM_IS_DEVICE (self));
+    g_return_if_fail (out_memory_usage != NULL);
+
+    g_mutex_lock (&self->priv->statistics_lock);
+    *out_memory_usage = self->priv->memory;
+    g_mutex_unlock (&self->priv->statistics_lock);
+}
+
+/*****************************************************************************/
+/* Capture */
+
+static void
+device_capture (MbimDevice           *self,
+                MbimCaptureDirection  direction,
+                const guint8         *data,
+                gsize                 length)
+{
+    MbimCapture *capture;
+
+    if (!g_atomic_pointer_get (&self->priv->capture))
+        return;
+
+    /* Announce the user before loading the pointer, so that an update either
+     * hides the capture from us or waits until the message is queued */
+    g_atomic_int_inc (&self->priv->capture_users);
+    capture = g_atomic_pointer_get (&self->priv->capture);
+    if (capture)
+        _mbim_capture_add (capture, self->priv->capture_interface, direction, data, length);
+    g_atomic_int_add (&self->priv->capture_users, -1);
+}
+
+void
+_mbim_device_set_capture (MbimDevice  *self,
+                          MbimCapture *capture)
+{
+    MbimCapture *previous;
+
+    g_mutex_lock (&self->priv->capture_lock);
+    previous = g_atomic_pointer_get (&self->priv->capture);
+    g_atomic_pointer_set (&self->priv->capture, NULL);
+
+    /* Wait for the messages being added to the previous capture, so that the
+     * interface is never changed under them */
+    while (g_atomic_int_get (&self->priv->capture_users) > 0)
+        g_thread_yield ();
+
+    if (capture) {
+        self->priv->capture_interface = _mbim_capture_add_interface (capture, self->priv->path_display);
+        g_atomic_pointer_set (&self->priv->capture, _mbim_capture_ref (capture));
+    }
+    g_mutex_unlock (&self->priv->capture_lock);
+
+    /* Unref out of the lock, as it waits for the writer to finish */
+    if (previous)
+        _mbim_capture_unref (previous);
+}
+
+gboolean
+mbim_device_start_capture (MbimDevice   *self,
+                           const gchar  *path,
+                           guint64       max_file_size,
+                           guint         max_files,
+                           GError      **error)
+{
+    g_autoptr(MbimCapture) capture = NULL;
+
+    g_return_val_if_fail (MBIM_IS_DEVICE (self), FALSE);
+    g_return_val_if_fail (path != NULL, FALSE);
+
+    capture = _mbim_capture_new (path, max_file_size, max_files, error);
+    if (!capture)
+        return FALSE;
+
+    g_debug ("[%s] capturing control traffic into '%s'", self->priv->path_display, path);
+    _mbim_device_set_capture (self, capture);
+    return TRUE;
+}
+
+void
+mbim_device_stop_capture (MbimDevice *self)
+{
+    g_return_if_fail (MBIM_IS_DEVICE (self));
+
+    _mbim_device_set_capture (self, NULL);
+}
 
 /*****************************************************************************/
 /* Message transactions (private) */
@@ -147,6 +566,8 @@ typedef struct {
     MbimDevice      *self;
     guint32          transaction_id;
     TransactionType  type;
+    /* Context where the transaction was stored */
+    GMainContext    *context;
 } TransactionWaitContext;
 
 typedef struct {
@@ -157,6 +578,12 @@ typedef struct {
     GCancellable           *cancellable;
     gulong                  cancellable_id;
     TransactionWaitContext *wait_ctx;
+    /* Only set when tracking the statistics of the request */
+    gint64                  request_key;
+    gint64                  request_start;
+    guint                   request_timeout_ms;
+    /* Bytes accounted while stored in the device */
+    gsize                   memory_size;
 } TransactionContext;
 
 static void
@@ -177,8 +604,10 @@ transaction_context_free (TransactionContext *ctx)
         g_object_unref (ctx->cancellable);
     }
 
-    if (ctx->wait_ctx)
+    if (ctx->wait_ctx) {
+        g_main_context_unref (ctx->wait_ctx->context);
         g_slice_free (TransactionWaitContext, ctx->wait_ctx);
+    }
 
     g_slice_free (TransactionContext, ctx);
 }
@@ -239,10 +668,28 @@ transaction_task_complete_and_free (GTask        *task,
     self = g_task_get_source_object (task);
     ctx  = g_task_get_task_data (task);
 
+    /* Timed out requests are also accounted, so that the adaptive timeout
+     * grows if the device becomes slower. They are accounted with the whole
+     * timeout given by the caller, not with the adaptive one they were timed
+     * out with, or the estimate would never grow past it */
+    if (ctx->request_start && !error)
+        device_request_statistics_completed (self,
+                                             ctx->request_key,
+                                             (guint) ((g_get_monotonic_time () - ctx->request_start) / 1000));
+    else if (ctx->request_start && g_error_matches (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_TIMEOUT))
+        device_request_statistics_completed (self,
+                                             ctx->request_key,
+                                             MAX ((guint) ((g_get_monotonic_time () - ctx->request_start) / 1000),
+                                                  ctx->request_timeout_ms));
+
     if (error) {
+        if (g_error_matches (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_ABORTED))
+            device_statistics_add (self, &self->priv->statistics.aborts, 1);
+
         /* Increase number of consecutive timeouts */
         if (g_error_matches (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_TIMEOUT) ||
             g_error_matches (error, MBIM_PROTOCOL_ERROR, MBIM_PROTOCOL_ERROR_TIMEOUT_FRAGMENT)) {
+            device_statistics_add (self, &self->priv->statistics.timeouts, 1);
             self->priv->consecutive_timeouts++;
             g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_CONSECUTIVE_TIMEOUTS]);
             g_debug ("[%s] number of consecutive timeouts: %u",
@@ -291,6 +738,11 @@ device_release_transaction (MbimDevice      *self,
         /* If found, remove it from the HT */
         transaction_task_trace (task, "release");
         g_hash_table_remove (self->priv->transactions[type], GUINT_TO_POINTER (transaction_id));
+        device_memory_usage_update (self, &self->priv->memory.pending_transactions,
+                                    &self->priv->memory.pending_transactions_peak,
+                                    self->priv->memory.pending_transactions - ctx->memory_size);
+        ctx->memory_size = 0;
+        MBIM_PROBE (transaction_release, self->priv->path_display, transaction_id, type, g_get_monotonic_time ());
         return task;
     }
 
@@ -304,6 +756,10 @@ transaction_timed_out (TransactionWaitContext *wait_ctx)
     TransactionContext *ctx;
     g_autoptr(GError)   error = NULL;
 
+    /* Fired before the release, so that tracers can tell the transactions
+     * that timed out apart from the ones that got a response */
+    MBIM_PROBE (transaction_timeout, wait_ctx->self->priv->path_display, wait_ctx->transaction_id, wait_ctx->type, g_get_monotonic_time ());
+
     task = device_release_transaction (wait_ctx->self,
                                        wait_ctx->type,
                                        MBIM_MESSAGE_TYPE_INVALID,
@@ -336,23 +792,35 @@ transaction_timed_out (TransactionWaitContext *wait_ctx)
     return G_SOURCE_REMOVE;
 }
 
+typedef struct {
+    MbimDevice      *self;
+    guint32          transaction_id;
+    TransactionType  type;
+} TransactionCancelContext;
+
 static void
-transaction_cancelled (GCancellable           *cancellable,
-                       TransactionWaitContext *wait_ctx)
+transaction_cancel_context_free (TransactionCancelContext *cancel_ctx)
+{
+    g_object_unref (cancel_ctx->self);
+    g_slice_free (TransactionCancelContext, cancel_ctx);
+}
+
+static gboolean
+transaction_cancelled_idle (TransactionCancelContext *cancel_ctx)
 {
     GTask              *task;
     TransactionContext *ctx;
     g_autoptr(GError)   error = NULL;
 
-    task = device_release_transaction (wait_ctx->self,
-                                       wait_ctx->type,
+    task = device_release_transaction (cancel_ctx->self,
+                                       cancel_ctx->type,
                                        MBIM_MESSAGE_TYPE_INVALID,
-                                       wait_ctx->transaction_id);
+                                       cancel_ctx->transaction_id);
 
-    /* The transaction may have already been cancelled before we stored it in
-     * the tracking table */
+    /* The transaction may have already been completed, or cancelled before
+     * we stored it in the tracking table */
     if (!task)
-        return;
+        return G_SOURCE_REMOVE;
 
     ctx = g_task_get_task_data (task);
     ctx->cancellable_id = 0;
@@ -362,6 +830,30 @@ transaction_cancelled (GCancellable           *cancellable,
                          MBIM_CORE_ERROR_ABORTED,
                          "Transaction aborted");
     transaction_task_complete_and_free (task, error);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+transaction_cancelled (GCancellable           *cancellable,
+                       TransactionWaitContext *wait_ctx)
+{
+    TransactionCancelContext *cancel_ctx;
+    GSource                  *source;
+
+    /* This runs in whatever thread cancelled the operation, so the
+     * transaction is released in the context where it was stored */
+    cancel_ctx = g_slice_new (TransactionCancelContext);
+    cancel_ctx->self = g_object_ref (wait_ctx->self);
+    cancel_ctx->transaction_id = wait_ctx->transaction_id;
+    cancel_ctx->type = wait_ctx->type;
+
+    source = g_idle_source_new ();
+    g_source_set_callback (source,
+                           (GSourceFunc)transaction_cancelled_idle,
+                           cancel_ctx,
+                           (GDestroyNotify)transaction_cancel_context_free);
+    g_source_attach (source, wait_ctx->context);
+    g_source_unref (source);
 }
 
 static gboolean
@@ -372,6 +864,7 @@ device_store_transaction (MbimDevice       *self,
                           GError          **error)
 {
     TransactionContext *ctx;
+    gsize               memory_size;
 
     g_assert ((type != TRANSACTION_TYPE_UNKNOWN) && (type < TRANSACTION_TYPE_LAST));
 
@@ -394,15 +887,17 @@ device_store_transaction (MbimDevice       *self,
         ctx->wait_ctx->self = self;
         ctx->wait_ctx->transaction_id = ctx->transaction_id;
         ctx->wait_ctx->type = type;
+        ctx->wait_ctx->context = g_main_context_ref_thread_default ();
         ctx->timeout_source = g_timeout_source_new (timeout_ms);
         g_source_set_callback (ctx->timeout_source, (GSourceFunc)transaction_timed_out, ctx->wait_ctx, NULL);
-        g_source_attach (ctx->timeout_source, g_main_context_get_thread_default ());
+        g_source_attach (ctx->timeout_source, ctx->wait_ctx->context);
     }
 
     /* Indication transactions don't have cancellable */
     if (ctx->cancellable && !ctx->cancellable_id) {
         /* Note: transaction_cancelled() will also be called directly if the
-         * cancellable is already cancelled */
+         * cancellable is already cancelled; the idle it schedules won't find
+         * the transaction in the HT and does nothing */
         ctx->cancellable_id = g_cancellable_connect (ctx->cancellable,
                                                      (GCallback)transaction_cancelled,
                                                      ctx->wait_ctx,
@@ -419,6 +914,15 @@ device_store_transaction (MbimDevice       *self,
     /* Keep in the HT */
     g_hash_table_insert (self->priv->transactions[type], GUINT_TO_POINTER (ctx->transaction_id), task);
 
+    /* Account the transaction itself and the fragments collected so far; a
+     * transaction stored again replaces its previous amount */
+    memory_size = sizeof (TransactionContext) + (ctx->fragments ? ((GByteArray *)ctx->fragments)->len : 0);
+    device_memory_usage_update (self, &self->priv->memory.pending_transactions,
+                                &self->priv->memory.pending_transactions_peak,
+                                self->priv->memory.pending_transactions - ctx->memory_size + memory_size);
+    ctx->memory_size = memory_size;
+    MBIM_PROBE (transaction_store, self->priv->path_display, ctx->transaction_id, type, timeout_ms, g_get_monotonic_time ());
+
     return TRUE;
 }
 
@@ -515,6 +1019,117 @@ mbim_device_get_consecutive_timeouts (MbimDevice *self)
     return self->priv->consecutive_timeouts;
 }
 
+void
+mbim_device_set_proxy_client_limits (MbimDevice *self,
+                                     guint       request_timeout,
+                                     guint       max_pending_requests)
+{
+    g_return_if_fail (MBIM_IS_DEVICE (self));
+
+    self->priv->proxy_request_timeout = request_timeout;
+    self->priv->proxy_max_pending_requests = max_pending_requests;
+}
+
+/*****************************************************************************/
+/* Proxy memory usage */
+
+typedef struct {
+    MbimDeviceMemoryUsage  device_memory_usage;
+    GArray                *client_memory_usage;
+} ProxyMemoryUsageResult;
+
+static void
+proxy_memory_usage_result_free (ProxyMemoryUsageResult *result)
+{
+    if (result->client_memory_usage)
+        g_array_unref (result->client_memory_usage);
+    g_slice_free (ProxyMemoryUsageResult, result);
+}
+
+gboolean
+mbim_device_query_proxy_memory_usage_finish (MbimDevice             *self,
+                                             GAsyncResult           *res,
+                                             MbimDeviceMemoryUsage  *out_device_memory_usage,
+                                             GArray                **out_client_memory_usage,
+                                             GError                **error)
+{
+    ProxyMemoryUsageResult *result;
+
+    result = g_task_propagate_pointer (G_TASK (res), error);
+    if (!result)
+        return FALSE;
+
+    if (out_device_memory_usage)
+        *out_device_memory_usage = result->device_memory_usage;
+    if (out_client_memory_usage)
+        *out_client_memory_usage = g_steal_pointer (&result->client_memory_usage);
+    proxy_memory_usage_result_free (result);
+    return TRUE;
+}
+
+static void
+proxy_memory_usage_ready (MbimDevice   *self,
+                          GAsyncResult *res,
+                          GTask        *task)
+{
+    ProxyMemoryUsageResult *result;
+    GError                 *error = NULL;
+    g_autoptr(MbimMessage)  response = NULL;
+
+    response = mbim_device_command_finish (self, res, &error);
+    if (!response || !mbim_message_response_get_result (response, MBIM_MESSAGE_TYPE_COMMAND_DONE, &error)) {
+        g_task_return_error (task, error);
+        g_object_unref (task);
+        return;
+    }
+
+    result = g_slice_new0 (ProxyMemoryUsageResult);
+    if (!_mbim_proxy_helper_memory_usage_response_parse (response,
+                                                         &result->device_memory_usage,
+                                                         &result->client_memory_usage,
+                                                         &error)) {
+        proxy_memory_usage_result_free (result);
+        g_task_return_error (task, error);
+        g_object_unref (task);
+        return;
+    }
+
+    g_task_return_pointer (task, result, (GDestroyNotify)proxy_memory_usage_result_free);
+    g_object_unref (task);
+}
+
+void
+mbim_device_query_proxy_memory_usage (MbimDevice          *self,
+                                      guint                timeout,
+                                      GCancellable        *cancellable,
+                                      GAsyncReadyCallback  callback,
+                                      gpointer             user_data)
+{
+    GTask                  *task;
+    g_autoptr(MbimMessage)  request = NULL;
+
+    g_return_if_fail (MBIM_IS_DEVICE (self));
+
+    task = g_task_new (self, cancellable, callback, user_data);
+
+    if (!(self->priv->open_flags & MBIM_DEVICE_OPEN_FLAGS_PROXY)) {
+        g_task_return_new_error (task,
+                                 MBIM_CORE_ERROR,
+                                 MBIM_CORE_ERROR_UNSUPPORTED,
+                                 "Device not opened through the proxy");
+        g_object_unref (task);
+        return;
+    }
+
+    request = _mbim_proxy_helper_memory_usage_query_new ();
+    mbim_device_command (self,
+                         request,
+                         timeout,
+                         cancellable,
+                         (GAsyncReadyCallback)proxy_memory_usage_ready,
+                         task);
+}
+
 /*****************************************************************************/
 
 static void
@@ -867,6 +1482,14 @@ indication_ready (MbimDevice   *self,
         }
     }
 
+    MBIM_PROBE (indication,
+                self->priv->path_display,
+                mbim_message_get_transaction_id (indication),
+                _mbim_probe_message_service (indication),
+                _mbim_probe_message_cid (indication),
+                mbim_message_get_message_length (indication),
+                g_get_monotonic_time ());
+
     g_signal_emit (self, signals[SIGNAL_INDICATE_STATUS], 0, indication);
 }
 
@@ -905,29 +1528,49 @@ process_message (MbimDevice        *self,
     is_partial_fragment = (_mbim_message_is_fragment (message) &&
                            _mbim_message_fragment_get_total (message) > 1);
 
-    if (mbim_utils_get_traces_enabled ()) {
-        g_autofree gchar *printable = NULL;
+    if (is_partial_fragment)
+        device_statistics_add (self, &self->priv->statistics.fragments_in, 1);
+    else
+        device_statistics_add (self, &self->priv->statistics.messages_in, 1);
+
+    MBIM_PROBE (device_message,
+                self->priv->path_display,
+                mbim_message_get_transaction_id (message),
+                MBIM_MESSAGE_GET_MESSAGE_TYPE (message),
+                _mbim_probe_message_service (message),
+                _mbim_probe_message_cid (message),
+                mbim_message_get_message_length (message),
+                is_partial_fragment,
+                g_get_monotonic_time ());
 
-        if (mbim_utils_get_show_personal_info () || (((GByteArray *)message)->len < MAX_PRINTED_BYTES)) {
-            printable = mbim_common_str_hex (((GByteArray *)message)->data,
+    if (mbim_utils_get_traces_enabled ()) {
+        g_autofree gchar *header = NULL;
+        gsize             max_printed;
+
+        header = g_strdup_printf ("[%s] received message...%s\n"
+                                  ">>>>>> RAW:\n"
+                                  ">>>>>>   length = %u\n"
+                                  ">>>>>>   data   = ",
+                                  self->priv->path_display,
+                                  is_partial_fragment ? " (partial fragment)" : "",
+                                  ((GByteArray *)message)->len);
+        max_printed = mbim_utils_get_show_personal_info () ? G_MAXSIZE : MAX_PRINTED_BYTES;
+
+        /* Let the trace sink thread format the data, if there is one */
+        if (!mbim_utils_trace_sink_push_raw (G_LOG_LEVEL_DEBUG,
+                                             header,
+                                             ((GByteArray *)message)->data,
                                              ((GByteArray *)message)->len,
-                                             ':');
-        } else {
-            g_autofree gchar *tmp = NULL;
+                                             max_printed)) {
+            g_autofree gchar *printable = NULL;
 
-            tmp = mbim_common_str_hex (((GByteArray *)message)->data, MAX_PRINTED_BYTES, ':');
-            printable = g_strdup_printf ("%s...", tmp);
+            printable = mbim_common_str_hex_truncated (((GByteArray *)message)->data,
+                                                       ((GByteArray *)message)->len,
+                                                       max_printed,
+                                                       ':');
+            g_debug ("%s%s\n", header, printable);
         }
 
-        g_debug ("[%s] received message...%s\n"
-                 ">>>>>> RAW:\n"
-                 ">>>>>>   length = %u\n"
-                 ">>>>>>   data   = %s\n",
-                 self->priv->path_display,
-                 is_partial_fragment ? " (partial fragment)" : "",
-                 ((GByteArray *)message)->len,
-                 printable);
-
         if (is_partial_fragment) {
             g_autofree gchar *translated = NULL;
 
@@ -1029,6 +1672,9 @@ process_message (MbimDevice        *self,
 
         /* Did we get all needed fragments? */
         if (_mbim_message_fragment_collector_complete (ctx->fragments)) {
+            device_statistics_add (self, &self->priv->statistics.reassemblies, 1);
+            device_statistics_add (self, &self->priv->statistics.messages_in, 1);
+
             /* Now, translate the whole message */
             if (mbim_utils_get_traces_enabled ()) {
                 g_autofree gchar *printable = NULL;
@@ -1061,6 +1707,8 @@ process_message (MbimDevice        *self,
         g_autoptr(GError)  error_indication = NULL;
         GTask             *task;
 
+        device_statistics_add (self, &self->priv->statistics.function_errors, 1);
+
         if (mbim_utils_get_traces_enabled ()) {
             g_autofree gchar *printable = NULL;
 
@@ -1122,7 +1770,7 @@ process_message (MbimDevice        *self,
 }
 
 static void
-parse_response (MbimDevice *self)
+parse_response_messages (MbimDevice *self)
 {
     do {
         const MbimMessage *message;
@@ -1138,6 +1786,7 @@ parse_response (MbimDevice *self)
                 return;
 
             /* Invalid MBIM message */
+            device_statistics_add (self, &self->priv->statistics.validation_failures, 1);
             g_warning ("[%s] discarding %u bytes in stream as message validation fails: %s",
                        self->priv->path_display, self->priv->response->len,
                        error->message);
@@ -1147,6 +1796,8 @@ parse_response (MbimDevice *self)
 
         /* Play with the received message */
         len = mbim_message_get_message_length (message);
+        device_statistics_add (self, &self->priv->statistics.bytes_in, len);
+        device_capture (self, MBIM_CAPTURE_DIRECTION_IN, self->priv->response->data, len);
         process_message (self, message);
 
         /* If we were force-closed during the processing of a message, we'd be
@@ -1159,57 +1810,137 @@ parse_response (MbimDevice *self)
     } while (self->priv->response->len > 0);
 }
 
-static gboolean
-data_available (GIOChannel   *source,
-                GIOCondition  condition,
-                MbimDevice   *self)
+static void
+parse_response (MbimDevice *self)
 {
-    gsize     bytes_read;
-    GIOStatus status;
-    gchar     buffer[MAX_CONTROL_TRANSFER + 1];
+    /* The buffer is at its largest right before parsing */
+    device_memory_usage_update (self, &self->priv->memory.receive_buffer,
+                                &self->priv->memory.receive_buffer_peak,
+                                self->priv->response->len);
 
-    if (condition & G_IO_HUP) {
-        g_debug ("[%s] unexpected port hangup!",
-                 self->priv->path_display);
+    parse_response_messages (self);
 
-        if (self->priv->response &&
-            self->priv->response->len)
-            g_byte_array_remove_range (self->priv->response, 0, self->priv->response->len);
+    device_memory_usage_update (self, &self->priv->memory.receive_buffer,
+                                &self->priv->memory.receive_buffer_peak,
+                                self->priv->response ? self->priv->response->len : 0);
+}
+
+static void
+device_hangup (MbimDevice *self)
+{
+    g_debug ("[%s] unexpected port hangup!",
+             self->priv->path_display);
 
-        mbim_device_close_force (self, NULL);
+    if (self->priv->response &&
+        self->priv->response->len)
+        g_byte_array_remove_range (self->priv->response, 0, self->priv->response->len);
+
+    destroy_iochannel (self, NULL);
+    if (!device_recovery_start (self))
         g_signal_emit (self, signals[SIGNAL_REMOVED], 0 );
-        return FALSE;
-    }
+}
 
-    if (condition & G_IO_ERR) {
-        if (self->priv->response &&
-            self->priv->response->len)
-            g_byte_array_remove_range (self->priv->response, 0, self->priv->response->len);
-        return TRUE;
+#if defined IO_URING_ENABLED
+
+static gboolean
+uring_available (const guint8 *data,
+                 gssize        length,
+                 MbimDevice   *self)
+{
+    /* A port gone away is reported like a hangup */
+    if (length < 0 && length != -EIO && length != -ENODEV)
+        g_warning ("[%s] error in the control port: '%s'",
+                   self->priv->path_display,
+                   g_strerror ((gint) -length));
+
+    if (length <= 0) {
+        /* The source is removed when returning FALSE, so forget it */
+        g_clear_pointer (&self->priv->uring_source, g_source_unref);
+        device_hangup (self);
+        return FALSE;
     }
 
-    /* If not ready yet, prepare the response with default initial size. */
     if (G_UNLIKELY (!self->priv->response))
         self->priv->response = g_byte_array_sized_new (500);
+    g_byte_array_append (self->priv->response, data, length);
+    MBIM_PROBE (device_read, self->priv->path_display, length, self->priv->response->len, g_get_monotonic_time ());
 
-    /* The parse_response() message may end up triggering a close of the
-     * MbimDevice or even a full unref. We are going to make sure a valid
-     * reference is available for as long as we need it in the while()
-     * loop. */
+    /* See data_available() */
     g_object_ref (self);
-    {
-        do {
-            g_autoptr(GError) error = NULL;
+    parse_response (self);
+    g_object_unref (self);
+
+    /* Port closed while processing the response */
+    return (self->priv->uring_source != NULL);
+}
+
+#endif
+
+static gboolean
+data_available (GIOChannel   *source,
+                GIOCondition  condition,
+                MbimDevice   *self)
+{
+    guint n_reads;
+
+    if (condition & G_IO_HUP) {
+        device_hangup (self);
+        return FALSE;
+    }
+
+    if (condition & G_IO_ERR) {
+        if (self->priv->response &&
+            self->priv->response->len)
+            g_byte_array_remove_range (self->priv->response, 0, self->priv->response->len);
+        return TRUE;
+    }
+
+    /* If not ready yet, prepare the response with default initial size. */
+    if (G_UNLIKELY (!self->priv->response))
+        self->priv->response = g_byte_array_sized_new (500);
+
+    /* The parse_response() message may end up triggering a close of the
+     * MbimDevice or even a full unref. We are going to make sure a valid
+     * reference is available for as long as we need it in the read
+     * loop. */
+    g_object_ref (self);
+    {
+        /* Read until there is nothing else pending, but only up to a maximum
+         * number of reads, so that other sources get a chance to run */
+        for (n_reads = 0; n_reads < MAX_READS_PER_WAKEUP; n_reads++) {
+            g_autoptr(GError)  error = NULL;
+            GByteArray        *response;
+            GIOStatus          status;
+            gsize              bytes_read = 0;
+            gsize              read_size;
+            guint              offset;
 
             /* Port is closed; we're done */
             if (!self->priv->iochannel_source)
                 break;
 
+            /* Read straight into the response buffer, trying to get at least
+             * the whole pending message if its length is already known */
+            response = self->priv->response;
+            read_size = self->priv->max_control_transfer;
+            if (response->len >= sizeof (struct header)) {
+                guint32 pending_length;
+
+                pending_length = MBIM_MESSAGE_GET_MESSAGE_LENGTH (response);
+                if (pending_length > response->len)
+                    read_size = CLAMP (pending_length - response->len, read_size, MAX_READ_SIZE);
+            }
+
+            offset = response->len;
+            g_byte_array_set_size (response, offset + read_size);
             status = g_io_channel_read_chars (source,
-                                              buffer,
-                                              self->priv->max_control_transfer,
+                                              (gchar *)&response->data[offset],
+                                              read_size,
                                               &bytes_read,
                                               &error);
+            g_byte_array_set_size (response, offset + bytes_read);
+            MBIM_PROBE (device_read, self->priv->path_display, bytes_read, response->len, g_get_monotonic_time ());
+
             if (status == G_IO_STATUS_ERROR && error)
                 g_warning ("[%s] error reading from the IOChannel: '%s'",
                            self->priv->path_display,
@@ -1219,20 +1950,74 @@ data_available (GIOChannel   *source,
             if (bytes_read == 0)
                 break;
 
-            if (bytes_read > 0)
-                g_byte_array_append (self->priv->response, (const guint8 *)buffer, bytes_read);
-
             /* Try to parse what we already got */
             parse_response (self);
 
-            /* And keep on if we were told to keep on */
-        } while (bytes_read == self->priv->max_control_transfer || status == G_IO_STATUS_AGAIN);
+            /* Stop once drained */
+            if (status != G_IO_STATUS_NORMAL)
+                break;
+        }
     }
     g_object_unref (self);
 
     return TRUE;
 }
 
+static gboolean
+device_flush_shm (MbimDevice  *self,
+                  GError     **error)
+{
+    gsize written = 0;
+
+    if (!self->priv->shm_outbound || self->priv->shm_outbound->len == 0)
+        return TRUE;
+
+    if (!_mbim_shm_channel_write (self->priv->shm,
+                                  self->priv->shm_outbound->data,
+                                  self->priv->shm_outbound->len,
+                                  &written,
+                                  error))
+        return FALSE;
+
+    if (written > 0) {
+        g_byte_array_remove_range (self->priv->shm_outbound, 0, written);
+        _mbim_shm_channel_notify (self->priv->shm);
+    }
+    return TRUE;
+}
+
+static gboolean
+shm_available (gint          fd,
+               GIOCondition  condition,
+               MbimDevice   *self)
+{
+    g_autoptr(GError) error = NULL;
+
+    /* The doorbell is rung by the proxy both when new messages are available
+     * and when space is released for us to write */
+    _mbim_shm_channel_acknowledge (self->priv->shm);
+
+    if (!device_flush_shm (self, &error)) {
+        g_warning ("[%s] couldn't write to the shared memory channel: %s",
+                   self->priv->path_display, error->message);
+        /* The source is destroyed along with the channel */
+        device_hangup (self);
+        return G_SOURCE_REMOVE;
+    }
+
+    if (G_UNLIKELY (!self->priv->response))
+        self->priv->response = g_byte_array_sized_new (500);
+
+    /* See data_available() */
+    g_object_ref (self);
+    if (_mbim_shm_channel_read (self->priv->shm, self->priv->response) > 0 ||
+        self->priv->response->len > 0)
+        parse_response (self);
+    g_object_unref (self);
+
+    return G_SOURCE_CONTINUE;
+}
+
 /* "MBIM Control Model Functional Descriptor" */
 struct usb_cdc_mbim_desc {
     guint8  bLength;
@@ -1343,13 +2128,78 @@ read_max_control_transfer (MbimDevice *self)
     return MAX_CONTROL_TRANSFER;
 }
 
+static gchar *
+build_cache_key (MbimDevice *self)
+{
+    g_autofree gchar *descriptors_path = NULL;
+    g_autofree gchar *contents = NULL;
+    gsize             length = 0;
+
+    /* The USB descriptors identify the device, and include the firmware
+     * revision in the bcdDevice field */
+    descriptors_path = get_descriptors_filepath (self);
+    if (!descriptors_path || !g_file_get_contents (descriptors_path, &contents, &length, NULL))
+        return NULL;
+
+    return g_compute_checksum_for_data (G_CHECKSUM_SHA256, (const guchar *)contents, length);
+}
+
 typedef struct {
     guint spawn_retries;
+    guint16 max_control_transfer;
+    gint ready_fd;
+    GSource *ready_source;
+    GSource *ready_timeout_source;
+    gboolean shared_memory;
+    gint transport_proxy_pid;
+    guint32 transport_transaction_id;
+    GByteArray *transport_buffer;
+    GUnixFDList *transport_fds;
+    GSource *transport_source;
+    GSource *transport_timeout_source;
 } CreateIoChannelContext;
 
+static void
+create_iochannel_context_clear_transport (CreateIoChannelContext *ctx)
+{
+    if (ctx->transport_source) {
+        g_source_destroy (ctx->transport_source);
+        g_source_unref (ctx->transport_source);
+        ctx->transport_source = NULL;
+    }
+    if (ctx->transport_timeout_source) {
+        g_source_destroy (ctx->transport_timeout_source);
+        g_source_unref (ctx->transport_timeout_source);
+        ctx->transport_timeout_source = NULL;
+    }
+    g_clear_pointer (&ctx->transport_buffer, g_byte_array_unref);
+    g_clear_object (&ctx->transport_fds);
+}
+
+static void
+create_iochannel_context_clear_ready (CreateIoChannelContext *ctx)
+{
+    if (ctx->ready_source) {
+        g_source_destroy (ctx->ready_source);
+        g_source_unref (ctx->ready_source);
+        ctx->ready_source = NULL;
+    }
+    if (ctx->ready_timeout_source) {
+        g_source_destroy (ctx->ready_timeout_source);
+        g_source_unref (ctx->ready_timeout_source);
+        ctx->ready_timeout_source = NULL;
+    }
+    if (ctx->ready_fd >= 0) {
+        close (ctx->ready_fd);
+        ctx->ready_fd = -1;
+    }
+}
+
 static void
 create_iochannel_context_free (CreateIoChannelContext *ctx)
 {
+    create_iochannel_context_clear_ready (ctx);
+    create_iochannel_context_clear_transport (ctx);
     g_slice_free (CreateIoChannelContext, ctx);
 }
 
@@ -1361,14 +2211,12 @@ create_iochannel_finish (MbimDevice *self,
     return g_task_propagate_boolean (G_TASK (res), error);
 }
 
-static void
-setup_iochannel (GTask *task)
+static gboolean
+setup_iochannel_sync (MbimDevice  *self,
+                      GError     **error)
 {
-    MbimDevice *self;
     GError *inner_error = NULL;
 
-    self = g_task_get_source_object (task);
-
     /* We don't want UTF-8 encoding, we're playing with raw binary data */
     g_io_channel_set_encoding (self->priv->iochannel, NULL, NULL);
 
@@ -1387,10 +2235,36 @@ setup_iochannel (GTask *task)
         self->priv->iochannel = NULL;
         g_clear_object (&self->priv->socket_connection);
         g_clear_object (&self->priv->socket_client);
-        g_task_return_error (task, inner_error);
-        g_object_unref (task);
-        return;
+        g_propagate_error (error, inner_error);
+        return FALSE;
+    }
+
+#if defined IO_URING_ENABLED
+    /* Control ports opened directly may use io_uring based I/O, with the
+     * GIOChannel being used as fallback if the ring can't be created */
+    if (!self->priv->socket_connection) {
+        g_autoptr(GError) uring_error = NULL;
+
+        self->priv->uring = _mbim_uring_channel_new (g_io_channel_unix_get_fd (self->priv->iochannel),
+                                                     MAX_READ_SIZE,
+                                                     &uring_error);
+        if (self->priv->uring) {
+            g_debug ("[%s] using io_uring based I/O (%s reads)",
+                     self->priv->path_display,
+                     _mbim_uring_channel_is_multishot (self->priv->uring) ? "multishot" : "single-shot");
+            self->priv->uring_source = _mbim_uring_channel_create_source (self->priv->uring);
+            g_source_set_callback (self->priv->uring_source,
+                                   (GSourceFunc)uring_available,
+                                   self,
+                                   NULL);
+            g_source_attach (self->priv->uring_source, g_main_context_get_thread_default ());
+            device_set_io_context (self);
+            return TRUE;
+        }
+        g_debug ("[%s] couldn't setup io_uring based I/O: %s",
+                 self->priv->path_display, uring_error->message);
     }
+#endif
 
     self->priv->iochannel_source = g_io_create_watch (self->priv->iochannel,
                                                       G_IO_IN | G_IO_ERR | G_IO_HUP);
@@ -1399,8 +2273,33 @@ setup_iochannel (GTask *task)
                            self,
                            NULL);
     g_source_attach (self->priv->iochannel_source, g_main_context_get_thread_default ());
+    device_set_io_context (self);
+
+    /* When using shared memory, the socket is still monitored to detect when
+     * the proxy goes away */
+    if (self->priv->shm) {
+        self->priv->shm_source = g_unix_fd_source_new (_mbim_shm_channel_get_fd (self->priv->shm), G_IO_IN);
+        g_source_set_callback (self->priv->shm_source,
+                               (GSourceFunc)shm_available,
+                               self,
+                               NULL);
+        g_source_attach (self->priv->shm_source, g_main_context_get_thread_default ());
+    }
 
-    g_task_return_boolean (task, TRUE);
+    return TRUE;
+}
+
+static void
+setup_iochannel (GTask *task)
+{
+    MbimDevice *self;
+    GError *error = NULL;
+
+    self = g_task_get_source_object (task);
+    if (!setup_iochannel_sync (self, &error))
+        g_task_return_error (task, error);
+    else
+        g_task_return_boolean (task, TRUE);
     g_object_unref (task);
 }
 
@@ -1408,10 +2307,12 @@ static void
 create_iochannel_with_fd (GTask *task)
 {
     MbimDevice *self;
+    CreateIoChannelContext *ctx;
     gint fd;
     guint16 max;
 
     self = g_task_get_source_object (task);
+    ctx = g_task_get_task_data (task);
     errno = 0;
     fd = open (self->priv->path, O_RDWR | O_EXCL | O_NONBLOCK | O_NOCTTY);
     if (fd < 0) {
@@ -1425,8 +2326,13 @@ create_iochannel_with_fd (GTask *task)
         return;
     }
 
-    /* Query message size */
-    if (ioctl (fd, IOCTL_WDM_MAX_COMMAND, &max) < 0) {
+    /* Query message size, unless already known */
+    if (ctx->max_control_transfer) {
+        max = ctx->max_control_transfer;
+        g_debug ("[%s] cached max control message size: %" G_GUINT16_FORMAT,
+                 self->priv->path_display,
+                 max);
+    } else if (ioctl (fd, IOCTL_WDM_MAX_COMMAND, &max) < 0) {
         g_debug ("[%s] couldn't query maximum message size: "
                  "IOCTL_WDM_MAX_COMMAND failed: %s",
                  self->priv->path_display,
@@ -1446,143 +2352,483 @@ create_iochannel_with_fd (GTask *task)
     setup_iochannel (task);
 }
 
-static void create_iochannel_with_socket (GTask *task);
-
-static gboolean
-wait_for_proxy_cb (GTask *task)
+static void
+setup_iochannel_with_socket (GTask *task)
 {
-    create_iochannel_with_socket (task);
-    return FALSE;
+    MbimDevice             *self;
+    CreateIoChannelContext *ctx;
+
+    self = g_task_get_source_object (task);
+    ctx = g_task_get_task_data (task);
+
+    self->priv->iochannel = g_io_channel_unix_new (
+                                     g_socket_get_fd (
+                                         g_socket_connection_get_socket (self->priv->socket_connection)));
+
+    /* try to read the descriptor file, unless already known */
+    self->priv->max_control_transfer = (ctx->max_control_transfer ?
+                                        ctx->max_control_transfer :
+                                        read_max_control_transfer (self));
+
+    setup_iochannel (task);
 }
 
-static void
-spawn_child_setup (void)
+/*
+ * Transport negotiation with the proxy.
+ *
+ * Before any other message is exchanged, the proxy is requested to switch to
+ * the shared memory transport. If it supports it, it replies over the socket
+ * with the channel fds attached to the response; otherwise the socket is used
+ * as usual. Any reply other than a successful one, e.g. an error status, falls
+ * back right away. Only proxies that don't know the command at all never
+ * reply, and once one of those has been found, the negotiation is skipped in
+ * all the later connections of the process to that same proxy process; a
+ * proxy started later, e.g. after an upgrade, is asked again.
+ */
+
+/* Pid of the last proxy found not to reply, or 0 if none */
+static volatile gint proxy_transport_unsupported_pid;
+
+static gint
+proxy_transport_peer_pid (MbimDevice *self)
 {
-    if (setpgid (0, 0) < 0)
-        g_warning ("couldn't setup proxy specific process group");
+    g_autoptr(GCredentials) credentials = NULL;
+
+    credentials = g_socket_get_credentials (g_socket_connection_get_socket (self->priv->socket_connection), NULL);
+    if (!credentials)
+        return -1;
+    return (gint) g_credentials_get_unix_pid (credentials, NULL);
 }
 
 static void
-create_iochannel_with_socket (GTask *task)
+proxy_transport_fallback (GTask       *task,
+                          const gchar *reason)
 {
-    MbimDevice                *self;
-    CreateIoChannelContext    *ctx;
-    g_autoptr(GSocketAddress)  socket_address = NULL;
-    GError                    *error = NULL;
+    MbimDevice             *self;
+    CreateIoChannelContext *ctx;
 
     self = g_task_get_source_object (task);
     ctx = g_task_get_task_data (task);
 
-    /* Create socket client */
-    if (self->priv->socket_client)
-        g_object_unref (self->priv->socket_client);
-    self->priv->socket_client = g_socket_client_new ();
-    g_socket_client_set_family (self->priv->socket_client, G_SOCKET_FAMILY_UNIX);
-    g_socket_client_set_socket_type (self->priv->socket_client, G_SOCKET_TYPE_STREAM);
-    g_socket_client_set_protocol (self->priv->socket_client, G_SOCKET_PROTOCOL_DEFAULT);
+    g_debug ("[%s] shared memory transport not available, using socket: %s",
+             self->priv->path_display, reason);
+    create_iochannel_context_clear_transport (ctx);
+    setup_iochannel_with_socket (task);
+}
 
-    /* Setup socket address */
-    socket_address = (g_unix_socket_address_new_with_type (
-                          MBIM_PROXY_SOCKET_PATH,
-                          -1,
-                          G_UNIX_SOCKET_ADDRESS_ABSTRACT));
+static gboolean
+proxy_transport_timeout_cb (GTask *task)
+{
+    CreateIoChannelContext *ctx;
 
-    /* Connect to address */
-    if (self->priv->socket_connection)
-        g_object_unref (self->priv->socket_connection);
-    self->priv->socket_connection = (g_socket_client_connect (
-                                              self->priv->socket_client,
-                                              G_SOCKET_CONNECTABLE (socket_address),
-                                              NULL,
-                                              &error));
+    ctx = g_task_get_task_data (task);
+    g_atomic_int_set (&proxy_transport_unsupported_pid, ctx->transport_proxy_pid);
+    proxy_transport_fallback (task, "timed out waiting for proxy response");
+    return G_SOURCE_REMOVE;
+}
 
-    if (!self->priv->socket_connection) {
-        g_auto(GStrv)      argc = NULL;
-        g_autoptr(GSource) source = NULL;
+static void
+proxy_transport_response (GTask *task)
+{
+    MbimDevice             *self;
+    CreateIoChannelContext *ctx;
+    MbimMessage            *response;
+    g_autoptr(GError)       error = NULL;
+    g_autofree gint        *fds = NULL;
+    gint                    n_fds = 0;
+    gint                    i;
+    gint                    sndbuf = 0;
 
-        g_debug ("[%s] cannot connect to proxy: %s", self->priv->path_display, error->message);
-        g_clear_error (&error);
-        g_clear_object (&self->priv->socket_client);
+    self = g_task_get_source_object (task);
+    ctx = g_task_get_task_data (task);
 
-        /* Don't retry forever */
-        ctx->spawn_retries++;
-        if (ctx->spawn_retries > MAX_SPAWN_RETRIES) {
-            g_task_return_new_error (task,
-                                     MBIM_CORE_ERROR,
-                                     MBIM_CORE_ERROR_FAILED,
-                                     "Couldn't spawn the mbim-proxy");
-            g_object_unref (task);
-            return;
-        }
+    response = (MbimMessage *)ctx->transport_buffer;
+    if (!mbim_message_validate (response, &error)) {
+        proxy_transport_fallback (task, error->message);
+        return;
+    }
 
-        g_debug ("[%s] spawning new mbim-proxy (try %u)...", self->priv->path_display, ctx->spawn_retries);
+    if (mbim_message_get_message_type (response) != MBIM_MESSAGE_TYPE_COMMAND_DONE ||
+        mbim_message_get_transaction_id (response) != ctx->transport_transaction_id) {
+        proxy_transport_fallback (task, "unexpected response");
+        return;
+    }
 
-        argc = g_new0 (gchar *, 2);
-        argc[0] = g_strdup (LIBEXEC_PATH "/mbim-proxy");
-        if (!g_spawn_async (NULL, /* working directory */
-                            argc,
-                            NULL, /* envp */
-                            G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
-                            (GSpawnChildSetupFunc) spawn_child_setup,
-                            NULL, /* child_setup_user_data */
-                            NULL,
-                            &error)) {
-            g_debug ("[%s] error spawning mbim-proxy: %s", self->priv->path_display, error->message);
-            g_clear_error (&error);
-        }
+    if (!mbim_message_response_get_result (response, MBIM_MESSAGE_TYPE_COMMAND_DONE, &error)) {
+        proxy_transport_fallback (task, error->message);
+        return;
+    }
 
-        /* Wait some ms and retry */
-        source = g_timeout_source_new (100);
-        g_source_set_callback (source, (GSourceFunc)wait_for_proxy_cb, task, NULL);
-        g_source_attach (source, g_main_context_get_thread_default ());
+    if (ctx->transport_fds)
+        fds = g_unix_fd_list_steal_fds (ctx->transport_fds, &n_fds);
+    if (n_fds != 3) {
+        for (i = 0; i < n_fds; i++)
+            close (fds[i]);
+        proxy_transport_fallback (task, "missing shared memory channel");
         return;
     }
 
-    self->priv->iochannel = g_io_channel_unix_new (
-                                     g_socket_get_fd (
-                                         g_socket_connection_get_socket (self->priv->socket_connection)));
+    /* The channel owns the fds from now on */
+    self->priv->shm = _mbim_shm_channel_new_from_fds (fds[0], fds[1], fds[2], &error);
+    if (!self->priv->shm) {
+        proxy_transport_fallback (task, error->message);
+        return;
+    }
 
-    /* try to read the descriptor file */
-    self->priv->max_control_transfer = read_max_control_transfer (self);
+    /* Don't let more data wait for the proxy than the socket would */
+    if (!g_socket_get_option (g_socket_connection_get_socket (self->priv->socket_connection),
+                              SOL_SOCKET, SO_SNDBUF, &sndbuf, NULL) || sndbuf <= 0)
+        sndbuf = SHM_OUTBOUND_LIMIT_DEFAULT;
+    self->priv->shm_outbound_limit = (guint) sndbuf;
 
-    setup_iochannel (task);
+    g_debug ("[%s] using shared memory transport with proxy", self->priv->path_display);
+    create_iochannel_context_clear_transport (ctx);
+    setup_iochannel_with_socket (task);
 }
 
-static void
-create_iochannel (MbimDevice           *self,
-                  gboolean              proxy,
-                  GAsyncReadyCallback   callback,
-                  gpointer              user_data)
+static gboolean
+proxy_transport_readable_cb (GSocket      *socket,
+                             GIOCondition  condition,
+                             GTask        *task)
 {
     CreateIoChannelContext *ctx;
-    GTask *task;
 
-    ctx = g_slice_new (CreateIoChannelContext);
-    ctx->spawn_retries = 0;
+    ctx = g_task_get_task_data (task);
 
-    task = g_task_new (self, NULL, callback, user_data);
-    g_task_set_task_data (task, ctx, (GDestroyNotify)create_iochannel_context_free);
+    /* Read the response header first, then the rest, so that nothing beyond
+     * the response is consumed from the socket */
+    while (TRUE) {
+        g_autoptr(GError)        error = NULL;
+        GSocketControlMessage  **messages = NULL;
+        gint                     n_messages = 0;
+        GInputVector             vector;
+        gsize                    expected;
+        guint                    offset;
+        gssize                   r;
+        gint                     i;
+
+        expected = sizeof (struct header);
+        if (ctx->transport_buffer->len >= sizeof (struct header))
+            expected = MBIM_MESSAGE_GET_MESSAGE_LENGTH (ctx->transport_buffer);
+        if (ctx->transport_buffer->len >= expected)
+            break;
 
-    if (self->priv->iochannel) {
-        g_task_return_new_error (task,
-                                 MBIM_CORE_ERROR,
-                                 MBIM_CORE_ERROR_WRONG_STATE,
-                                 "Already open");
-        g_object_unref (task);
-        return;
-    }
+        offset = ctx->transport_buffer->len;
+        g_byte_array_set_size (ctx->transport_buffer, expected);
+        vector.buffer = &ctx->transport_buffer->data[offset];
+        vector.size = expected - offset;
+        r = g_socket_receive_message (socket, NULL, &vector, 1, &messages, &n_messages, NULL, NULL, &error);
+        g_byte_array_set_size (ctx->transport_buffer, offset + MAX (r, 0));
+
+        for (i = 0; i < n_messages; i++) {
+            if (G_IS_UNIX_FD_MESSAGE (messages[i]) && !ctx->transport_fds)
+                ctx->transport_fds = g_object_ref (g_unix_fd_message_get_fd_list (G_UNIX_FD_MESSAGE (messages[i])));
+            g_object_unref (messages[i]);
+        }
+        g_free (messages);
 
-    g_assert (self->priv->file);
-    g_assert (self->priv->path);
+        if (r < 0) {
+            if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+                return G_SOURCE_CONTINUE;
+            proxy_transport_fallback (task, error->message);
+            return G_SOURCE_REMOVE;
+        }
 
-    if (proxy)
-        create_iochannel_with_socket (task);
-    else
-        create_iochannel_with_fd (task);
+        /* Proxy gone; let the socket setup report it */
+        if (r == 0) {
+            proxy_transport_fallback (task, "connection closed");
+            return G_SOURCE_REMOVE;
+        }
+
+        if (ctx->transport_buffer->len >= sizeof (struct header) &&
+            MBIM_MESSAGE_GET_MESSAGE_LENGTH (ctx->transport_buffer) > MAX_READ_SIZE) {
+            proxy_transport_fallback (task, "invalid response");
+            return G_SOURCE_REMOVE;
+        }
+    }
+
+    /* The source is destroyed while processing the response */
+    proxy_transport_response (task);
+    return G_SOURCE_REMOVE;
 }
 
-typedef enum {
-    DEVICE_OPEN_CONTEXT_STEP_FIRST = 0,
+static void
+proxy_transport_request (GTask *task)
+{
+    MbimDevice             *self;
+    CreateIoChannelContext *ctx;
+    GSocket                *socket;
+    g_autoptr(MbimMessage)  request = NULL;
+    g_autoptr(GError)       error = NULL;
+    const guint8           *raw;
+    guint32                 raw_len;
+
+    self = g_task_get_source_object (task);
+    ctx = g_task_get_task_data (task);
+
+    socket = g_socket_connection_get_socket (self->priv->socket_connection);
+    g_socket_set_blocking (socket, FALSE);
+
+    /* No other message has been sent yet, so any transaction id is fine */
+    request = _mbim_proxy_helper_transport_set_new (MBIM_PROXY_TRANSPORT_SHARED_MEMORY);
+    ctx->transport_transaction_id = mbim_device_get_next_transaction_id (self);
+    mbim_message_set_transaction_id (request, ctx->transport_transaction_id);
+    raw = mbim_message_get_raw (request, &raw_len, NULL);
+
+    /* The socket buffer is empty, so the request is always written at once */
+    if (g_socket_send (socket, (const gchar *)raw, raw_len, NULL, &error) != (gssize)raw_len) {
+        proxy_transport_fallback (task, error ? error->message : "partial write");
+        return;
+    }
+
+    ctx->transport_buffer = g_byte_array_sized_new (sizeof (struct header));
+
+    ctx->transport_source = g_socket_create_source (socket, G_IO_IN | G_IO_ERR | G_IO_HUP, NULL);
+    g_source_set_callback (ctx->transport_source,
+                           (GSourceFunc)proxy_transport_readable_cb,
+                           task,
+                           NULL);
+    g_source_attach (ctx->transport_source, g_main_context_get_thread_default ());
+
+    ctx->transport_timeout_source = g_timeout_source_new (PROXY_TRANSPORT_TIMEOUT_MS);
+    g_source_set_callback (ctx->transport_timeout_source,
+                           (GSourceFunc)proxy_transport_timeout_cb,
+                           task,
+                           NULL);
+    g_source_attach (ctx->transport_timeout_source, g_main_context_get_thread_default ());
+}
+
+static void create_iochannel_with_socket (GTask *task);
+
+static gboolean
+wait_for_proxy_cb (GTask *task)
+{
+    create_iochannel_with_socket (task);
+    return FALSE;
+}
+
+static gboolean
+proxy_ready_cb (GTask *task)
+{
+    MbimDevice             *self;
+    CreateIoChannelContext *ctx;
+    gchar                   value;
+
+    self = g_task_get_source_object (task);
+    ctx = g_task_get_task_data (task);
+
+    /* Either notified, or the proxy exited before getting ready (e.g. because
+     * another one was already running); retry the connection right away */
+    if (read (ctx->ready_fd, &value, 1) == 1)
+        g_debug ("[%s] mbim-proxy ready", self->priv->path_display);
+    else
+        g_debug ("[%s] mbim-proxy didn't notify readiness", self->priv->path_display);
+
+    create_iochannel_context_clear_ready (ctx);
+    create_iochannel_with_socket (task);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+proxy_ready_timeout_cb (GTask *task)
+{
+    MbimDevice             *self;
+    CreateIoChannelContext *ctx;
+
+    self = g_task_get_source_object (task);
+    ctx = g_task_get_task_data (task);
+
+    g_debug ("[%s] timed out waiting for mbim-proxy readiness", self->priv->path_display);
+    create_iochannel_context_clear_ready (ctx);
+    create_iochannel_with_socket (task);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+spawn_child_setup (gpointer user_data)
+{
+    gint ready_fd;
+
+    if (setpgid (0, 0) < 0)
+        g_warning ("couldn't setup proxy specific process group");
+
+    /* All fds are flagged as close-on-exec right before this setup, so make
+     * sure the readiness pipe gets inherited by the proxy */
+    ready_fd = GPOINTER_TO_INT (user_data);
+    if (ready_fd >= 0)
+        fcntl (ready_fd, F_SETFD, 0);
+}
+
+static gboolean
+spawn_proxy (CreateIoChannelContext  *ctx,
+             GError                 **error)
+{
+    g_auto(GStrv) argv = NULL;
+    gint          fds[2] = { -1, -1 };
+    gboolean      spawned;
+
+    /* Readiness pipe; the proxy writes to it once it is listening, or closes
+     * it if it exits earlier. If it cannot be created, we just poll. */
+    if (!g_unix_open_pipe (fds, FD_CLOEXEC, NULL))
+        fds[0] = fds[1] = -1;
+
+    argv = g_new0 (gchar *, 3);
+    argv[0] = g_strdup (LIBEXEC_PATH "/mbim-proxy");
+    if (fds[1] >= 0)
+        argv[1] = g_strdup_printf ("--ready-fd=%d", fds[1]);
+
+    spawned = g_spawn_async (NULL, /* working directory */
+                             argv,
+                             NULL, /* envp */
+                             G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                             (GSpawnChildSetupFunc) spawn_child_setup,
+                             GINT_TO_POINTER (fds[1]),
+                             NULL,
+                             error);
+
+    /* The write end is owned by the proxy */
+    if (fds[1] >= 0)
+        close (fds[1]);
+
+    if (!spawned || fds[0] < 0) {
+        if (fds[0] >= 0)
+            close (fds[0]);
+        return spawned;
+    }
+
+    ctx->ready_fd = fds[0];
+    return TRUE;
+}
+
+static void
+create_iochannel_with_socket (GTask *task)
+{
+    MbimDevice                *self;
+    CreateIoChannelContext    *ctx;
+    g_autoptr(GSocketAddress)  socket_address = NULL;
+    GError                    *error = NULL;
+
+    self = g_task_get_source_object (task);
+    ctx = g_task_get_task_data (task);
+
+    /* Create socket client */
+    if (self->priv->socket_client)
+        g_object_unref (self->priv->socket_client);
+    self->priv->socket_client = g_socket_client_new ();
+    g_socket_client_set_family (self->priv->socket_client, G_SOCKET_FAMILY_UNIX);
+    g_socket_client_set_socket_type (self->priv->socket_client, G_SOCKET_TYPE_STREAM);
+    g_socket_client_set_protocol (self->priv->socket_client, G_SOCKET_PROTOCOL_DEFAULT);
+
+    /* Setup socket address */
+    socket_address = (g_unix_socket_address_new_with_type (
+                          MBIM_PROXY_SOCKET_PATH,
+                          -1,
+                          G_UNIX_SOCKET_ADDRESS_ABSTRACT));
+
+    /* Connect to address */
+    if (self->priv->socket_connection)
+        g_object_unref (self->priv->socket_connection);
+    self->priv->socket_connection = (g_socket_client_connect (
+                                              self->priv->socket_client,
+                                              G_SOCKET_CONNECTABLE (socket_address),
+                                              NULL,
+                                              &error));
+
+    if (!self->priv->socket_connection) {
+        g_autoptr(GSource) source = NULL;
+
+        g_debug ("[%s] cannot connect to proxy: %s", self->priv->path_display, error->message);
+        g_clear_error (&error);
+        g_clear_object (&self->priv->socket_client);
+
+        /* Don't retry forever */
+        ctx->spawn_retries++;
+        if (ctx->spawn_retries > MAX_SPAWN_RETRIES) {
+            g_task_return_new_error (task,
+                                     MBIM_CORE_ERROR,
+                                     MBIM_CORE_ERROR_FAILED,
+                                     "Couldn't spawn the mbim-proxy");
+            g_object_unref (task);
+            return;
+        }
+
+        g_debug ("[%s] spawning new mbim-proxy (try %u)...", self->priv->path_display, ctx->spawn_retries);
+
+        if (!spawn_proxy (ctx, &error)) {
+            g_debug ("[%s] error spawning mbim-proxy: %s", self->priv->path_display, error->message);
+            g_clear_error (&error);
+        }
+
+        /* Wait until the proxy is ready, or until it exits */
+        if (ctx->ready_fd >= 0) {
+            ctx->ready_source = g_unix_fd_source_new (ctx->ready_fd, G_IO_IN | G_IO_HUP | G_IO_ERR);
+            g_source_set_callback (ctx->ready_source, (GSourceFunc)proxy_ready_cb, task, NULL);
+            g_source_attach (ctx->ready_source, g_main_context_get_thread_default ());
+            ctx->ready_timeout_source = g_timeout_source_new (PROXY_READY_TIMEOUT_MS);
+            g_source_set_callback (ctx->ready_timeout_source, (GSourceFunc)proxy_ready_timeout_cb, task, NULL);
+            g_source_attach (ctx->ready_timeout_source, g_main_context_get_thread_default ());
+            return;
+        }
+
+        /* Otherwise, wait some ms and retry */
+        source = g_timeout_source_new (100);
+        g_source_set_callback (source, (GSourceFunc)wait_for_proxy_cb, task, NULL);
+        g_source_attach (source, g_main_context_get_thread_default ());
+        return;
+    }
+
+    if (ctx->shared_memory) {
+        ctx->transport_proxy_pid = proxy_transport_peer_pid (self);
+        if (ctx->transport_proxy_pid != g_atomic_int_get (&proxy_transport_unsupported_pid)) {
+            proxy_transport_request (task);
+            return;
+        }
+        g_debug ("[%s] shared memory transport not supported by proxy (pid %d), using socket",
+                 self->priv->path_display, ctx->transport_proxy_pid);
+    }
+
+    setup_iochannel_with_socket (task);
+}
+
+static void
+create_iochannel (MbimDevice           *self,
+                  MbimDeviceOpenFlags   flags,
+                  guint16               max_control_transfer,
+                  GAsyncReadyCallback   callback,
+                  gpointer              user_data)
+{
+    CreateIoChannelContext *ctx;
+    GTask *task;
+
+    ctx = g_slice_new0 (CreateIoChannelContext);
+    ctx->spawn_retries = 0;
+    ctx->max_control_transfer = max_control_transfer;
+    ctx->ready_fd = -1;
+    ctx->shared_memory = !!(flags & MBIM_DEVICE_OPEN_FLAGS_PROXY_SHARED_MEMORY);
+
+    task = g_task_new (self, NULL, callback, user_data);
+    g_task_set_task_data (task, ctx, (GDestroyNotify)create_iochannel_context_free);
+
+    if (self->priv->iochannel) {
+        g_task_return_new_error (task,
+                                 MBIM_CORE_ERROR,
+                                 MBIM_CORE_ERROR_WRONG_STATE,
+                                 "Already open");
+        g_object_unref (task);
+        return;
+    }
+
+    g_assert (self->priv->file);
+    g_assert (self->priv->path);
+
+    if (flags & MBIM_DEVICE_OPEN_FLAGS_PROXY)
+        create_iochannel_with_socket (task);
+    else
+        create_iochannel_with_fd (task);
+}
+
+typedef enum {
+    DEVICE_OPEN_CONTEXT_STEP_FIRST = 0,
     DEVICE_OPEN_CONTEXT_STEP_CREATE_IOCHANNEL,
     DEVICE_OPEN_CONTEXT_STEP_FLAGS_PROXY,
     DEVICE_OPEN_CONTEXT_STEP_CLOSE_MESSAGE,
@@ -1598,15 +2844,96 @@ typedef struct {
     guint                  timeout;
     GTimer                *timer;
     gboolean               close_before_open;
+
+    /* Fast open */
+    gchar                  *cache_path;
+    gchar                  *cache_key;
+    gboolean                cache_hit;
+    MbimDeviceCacheEntry    cache_entry;
+    MbimDeviceCacheSupport  ms_mbimex_version_support;
+
+    /* Pipelined post-open queries */
+    guint                   pipelined_pending;
+    MbimMessage            *pipelined_services_response;
+    GError                 *pipelined_services_error;
+    MbimMessage            *pipelined_version_response;
+    GError                 *pipelined_version_error;
 } DeviceOpenContext;
 
 static void
 device_open_context_free (DeviceOpenContext *ctx)
 {
+    g_free (ctx->cache_path);
+    g_free (ctx->cache_key);
+    g_clear_pointer (&ctx->pipelined_services_response, mbim_message_unref);
+    g_clear_pointer (&ctx->pipelined_version_response, mbim_message_unref);
+    g_clear_error (&ctx->pipelined_services_error);
+    g_clear_error (&ctx->pipelined_version_error);
     g_timer_destroy (ctx->timer);
     g_slice_free (DeviceOpenContext, ctx);
 }
 
+static void
+device_open_cache_load (MbimDevice        *self,
+                        DeviceOpenContext *ctx)
+{
+    ctx->cache_key = build_cache_key (self);
+    if (!ctx->cache_key) {
+        g_debug ("[%s] fast open not possible: couldn't identify device", self->priv->path_display);
+        return;
+    }
+
+    ctx->cache_path = _mbim_device_cache_get_default_path ();
+    ctx->cache_hit = _mbim_device_cache_load (ctx->cache_path, self->priv->path, ctx->cache_key, &ctx->cache_entry);
+    g_debug ("[%s] fast open cache %s", self->priv->path_display, ctx->cache_hit ? "hit" : "miss");
+}
+
+static void
+device_open_cache_invalidate (MbimDevice        *self,
+                              DeviceOpenContext *ctx)
+{
+    if (!ctx->cache_hit)
+        return;
+
+    g_debug ("[%s] fast open cache invalidated", self->priv->path_display);
+    _mbim_device_cache_invalidate (ctx->cache_path, self->priv->path);
+    ctx->cache_hit = FALSE;
+}
+
+static void
+device_open_cache_store (MbimDevice        *self,
+                         DeviceOpenContext *ctx)
+{
+    MbimDeviceCacheEntry  entry = { 0 };
+    g_autoptr(GError)     error = NULL;
+
+    if (!ctx->cache_key)
+        return;
+
+    entry.max_control_transfer = self->priv->max_control_transfer;
+    entry.ms_mbimex_version_support = ctx->ms_mbimex_version_support;
+    entry.ms_mbimex_version_major = self->priv->ms_mbimex_version_major;
+    entry.ms_mbimex_version_minor = self->priv->ms_mbimex_version_minor;
+
+    /* Don't keep whatever we knew if we didn't learn it this time */
+    if (ctx->cache_hit && entry.ms_mbimex_version_support == MBIM_DEVICE_CACHE_SUPPORT_UNKNOWN) {
+        entry.ms_mbimex_version_support = ctx->cache_entry.ms_mbimex_version_support;
+        entry.ms_mbimex_version_major = ctx->cache_entry.ms_mbimex_version_major;
+        entry.ms_mbimex_version_minor = ctx->cache_entry.ms_mbimex_version_minor;
+    }
+
+    /* Avoid writing the same contents over and over */
+    if (ctx->cache_hit &&
+        entry.max_control_transfer == ctx->cache_entry.max_control_transfer &&
+        entry.ms_mbimex_version_support == ctx->cache_entry.ms_mbimex_version_support &&
+        entry.ms_mbimex_version_major == ctx->cache_entry.ms_mbimex_version_major &&
+        entry.ms_mbimex_version_minor == ctx->cache_entry.ms_mbimex_version_minor)
+        return;
+
+    if (!_mbim_device_cache_store (ctx->cache_path, self->priv->path, ctx->cache_key, &entry, &error))
+        g_debug ("[%s] couldn't update fast open cache: %s", self->priv->path_display, error->message);
+}
+
 gboolean
 mbim_device_open_full_finish (MbimDevice    *self,
                               GAsyncResult  *res,
@@ -1625,31 +2952,21 @@ mbim_device_open_finish (MbimDevice   *self,
 
 static void device_open_context_step (GTask *task);
 
-static void
-ms_ext_version_message_ready (MbimDevice   *self,
-                              GAsyncResult *res,
-                              GTask        *task)
+static gboolean
+ms_ext_version_response_process (MbimDevice   *self,
+                                 MbimMessage  *response,
+                                 GError      **error)
 {
-    g_autoptr(MbimMessage)  response = NULL;
-    GError                 *error = NULL;
-    guint16                 mbim_version;
-    guint16                 ms_mbimex_version;
-    DeviceOpenContext      *ctx;
-
-    ctx = g_task_get_task_data (task);
+    guint16 mbim_version;
+    guint16 ms_mbimex_version;
 
-    response = mbim_device_command_finish (self, res, &error);
-    if (!response ||
-        !mbim_message_response_get_result (response, MBIM_MESSAGE_TYPE_COMMAND_DONE, &error) ||
+    if (!mbim_message_response_get_result (response, MBIM_MESSAGE_TYPE_COMMAND_DONE, error) ||
         !mbim_message_ms_basic_connect_extensions_v2_version_response_parse (
             response,
             &mbim_version,
             &ms_mbimex_version,
-            &error)){
-        g_task_return_error (task, error);
-        g_object_unref (task);
-        return;
-    }
+            error))
+        return FALSE;
 
     /* We fully ignore the MBIM version for now, we just assume it's 1.0, which
      * is the only known release from the USB-IF for now. */
@@ -1662,30 +2979,60 @@ ms_ext_version_message_ready (MbimDevice   *self,
              mbim_version & 0xFF,
              self->priv->ms_mbimex_version_major,
              self->priv->ms_mbimex_version_minor);
-
-    ctx->step++;
-    device_open_context_step (task);
+    return TRUE;
 }
 
 static void
-ms_ext_version_message (GTask *task)
+ms_ext_version_message_ready (MbimDevice   *self,
+                              GAsyncResult *res,
+                              GTask        *task)
 {
-    MbimDevice             *self;
+    g_autoptr(MbimMessage)  response = NULL;
+    GError                 *error = NULL;
     DeviceOpenContext      *ctx;
-    g_autoptr(MbimMessage)  request = NULL;
-    guint32                 mbim_version = 0;
-    guint32                 ms_mbimex_version = 0;
 
-    self = g_task_get_source_object (task);
     ctx = g_task_get_task_data (task);
 
-    if ((ctx->flags & MBIM_DEVICE_OPEN_FLAGS_MS_MBIMEX_V2) && (ctx->flags & MBIM_DEVICE_OPEN_FLAGS_MS_MBIMEX_V3)) {
-        g_task_return_new_error (task, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_ARGS,
-                                 "Cannot request both MBIMEx v2.0 and v3.0 at the same time");
+    response = mbim_device_command_finish (self, res, &error);
+    if (!response || !ms_ext_version_response_process (self, response, &error)) {
+        /* If the device services list was skipped because of the cache,
+         * the cache may be wrong */
+        if (ctx->ms_mbimex_version_support == MBIM_DEVICE_CACHE_SUPPORT_UNKNOWN) {
+            device_open_cache_invalidate (self, ctx);
+            if (g_error_matches (error, MBIM_STATUS_ERROR, MBIM_STATUS_ERROR_NO_DEVICE_SUPPORT)) {
+                g_debug ("[%s] version command not supported", self->priv->path_display);
+                g_clear_error (&error);
+                ctx->ms_mbimex_version_support = MBIM_DEVICE_CACHE_SUPPORT_NO;
+                ctx->step = DEVICE_OPEN_CONTEXT_STEP_LAST;
+                device_open_context_step (task);
+                return;
+            }
+        }
+        g_task_return_error (task, error);
         g_object_unref (task);
         return;
     }
 
+    if (ctx->ms_mbimex_version_support == MBIM_DEVICE_CACHE_SUPPORT_UNKNOWN)
+        ctx->ms_mbimex_version_support = MBIM_DEVICE_CACHE_SUPPORT_YES;
+
+    ctx->step++;
+    device_open_context_step (task);
+}
+
+static MbimMessage *
+ms_ext_version_request_new (DeviceOpenContext  *ctx,
+                            GError            **error)
+{
+    guint32 mbim_version = 0;
+    guint32 ms_mbimex_version = 0;
+
+    if ((ctx->flags & MBIM_DEVICE_OPEN_FLAGS_MS_MBIMEX_V2) && (ctx->flags & MBIM_DEVICE_OPEN_FLAGS_MS_MBIMEX_V3)) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_ARGS,
+                     "Cannot request both MBIMEx v2.0 and v3.0 at the same time");
+        return NULL;
+    }
+
     /* User requested MBIMEx 2.0 or 3.0, so we'll report it along with MBIM 1.0 */
     mbim_version = 0x01 << 8 | 0x00;
     if (ctx->flags & MBIM_DEVICE_OPEN_FLAGS_MS_MBIMEX_V2)
@@ -1695,51 +3042,58 @@ ms_ext_version_message (GTask *task)
     else
         g_assert_not_reached ();
 
-    request = mbim_message_ms_basic_connect_extensions_v2_version_query_new (mbim_version, ms_mbimex_version, NULL);
-    g_assert (request);
+    return mbim_message_ms_basic_connect_extensions_v2_version_query_new (mbim_version, ms_mbimex_version, error);
+}
 
-    mbim_device_command (self,
-                         request,
+static void
+ms_ext_version_message (GTask *task)
+{
+    MbimDevice             *self;
+    DeviceOpenContext      *ctx;
+    g_autoptr(MbimMessage)  request = NULL;
+    GError                 *error = NULL;
+
+    self = g_task_get_source_object (task);
+    ctx = g_task_get_task_data (task);
+
+    request = ms_ext_version_request_new (ctx, &error);
+    if (!request) {
+        g_task_return_error (task, error);
+        g_object_unref (task);
+        return;
+    }
+
+    mbim_device_command (self,
+                         request,
                          ctx->timeout,
                          g_task_get_cancellable (task),
                          (GAsyncReadyCallback)ms_ext_version_message_ready,
                          task);
 }
 
-static void
-device_services_message_ready (MbimDevice   *device,
-                               GAsyncResult *res,
-                               GTask        *task)
+static gboolean
+device_services_response_process (MbimMessage  *response,
+                                  gboolean     *out_version_supported,
+                                  GError      **error)
 {
-    g_autoptr(MbimMessage)                    response = NULL;
-    g_autoptr(MbimDeviceServiceElementArray)  device_services = NULL;
-    GError                                   *error = NULL;
-    guint32                                   device_services_count;
-    guint32                                   max_dss_sessions;
-    DeviceOpenContext                        *ctx;
-    guint                                     i;
-
-    ctx = g_task_get_task_data (task);
+    g_autoptr(MbimDeviceServiceElementArray) device_services = NULL;
+    guint32                                  device_services_count;
+    guint32                                  max_dss_sessions;
+    guint                                    i;
 
-    response = mbim_device_command_finish (device, res, &error);
-    if (!response ||
-        !mbim_message_response_get_result (response, MBIM_MESSAGE_TYPE_COMMAND_DONE, &error) ||
+    if (!mbim_message_response_get_result (response, MBIM_MESSAGE_TYPE_COMMAND_DONE, error) ||
         !mbim_message_device_services_response_parse (
             response,
             &device_services_count,
             &max_dss_sessions,
             &device_services,
-            &error)) {
-        g_task_return_error (task, error);
-        g_object_unref (task);
-        return;
-    }
+            error))
+        return FALSE;
 
     if (device_services_count == 0) {
-        g_task_return_new_error (task, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
-                                 "No supported services reported by the modem");
-        g_object_unref (task);
-        return;
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "No supported services reported by the modem");
+        return FALSE;
     }
 
     for (i = 0; i < device_services_count; i++) {
@@ -1751,16 +3105,46 @@ device_services_message_ready (MbimDevice   *device,
 
             if ((service == MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS) &&
                 device_services[i]->cids[j] == MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_VERSION) {
-                /* version command is supported, go on */
-                ctx->step++;
-                device_open_context_step (task);
-                return;
+                *out_version_supported = TRUE;
+                return TRUE;
             }
         }
     }
 
+    *out_version_supported = FALSE;
+    return TRUE;
+}
+
+static void
+device_services_message_ready (MbimDevice   *device,
+                               GAsyncResult *res,
+                               GTask        *task)
+{
+    g_autoptr(MbimMessage)  response = NULL;
+    GError                 *error = NULL;
+    DeviceOpenContext      *ctx;
+    gboolean                version_supported = FALSE;
+
+    ctx = g_task_get_task_data (task);
+
+    response = mbim_device_command_finish (device, res, &error);
+    if (!response || !device_services_response_process (response, &version_supported, &error)) {
+        g_task_return_error (task, error);
+        g_object_unref (task);
+        return;
+    }
+
+    if (version_supported) {
+        /* version command is supported, go on */
+        ctx->ms_mbimex_version_support = MBIM_DEVICE_CACHE_SUPPORT_YES;
+        ctx->step++;
+        device_open_context_step (task);
+        return;
+    }
+
     /* the version command isn't supported, so we can just jump to the end */
-    ctx->step = DEVICE_OPEN_CONTEXT_STEP_LAST;;
+    ctx->ms_mbimex_version_support = MBIM_DEVICE_CACHE_SUPPORT_NO;
+    ctx->step = DEVICE_OPEN_CONTEXT_STEP_LAST;
     device_open_context_step (task);
 }
 
@@ -1785,6 +3169,146 @@ device_services_message (GTask *task)
                          task);
 }
 
+/*
+ * Pipelined post-open queries: the device services query and the version
+ * exchange are sent at the same time, and the result is evaluated once both
+ * have finished, exactly as if they had been run in sequence: the version
+ * exchange result is ignored if the device services list says the command
+ * isn't supported. Devices listing the command may still reject it when sent
+ * before the services query is answered, so if the pipelined version exchange
+ * fails with an error reported by the device, it is run again in sequence.
+ * If the device support is already cached, the services query is skipped
+ * altogether and there is nothing to pipeline.
+ */
+
+static gboolean
+pipelined_error_is_retriable (const GError *error)
+{
+    return (error->domain == MBIM_STATUS_ERROR || error->domain == MBIM_PROTOCOL_ERROR);
+}
+
+static void
+pipelined_queries_complete (GTask *task)
+{
+    MbimDevice        *self;
+    DeviceOpenContext *ctx;
+    gboolean           version_supported = FALSE;
+    GError            *error = NULL;
+
+    self = g_task_get_source_object (task);
+    ctx = g_task_get_task_data (task);
+
+    if (!ctx->pipelined_services_response) {
+        error = g_steal_pointer (&ctx->pipelined_services_error);
+        goto out;
+    }
+
+    if (!device_services_response_process (ctx->pipelined_services_response, &version_supported, &error))
+        goto out;
+
+    if (!version_supported) {
+        g_debug ("[%s] version command not supported: ignoring pipelined version exchange result",
+                 self->priv->path_display);
+        ctx->ms_mbimex_version_support = MBIM_DEVICE_CACHE_SUPPORT_NO;
+        ctx->step = DEVICE_OPEN_CONTEXT_STEP_LAST;
+        goto out;
+    }
+
+    ctx->ms_mbimex_version_support = MBIM_DEVICE_CACHE_SUPPORT_YES;
+    if (!ctx->pipelined_version_response)
+        error = g_steal_pointer (&ctx->pipelined_version_error);
+    else if (ms_ext_version_response_process (self, ctx->pipelined_version_response, &error)) {
+        ctx->step = DEVICE_OPEN_CONTEXT_STEP_LAST;
+        goto out;
+    }
+
+    if (pipelined_error_is_retriable (error)) {
+        g_debug ("[%s] pipelined version exchange failed: %s; retrying in sequence",
+                 self->priv->path_display, error->message);
+        g_clear_error (&error);
+        ctx->step = DEVICE_OPEN_CONTEXT_STEP_MS_EXT_VERSION;
+    }
+
+out:
+    g_clear_pointer (&ctx->pipelined_services_response, mbim_message_unref);
+    g_clear_pointer (&ctx->pipelined_version_response, mbim_message_unref);
+    g_clear_error (&ctx->pipelined_services_error);
+    g_clear_error (&ctx->pipelined_version_error);
+
+    if (error) {
+        g_task_return_error (task, error);
+        g_object_unref (task);
+        return;
+    }
+
+    device_open_context_step (task);
+}
+
+static void
+pipelined_device_services_ready (MbimDevice   *self,
+                                 GAsyncResult *res,
+                                 GTask        *task)
+{
+    DeviceOpenContext *ctx;
+
+    ctx = g_task_get_task_data (task);
+    ctx->pipelined_services_response = mbim_device_command_finish (self, res, &ctx->pipelined_services_error);
+    if (--ctx->pipelined_pending == 0)
+        pipelined_queries_complete (task);
+}
+
+static void
+pipelined_ms_ext_version_ready (MbimDevice   *self,
+                                GAsyncResult *res,
+                                GTask        *task)
+{
+    DeviceOpenContext *ctx;
+
+    ctx = g_task_get_task_data (task);
+    ctx->pipelined_version_response = mbim_device_command_finish (self, res, &ctx->pipelined_version_error);
+    if (--ctx->pipelined_pending == 0)
+        pipelined_queries_complete (task);
+}
+
+static void
+pipelined_queries (GTask *task)
+{
+    MbimDevice             *self;
+    DeviceOpenContext      *ctx;
+    g_autoptr(MbimMessage)  services_request = NULL;
+    g_autoptr(MbimMessage)  version_request = NULL;
+    GError                 *error = NULL;
+
+    self = g_task_get_source_object (task);
+    ctx  = g_task_get_task_data (task);
+
+    version_request = ms_ext_version_request_new (ctx, &error);
+    if (!version_request) {
+        g_task_return_error (task, error);
+        g_object_unref (task);
+        return;
+    }
+
+    services_request = mbim_message_device_services_query_new (NULL);
+    g_assert (services_request);
+
+    g_debug ("[%s] running post-open queries in parallel...", self->priv->path_display);
+
+    ctx->pipelined_pending = 2;
+    mbim_device_command (self,
+                         services_request,
+                         ctx->timeout,
+                         g_task_get_cancellable (task),
+                         (GAsyncReadyCallback)pipelined_device_services_ready,
+                         task);
+    mbim_device_command (self,
+                         version_request,
+                         ctx->timeout,
+                         g_task_get_cancellable (task),
+                         (GAsyncReadyCallback)pipelined_ms_ext_version_ready,
+                         task);
+}
+
 static void
 open_message_ready (MbimDevice   *self,
                     GAsyncResult *res,
@@ -1816,6 +3340,7 @@ open_message_ready (MbimDevice   *self,
         }
 
         g_debug ("[%s] error reported in open operation: closed", self->priv->path_display);
+        device_open_cache_invalidate (self, ctx);
         self->priv->open_status = OPEN_STATUS_CLOSED;
         g_task_return_error (task, g_steal_pointer (&error));
         g_object_unref (task);
@@ -1824,6 +3349,7 @@ open_message_ready (MbimDevice   *self,
 
     if (!mbim_message_response_get_result (response, MBIM_MESSAGE_TYPE_OPEN_DONE, &error)) {
         g_debug ("[%s] getting open done result failed: closed", self->priv->path_display);
+        device_open_cache_invalidate (self, ctx);
         self->priv->open_status = OPEN_STATUS_CLOSED;
         g_task_return_error (task, g_steal_pointer (&error));
         g_object_unref (task);
@@ -1930,7 +3456,14 @@ proxy_cfg_message (GTask *task)
     self = g_task_get_source_object (task);
     ctx = g_task_get_task_data (task);
 
-    request = mbim_message_proxy_control_configuration_set_new (self->priv->path, ctx->timeout, NULL);
+    /* Only use the extended request format if client limits are given */
+    if (self->priv->proxy_request_timeout || self->priv->proxy_max_pending_requests)
+        request = _mbim_proxy_helper_configuration_set_new (self->priv->path,
+                                                            ctx->timeout,
+                                                            self->priv->proxy_request_timeout,
+                                                            self->priv->proxy_max_pending_requests);
+    else
+        request = mbim_message_proxy_control_configuration_set_new (self->priv->path, ctx->timeout, NULL);
     g_assert (request);
 
     /* This message is no longer a direct reply; as the proxy will also try to open the device
@@ -2010,12 +3543,16 @@ device_open_context_step (GTask *task)
         g_assert (self->priv->open_status == OPEN_STATUS_CLOSED);
         self->priv->open_status = OPEN_STATUS_OPENING;
 
+        if (ctx->flags & MBIM_DEVICE_OPEN_FLAGS_FAST_OPEN)
+            device_open_cache_load (self, ctx);
+
         ctx->step++;
         /* Fall through */
 
     case DEVICE_OPEN_CONTEXT_STEP_CREATE_IOCHANNEL:
         create_iochannel (self,
-                          !!(ctx->flags & MBIM_DEVICE_OPEN_FLAGS_PROXY),
+                          ctx->flags,
+                          ctx->cache_hit ? ctx->cache_entry.max_control_transfer : 0,
                           (GAsyncReadyCallback)create_iochannel_ready,
                           task);
         return;
@@ -2049,6 +3586,27 @@ device_open_context_step (GTask *task)
 
         case DEVICE_OPEN_CONTEXT_STEP_DEVICE_SERVICES:
         if (ctx->flags & (MBIM_DEVICE_OPEN_FLAGS_MS_MBIMEX_V2 | MBIM_DEVICE_OPEN_FLAGS_MS_MBIMEX_V3)) {
+            /* If we already know whether the version command is supported,
+             * skip querying the device services; if the cache is wrong, the
+             * version command itself will tell */
+            if (ctx->cache_hit && ctx->cache_entry.ms_mbimex_version_support == MBIM_DEVICE_CACHE_SUPPORT_NO) {
+                g_debug ("[%s] skipping device services query: version command not supported (cached)",
+                         self->priv->path_display);
+                ctx->step = DEVICE_OPEN_CONTEXT_STEP_LAST;
+                device_open_context_step (task);
+                return;
+            }
+            if (ctx->cache_hit && ctx->cache_entry.ms_mbimex_version_support == MBIM_DEVICE_CACHE_SUPPORT_YES) {
+                g_debug ("[%s] skipping device services query: version command supported (cached)",
+                         self->priv->path_display);
+                ctx->step++;
+                device_open_context_step (task);
+                return;
+            }
+            if (ctx->flags & MBIM_DEVICE_OPEN_FLAGS_PIPELINED) {
+                pipelined_queries (task);
+                return;
+            }
             device_services_message (task);
             return;
         }
@@ -2065,6 +3623,10 @@ device_open_context_step (GTask *task)
 
     case DEVICE_OPEN_CONTEXT_STEP_LAST:
         /* Nothing else to process, complete without error */
+        if (ctx->flags & MBIM_DEVICE_OPEN_FLAGS_FAST_OPEN)
+            device_open_cache_store (self, ctx);
+        self->priv->open_flags = ctx->flags;
+        self->priv->open_timeout = ctx->timeout;
         self->priv->open_status = OPEN_STATUS_OPEN;
         g_task_return_boolean (task, TRUE);
         g_object_unref (task);
@@ -2101,6 +3663,9 @@ mbim_device_open_full (MbimDevice          *self,
     task = g_task_new (self, cancellable, callback, user_data);
     g_task_set_task_data (task, ctx, (GDestroyNotify)device_open_context_free);
 
+    /* The device is bound to the context where it's opened */
+    device_set_io_context (self);
+
     /* Start processing */
     device_open_context_step (task);
 }
@@ -2135,6 +3700,16 @@ destroy_iochannel (MbimDevice  *self,
 
     g_debug ("[%s] channel destroyed", self->priv->path_display);
 
+#if defined IO_URING_ENABLED
+    /* Before the fd is closed, as pending writes are flushed */
+    if (self->priv->uring_source) {
+        g_source_destroy (self->priv->uring_source);
+        g_source_unref (self->priv->uring_source);
+        self->priv->uring_source = NULL;
+    }
+    g_clear_pointer (&self->priv->uring, _mbim_uring_channel_free);
+#endif
+
     if (self->priv->iochannel) {
         g_io_channel_shutdown (self->priv->iochannel, TRUE, &inner_error);
         g_io_channel_unref (self->priv->iochannel);
@@ -2145,6 +3720,14 @@ destroy_iochannel (MbimDevice  *self,
     g_clear_object (&self->priv->socket_connection);
     g_clear_object (&self->priv->socket_client);
 
+    if (self->priv->shm_source) {
+        g_source_destroy (self->priv->shm_source);
+        g_source_unref (self->priv->shm_source);
+        self->priv->shm_source = NULL;
+    }
+    g_clear_pointer (&self->priv->shm, _mbim_shm_channel_free);
+    g_clear_pointer (&self->priv->shm_outbound, g_byte_array_unref);
+
     if (self->priv->iochannel_source) {
         g_source_destroy (self->priv->iochannel_source);
         g_source_unref (self->priv->iochannel_source);
@@ -2170,9 +3753,158 @@ mbim_device_close_force (MbimDevice *self,
 {
     g_return_val_if_fail (MBIM_IS_DEVICE (self), FALSE);
 
+    device_recovery_stop (self, "device closed");
     return destroy_iochannel (self, error);
 }
 
+/*****************************************************************************/
+/* Adopt an already open channel (private) */
+
+gint
+_mbim_device_get_fd (MbimDevice *self)
+{
+    g_return_val_if_fail (MBIM_IS_DEVICE (self), -1);
+
+    /* Only for devices opened directly, not through the proxy */
+    if (self->priv->open_status != OPEN_STATUS_OPEN ||
+        !self->priv->iochannel ||
+        self->priv->socket_connection)
+        return -1;
+
+    return g_io_channel_unix_get_fd (self->priv->iochannel);
+}
+
+guint16
+_mbim_device_get_max_control_transfer (MbimDevice *self)
+{
+    g_return_val_if_fail (MBIM_IS_DEVICE (self), 0);
+
+    return self->priv->max_control_transfer;
+}
+
+gboolean
+_mbim_device_adopt_fd (MbimDevice    *self,
+                       gint           fd,
+                       guint32        transaction_id,
+                       guint16        max_control_transfer,
+                       const guint8  *partial_response,
+                       gsize          partial_response_length,
+                       GError       **error)
+{
+    g_return_val_if_fail (MBIM_IS_DEVICE (self), FALSE);
+    g_return_val_if_fail (fd >= 0, FALSE);
+
+    if (self->priv->open_status != OPEN_STATUS_CLOSED) {
+        close (fd);
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_WRONG_STATE,
+                     "Device is already open");
+        return FALSE;
+    }
+
+    /* The fd is owned by the GIOChannel right away, also on error */
+    self->priv->iochannel = g_io_channel_unix_new (fd);
+    if (!setup_iochannel_sync (self, error))
+        return FALSE;
+
+    /* The MBIM session is already open in the device, so we just keep on
+     * using it from the same transaction id onwards */
+    g_debug ("[%s] adopted already open channel (transaction id %" G_GUINT32_FORMAT ")",
+             self->priv->path_display, transaction_id);
+    self->priv->transaction_id = transaction_id ? transaction_id : 0x01;
+    self->priv->max_control_transfer = max_control_transfer ? max_control_transfer : MAX_CONTROL_TRANSFER;
+    self->priv->open_status = OPEN_STATUS_OPEN;
+
+    /* The rest of the message is read from the fd */
+    if (partial_response_length > 0) {
+        self->priv->response = g_byte_array_sized_new (MAX (partial_response_length, 500));
+        g_byte_array_append (self->priv->response, partial_response, partial_response_length);
+    }
+    return TRUE;
+}
+
+void
+_mbim_device_suspend_reading (MbimDevice *self)
+{
+    g_return_if_fail (MBIM_IS_DEVICE (self));
+
+#if defined IO_URING_ENABLED
+    /* Reads posted in the ring would keep on consuming data, so the ring is
+     * torn down; reading is resumed through the GIOChannel */
+    if (self->priv->uring_source) {
+        g_source_destroy (self->priv->uring_source);
+        g_source_unref (self->priv->uring_source);
+        self->priv->uring_source = NULL;
+    }
+    g_clear_pointer (&self->priv->uring, _mbim_uring_channel_free);
+#endif
+
+    if (self->priv->iochannel_source) {
+        g_source_destroy (self->priv->iochannel_source);
+        g_source_unref (self->priv->iochannel_source);
+        self->priv->iochannel_source = NULL;
+    }
+}
+
+void
+_mbim_device_resume_reading (MbimDevice *self)
+{
+    g_return_if_fail (MBIM_IS_DEVICE (self));
+
+    if (!self->priv->iochannel || self->priv->iochannel_source)
+        return;
+#if defined IO_URING_ENABLED
+    if (self->priv->uring_source)
+        return;
+#endif
+
+    self->priv->iochannel_source = g_io_create_watch (self->priv->iochannel,
+                                                      G_IO_IN | G_IO_ERR | G_IO_HUP);
+    g_source_set_callback (self->priv->iochannel_source,
+                           (GSourceFunc)data_available,
+                           self,
+                           NULL);
+    g_source_attach (self->priv->iochannel_source, g_main_context_get_thread_default ());
+}
+
+const guint8 *
+_mbim_device_peek_partial_response (MbimDevice *self,
+                                    gsize      *out_length)
+{
+    g_return_val_if_fail (MBIM_IS_DEVICE (self), NULL);
+
+    *out_length = self->priv->response ? self->priv->response->len : 0;
+    return *out_length ? self->priv->response->data : NULL;
+}
+
+gboolean
+_mbim_device_has_partial_transactions (MbimDevice *self)
+{
+    guint i;
+
+    g_return_val_if_fail (MBIM_IS_DEVICE (self), FALSE);
+
+    for (i = 0; i < TRANSACTION_TYPE_LAST; i++) {
+        GHashTableIter iter;
+        GTask          *task;
+
+        if (!self->priv->transactions[i])
+            continue;
+
+        g_hash_table_iter_init (&iter, self->priv->transactions[i]);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&task)) {
+            TransactionContext *ctx;
+
+            ctx = g_task_get_task_data (task);
+            if (ctx->fragments)
+                return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/*****************************************************************************/
+
 typedef struct {
     guint timeout;
 } DeviceCloseContext;
@@ -2235,6 +3967,8 @@ mbim_device_close (MbimDevice          *self,
     task = g_task_new (self, cancellable, callback, user_data);
     g_task_set_task_data (task, ctx, (GDestroyNotify)device_close_context_free);
 
+    device_recovery_stop (self, "device closed");
+
     /* If already closed, we're done */
     if (self->priv->open_status == OPEN_STATUS_CLOSED) {
         g_task_return_boolean (task, TRUE);
@@ -2286,17 +4020,18 @@ guint32
 mbim_device_get_next_transaction_id (MbimDevice *self)
 {
     guint32 next;
+    guint32 following;
 
     g_return_val_if_fail (MBIM_IS_DEVICE (self), 0);
 
-    next = self->priv->transaction_id;
-
-    /* Don't go further than 8bits in the CTL service */
-    if (self->priv->transaction_id == G_MAXUINT32)
+    /* May be called from any thread */
+    do {
+        next = (guint32) g_atomic_int_get ((gint *) &self->priv->transaction_id);
         /* Reset! */
-        self->priv->transaction_id = 0x01;
-    else
-        self->priv->transaction_id++;
+        following = (next == G_MAXUINT32) ? 0x01 : next + 1;
+    } while (!g_atomic_int_compare_and_exchange ((gint *) &self->priv->transaction_id,
+                                                 (gint) next,
+                                                 (gint) following));
 
     return next;
 }
@@ -2308,21 +4043,76 @@ mbim_device_get_transaction_id (MbimDevice *self)
 {
     g_return_val_if_fail (MBIM_IS_DEVICE (self), 0);
 
-    return self->priv->transaction_id;
+    return (guint32) g_atomic_int_get ((gint *) &self->priv->transaction_id);
 }
 
 /*****************************************************************************/
 
 static gboolean
-device_write (MbimDevice    *self,
-              const guint8  *data,
-              guint32        data_length,
-              GError       **error)
+device_write_shm (MbimDevice    *self,
+                  const guint8  *data,
+                  guint32        data_length,
+                  GError       **error)
 {
-    gsize     written;
-    GIOStatus write_status;
+    gsize written = 0;
+
+    /* If the proxy isn't reading, fail as a full socket would, before
+     * writing anything of the message */
+    if (self->priv->shm_outbound &&
+        self->priv->shm_outbound->len > 0 &&
+        self->priv->shm_outbound->len + data_length > self->priv->shm_outbound_limit) {
+        g_set_error (error,
+                     MBIM_CORE_ERROR,
+                     MBIM_CORE_ERROR_FAILED,
+                     "Cannot write message: %u bytes already pending to be read by the proxy",
+                     self->priv->shm_outbound->len);
+        return FALSE;
+    }
 
-    written = 0;
+    /* Keep the order of the messages already waiting for space in the ring */
+    if (!self->priv->shm_outbound || self->priv->shm_outbound->len == 0) {
+        if (!_mbim_shm_channel_write (self->priv->shm, data, data_length, &written, error)) {
+            g_prefix_error (error, "Cannot write message: ");
+            return FALSE;
+        }
+        if (written > 0)
+            _mbim_shm_channel_notify (self->priv->shm);
+        if (written == data_length)
+            return TRUE;
+    }
+
+    /* Ring full; the rest is written once the proxy releases space and rings
+     * our doorbell */
+    if (!self->priv->shm_outbound)
+        self->priv->shm_outbound = g_byte_array_new ();
+    g_byte_array_append (self->priv->shm_outbound, &data[written], data_length - written);
+    return TRUE;
+}
+
+static gboolean
+device_write (MbimDevice    *self,
+              const guint8  *data,
+              guint32        data_length,
+              GError       **error)
+{
+    gsize     written;
+    GIOStatus write_status;
+
+    device_statistics_add (self, &self->priv->statistics.bytes_out, data_length);
+    device_capture (self, MBIM_CAPTURE_DIRECTION_OUT, data, data_length);
+
+    if (self->priv->shm)
+        return device_write_shm (self, data, data_length, error);
+
+#if defined IO_URING_ENABLED
+    /* Submitted in the next main loop iteration */
+    if (self->priv->uring) {
+        _mbim_uring_channel_write (self->priv->uring, data, data_length);
+        return TRUE;
+    }
+#endif
+
+    written = 0;
     write_status = G_IO_STATUS_AGAIN;
     while (write_status == G_IO_STATUS_AGAIN) {
         write_status = g_io_channel_write_chars (self->priv->iochannel,
@@ -2369,224 +4159,986 @@ device_send (MbimDevice   *self,
     guint                            n_fragments;
     guint                            i;
 
-    raw_message = mbim_message_get_raw (message, &raw_message_len, NULL);
-    g_assert (raw_message);
+    raw_message = mbim_message_get_raw (message, &raw_message_len, NULL);
+    g_assert (raw_message);
+
+    if (mbim_utils_get_traces_enabled ()) {
+        g_autofree gchar *header = NULL;
+        g_autofree gchar *printable = NULL;
+        gsize             max_printed;
+
+        header = g_strdup_printf ("[%s] sent message...\n"
+                                  "<<<<<< RAW:\n"
+                                  "<<<<<<   length = %u\n"
+                                  "<<<<<<   data   = ",
+                                  self->priv->path_display,
+                                  ((GByteArray *)message)->len);
+        max_printed = mbim_utils_get_show_personal_info () ? G_MAXSIZE : MAX_PRINTED_BYTES;
+
+        /* Let the trace sink thread format the data, if there is one */
+        if (!mbim_utils_trace_sink_push_raw (G_LOG_LEVEL_DEBUG, header, raw_message, raw_message_len, max_printed)) {
+            g_autofree gchar *hex = NULL;
+
+            hex = mbim_common_str_hex_truncated (raw_message, raw_message_len, max_printed, ':');
+            g_debug ("%s%s\n", header, hex);
+        }
+
+        printable = mbim_message_get_printable_full (message,
+                                                     self->priv->ms_mbimex_version_major,
+                                                     self->priv->ms_mbimex_version_minor,
+                                                     "<<<<<< ",
+                                                     FALSE,
+                                                     NULL);
+        g_debug ("[%s] sent message (translated)...\n%s",
+                 self->priv->path_display,
+                 printable);
+    }
+
+    device_statistics_add (self, &self->priv->statistics.messages_out, 1);
+
+    /* Single fragment? Send it! */
+    if (raw_message_len <= MAX_CONTROL_TRANSFER) {
+        MBIM_PROBE (device_send,
+                    self->priv->path_display,
+                    mbim_message_get_transaction_id (message),
+                    MBIM_MESSAGE_GET_MESSAGE_TYPE (message),
+                    _mbim_probe_message_service (message),
+                    _mbim_probe_message_cid (message),
+                    0, 1,
+                    raw_message_len,
+                    g_get_monotonic_time ());
+        return device_write (self, raw_message, raw_message_len, error);
+    }
+
+    /* The message to send must be able to handle fragments */
+    g_assert (_mbim_message_is_fragment (message));
+
+    fragments = _mbim_message_split_fragments (message, MAX_CONTROL_TRANSFER, &n_fragments);
+    device_statistics_add (self, &self->priv->statistics.fragments_out, n_fragments);
+    for (i = 0; i < n_fragments; i++) {
+        g_autoptr(GByteArray)  full_fragment = NULL;
+        g_autofree gchar      *printable_headers = NULL;
+
+        /* Build compiled fragment headers */
+        full_fragment = g_byte_array_new ();
+        g_byte_array_append (full_fragment, (guint8 *)&fragments[i].header, sizeof (fragments[i].header));
+        g_byte_array_append (full_fragment, (guint8 *)&fragments[i].fragment_header, sizeof (fragments[i].fragment_header));
+
+        /* Build placeholder message with only headers for printable purposes only */
+        if (mbim_utils_get_traces_enabled ())
+            printable_headers = mbim_message_get_printable_full ((MbimMessage *)full_fragment,
+                                                                 self->priv->ms_mbimex_version_major,
+                                                                 self->priv->ms_mbimex_version_minor,
+                                                                 "<<<<<< ",
+                                                                 TRUE,
+                                                                 NULL);
+
+        /* Append the actual fragment data */
+        g_byte_array_append (full_fragment, (guint8 *)fragments[i].data, fragments[i].data_length);
+
+        if (mbim_utils_get_traces_enabled ()) {
+            g_autofree gchar *header = NULL;
+
+            header = g_strdup_printf ("[%s] sent fragment (%u)...\n"
+                                      "<<<<<< RAW:\n"
+                                      "<<<<<<   length = %u\n"
+                                      "<<<<<<   data   = ",
+                                      self->priv->path_display, i,
+                                      full_fragment->len);
+            if (!mbim_utils_trace_sink_push_raw (G_LOG_LEVEL_DEBUG, header, full_fragment->data, full_fragment->len, G_MAXSIZE)) {
+                g_autofree gchar *printable_full = NULL;
+
+                printable_full = mbim_common_str_hex (full_fragment->data, full_fragment->len, ':');
+                g_debug ("%s%s\n", header, printable_full);
+            }
+
+            g_debug ("[%s] sent fragment (translated)...\n%s",
+                     self->priv->path_display,
+                     printable_headers);
+        }
+
+        /* Write whole packet to MBIM device.
+         * Here send whole packet rather than seperated elements, such as header,
+         * fragment_header, data, because some MBIM devices may have errors on
+         * seperated fragment case, such as "MBIM protocol error: LengthMismatch"
+         */
+        MBIM_PROBE (device_send,
+                    self->priv->path_display,
+                    mbim_message_get_transaction_id (message),
+                    MBIM_MESSAGE_GET_MESSAGE_TYPE (message),
+                    _mbim_probe_message_service (message),
+                    _mbim_probe_message_cid (message),
+                    i, n_fragments,
+                    full_fragment->len,
+                    g_get_monotonic_time ());
+        if (!device_write (self,
+                           (guint8 *)full_fragment->data,
+                           full_fragment->len,
+                           error))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*****************************************************************************/
+/* Report error */
+
+typedef struct {
+    MbimDevice  *self;
+    MbimMessage *message;
+} ReportErrorContext;
+
+static void
+device_report_error_context_free (ReportErrorContext *ctx)
+{
+    mbim_message_unref (ctx->message);
+    g_object_unref (ctx->self);
+    g_slice_free (ReportErrorContext, ctx);
+}
+
+static gboolean
+device_report_error_in_idle (ReportErrorContext *ctx)
+{
+    /* Device must be open */
+    if (ctx->self->priv->iochannel) {
+        g_autoptr(GError) error = NULL;
+
+        if (!device_send (ctx->self, ctx->message, &error))
+            g_warning ("[%s] couldn't send host error message: %s",
+                       ctx->self->priv->path_display,
+                       error->message);
+    }
+
+    device_report_error_context_free (ctx);
+    return FALSE;
+}
+
+static void
+device_report_error (MbimDevice   *self,
+                     guint32       transaction_id,
+                     const GError *error)
+{
+    ReportErrorContext *ctx;
+    g_autoptr(GSource)  source = NULL;
+
+    /* Only protocol errors to be reported to the modem */
+    if (error->domain != MBIM_PROTOCOL_ERROR)
+        return;
+
+    ctx = g_slice_new (ReportErrorContext);
+    ctx->self = g_object_ref (self);
+    ctx->message = mbim_message_error_new (transaction_id, error->code);
+
+    source = g_idle_source_new ();
+    g_source_set_callback (source, (GSourceFunc)device_report_error_in_idle, ctx, NULL);
+    g_source_attach (source, g_main_context_get_thread_default ());
+}
+
+/*****************************************************************************/
+/* Command */
+
+MbimMessage *
+mbim_device_command_finish (MbimDevice    *self,
+                            GAsyncResult  *res,
+                            GError       **error)
+{
+    return g_task_propagate_pointer (G_TASK (res), error);
+}
+
+static void device_command_task_run (MbimDevice  *self,
+                                     GTask       *task,
+                                     MbimMessage *message,
+                                     guint        timeout);
+
+static void
+device_command_submit (MbimDevice  *self,
+                       GTask       *task,
+                       MbimMessage *message,
+                       guint        timeout)
+{
+    MbimService service;
+    guint32     cid;
+
+    /* Keep the last service subscribe list set, to replay it on recovery */
+    if (MBIM_MESSAGE_GET_MESSAGE_TYPE (message) == MBIM_MESSAGE_TYPE_COMMAND &&
+        _mbim_message_fragment_get_total (message) == 1 &&
+        _mbim_message_peek_service_cid (message, &service, &cid) &&
+        service == MBIM_SERVICE_BASIC_CONNECT &&
+        cid == MBIM_CID_BASIC_CONNECT_DEVICE_SERVICE_SUBSCRIBE_LIST &&
+        mbim_message_command_get_command_type (message) == MBIM_MESSAGE_COMMAND_TYPE_SET) {
+        g_clear_pointer (&self->priv->subscribe_list, mbim_message_unref);
+        self->priv->subscribe_list = mbim_message_dup (message);
+    }
+
+    /* While the device is being recovered, commands are held until it is
+     * back, except for the ones sent during the reopen sequence itself */
+    if (self->priv->recovery && self->priv->open_status != OPEN_STATUS_OPENING) {
+        device_recovery_hold_command (self, task, message, timeout);
+        return;
+    }
+
+    device_command_task_run (self, task, message, timeout);
+}
+
+typedef struct {
+    MbimDevice   *self;
+    GMainContext *io_context;
+} DeviceCommandQueueDrainContext;
+
+static void
+device_command_queue_drain_context_free (DeviceCommandQueueDrainContext *drain_ctx)
+{
+    g_main_context_unref (drain_ctx->io_context);
+    g_object_unref (drain_ctx->self);
+    g_slice_free (DeviceCommandQueueDrainContext, drain_ctx);
+}
+
+static gboolean
+device_command_queue_drain (DeviceCommandQueueDrainContext *drain_ctx)
+{
+    MbimDevice           *self;
+    DeviceCommandRequest *list;
+    DeviceCommandRequest *fifo = NULL;
+
+    self = drain_ctx->self;
+
+    do {
+        list = g_atomic_pointer_get (&self->priv->command_queue);
+    } while (!g_atomic_pointer_compare_and_exchange (&self->priv->command_queue, list, NULL));
+
+    /* Restore submission order */
+    while (list) {
+        DeviceCommandRequest *next;
+
+        next = list->next;
+        list->next = fifo;
+        fifo = list;
+        list = next;
+    }
+
+    /* Any source setup while submitting goes to the device context; this may
+     * run without a dispatching source if the invoke() was done directly */
+    g_main_context_push_thread_default (drain_ctx->io_context);
+    while (fifo) {
+        DeviceCommandRequest *request;
+
+        request = fifo;
+        fifo = fifo->next;
+        device_command_submit (self, request->task, request->message, request->timeout);
+        mbim_message_unref (request->message);
+        g_slice_free (DeviceCommandRequest, request);
+    }
+    g_main_context_pop_thread_default (drain_ctx->io_context);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void
+device_command_queue_push (MbimDevice   *self,
+                           GMainContext *io_context,
+                           GTask        *task,
+                           MbimMessage  *message,
+                           guint         timeout)
+{
+    DeviceCommandRequest           *request;
+    DeviceCommandRequest           *head;
+    DeviceCommandQueueDrainContext *drain_ctx;
+
+    request = g_slice_new0 (DeviceCommandRequest);
+    request->task = task;
+    request->message = mbim_message_ref (message);
+    request->timeout = timeout;
+
+    do {
+        head = g_atomic_pointer_get (&self->priv->command_queue);
+        request->next = head;
+    } while (!g_atomic_pointer_compare_and_exchange (&self->priv->command_queue, head, request));
+
+    /* Only the first one queued schedules the drain; the ones queued before
+     * it runs are drained along */
+    if (head)
+        return;
+
+    drain_ctx = g_slice_new (DeviceCommandQueueDrainContext);
+    drain_ctx->self = g_object_ref (self);
+    drain_ctx->io_context = g_main_context_ref (io_context);
+    g_main_context_invoke_full (io_context,
+                                G_PRIORITY_DEFAULT,
+                                (GSourceFunc)device_command_queue_drain,
+                                drain_ctx,
+                                (GDestroyNotify)device_command_queue_drain_context_free);
+}
+
+void
+mbim_device_command (MbimDevice          *self,
+                     MbimMessage         *message,
+                     guint                timeout,
+                     GCancellable        *cancellable,
+                     GAsyncReadyCallback  callback,
+                     gpointer             user_data)
+{
+    GTask             *task;
+    guint32            transaction_id;
+    GMainContext      *io_context;
+
+    g_return_if_fail (MBIM_IS_DEVICE (self));
+    g_return_if_fail (message != NULL);
+
+    /* If the message comes without a explicit transaction ID, add one
+     * ourselves */
+    transaction_id = mbim_message_get_transaction_id (message);
+    if (!transaction_id) {
+        transaction_id = mbim_device_get_next_transaction_id (self);
+        mbim_message_set_transaction_id (message, transaction_id);
+    }
+
+    task = transaction_task_new (self,
+                                 MBIM_MESSAGE_GET_MESSAGE_TYPE (message),
+                                 transaction_id,
+                                 cancellable,
+                                 callback,
+                                 user_data);
+
+    /* The task completes in the thread-default context of the caller. If the
+     * device context is run by a different thread, the submission itself is
+     * queued to be run there. */
+    io_context = device_ref_io_context (self);
+    if (!io_context) {
+        device_command_submit (self, task, message, timeout);
+        return;
+    }
+
+    if (!g_main_context_acquire (io_context)) {
+        device_command_queue_push (self, io_context, task, message, timeout);
+        g_main_context_unref (io_context);
+        return;
+    }
+
+    g_main_context_push_thread_default (io_context);
+    device_command_submit (self, task, message, timeout);
+    g_main_context_pop_thread_default (io_context);
+    g_main_context_release (io_context);
+    g_main_context_unref (io_context);
+}
+
+static void
+device_command_task_run (MbimDevice  *self,
+                         GTask       *task,
+                         MbimMessage *message,
+                         guint        timeout)
+{
+    g_autoptr(GError) error = NULL;
+    guint             timeout_ms;
+    MbimService       service;
+    guint32           cid;
+
+    /* Device must be open */
+    if (!self->priv->iochannel) {
+        error = g_error_new (MBIM_CORE_ERROR,
+                             MBIM_CORE_ERROR_WRONG_STATE,
+                             "Device must be open to send commands");
+        transaction_task_complete_and_free (task, error);
+        return;
+    }
+
+    timeout_ms = timeout * 1000;
+    if (MBIM_MESSAGE_GET_MESSAGE_TYPE (message) == MBIM_MESSAGE_TYPE_COMMAND &&
+        _mbim_message_peek_service_cid (message, &service, &cid) &&
+        service != MBIM_SERVICE_INVALID) {
+        TransactionContext *ctx;
+
+        /* Requests of unknown services are not tracked */
+        ctx = g_task_get_task_data (task);
+        ctx->request_key = REQUEST_KEY (service, cid, mbim_message_command_get_command_type (message));
+        ctx->request_start = g_get_monotonic_time ();
+        ctx->request_timeout_ms = timeout_ms;
+        device_request_statistics_sent (self, ctx->request_key);
+        if (self->priv->open_flags & MBIM_DEVICE_OPEN_FLAGS_ADAPTIVE_TIMEOUTS)
+            timeout_ms = device_latency_get_timeout (self, ctx->request_key, timeout_ms);
+    }
+
+    /* Setup context to match response */
+    if (!device_store_transaction (self, TRANSACTION_TYPE_HOST, task, timeout_ms, &error)) {
+        g_prefix_error (&error, "Cannot store transaction: ");
+        transaction_task_complete_and_free (task, error);
+        return;
+    }
+
+    if (!device_send (self, message, &error)) {
+        /* Match transaction so that we remove it from our tracking table */
+        task = device_release_transaction (self,
+                                           TRANSACTION_TYPE_HOST,
+                                           MBIM_MESSAGE_GET_MESSAGE_TYPE (message),
+                                           mbim_message_get_transaction_id (message));
+        transaction_task_complete_and_free (task, error);
+        return;
+    }
+
+    /* Just return, we'll get response asynchronously */
+}
+
+/*****************************************************************************/
+/* Device context */
+
+static void
+device_set_io_context (MbimDevice *self)
+{
+    GMainContext *old;
+
+    g_mutex_lock (&self->priv->io_context_lock);
+    old = self->priv->io_context;
+    self->priv->io_context = g_main_context_ref_thread_default ();
+    g_mutex_unlock (&self->priv->io_context_lock);
+
+    if (old)
+        g_main_context_unref (old);
+}
+
+static GMainContext *
+device_ref_io_context (MbimDevice *self)
+{
+    GMainContext *io_context = NULL;
+
+    g_mutex_lock (&self->priv->io_context_lock);
+    if (self->priv->io_context)
+        io_context = g_main_context_ref (self->priv->io_context);
+    g_mutex_unlock (&self->priv->io_context_lock);
+
+    return io_context;
+}
+
+/*****************************************************************************/
+/* Synchronous operations
+ *
+ * The async operation is started in the context where the device I/O sources
+ * are attached. If no other thread owns that context, the calling thread
+ * iterates it until the operation finishes; otherwise the operation is
+ * started from the owner thread, and the calling thread waits iterating a
+ * private context, woken up once the result is available.
+ */
+
+typedef void (* DeviceSyncStartFunc) (MbimDevice          *self,
+                                      gpointer             start_data,
+                                      GAsyncReadyCallback  callback,
+                                      gpointer             user_data);
+
+typedef struct {
+    MbimDevice          *self;
+    GMainContext        *io_context;
+    GMainContext        *context;
+    DeviceSyncStartFunc  start;
+    gpointer             start_data;
+    GAsyncResult        *result;
+    gint                 done;
+} DeviceSync;
+
+static void
+device_sync_ready (MbimDevice   *self,
+                   GAsyncResult *res,
+                   DeviceSync   *sync)
+{
+    GMainContext *context;
+
+    /* The waiting thread may go away as soon as done is set */
+    context = g_main_context_ref (sync->context);
+    sync->result = g_object_ref (res);
+    g_atomic_int_set (&sync->done, TRUE);
+    g_main_context_wakeup (context);
+    g_main_context_unref (context);
+}
+
+static gboolean
+device_sync_start_cb (DeviceSync *sync)
+{
+    g_main_context_push_thread_default (sync->io_context);
+    sync->start (sync->self, sync->start_data, (GAsyncReadyCallback)device_sync_ready, sync);
+    g_main_context_pop_thread_default (sync->io_context);
+    return G_SOURCE_REMOVE;
+}
+
+static GAsyncResult *
+device_sync_run (MbimDevice          *self,
+                 GMainContext        *io_context,
+                 DeviceSyncStartFunc  start,
+                 gpointer             start_data)
+{
+    DeviceSync sync = { 0 };
+
+    sync.self = self;
+    sync.io_context = io_context;
+    sync.start = start;
+    sync.start_data = start_data;
+
+    g_rec_mutex_lock (&self->priv->sync_lock);
+
+    if (g_main_context_acquire (io_context)) {
+        sync.context = g_main_context_ref (io_context);
+        g_main_context_push_thread_default (sync.context);
+        device_sync_start_cb (&sync);
+        while (!g_atomic_int_get (&sync.done))
+            g_main_context_iteration (sync.context, TRUE);
+        g_main_context_pop_thread_default (sync.context);
+        g_main_context_release (io_context);
+    } else {
+        sync.context = g_main_context_new ();
+        g_main_context_push_thread_default (sync.context);
+        g_main_context_invoke (io_context, (GSourceFunc)device_sync_start_cb, &sync);
+        while (!g_atomic_int_get (&sync.done))
+            g_main_context_iteration (sync.context, TRUE);
+        g_main_context_pop_thread_default (sync.context);
+    }
+
+    g_rec_mutex_unlock (&self->priv->sync_lock);
+
+    g_main_context_unref (sync.context);
+    return sync.result;
+}
+
+static GMainContext *
+device_sync_get_io_context (MbimDevice  *self,
+                            GError     **error)
+{
+    GMainContext *io_context = NULL;
+
+    if (self->priv->open_status == OPEN_STATUS_OPEN)
+        io_context = device_ref_io_context (self);
+
+    if (!io_context)
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_WRONG_STATE,
+                     "Device must be open");
+    return io_context;
+}
+
+/* Called from the thread running the context, e.g. from a signal handler or
+ * an async callback, the operation would have to iterate that same context
+ * reentrantly, dispatching any other source attached to it */
+static gboolean
+device_sync_check_context (GMainContext  *io_context,
+                           GError       **error)
+{
+    if (!g_main_context_is_owner (io_context))
+        return TRUE;
+
+    g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_WRONG_STATE,
+                 "Synchronous operations cannot be run from the context where the device was opened");
+    return FALSE;
+}
+
+typedef struct {
+    MbimDeviceOpenFlags  flags;
+    MbimMessage         *message;
+    guint                timeout;
+    GCancellable        *cancellable;
+} DeviceSyncParams;
+
+static void
+device_open_sync_start (MbimDevice          *self,
+                        DeviceSyncParams    *params,
+                        GAsyncReadyCallback  callback,
+                        gpointer             user_data)
+{
+    mbim_device_open_full (self, params->flags, params->timeout, params->cancellable, callback, user_data);
+}
+
+gboolean
+mbim_device_open_sync (MbimDevice           *self,
+                       MbimDeviceOpenFlags   flags,
+                       guint                 timeout,
+                       GCancellable         *cancellable,
+                       GError              **error)
+{
+    g_autoptr(GMainContext) io_context = NULL;
+    g_autoptr(GAsyncResult) result = NULL;
+    DeviceSyncParams        params = { 0 };
+
+    g_return_val_if_fail (MBIM_IS_DEVICE (self), FALSE);
+
+    params.flags = flags;
+    params.timeout = timeout;
+    params.cancellable = cancellable;
+
+    /* The device I/O sources end up attached to this new context */
+    io_context = g_main_context_new ();
+    result = device_sync_run (self, io_context, (DeviceSyncStartFunc)device_open_sync_start, &params);
+    return mbim_device_open_full_finish (self, result, error);
+}
+
+static void
+device_close_sync_start (MbimDevice          *self,
+                         DeviceSyncParams    *params,
+                         GAsyncReadyCallback  callback,
+                         gpointer             user_data)
+{
+    mbim_device_close (self, params->timeout, params->cancellable, callback, user_data);
+}
 
-    if (mbim_utils_get_traces_enabled ()) {
-        g_autofree gchar *hex = NULL;
-        g_autofree gchar *printable = NULL;
+gboolean
+mbim_device_close_sync (MbimDevice    *self,
+                        guint          timeout,
+                        GCancellable  *cancellable,
+                        GError       **error)
+{
+    g_autoptr(GMainContext) io_context = NULL;
+    g_autoptr(GAsyncResult) result = NULL;
+    DeviceSyncParams        params = { 0 };
 
-        if (mbim_utils_get_show_personal_info () || (raw_message_len < MAX_PRINTED_BYTES)) {
-            hex = mbim_common_str_hex (raw_message, raw_message_len, ':');
-        } else {
-            g_autofree gchar *tmp = NULL;
+    g_return_val_if_fail (MBIM_IS_DEVICE (self), FALSE);
 
-            tmp = mbim_common_str_hex (raw_message, MAX_PRINTED_BYTES, ':');
-            hex = g_strdup_printf ("%s...", tmp);
-        }
+    /* The state is checked with the lock held, so that no other synchronous
+     * operation changes it meanwhile */
+    g_rec_mutex_lock (&self->priv->sync_lock);
 
-        g_debug ("[%s] sent message...\n"
-                 "<<<<<< RAW:\n"
-                 "<<<<<<   length = %u\n"
-                 "<<<<<<   data   = %s\n",
-                 self->priv->path_display,
-                 ((GByteArray *)message)->len,
-                 hex);
+    /* Already closed */
+    if (self->priv->open_status == OPEN_STATUS_CLOSED) {
+        g_rec_mutex_unlock (&self->priv->sync_lock);
+        return TRUE;
+    }
 
-        printable = mbim_message_get_printable_full (message,
-                                                     self->priv->ms_mbimex_version_major,
-                                                     self->priv->ms_mbimex_version_minor,
-                                                     "<<<<<< ",
-                                                     FALSE,
-                                                     NULL);
-        g_debug ("[%s] sent message (translated)...\n%s",
-                 self->priv->path_display,
-                 printable);
+    io_context = device_sync_get_io_context (self, error);
+    if (!io_context || !device_sync_check_context (io_context, error)) {
+        g_rec_mutex_unlock (&self->priv->sync_lock);
+        return FALSE;
     }
 
-    /* Single fragment? Send it! */
-    if (raw_message_len <= MAX_CONTROL_TRANSFER)
-        return device_write (self, raw_message, raw_message_len, error);
+    params.timeout = timeout;
+    params.cancellable = cancellable;
 
-    /* The message to send must be able to handle fragments */
-    g_assert (_mbim_message_is_fragment (message));
+    result = device_sync_run (self, io_context, (DeviceSyncStartFunc)device_close_sync_start, &params);
+    g_rec_mutex_unlock (&self->priv->sync_lock);
 
-    fragments = _mbim_message_split_fragments (message, MAX_CONTROL_TRANSFER, &n_fragments);
-    for (i = 0; i < n_fragments; i++) {
-        g_autoptr(GByteArray)  full_fragment = NULL;
-        g_autofree gchar      *printable_headers = NULL;
+    return mbim_device_close_finish (self, result, error);
+}
 
-        /* Build compiled fragment headers */
-        full_fragment = g_byte_array_new ();
-        g_byte_array_append (full_fragment, (guint8 *)&fragments[i].header, sizeof (fragments[i].header));
-        g_byte_array_append (full_fragment, (guint8 *)&fragments[i].fragment_header, sizeof (fragments[i].fragment_header));
+static void
+device_command_sync_start (MbimDevice          *self,
+                           DeviceSyncParams    *params,
+                           GAsyncReadyCallback  callback,
+                           gpointer             user_data)
+{
+    mbim_device_command (self, params->message, params->timeout, params->cancellable, callback, user_data);
+}
 
-        /* Build placeholder message with only headers for printable purposes only */
-        if (mbim_utils_get_traces_enabled ())
-            printable_headers = mbim_message_get_printable_full ((MbimMessage *)full_fragment,
-                                                                 self->priv->ms_mbimex_version_major,
-                                                                 self->priv->ms_mbimex_version_minor,
-                                                                 "<<<<<< ",
-                                                                 TRUE,
-                                                                 NULL);
+MbimMessage *
+mbim_device_command_sync (MbimDevice    *self,
+                          MbimMessage   *message,
+                          guint          timeout,
+                          GCancellable  *cancellable,
+                          GError       **error)
+{
+    g_autoptr(GMainContext) io_context = NULL;
+    g_autoptr(GAsyncResult) result = NULL;
+    DeviceSyncParams        params = { 0 };
 
-        /* Append the actual fragment data */
-        g_byte_array_append (full_fragment, (guint8 *)fragments[i].data, fragments[i].data_length);
+    g_return_val_if_fail (MBIM_IS_DEVICE (self), NULL);
+    g_return_val_if_fail (message != NULL, NULL);
 
-        if (mbim_utils_get_traces_enabled ()) {
-            g_autofree gchar *printable_full = NULL;
+    g_rec_mutex_lock (&self->priv->sync_lock);
 
-            printable_full  = mbim_common_str_hex ((const guint8 *)full_fragment->data, full_fragment->len, ':');
-            g_debug ("[%s] sent fragment (%u)...\n"
-                     "<<<<<< RAW:\n"
-                     "<<<<<<   length = %u\n"
-                     "<<<<<<   data   = %s\n",
-                     self->priv->path_display, i,
-                     full_fragment->len,
-                     printable_full);
+    io_context = device_sync_get_io_context (self, error);
+    if (!io_context || !device_sync_check_context (io_context, error)) {
+        g_rec_mutex_unlock (&self->priv->sync_lock);
+        return NULL;
+    }
 
-            g_debug ("[%s] sent fragment (translated)...\n%s",
-                     self->priv->path_display,
-                     printable_headers);
-        }
+    params.message = message;
+    params.timeout = timeout;
+    params.cancellable = cancellable;
 
-        /* Write whole packet to MBIM device.
-         * Here send whole packet rather than seperated elements, such as header,
-         * fragment_header, data, because some MBIM devices may have errors on
-         * seperated fragment case, such as "MBIM protocol error: LengthMismatch"
-         */
-        if (!device_write (self,
-                           (guint8 *)full_fragment->data,
-                           full_fragment->len,
-                           error))
-            return FALSE;
-    }
+    result = device_sync_run (self, io_context, (DeviceSyncStartFunc)device_command_sync_start, &params);
+    g_rec_mutex_unlock (&self->priv->sync_lock);
 
-    return TRUE;
+    return mbim_device_command_finish (self, result, error);
 }
 
 /*****************************************************************************/
-/* Report error */
+/* Automatic recovery
+ *
+ * When a device opened with MBIM_DEVICE_OPEN_FLAGS_AUTO_RECOVER goes away
+ * unexpectedly, we periodically check whether the device node is back, and
+ * reopen it with the same flags and timeout used in the last successful open.
+ * Once open, the last service subscribe list set by the user is replayed, and
+ * the commands held in the meantime are sent.
+ *
+ * The held commands are stored as transactions right away, so that their own
+ * timeout and cancellation keep on applying while held.
+ *
+ * Failed reopen attempts are retried with an exponential backoff, as the node
+ * may exist while the device is still not usable, and when using the proxy
+ * each attempt may end up spawning a new one.
+ */
 
-typedef struct {
-    MbimDevice  *self;
-    MbimMessage *message;
-} ReportErrorContext;
+#define RECOVERY_CHECK_INTERVAL_MS           500
+#define RECOVERY_MAX_BACKOFF_MS              16000
+#define RECOVERY_WARNING_FAILURES            3
+#define RECOVERY_TIMEOUT_SECS                120
+#define RECOVERY_SUBSCRIBE_LIST_TIMEOUT_SECS 10
 
 static void
-device_report_error_context_free (ReportErrorContext *ctx)
+device_recovery_free (DeviceRecovery *recovery)
 {
-    mbim_message_unref (ctx->message);
-    g_object_unref (ctx->self);
-    g_slice_free (ReportErrorContext, ctx);
+    if (recovery->source) {
+        g_source_destroy (recovery->source);
+        g_source_unref (recovery->source);
+    }
+    g_queue_free_full (recovery->held, (GDestroyNotify)mbim_message_unref);
+    g_slice_free (DeviceRecovery, recovery);
 }
 
-static gboolean
-device_report_error_in_idle (ReportErrorContext *ctx)
+static void
+device_recovery_stop (MbimDevice  *self,
+                      const gchar *reason)
 {
-    /* Device must be open */
-    if (ctx->self->priv->iochannel) {
-        g_autoptr(GError) error = NULL;
+    DeviceRecovery    *recovery;
+    MbimMessage       *message;
+    g_autoptr(GError)  error = NULL;
 
-        if (!device_send (ctx->self, ctx->message, &error))
-            g_warning ("[%s] couldn't send host error message: %s",
-                       ctx->self->priv->path_display,
-                       error->message);
+    recovery = g_steal_pointer (&self->priv->recovery);
+    if (!recovery)
+        return;
+
+    g_debug ("[%s] device recovery stopped: %s", self->priv->path_display, reason);
+    device_memory_usage_update (self, &self->priv->memory.outbound, &self->priv->memory.outbound_peak, 0);
+
+    error = g_error_new (MBIM_CORE_ERROR, MBIM_CORE_ERROR_ABORTED,
+                         "Device recovery stopped: %s", reason);
+    while ((message = g_queue_pop_head (recovery->held)) != NULL) {
+        GTask *task;
+
+        task = device_release_transaction (self,
+                                           TRANSACTION_TYPE_HOST,
+                                           MBIM_MESSAGE_TYPE_INVALID,
+                                           mbim_message_get_transaction_id (message));
+        if (task)
+            transaction_task_complete_and_free (task, error);
+        mbim_message_unref (message);
     }
 
-    device_report_error_context_free (ctx);
-    return FALSE;
+    device_recovery_free (recovery);
 }
 
 static void
-device_report_error (MbimDevice   *self,
-                     guint32       transaction_id,
-                     const GError *error)
+device_recovery_complete (MbimDevice *self)
 {
-    ReportErrorContext *ctx;
-    g_autoptr(GSource)  source = NULL;
+    DeviceRecovery *recovery;
+    MbimMessage    *message;
 
-    /* Only protocol errors to be reported to the modem */
-    if (error->domain != MBIM_PROTOCOL_ERROR)
-        return;
+    recovery = g_steal_pointer (&self->priv->recovery);
+    self->priv->last_recovery_time = (g_get_monotonic_time () - recovery->start_time) / 1000;
+    device_memory_usage_update (self, &self->priv->memory.outbound, &self->priv->memory.outbound_peak, 0);
+    g_debug ("[%s] device recovered in %" G_GUINT64_FORMAT " ms: sending %u held commands...",
+             self->priv->path_display,
+             self->priv->last_recovery_time,
+             g_queue_get_length (recovery->held));
 
-    ctx = g_slice_new (ReportErrorContext);
-    ctx->self = g_object_ref (self);
-    ctx->message = mbim_message_error_new (transaction_id, error->code);
+    while ((message = g_queue_pop_head (recovery->held)) != NULL) {
+        g_autoptr(GError) error = NULL;
+        guint32           transaction_id;
+
+        /* Skip the ones that timed out or were cancelled while held */
+        transaction_id = mbim_message_get_transaction_id (message);
+        if (self->priv->transactions[TRANSACTION_TYPE_HOST] &&
+            g_hash_table_contains (self->priv->transactions[TRANSACTION_TYPE_HOST], GUINT_TO_POINTER (transaction_id)) &&
+            !device_send (self, message, &error)) {
+            GTask *task;
+
+            task = device_release_transaction (self, TRANSACTION_TYPE_HOST, MBIM_MESSAGE_TYPE_INVALID, transaction_id);
+            if (task)
+                transaction_task_complete_and_free (task, error);
+        }
+        mbim_message_unref (message);
+    }
 
-    source = g_idle_source_new ();
-    g_source_set_callback (source, (GSourceFunc)device_report_error_in_idle, ctx, NULL);
-    g_source_attach (source, g_main_context_get_thread_default ());
+    device_recovery_free (recovery);
+
+    g_signal_emit (self, signals[SIGNAL_RECOVERED], 0);
 }
 
-/*****************************************************************************/
-/* Command */
+static void
+device_recovery_subscribe_list_ready (MbimDevice   *self,
+                                      GAsyncResult *res,
+                                      gpointer      user_data)
+{
+    g_autoptr(MbimMessage) response = NULL;
+    g_autoptr(GError)      error = NULL;
 
-MbimMessage *
-mbim_device_command_finish (MbimDevice    *self,
-                            GAsyncResult  *res,
-                            GError       **error)
+    response = mbim_device_command_finish (self, res, &error);
+    if (!response || !mbim_message_response_get_result (response, MBIM_MESSAGE_TYPE_COMMAND_DONE, &error))
+        g_warning ("[%s] couldn't replay service subscribe list: %s",
+                   self->priv->path_display, error->message);
+
+    /* Recovery may have been stopped meanwhile */
+    if (self->priv->recovery)
+        device_recovery_complete (self);
+}
+
+static void
+device_recovery_backoff (MbimDevice   *self,
+                         const GError *error)
 {
-    return g_task_propagate_pointer (G_TASK (res), error);
+    DeviceRecovery *recovery;
+
+    recovery = self->priv->recovery;
+    recovery->reopening = FALSE;
+    recovery->n_failures++;
+    recovery->backoff_ms = (recovery->backoff_ms ?
+                            MIN (recovery->backoff_ms * 2, RECOVERY_MAX_BACKOFF_MS) :
+                            RECOVERY_CHECK_INTERVAL_MS);
+    recovery->next_attempt_time = g_get_monotonic_time () + (gint64) recovery->backoff_ms * 1000;
+
+    /* Reported once, the following failures are expected to be alike */
+    if (recovery->n_failures == RECOVERY_WARNING_FAILURES)
+        g_warning ("[%s] couldn't reopen device after %u attempts: %s (retrying up to every %u ms)",
+                   self->priv->path_display,
+                   recovery->n_failures,
+                   error->message,
+                   RECOVERY_MAX_BACKOFF_MS);
+    else
+        g_debug ("[%s] couldn't reopen device: %s (retrying in %u ms)",
+                 self->priv->path_display,
+                 error->message,
+                 recovery->backoff_ms);
 }
 
-void
-mbim_device_command (MbimDevice          *self,
-                     MbimMessage         *message,
-                     guint                timeout,
-                     GCancellable        *cancellable,
-                     GAsyncReadyCallback  callback,
-                     gpointer             user_data)
+static void
+device_recovery_open_ready (MbimDevice   *self,
+                            GAsyncResult *res,
+                            gpointer      user_data)
 {
-    g_autoptr(GError)  error = NULL;
-    GTask             *task;
-    guint32            transaction_id;
+    g_autoptr(GError)       error = NULL;
+    g_autoptr(MbimMessage)  request = NULL;
+    GTask                  *task;
+    guint32                 transaction_id;
 
-    g_return_if_fail (MBIM_IS_DEVICE (self));
-    g_return_if_fail (message != NULL);
+    if (!mbim_device_open_full_finish (self, res, &error)) {
+        /* Cleanup whatever was left open, and retry later */
+        self->priv->open_status = OPEN_STATUS_CLOSED;
+        destroy_iochannel (self, NULL);
+        if (self->priv->recovery)
+            device_recovery_backoff (self, error);
+        else
+            g_debug ("[%s] couldn't reopen device: %s", self->priv->path_display, error->message);
+        return;
+    }
 
-    /* If the message comes without a explicit transaction ID, add one
-     * ourselves */
-    transaction_id = mbim_message_get_transaction_id (message);
-    if (!transaction_id) {
-        transaction_id = mbim_device_get_next_transaction_id (self);
-        mbim_message_set_transaction_id (message, transaction_id);
+    /* Device closed by the user while reopening */
+    if (!self->priv->recovery) {
+        self->priv->open_status = OPEN_STATUS_CLOSED;
+        destroy_iochannel (self, NULL);
+        return;
+    }
+
+    if (!self->priv->subscribe_list) {
+        device_recovery_complete (self);
+        return;
     }
 
+    g_debug ("[%s] replaying service subscribe list...", self->priv->path_display);
+    request = mbim_message_dup (self->priv->subscribe_list);
+    transaction_id = mbim_device_get_next_transaction_id (self);
+    mbim_message_set_transaction_id (request, transaction_id);
     task = transaction_task_new (self,
-                                 MBIM_MESSAGE_GET_MESSAGE_TYPE (message),
+                                 MBIM_MESSAGE_GET_MESSAGE_TYPE (request),
                                  transaction_id,
-                                 cancellable,
-                                 callback,
-                                 user_data);
+                                 NULL,
+                                 (GAsyncReadyCallback)device_recovery_subscribe_list_ready,
+                                 NULL);
+    device_command_task_run (self, task, request, RECOVERY_SUBSCRIBE_LIST_TIMEOUT_SECS);
+}
 
-    /* Device must be open */
-    if (!self->priv->iochannel) {
-        error = g_error_new (MBIM_CORE_ERROR,
-                             MBIM_CORE_ERROR_WRONG_STATE,
-                             "Device must be open to send commands");
-        transaction_task_complete_and_free (task, error);
-        return;
+static gboolean
+device_recovery_check_cb (MbimDevice *self)
+{
+    DeviceRecovery *recovery;
+
+    recovery = self->priv->recovery;
+    if (recovery->reopening)
+        return G_SOURCE_CONTINUE;
+
+    if (g_get_monotonic_time () - recovery->start_time > RECOVERY_TIMEOUT_SECS * G_USEC_PER_SEC) {
+        device_recovery_stop (self, "device not back in time");
+        g_signal_emit (self, signals[SIGNAL_REMOVED], 0);
+        return G_SOURCE_REMOVE;
     }
 
-    /* Setup context to match response */
+    if (g_get_monotonic_time () < recovery->next_attempt_time)
+        return G_SOURCE_CONTINUE;
+
+    /* Wait for the device node to come back; when using the proxy, it may
+     * also be the proxy the one gone, which is respawned during the open */
+    if (!(self->priv->open_flags & MBIM_DEVICE_OPEN_FLAGS_PROXY) &&
+        !g_file_test (self->priv->path, G_FILE_TEST_EXISTS))
+        return G_SOURCE_CONTINUE;
+
+    g_debug ("[%s] reopening device...", self->priv->path_display);
+    recovery->reopening = TRUE;
+    mbim_device_open_full (self,
+                           self->priv->open_flags,
+                           self->priv->open_timeout,
+                           NULL,
+                           (GAsyncReadyCallback)device_recovery_open_ready,
+                           NULL);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+device_recovery_start (MbimDevice *self)
+{
+    DeviceRecovery *recovery;
+
+    /* If gone while reopening, the ongoing open will fail and be retried */
+    if (self->priv->recovery)
+        return TRUE;
+
+    if (!(self->priv->open_flags & MBIM_DEVICE_OPEN_FLAGS_AUTO_RECOVER))
+        return FALSE;
+
+    g_debug ("[%s] waiting for device to come back...", self->priv->path_display);
+
+    /* The device needs to be fully opened again */
+    self->priv->open_status = OPEN_STATUS_CLOSED;
+    self->priv->in_session = FALSE;
+
+    recovery = g_slice_new0 (DeviceRecovery);
+    recovery->start_time = g_get_monotonic_time ();
+    recovery->held = g_queue_new ();
+    recovery->source = g_timeout_source_new (RECOVERY_CHECK_INTERVAL_MS);
+    g_source_set_callback (recovery->source,
+                           (GSourceFunc)device_recovery_check_cb,
+                           self,
+                           NULL);
+    g_source_attach (recovery->source, g_main_context_get_thread_default ());
+    self->priv->recovery = recovery;
+    return TRUE;
+}
+
+static void
+device_recovery_hold_command (MbimDevice  *self,
+                              GTask       *task,
+                              MbimMessage *message,
+                              guint        timeout)
+{
+    g_autoptr(GError) error = NULL;
+
     if (!device_store_transaction (self, TRANSACTION_TYPE_HOST, task, timeout * 1000, &error)) {
         g_prefix_error (&error, "Cannot store transaction: ");
         transaction_task_complete_and_free (task, error);
         return;
     }
 
-    if (!device_send (self, message, &error)) {
-        /* Match transaction so that we remove it from our tracking table */
-        task = device_release_transaction (self,
-                                           TRANSACTION_TYPE_HOST,
-                                           MBIM_MESSAGE_GET_MESSAGE_TYPE (message),
-                                           mbim_message_get_transaction_id (message));
-        transaction_task_complete_and_free (task, error);
-        return;
-    }
+    g_debug ("[%s] device being recovered: command held", self->priv->path_display);
+    g_queue_push_tail (self->priv->recovery->held, mbim_message_ref (message));
+    device_memory_usage_update (self, &self->priv->memory.outbound,
+                                &self->priv->memory.outbound_peak,
+                                self->priv->memory.outbound + ((GByteArray *)message)->len);
+}
 
-    /* Just return, we'll get response asynchronously */
+guint64
+mbim_device_get_last_recovery_time (MbimDevice *self)
+{
+    g_return_val_if_fail (MBIM_IS_DEVICE (self), 0);
+
+    return self->priv->last_recovery_time;
 }
 
 /*****************************************************************************/
@@ -2772,6 +5324,12 @@ mbim_device_init (MbimDevice *self)
 
     /* By default, assume v1.0 supported */
     self->priv->ms_mbimex_version_major = 0x01;
+
+    g_mutex_init (&self->priv->io_context_lock);
+    g_rec_mutex_init (&self->priv->sync_lock);
+    g_mutex_init (&self->priv->requests_lock);
+    g_mutex_init (&self->priv->statistics_lock);
+    g_mutex_init (&self->priv->capture_lock);
 }
 
 static void
@@ -2782,8 +5340,10 @@ dispose (GObject *object)
     g_clear_object (&self->priv->file);
 
     self->priv->open_status = OPEN_STATUS_CLOSED;
+    device_recovery_stop (self, "device disposed");
     destroy_iochannel (self, NULL);
     g_clear_object (&self->priv->net_port_manager);
+    g_clear_pointer (&self->priv->subscribe_list, mbim_message_unref);
 
     G_OBJECT_CLASS (mbim_device_parent_class)->dispose (object);
 }
@@ -2808,6 +5368,17 @@ finalize (GObject *object)
     g_free (self->priv->path_display);
     g_free (self->priv->wwan_iface);
 
+    g_clear_pointer (&self->priv->io_context, g_main_context_unref);
+    g_mutex_clear (&self->priv->io_context_lock);
+    g_rec_mutex_clear (&self->priv->sync_lock);
+
+    g_clear_pointer (&self->priv->requests, g_hash_table_unref);
+    g_mutex_clear (&self->priv->requests_lock);
+    g_mutex_clear (&self->priv->statistics_lock);
+
+    g_clear_pointer (&self->priv->capture, _mbim_capture_unref);
+    g_mutex_clear (&self->priv->capture_lock);
+
     G_OBJECT_CLASS (mbim_device_parent_class)->finalize (object);
 }
 
@@ -2945,4 +5516,25 @@ mbim_device_class_init (MbimDeviceClass *klass)
                       NULL,
                       G_TYPE_NONE,
                       0);
+
+  /**
+   * MbimDevice::device-recovered:
+   * @self: the #MbimDevice
+   *
+   * The ::device-recovered signal is emitted when a device opened with
+   * %MBIM_DEVICE_OPEN_FLAGS_AUTO_RECOVER has been reopened after going away
+   * unexpectedly.
+   *
+   * Since: 1.30
+   */
+    signals[SIGNAL_RECOVERED] =
+        g_signal_new (MBIM_DEVICE_SIGNAL_RECOVERED,
+                      G_OBJECT_CLASS_TYPE (G_OBJECT_CLASS (klass)),
+                      G_SIGNAL_RUN_LAST,
+                      0,
+                      NULL,
+                      NULL,
+                      NULL,
+                      G_TYPE_NONE,
+                      0);
 }
@@ -106,6 +106,15 @@ typedef struct _MbimDevicePrivate MbimDevicePrivate;
  */
 #define MBIM_DEVICE_SIGNAL_REMOVED "device-removed"
 
+/**
+ * MBIM_DEVICE_SIGNAL_RECOVERED:
+ *
+ * Symbol defining the #MbimDevice::device-recovered signal.
+ *
+ * Since: 1.30
+ */
+#define MBIM_DEVICE_SIGNAL_RECOVERED "device-recovered"
+
 /**
  * MbimDevice:
  *
@@ -293,16 +302,26 @@ gboolean mbim_device_check_ms_mbimex_version (MbimDevice *self,
  * @MBIM_DEVICE_OPEN_FLAGS_PROXY: Try to open the port through the 'mbim-proxy'.
  * @MBIM_DEVICE_OPEN_FLAGS_MS_MBIMEX_V2: Try to enable MS MBIMEx 2.0 support. Since 1.28.
  * @MBIM_DEVICE_OPEN_FLAGS_MS_MBIMEX_V3: Try to enable MS MBIMEx 3.0 support. Since 1.28.
+ * @MBIM_DEVICE_OPEN_FLAGS_PROXY_SHARED_MEMORY: When opening the port through the 'mbim-proxy', try to exchange messages with it over shared memory instead of over the socket; falls back to the socket if the proxy doesn't support it. Since 1.30.
+ * @MBIM_DEVICE_OPEN_FLAGS_FAST_OPEN: Use a persistent cache of the information learnt in previous open operations of the same device and firmware to skip some of the steps of the open sequence. The cache is revalidated if any of the cached information is found to be wrong. Since 1.30.
+ * @MBIM_DEVICE_OPEN_FLAGS_PIPELINED: Run the queries performed after the device is open (e.g. the MS MBIMEx version exchange) in parallel instead of in sequence; if the device rejects a query sent ahead of time, it is sent again in sequence. The result of the open operation is the same in both cases. Since 1.30.
+ * @MBIM_DEVICE_OPEN_FLAGS_AUTO_RECOVER: If the device goes away unexpectedly (e.g. on a modem reset), wait for it to come back and reopen it with the same flags, replaying the last service subscribe list set by the user. Commands sent in the meantime are held until the device is recovered, instead of failing. The #MbimDevice::device-removed signal is only emitted if the device cannot be recovered. Since 1.30.
+ * @MBIM_DEVICE_OPEN_FLAGS_ADAPTIVE_TIMEOUTS: Use the latencies observed for the commands sent with mbim_device_command(), per service, CID and command type, to time out requests that take much longer than usual, instead of always waiting for the whole timeout given by the caller. See mbim_device_get_expected_latency(). Since 1.30.
  *
  * Flags to specify which actions to be performed when the device is open.
  *
  * Since: 1.10
  */
 typedef enum { /*< since=1.10 >*/
-    MBIM_DEVICE_OPEN_FLAGS_NONE         = 0,
-    MBIM_DEVICE_OPEN_FLAGS_PROXY        = 1 << 0,
-    MBIM_DEVICE_OPEN_FLAGS_MS_MBIMEX_V2 = 1 << 1,
-    MBIM_DEVICE_OPEN_FLAGS_MS_MBIMEX_V3 = 1 << 2,
+    MBIM_DEVICE_OPEN_FLAGS_NONE                = 0,
+    MBIM_DEVICE_OPEN_FLAGS_PROXY               = 1 << 0,
+    MBIM_DEVICE_OPEN_FLAGS_MS_MBIMEX_V2        = 1 << 1,
+    MBIM_DEVICE_OPEN_FLAGS_MS_MBIMEX_V3        = 1 << 2,
+    MBIM_DEVICE_OPEN_FLAGS_PROXY_SHARED_MEMORY = 1 << 3,
+    MBIM_DEVICE_OPEN_FLAGS_FAST_OPEN           = 1 << 4,
+    MBIM_DEVICE_OPEN_FLAGS_PIPELINED           = 1 << 5,
+    MBIM_DEVICE_OPEN_FLAGS_AUTO_RECOVER        = 1 << 6,
+    MBIM_DEVICE_OPEN_FLAGS_ADAPTIVE_TIMEOUTS   = 1 << 7,
 } MbimDeviceOpenFlags;
 
 /**
@@ -347,6 +366,36 @@ gboolean mbim_device_open_full_finish (MbimDevice    *self,
                                        GAsyncResult  *res,
                                        GError       **error);
 
+/**
+ * mbim_device_open_sync:
+ * @self: a #MbimDevice.
+ * @flags: a set of #MbimDeviceOpenFlags.
+ * @timeout: maximum time, in seconds, to wait for the device to be opened.
+ * @cancellable: optional #GCancellable object, #NULL to ignore.
+ * @error: Return location for error or %NULL.
+ *
+ * Synchronously opens a #MbimDevice for I/O, without requiring a running
+ * #GMainLoop.
+ *
+ * The device is bound to a new private #GMainContext, which is iterated by
+ * the synchronous methods mbim_device_command_sync() and
+ * mbim_device_close_sync(). Signals, e.g. #MbimDevice::device-indicate-status,
+ * are emitted while those methods are running, in the calling thread.
+ *
+ * A device opened with this method should only be used with the synchronous
+ * methods, which may be called from any thread; concurrent calls are
+ * serialized.
+ *
+ * Returns: %TRUE if successful, %FALSE if @error is set.
+ *
+ * Since: 1.30
+ */
+gboolean mbim_device_open_sync (MbimDevice           *self,
+                                MbimDeviceOpenFlags   flags,
+                                guint                 timeout,
+                                GCancellable         *cancellable,
+                                GError              **error);
+
 /**
  * mbim_device_open:
  * @self: a #MbimDevice.
@@ -421,6 +470,26 @@ gboolean mbim_device_close_finish (MbimDevice    *self,
                                    GAsyncResult  *res,
                                    GError       **error);
 
+/**
+ * mbim_device_close_sync:
+ * @self: a #MbimDevice.
+ * @timeout: maximum time, in seconds, to wait for the device to be closed.
+ * @cancellable: optional #GCancellable object, #NULL to ignore.
+ * @error: Return location for error or %NULL.
+ *
+ * Synchronously closes a #MbimDevice for I/O.
+ *
+ * See mbim_device_command_sync() for details on how the operation is run.
+ *
+ * Returns: %TRUE if successful, %FALSE if @error is set.
+ *
+ * Since: 1.30
+ */
+gboolean mbim_device_close_sync (MbimDevice    *self,
+                                 guint          timeout,
+                                 GCancellable  *cancellable,
+                                 GError       **error);
+
 /**
  * mbim_device_close_force:
  * @self: a #MbimDevice.
@@ -442,6 +511,8 @@ gboolean mbim_device_close_force (MbimDevice  *self,
  * Acquire the next transaction ID of this #MbimDevice.
  * The internal transaction ID gets incremented.
  *
+ * Since 1.30, this method may be called from any thread.
+ *
  * Returns: the next transaction ID.
  *
  * Since: 1.0
@@ -473,6 +544,339 @@ guint32 mbim_device_get_transaction_id (MbimDevice *self);
  */
 guint mbim_device_get_consecutive_timeouts (MbimDevice *self);
 
+/**
+ * mbim_device_get_last_recovery_time:
+ * @self: a #MbimDevice.
+ *
+ * Gets the time it took to recover the device the last time it went away
+ * unexpectedly, when opened with %MBIM_DEVICE_OPEN_FLAGS_AUTO_RECOVER. The
+ * time goes from the moment the device is detected as gone until it is open
+ * again with the service subscribe list replayed.
+ *
+ * Returns: the time in milliseconds, or 0 if the device was never recovered.
+ *
+ * Since: 1.30
+ */
+guint64 mbim_device_get_last_recovery_time (MbimDevice *self);
+
+/**
+ * mbim_device_get_expected_latency:
+ * @self: a #MbimDevice.
+ * @service: a #MbimService.
+ * @cid: a command ID.
+ * @command_type: a #MbimMessageCommandType.
+ * @out_typical: (out) (optional): return location for the typical latency,
+ *  in milliseconds, or %NULL.
+ * @out_high: (out) (optional): return location for the latency not exceeded
+ *  by most of the requests, in milliseconds, or %NULL.
+ *
+ * Gets the latency expected for the requests of the given @service, @cid and
+ * @command_type, e.g. to plan how often to poll the device.
+ *
+ * The latency information is only available once enough requests have been
+ * completed.
+ *
+ * Returns: %TRUE if @out_typical and @out_high are set, %FALSE if there is
+ * no latency information for the given @service, @cid and @command_type.
+ *
+ * Since: 1.30
+ */
+gboolean mbim_device_get_expected_latency (MbimDevice             *self,
+                                           MbimService             service,
+                                           guint                   cid,
+                                           MbimMessageCommandType  command_type,
+                                           guint                  *out_typical,
+                                           guint                  *out_high);
+
+/**
+ * MbimDeviceStatistics:
+ * @bytes_in: number of bytes received.
+ * @bytes_out: number of bytes sent.
+ * @messages_in: number of messages received, once reassembled.
+ * @messages_out: number of messages sent.
+ * @fragments_in: number of fragments received of messages split in multiple
+ *  fragments.
+ * @fragments_out: number of fragments sent of messages split in multiple
+ *  fragments.
+ * @reassemblies: number of messages reassembled from multiple fragments.
+ * @validation_failures: number of times received data was discarded because
+ *  it wasn't a valid message.
+ * @timeouts: number of requests timed out, including fragment timeouts.
+ * @aborts: number of requests aborted, e.g. cancelled or because the device
+ *  was closed.
+ * @function_errors: number of function error messages received.
+ *
+ * Control plane counters of a #MbimDevice, since it was created.
+ *
+ * Since: 1.30
+ */
+typedef struct {
+    guint64 bytes_in;
+    guint64 bytes_out;
+    guint64 messages_in;
+    guint64 messages_out;
+    guint64 fragments_in;
+    guint64 fragments_out;
+    guint64 reassemblies;
+    guint64 validation_failures;
+    guint64 timeouts;
+    guint64 aborts;
+    guint64 function_errors;
+    /*< private >*/
+    gpointer reserved[8];
+} MbimDeviceStatistics;
+
+/**
+ * MbimDeviceRequestStatistics:
+ * @service: a #MbimService.
+ * @cid: a command ID.
+ * @command_type: a #MbimMessageCommandType.
+ * @n_requests: number of requests sent.
+ * @latency_p50: latency not exceeded by 50% of the recent requests, in
+ *  milliseconds.
+ * @latency_p90: latency not exceeded by 90% of the recent requests, in
+ *  milliseconds.
+ * @latency_p99: latency not exceeded by 99% of the recent requests, in
+ *  milliseconds.
+ * @latency_max: maximum latency observed, in milliseconds.
+ *
+ * Statistics of the requests of a given service, CID and command type sent
+ * to a #MbimDevice.
+ *
+ * The latency percentiles are approximations, given as the upper limit of
+ * the histogram bucket they fall in. Requests that timed out are accounted
+ * with the whole timeout given by the caller, even if they were timed out
+ * earlier because of %MBIM_DEVICE_OPEN_FLAGS_ADAPTIVE_TIMEOUTS.
+ *
+ * Since: 1.30
+ */
+typedef struct {
+    MbimService            service;
+    guint                  cid;
+    MbimMessageCommandType command_type;
+    guint64                n_requests;
+    guint                  latency_p50;
+    guint                  latency_p90;
+    guint                  latency_p99;
+    guint                  latency_max;
+    /*< private >*/
+    gpointer               reserved[8];
+} MbimDeviceRequestStatistics;
+
+/**
+ * mbim_device_get_statistics:
+ * @self: a #MbimDevice.
+ * @out_statistics: (out) (optional): return location for the
+ *  #MbimDeviceStatistics, or %NULL.
+ * @out_request_statistics: (out) (optional) (transfer full) (element-type MbimDeviceRequestStatistics):
+ *  return location for a #GArray of #MbimDeviceRequestStatistics, one for
+ *  each service, CID and command type requested, or %NULL. The returned value should be
+ *  freed with g_array_unref().
+ *
+ * Gets the control plane statistics of the device.
+ *
+ * The counters are updated in the #GMainContext where the device was opened,
+ * so if this method is called from a different thread the values may not
+ * include the very latest messages.
+ *
+ * Since: 1.30
+ */
+void mbim_device_get_statistics (MbimDevice            *self,
+                                 MbimDeviceStatistics  *out_statistics,
+                                 GArray               **out_request_statistics);
+
+/**
+ * MbimDeviceMemoryUsage:
+ * @receive_buffer: bytes received from the device and not yet processed.
+ * @receive_buffer_peak: maximum value of @receive_buffer.
+ * @pending_transactions: bytes held by the ongoing transactions, including
+ *  the fragments collected of partially received messages.
+ * @pending_transactions_peak: maximum value of @pending_transactions.
+ * @outbound: bytes of the messages waiting to be sent, e.g. while the device
+ *  is being recovered.
+ * @outbound_peak: maximum value of @outbound.
+ *
+ * Memory used by a #MbimDevice to handle its control messages, since it was
+ * created.
+ *
+ * Since: 1.30
+ */
+typedef struct {
+    guint64 receive_buffer;
+    guint64 receive_buffer_peak;
+    guint64 pending_transactions;
+    guint64 pending_transactions_peak;
+    guint64 outbound;
+    guint64 outbound_peak;
+    /*< private >*/
+    gpointer reserved[8];
+} MbimDeviceMemoryUsage;
+
+/**
+ * mbim_device_get_memory_usage:
+ * @self: a #MbimDevice.
+ * @out_memory_usage: (out): return location for the #MbimDeviceMemoryUsage.
+ *
+ * Gets the memory used by the device to handle its control messages.
+ *
+ * As with mbim_device_get_statistics(), the values are updated in the
+ * #GMainContext where the device was opened.
+ *
+ * Since: 1.30
+ */
+void mbim_device_get_memory_usage (MbimDevice            *self,
+                                   MbimDeviceMemoryUsage *out_memory_usage);
+
+/**
+ * mbim_device_start_capture:
+ * @self: a #MbimDevice.
+ * @path: path of the capture file.
+ * @max_file_size: size in bytes after which the capture file is rotated, or
+ *  0 to never rotate it.
+ * @max_files: maximum number of capture files to keep when rotating,
+ *  including the one being written.
+ * @error: Return location for error or %NULL.
+ *
+ * Starts capturing all the MBIM messages sent to and received from the
+ * device into a pcapng file, which can be decoded by Wireshark.
+ *
+ * The messages are written by a separate thread; if the capture can't keep
+ * up with the traffic, messages are dropped from the capture instead of
+ * delaying the device operations. When the file reaches @max_file_size it
+ * is renamed to '@path.1', any previous '@path.1' to '@path.2' and so on,
+ * keeping at most @max_files.
+ *
+ * Any previous capture running in the device is stopped.
+ *
+ * Returns: %TRUE if the capture was started, %FALSE if @error is set.
+ *
+ * Since: 1.30
+ */
+gboolean mbim_device_start_capture (MbimDevice   *self,
+                                    const gchar  *path,
+                                    guint64       max_file_size,
+                                    guint         max_files,
+                                    GError      **error);
+
+/**
+ * mbim_device_stop_capture:
+ * @self: a #MbimDevice.
+ *
+ * Stops the capture started with mbim_device_start_capture(), if any,
+ * once all the pending messages are written.
+ *
+ * Since: 1.30
+ */
+void mbim_device_stop_capture (MbimDevice *self);
+
+/**
+ * mbim_device_set_proxy_client_limits:
+ * @self: a #MbimDevice.
+ * @request_timeout: maximum time, in seconds, the proxy should wait for the
+ *  device to reply each request sent by this client, or 0 to use the proxy
+ *  default.
+ * @max_pending_requests: maximum number of requests sent by this client that
+ *  the proxy should allow to be ongoing at the same time, or 0 to use the
+ *  proxy default.
+ *
+ * Sets the limits to request to the 'mbim-proxy' for this client.
+ *
+ * The limits are given to the proxy during the device open operation, so this
+ * method must be called before mbim_device_open_full() is run with the
+ * %MBIM_DEVICE_OPEN_FLAGS_PROXY flag. Requests sent once the limit of pending
+ * requests has been reached are rejected by the proxy right away with a
+ * %MBIM_STATUS_ERROR_BUSY status.
+ *
+ * The proxy may clamp the given limits to its own maximum values.
+ *
+ * Since: 1.30
+ */
+void mbim_device_set_proxy_client_limits (MbimDevice *self,
+                                          guint       request_timeout,
+                                          guint       max_pending_requests);
+
+/**
+ * MbimProxyClientMemoryUsage:
+ * @client_id: identifier of the client in the proxy.
+ * @receive_buffer: bytes received from the client and not yet processed.
+ * @receive_buffer_peak: maximum value of @receive_buffer.
+ * @pending_requests: bytes held by the requests of the client waiting for a
+ *  response from the device.
+ * @pending_requests_peak: maximum value of @pending_requests.
+ * @outbound: bytes of the messages waiting to be sent to the client.
+ * @outbound_peak: maximum value of @outbound.
+ * @subscriptions: bytes held by the event subscription list of the client.
+ * @subscriptions_peak: maximum value of @subscriptions.
+ *
+ * Memory used by the 'mbim-proxy' on behalf of one of its clients, since the
+ * client connected.
+ *
+ * Since: 1.30
+ */
+typedef struct {
+    guint64 client_id;
+    guint64 receive_buffer;
+    guint64 receive_buffer_peak;
+    guint64 pending_requests;
+    guint64 pending_requests_peak;
+    guint64 outbound;
+    guint64 outbound_peak;
+    guint64 subscriptions;
+    guint64 subscriptions_peak;
+    /*< private >*/
+    gpointer reserved[8];
+} MbimProxyClientMemoryUsage;
+
+/**
+ * mbim_device_query_proxy_memory_usage:
+ * @self: a #MbimDevice.
+ * @timeout: maximum time, in seconds, to wait for the response.
+ * @cancellable: a #GCancellable, or %NULL.
+ * @callback: a #GAsyncReadyCallback to call when the operation is finished.
+ * @user_data: the data to pass to callback function.
+ *
+ * Asynchronously queries the memory used by the 'mbim-proxy' to handle the
+ * device and all the clients connected to it.
+ *
+ * The device must have been opened with the %MBIM_DEVICE_OPEN_FLAGS_PROXY
+ * flag.
+ *
+ * When the operation is finished @callback will be called. You can then call
+ * mbim_device_query_proxy_memory_usage_finish() to get the result of the
+ * operation.
+ *
+ * Since: 1.30
+ */
+void mbim_device_query_proxy_memory_usage (MbimDevice          *self,
+                                           guint                timeout,
+                                           GCancellable        *cancellable,
+                                           GAsyncReadyCallback  callback,
+                                           gpointer             user_data);
+
+/**
+ * mbim_device_query_proxy_memory_usage_finish:
+ * @self: a #MbimDevice.
+ * @res: a #GAsyncResult.
+ * @out_device_memory_usage: (out) (optional): return location for the
+ *  #MbimDeviceMemoryUsage of the device in the proxy, or %NULL.
+ * @out_client_memory_usage: (out) (optional) (transfer full) (element-type MbimProxyClientMemoryUsage):
+ *  return location for a #GArray of #MbimProxyClientMemoryUsage, one for each
+ *  client connected to the proxy using the same device, or %NULL. The returned value should be
+ *  freed with g_array_unref().
+ * @error: Return location for error or %NULL.
+ *
+ * Finishes an operation started with mbim_device_query_proxy_memory_usage().
+ *
+ * Returns: %TRUE if the query succeeded, %FALSE if @error is set.
+ *
+ * Since: 1.30
+ */
+gboolean mbim_device_query_proxy_memory_usage_finish (MbimDevice             *self,
+                                                      GAsyncResult           *res,
+                                                      MbimDeviceMemoryUsage  *out_device_memory_usage,
+                                                      GArray                **out_client_memory_usage,
+                                                      GError                **error);
+
 /**
  * mbim_device_command:
  * @self: a #MbimDevice.
@@ -487,6 +891,15 @@ guint mbim_device_get_consecutive_timeouts (MbimDevice *self);
  * When the operation is finished @callback will be called. You can then call
  * mbim_device_command_finish() to get the result of the operation.
  *
+ * Since 1.30, this method may be called from any thread. If the
+ * #GMainContext where the device was opened is being run by a different
+ * thread, the command is submitted from that thread, and @callback is called
+ * in the thread-default #GMainContext of the caller.
+ *
+ * If the device was opened with %MBIM_DEVICE_OPEN_FLAGS_ADAPTIVE_TIMEOUTS,
+ * @timeout is the upper limit of the timeout derived from the latencies
+ * previously observed for the same request.
+ *
  * Since: 1.0
  */
 void mbim_device_command (MbimDevice          *self,
@@ -512,6 +925,43 @@ MbimMessage *mbim_device_command_finish (MbimDevice    *self,
                                          GAsyncResult  *res,
                                          GError       **error);
 
+/**
+ * mbim_device_command_sync:
+ * @self: a #MbimDevice.
+ * @message: the message to send.
+ * @timeout: maximum time, in seconds, to wait for the response.
+ * @cancellable: a #GCancellable, or %NULL.
+ * @error: Return location for error or %NULL.
+ *
+ * Synchronously sends a #MbimMessage to the device, and waits for the
+ * response, without requiring a running #GMainLoop.
+ *
+ * If no other thread is running the #GMainContext where the device was opened
+ * (e.g. if opened with mbim_device_open_sync()), the calling thread iterates
+ * that context until the response is received.
+ *
+ * Otherwise, the command is submitted in the #GMainContext where the device
+ * was opened, and the calling thread waits iterating a new private
+ * #GMainContext, so this method is safe to call from worker threads as long
+ * as the context where the device was opened keeps on running.
+ *
+ * This method must not be called from a thread running a #GMainContext
+ * different to the one where the device was opened, as that context would be
+ * blocked until the operation finishes. It fails with
+ * %MBIM_CORE_ERROR_WRONG_STATE if called from the thread running the context
+ * where the device was opened, e.g. from a signal handler, as that context
+ * cannot be iterated reentrantly.
+ *
+ * Returns: a #MbimMessage response, or #NULL if @error is set. The returned value should be freed with mbim_message_unref().
+ *
+ * Since: 1.30
+ */
+MbimMessage *mbim_device_command_sync (MbimDevice    *self,
+                                       MbimMessage   *message,
+                                       guint          timeout,
+                                       GCancellable  *cancellable,
+                                       GError       **error);
+
 /**
  * MBIM_DEVICE_SESSION_ID_AUTOMATIC:
  *
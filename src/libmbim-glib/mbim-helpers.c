@@ -101,6 +101,94 @@ mbim_helpers_get_devname (const gchar  *cdc_wdm_path,
 
 /*****************************************************************************/
 
+static gboolean
+control_port_is_cdc_mbim (const gchar *class_path,
+                          const gchar *name)
+{
+    g_autofree gchar *driver_link = NULL;
+    g_autofree gchar *driver_path = NULL;
+    g_autofree gchar *driver = NULL;
+
+    /* cdc-wdm ports are also exposed by e.g. the qmi_wwan driver */
+    driver_link = g_build_filename (class_path, name, "device", "driver", NULL);
+    driver_path = g_file_read_link (driver_link, NULL);
+    if (!driver_path)
+        return FALSE;
+    driver = g_path_get_basename (driver_path);
+    return g_str_equal (driver, "cdc_mbim");
+}
+
+static gboolean
+control_port_is_wwan_mbim (const gchar *class_path,
+                           const gchar *name)
+{
+    g_autofree gchar *type_path = NULL;
+    g_autofree gchar *type = NULL;
+
+    /* The port type is exposed in sysfs since kernel 5.18, otherwise rely
+     * on the port name, e.g. wwan0mbim0 */
+    type_path = g_build_filename (class_path, name, "type", NULL);
+    if (g_file_get_contents (type_path, &type, NULL, NULL))
+        return g_str_equal (g_strstrip (type), "MBIM");
+    return (strstr (name, "mbim") != NULL);
+}
+
+static gint
+control_port_cmp (const gchar **a,
+                  const gchar **b)
+{
+    return g_strcmp0 (*a, *b);
+}
+
+GPtrArray *
+mbim_helpers_list_control_ports (const gchar  *sysfs_root,
+                                 GError      **error)
+{
+    static const gchar *subsystems[] = { "usbmisc", /* kernel >= 3.6 */
+                                         "usb",     /* kernel < 3.6 */
+                                         "wwan" };
+    g_autoptr(GPtrArray) ports = NULL;
+    guint                i;
+    gboolean             found_class = FALSE;
+
+    ports = g_ptr_array_new_with_free_func (g_free);
+
+    for (i = 0; i < G_N_ELEMENTS (subsystems); i++) {
+        g_autofree gchar *class_path = NULL;
+        g_autoptr(GDir)   dir = NULL;
+        const gchar      *name;
+
+        class_path = g_build_filename (sysfs_root ? sysfs_root : "/sys", "class", subsystems[i], NULL);
+        dir = g_dir_open (class_path, 0, NULL);
+        if (!dir)
+            continue;
+        found_class = TRUE;
+
+        while ((name = g_dir_read_name (dir)) != NULL) {
+            gboolean valid;
+
+            if (g_str_equal (subsystems[i], "wwan"))
+                valid = control_port_is_wwan_mbim (class_path, name);
+            else
+                valid = (g_str_has_prefix (name, "cdc-wdm") && control_port_is_cdc_mbim (class_path, name));
+
+            if (valid)
+                g_ptr_array_add (ports, g_build_filename ("/dev", name, NULL));
+        }
+    }
+
+    if (!found_class) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_UNSUPPORTED,
+                     "Couldn't find any control port subsystem in sysfs");
+        return NULL;
+    }
+
+    g_ptr_array_sort (ports, (GCompareFunc)control_port_cmp);
+    return g_steal_pointer (&ports);
+}
+
+/*****************************************************************************/
+
 gboolean
 mbim_helpers_list_links_wdm (GFile         *sysfs_file,
                              GCancellable  *cancellable,
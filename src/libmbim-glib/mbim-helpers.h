@@ -30,6 +30,10 @@ G_GNUC_INTERNAL
 gchar *mbim_helpers_get_devname (const gchar  *cdc_wdm_path,
                                  GError      **error);
 
+G_GNUC_INTERNAL
+GPtrArray *mbim_helpers_list_control_ports (const gchar  *sysfs_root,
+                                            GError      **error);
+
 G_GNUC_INTERNAL
 gboolean mbim_helpers_list_links_wdm (GFile         *sysfs_file,
                                       GCancellable  *cancellable,
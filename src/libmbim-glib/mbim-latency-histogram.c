@@ -0,0 +1,110 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * libmbim-glib -- GLib/GIO based library to control MBIM devices
+ */
+
+#include <glib.h>
+
+#include "mbim-latency-histogram.h"
+
+/* Upper limits of each bucket, in milliseconds; the last bucket takes all
+ * the samples above the last limit */
+static const guint bucket_limits[] = {
+    5, 10, 20, 35, 50, 75, 100, 150, 200, 300, 500, 750,
+    1000, 1500, 2000, 3000, 5000, 7500, 10000, 15000, 20000, 30000,
+    45000, 60000, 90000, 120000, 180000,
+};
+
+#define N_BUCKETS   (G_N_ELEMENTS (bucket_limits) + 1)
+#define MAX_SAMPLES 256
+
+struct _MbimLatencyHistogram {
+    guint counts[N_BUCKETS];
+    guint n_samples;
+    guint max_latency_ms;
+};
+
+/*****************************************************************************/
+
+static guint
+bucket_for_latency (guint latency_ms)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (bucket_limits); i++) {
+        if (latency_ms <= bucket_limits[i])
+            return i;
+    }
+    return N_BUCKETS - 1;
+}
+
+void
+_mbim_latency_histogram_add (MbimLatencyHistogram *self,
+                             guint                 latency_ms)
+{
+    guint i;
+
+    if (self->n_samples == MAX_SAMPLES) {
+        self->n_samples = 0;
+        for (i = 0; i < N_BUCKETS; i++) {
+            self->counts[i] /= 2;
+            self->n_samples += self->counts[i];
+        }
+        /* The maximum may not be there any more */
+        if (!self->counts[N_BUCKETS - 1])
+            self->max_latency_ms = 0;
+    }
+
+    self->counts[bucket_for_latency (latency_ms)]++;
+    self->n_samples++;
+    self->max_latency_ms = MAX (self->max_latency_ms, latency_ms);
+}
+
+guint
+_mbim_latency_histogram_get_n_samples (MbimLatencyHistogram *self)
+{
+    return self->n_samples;
+}
+
+gboolean
+_mbim_latency_histogram_get_percentile (MbimLatencyHistogram *self,
+                                        guint                 percentile,
+                                        guint                *out_latency_ms)
+{
+    guint64 threshold;
+    guint64 accumulated = 0;
+    guint   i;
+
+    g_assert (percentile > 0 && percentile <= 100);
+
+    if (!self->n_samples)
+        return FALSE;
+
+    /* Number of samples at or below the percentile, rounded up */
+    threshold = ((guint64) self->n_samples * percentile + 99) / 100;
+
+    for (i = 0; i < N_BUCKETS; i++) {
+        accumulated += self->counts[i];
+        if (accumulated >= threshold)
+            break;
+    }
+    g_assert (i < N_BUCKETS);
+
+    *out_latency_ms = (i < G_N_ELEMENTS (bucket_limits)) ? bucket_limits[i] : self->max_latency_ms;
+    return TRUE;
+}
+
+/*****************************************************************************/
+
+MbimLatencyHistogram *
+_mbim_latency_histogram_new (void)
+{
+    return g_slice_new0 (MbimLatencyHistogram);
+}
+
+void
+_mbim_latency_histogram_free (MbimLatencyHistogram *self)
+{
+    g_slice_free (MbimLatencyHistogram, self);
+}
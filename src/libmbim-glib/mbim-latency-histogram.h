@@ -0,0 +1,44 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * libmbim-glib -- GLib/GIO based library to control MBIM devices
+ *
+ * This is a private non-installed header
+ */
+
+#ifndef _LIBMBIM_GLIB_MBIM_LATENCY_HISTOGRAM_H_
+#define _LIBMBIM_GLIB_MBIM_LATENCY_HISTOGRAM_H_
+
+#if !defined (LIBMBIM_GLIB_COMPILATION)
+#error "This is a private header!!"
+#endif
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Histogram of the latencies observed for a given request, in milliseconds.
+ *
+ * Samples are counted in buckets of increasing width, so percentiles are
+ * reported as the upper limit of the bucket they fall in. Once the maximum
+ * number of samples is reached, all counts are halved, so that the most
+ * recent samples have a bigger weight.
+ */
+
+typedef struct _MbimLatencyHistogram MbimLatencyHistogram;
+
+MbimLatencyHistogram *_mbim_latency_histogram_new            (void);
+void                  _mbim_latency_histogram_free           (MbimLatencyHistogram *self);
+void                  _mbim_latency_histogram_add            (MbimLatencyHistogram *self,
+                                                              guint                 latency_ms);
+guint                 _mbim_latency_histogram_get_n_samples  (MbimLatencyHistogram *self);
+gboolean              _mbim_latency_histogram_get_percentile (MbimLatencyHistogram *self,
+                                                              guint                 percentile,
+                                                              guint                *out_latency_ms);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (MbimLatencyHistogram, _mbim_latency_histogram_free)
+
+G_END_DECLS
+
+#endif /* _LIBMBIM_GLIB_MBIM_LATENCY_HISTOGRAM_H_ */
@@ -127,6 +127,12 @@ guint32       _mbim_message_fragment_get_current (const MbimMessage  *self);
 const guint8 *_mbim_message_fragment_get_payload (const MbimMessage  *self,
                                                   guint32            *length);
 
+/* Service and CID of command, command done and indication messages, or of
+ * their first fragment; FALSE for any other message, without warnings */
+gboolean      _mbim_message_peek_service_cid     (const MbimMessage  *self,
+                                                  MbimService        *out_service,
+                                                  guint32            *out_cid);
+
 /* Merge fragments into a message... */
 
 MbimMessage *_mbim_message_fragment_collector_init     (const MbimMessage  *fragment,
@@ -2256,6 +2256,36 @@ _mbim_message_fragment_get_current (const MbimMessage  *self)
     return MBIM_MESSAGE_FRAGMENT_GET_CURRENT (self);
 }
 
+gboolean
+_mbim_message_peek_service_cid (const MbimMessage *self,
+                                MbimService       *out_service,
+                                guint32           *out_cid)
+{
+    const struct full_message *full;
+
+    switch (MBIM_MESSAGE_GET_MESSAGE_TYPE (self)) {
+    case MBIM_MESSAGE_TYPE_COMMAND:
+    case MBIM_MESSAGE_TYPE_COMMAND_DONE:
+    case MBIM_MESSAGE_TYPE_INDICATE_STATUS:
+        break;
+    default:
+        return FALSE;
+    }
+
+    /* Service and CID are at the same offset in the three message types,
+     * and only available in the first fragment */
+    if (self->len < sizeof (struct header) + G_STRUCT_OFFSET (struct command_message, command_type) ||
+        MBIM_MESSAGE_FRAGMENT_GET_CURRENT (self) != 0)
+        return FALSE;
+
+    full = (const struct full_message *)self->data;
+    if (out_service)
+        *out_service = mbim_uuid_to_service ((const MbimUuid *)full->message.command.service_id);
+    if (out_cid)
+        *out_cid = GUINT32_FROM_LE (full->message.command.command_id);
+    return TRUE;
+}
+
 const guint8 *
 _mbim_message_fragment_get_payload (const MbimMessage *self,
                                     guint32           *length)
@@ -0,0 +1,23 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * libmbim-glib -- GLib/GIO based library to control MBIM devices
+ */
+
+#include "mbim-probes.h"
+
+/* Semaphores of the probes, set by the tracers when attached; they must live
+ * in the .probes section to be found */
+
+#define MBIM_PROBE_SEMAPHORE_DEFINE(name) \
+    __extension__ volatile unsigned short MBIM_PROBE_SEMAPHORE (name) __attribute__ ((unused)) __attribute__ ((section (".probes")))
+
+MBIM_PROBE_SEMAPHORE_DEFINE (device_send);
+MBIM_PROBE_SEMAPHORE_DEFINE (device_read);
+MBIM_PROBE_SEMAPHORE_DEFINE (device_message);
+MBIM_PROBE_SEMAPHORE_DEFINE (transaction_store);
+MBIM_PROBE_SEMAPHORE_DEFINE (transaction_release);
+MBIM_PROBE_SEMAPHORE_DEFINE (transaction_timeout);
+MBIM_PROBE_SEMAPHORE_DEFINE (indication);
+MBIM_PROBE_SEMAPHORE_DEFINE (proxy_request);
+MBIM_PROBE_SEMAPHORE_DEFINE (proxy_response);
@@ -0,0 +1,98 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * libmbim-glib -- GLib/GIO based library to control MBIM devices
+ *
+ * This is a private non-installed header
+ */
+
+#ifndef _LIBMBIM_GLIB_MBIM_PROBES_H_
+#define _LIBMBIM_GLIB_MBIM_PROBES_H_
+
+#if !defined (LIBMBIM_GLIB_COMPILATION)
+#error "This is a private header!!"
+#endif
+
+#include <glib.h>
+
+#include "config.h"
+
+/*
+ * USDT probes in the 'libmbim' provider.
+ *
+ * Each probe has a semaphore, so the probe arguments are only evaluated
+ * while a tracer is attached to the probe. When built without USDT support,
+ * the probes aren't built at all.
+ *
+ * All probes get a timestamp from g_get_monotonic_time() as last argument.
+ * Probes in the device also get the device path as first argument.
+ *
+ *   device_send         (path, transaction id, message type, service, cid,
+ *                        fragment, n fragments, length, timestamp)
+ *   device_read         (path, bytes read, bytes buffered, timestamp)
+ *   device_message      (path, transaction id, message type, service, cid,
+ *                        length, partial fragment, timestamp)
+ *   transaction_store   (path, transaction id, transaction type, timeout ms,
+ *                        timestamp)
+ *   transaction_release (path, transaction id, transaction type, timestamp)
+ *   transaction_timeout (path, transaction id, transaction type, timestamp)
+ *   indication          (path, transaction id, service, cid, length,
+ *                        timestamp)
+ *   proxy_request       (client id, client transaction id, device
+ *                        transaction id, service, cid, length, timestamp)
+ *   proxy_response      (client id, client transaction id, device
+ *                        transaction id, service, cid, length, timestamp)
+ *
+ * Service is given as a MbimService value. When a transaction times out,
+ * transaction_timeout is fired before its transaction_release.
+ */
+
+#if defined USDT_ENABLED
+
+# define _SDT_HAS_SEMAPHORES 1
+# include <sys/sdt.h>
+
+# define MBIM_PROBE_SEMAPHORE(name) libmbim_##name##_semaphore
+# define MBIM_PROBE(name, ...)                              \
+    G_STMT_START {                                          \
+        if (G_UNLIKELY (MBIM_PROBE_SEMAPHORE (name)))       \
+            STAP_PROBEV (libmbim, name, __VA_ARGS__);       \
+    } G_STMT_END
+
+extern volatile unsigned short MBIM_PROBE_SEMAPHORE (device_send);
+extern volatile unsigned short MBIM_PROBE_SEMAPHORE (device_read);
+extern volatile unsigned short MBIM_PROBE_SEMAPHORE (device_message);
+extern volatile unsigned short MBIM_PROBE_SEMAPHORE (transaction_store);
+extern volatile unsigned short MBIM_PROBE_SEMAPHORE (transaction_release);
+extern volatile unsigned short MBIM_PROBE_SEMAPHORE (transaction_timeout);
+extern volatile unsigned short MBIM_PROBE_SEMAPHORE (indication);
+extern volatile unsigned short MBIM_PROBE_SEMAPHORE (proxy_request);
+extern volatile unsigned short MBIM_PROBE_SEMAPHORE (proxy_response);
+
+# include "mbim-message-private.h"
+
+static inline guint
+_mbim_probe_message_service (const MbimMessage *message)
+{
+    MbimService service = MBIM_SERVICE_INVALID;
+
+    _mbim_message_peek_service_cid (message, &service, NULL);
+    return service;
+}
+
+static inline guint32
+_mbim_probe_message_cid (const MbimMessage *message)
+{
+    guint32 cid = 0;
+
+    _mbim_message_peek_service_cid (message, NULL, &cid);
+    return cid;
+}
+
+#else
+
+# define MBIM_PROBE(name, ...) G_STMT_START { } G_STMT_END
+
+#endif
+
+#endif /* _LIBMBIM_GLIB_MBIM_PROBES_H_ */
@@ -399,3 +399,315 @@ _mbim_proxy_helper_service_subscribe_list_new_standard (gsize *out_size)
     *out_size = i;
     return out;
 }
+
+/*****************************************************************************/
+
+/* The Configuration request in the Proxy Control service may include two
+ * additional guint32 fields after the Timeout one: the per-client request
+ * timeout and the maximum number of pending requests. These are appended as
+ * static fields before the variable buffer with the device path, so the offset
+ * of the device path string tells whether they're included or not. Proxies not
+ * knowing about these fields will just ignore them. */
+#define CONFIGURATION_FIXED_SIZE_EXTENDED 20
+
+MbimMessage *
+_mbim_proxy_helper_configuration_set_new (const gchar *device_path,
+                                          guint32      timeout,
+                                          guint32      request_timeout,
+                                          guint32      max_pending_requests)
+{
+    MbimMessageCommandBuilder *builder;
+
+    builder = _mbim_message_command_builder_new (0,
+                                                 MBIM_SERVICE_PROXY_CONTROL,
+                                                 MBIM_CID_PROXY_CONTROL_CONFIGURATION,
+                                                 MBIM_MESSAGE_COMMAND_TYPE_SET);
+    _mbim_message_command_builder_append_string (builder, device_path);
+    _mbim_message_command_builder_append_guint32 (builder, timeout);
+    _mbim_message_command_builder_append_guint32 (builder, request_timeout);
+    _mbim_message_command_builder_append_guint32 (builder, max_pending_requests);
+    return _mbim_message_command_builder_complete (builder);
+}
+
+gboolean
+_mbim_proxy_helper_configuration_set_parse (MbimMessage  *message,
+                                            gchar       **out_device_path,
+                                            guint32      *out_timeout,
+                                            guint32      *out_request_timeout,
+                                            guint32      *out_max_pending_requests,
+                                            GError      **error)
+{
+    g_autofree gchar *device_path = NULL;
+    guint32           device_path_offset = 0;
+    guint32           timeout = 0;
+    guint32           request_timeout = 0;
+    guint32           max_pending_requests = 0;
+
+    g_assert (message != NULL);
+
+    if (mbim_message_get_message_type (message) != MBIM_MESSAGE_TYPE_COMMAND) {
+        g_set_error (error,
+                     MBIM_CORE_ERROR,
+                     MBIM_CORE_ERROR_INVALID_MESSAGE,
+                     "Message is not a request");
+        return FALSE;
+    }
+
+    if (!_mbim_message_read_string (message, 0, 0, MBIM_STRING_ENCODING_UTF16, &device_path, error)) {
+        g_prefix_error (error, "Couldn't read device path: ");
+        return FALSE;
+    }
+
+    if (!_mbim_message_read_guint32 (message, 8, &timeout, error)) {
+        g_prefix_error (error, "Couldn't read timeout: ");
+        return FALSE;
+    }
+
+    /* The offset of the device path data is right after the static fields */
+    if (!_mbim_message_read_guint32 (message, 0, &device_path_offset, error))
+        return FALSE;
+
+    if (device_path_offset >= CONFIGURATION_FIXED_SIZE_EXTENDED) {
+        if (!_mbim_message_read_guint32 (message, 12, &request_timeout, error)) {
+            g_prefix_error (error, "Couldn't read request timeout: ");
+            return FALSE;
+        }
+        if (!_mbim_message_read_guint32 (message, 16, &max_pending_requests, error)) {
+            g_prefix_error (error, "Couldn't read maximum number of pending requests: ");
+            return FALSE;
+        }
+    }
+
+    if (out_device_path)
+        *out_device_path = g_steal_pointer (&device_path);
+    if (out_timeout)
+        *out_timeout = timeout;
+    if (out_request_timeout)
+        *out_request_timeout = request_timeout;
+    if (out_max_pending_requests)
+        *out_max_pending_requests = max_pending_requests;
+    return TRUE;
+}
+
+/*****************************************************************************/
+
+MbimMessage *
+_mbim_proxy_helper_transport_set_new (MbimProxyTransport transport)
+{
+    MbimMessageCommandBuilder *builder;
+
+    builder = _mbim_message_command_builder_new (0,
+                                                 MBIM_SERVICE_PROXY_CONTROL,
+                                                 MBIM_CID_PROXY_CONTROL_TRANSPORT,
+                                                 MBIM_MESSAGE_COMMAND_TYPE_SET);
+    _mbim_message_command_builder_append_guint32 (builder, (guint32) transport);
+    return _mbim_message_command_builder_complete (builder);
+}
+
+gboolean
+_mbim_proxy_helper_transport_set_parse (MbimMessage         *message,
+                                        MbimProxyTransport  *out_transport,
+                                        GError             **error)
+{
+    guint32 transport = 0;
+
+    g_assert (message != NULL);
+
+    if (mbim_message_get_message_type (message) != MBIM_MESSAGE_TYPE_COMMAND) {
+        g_set_error (error,
+                     MBIM_CORE_ERROR,
+                     MBIM_CORE_ERROR_INVALID_MESSAGE,
+                     "Message is not a request");
+        return FALSE;
+    }
+
+    if (!_mbim_message_read_guint32 (message, 0, &transport, error)) {
+        g_prefix_error (error, "Couldn't read transport: ");
+        return FALSE;
+    }
+
+    if (out_transport)
+        *out_transport = (MbimProxyTransport) transport;
+    return TRUE;
+}
+
+/*****************************************************************************/
+
+/* The MemoryUsage response in the Proxy Control service carries the six
+ * guint64 counters of the device, followed by the count and offset of an
+ * array of fixed size client entries, each with nine guint64 values, in the
+ * same order as in the public structs. */
+#define MEMORY_USAGE_DEVICE_SIZE  (6 * sizeof (guint64))
+#define MEMORY_USAGE_FIXED_SIZE   (MEMORY_USAGE_DEVICE_SIZE + 2 * sizeof (guint32))
+#define MEMORY_USAGE_CLIENT_SIZE  (9 * sizeof (guint64))
+
+MbimMessage *
+_mbim_proxy_helper_memory_usage_query_new (void)
+{
+    MbimMessageCommandBuilder *builder;
+
+    builder = _mbim_message_command_builder_new (0,
+                                                 MBIM_SERVICE_PROXY_CONTROL,
+                                                 MBIM_CID_PROXY_CONTROL_MEMORY_USAGE,
+                                                 MBIM_MESSAGE_COMMAND_TYPE_QUERY);
+    return _mbim_message_command_builder_complete (builder);
+}
+
+static void
+memory_usage_append (GByteArray *buffer,
+                     guint64     value)
+{
+    value = GUINT64_TO_LE (value);
+    g_byte_array_append (buffer, (const guint8 *)&value, sizeof (value));
+}
+
+MbimMessage *
+_mbim_proxy_helper_memory_usage_response_new (MbimMessage                 *request,
+                                              const MbimDeviceMemoryUsage *device_memory_usage,
+                                              GArray                      *client_memory_usage)
+{
+    g_autoptr(GByteArray)        buffer = NULL;
+    GByteArray                  *response;
+    struct command_done_message *command_done;
+    guint32                      n_clients;
+    guint32                      value;
+    guint                        i;
+
+    g_assert (request != NULL);
+    g_assert (device_memory_usage != NULL);
+
+    n_clients = client_memory_usage ? client_memory_usage->len : 0;
+    buffer = g_byte_array_sized_new (MEMORY_USAGE_FIXED_SIZE + n_clients * MEMORY_USAGE_CLIENT_SIZE);
+
+    memory_usage_append (buffer, device_memory_usage->receive_buffer);
+    memory_usage_append (buffer, device_memory_usage->receive_buffer_peak);
+    memory_usage_append (buffer, device_memory_usage->pending_transactions);
+    memory_usage_append (buffer, device_memory_usage->pending_transactions_peak);
+    memory_usage_append (buffer, device_memory_usage->outbound);
+    memory_usage_append (buffer, device_memory_usage->outbound_peak);
+
+    value = GUINT32_TO_LE (n_clients);
+    g_byte_array_append (buffer, (const guint8 *)&value, sizeof (value));
+    value = GUINT32_TO_LE (n_clients ? MEMORY_USAGE_FIXED_SIZE : 0);
+    g_byte_array_append (buffer, (const guint8 *)&value, sizeof (value));
+
+    for (i = 0; i < n_clients; i++) {
+        const MbimProxyClientMemoryUsage *client;
+
+        client = &g_array_index (client_memory_usage, MbimProxyClientMemoryUsage, i);
+        memory_usage_append (buffer, client->client_id);
+        memory_usage_append (buffer, client->receive_buffer);
+        memory_usage_append (buffer, client->receive_buffer_peak);
+        memory_usage_append (buffer, client->pending_requests);
+        memory_usage_append (buffer, client->pending_requests_peak);
+        memory_usage_append (buffer, client->outbound);
+        memory_usage_append (buffer, client->outbound_peak);
+        memory_usage_append (buffer, client->subscriptions);
+        memory_usage_append (buffer, client->subscriptions_peak);
+    }
+
+    response = _mbim_message_allocate (MBIM_MESSAGE_TYPE_COMMAND_DONE,
+                                       mbim_message_get_transaction_id (request),
+                                       sizeof (struct command_done_message) + buffer->len);
+    command_done = &(((struct full_message *)(response->data))->message.command_done);
+    command_done->fragment_header.total = GUINT32_TO_LE (1);
+    command_done->fragment_header.current = 0;
+    memcpy (command_done->service_id, MBIM_UUID_PROXY_CONTROL, sizeof (MbimUuid));
+    command_done->command_id = GUINT32_TO_LE (MBIM_CID_PROXY_CONTROL_MEMORY_USAGE);
+    command_done->status_code = GUINT32_TO_LE (MBIM_STATUS_ERROR_NONE);
+    command_done->buffer_length = GUINT32_TO_LE (buffer->len);
+    memcpy (&command_done->buffer[0], buffer->data, buffer->len);
+
+    return (MbimMessage *)response;
+}
+
+gboolean
+_mbim_proxy_helper_memory_usage_response_parse (MbimMessage            *message,
+                                                MbimDeviceMemoryUsage  *out_device_memory_usage,
+                                                GArray                **out_client_memory_usage,
+                                                GError                **error)
+{
+    MbimDeviceMemoryUsage  device_memory_usage = { 0 };
+    g_autoptr(GArray)      client_memory_usage = NULL;
+    guint64               *device_values[] = {
+        &device_memory_usage.receive_buffer,
+        &device_memory_usage.receive_buffer_peak,
+        &device_memory_usage.pending_transactions,
+        &device_memory_usage.pending_transactions_peak,
+        &device_memory_usage.outbound,
+        &device_memory_usage.outbound_peak,
+    };
+    guint32                information_buffer_size = 0;
+    guint32                n_clients = 0;
+    guint32                clients_offset = 0;
+    guint                  i;
+
+    g_assert (message != NULL);
+
+    if (mbim_message_get_message_type (message) != MBIM_MESSAGE_TYPE_COMMAND_DONE) {
+        g_set_error (error,
+                     MBIM_CORE_ERROR,
+                     MBIM_CORE_ERROR_INVALID_MESSAGE,
+                     "Message is not a response");
+        return FALSE;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS (device_values); i++) {
+        if (!_mbim_message_read_guint64 (message, i * sizeof (guint64), device_values[i], error)) {
+            g_prefix_error (error, "Couldn't read device memory usage: ");
+            return FALSE;
+        }
+    }
+
+    if (!_mbim_message_read_guint32 (message, MEMORY_USAGE_DEVICE_SIZE, &n_clients, error) ||
+        !_mbim_message_read_guint32 (message, MEMORY_USAGE_DEVICE_SIZE + 4, &clients_offset, error)) {
+        g_prefix_error (error, "Couldn't read client memory usage array: ");
+        return FALSE;
+    }
+
+    /* Validate the array size before allocating anything for it */
+    mbim_message_command_done_get_raw_information_buffer (message, &information_buffer_size);
+    if (n_clients > 0 &&
+        ((guint64)clients_offset + (guint64)n_clients * MEMORY_USAGE_CLIENT_SIZE) > information_buffer_size) {
+        g_set_error (error,
+                     MBIM_CORE_ERROR,
+                     MBIM_CORE_ERROR_INVALID_MESSAGE,
+                     "Client memory usage array (%u entries at offset %u) exceeds the information buffer (%u bytes)",
+                     n_clients, clients_offset, information_buffer_size);
+        return FALSE;
+    }
+
+    client_memory_usage = g_array_sized_new (FALSE, FALSE, sizeof (MbimProxyClientMemoryUsage), n_clients);
+    for (i = 0; i < n_clients; i++) {
+        MbimProxyClientMemoryUsage  client = { 0 };
+        guint64                    *client_values[] = {
+            &client.client_id,
+            &client.receive_buffer,
+            &client.receive_buffer_peak,
+            &client.pending_requests,
+            &client.pending_requests_peak,
+            &client.outbound,
+            &client.outbound_peak,
+            &client.subscriptions,
+            &client.subscriptions_peak,
+        };
+        guint                       j;
+
+        for (j = 0; j < G_N_ELEMENTS (client_values); j++) {
+            if (!_mbim_message_read_guint64 (message,
+                                             clients_offset + i * MEMORY_USAGE_CLIENT_SIZE + j * sizeof (guint64),
+                                             client_values[j],
+                                             error)) {
+                g_prefix_error (error, "Couldn't read client memory usage: ");
+                return FALSE;
+            }
+        }
+        g_array_append_val (client_memory_usage, client);
+    }
+
+    if (out_device_memory_usage)
+        *out_device_memory_usage = device_memory_usage;
+    if (out_client_memory_usage)
+        *out_client_memory_usage = g_steal_pointer (&client_memory_usage);
+    return TRUE;
+}
@@ -19,6 +19,7 @@
 #include <glib.h>
 
 #include "mbim-basic-connect.h"
+#include "mbim-device.h"
 
 G_BEGIN_DECLS
 
@@ -41,6 +42,38 @@ MbimEventEntry **_mbim_proxy_helper_service_subscribe_list_dup          (MbimEve
                                                                          gsize           *out_size);
 MbimEventEntry **_mbim_proxy_helper_service_subscribe_list_new_standard (gsize           *out_size);
 
+MbimMessage      *_mbim_proxy_helper_configuration_set_new               (const gchar     *device_path,
+                                                                         guint32          timeout,
+                                                                         guint32          request_timeout,
+                                                                         guint32          max_pending_requests);
+gboolean          _mbim_proxy_helper_configuration_set_parse             (MbimMessage     *message,
+                                                                         gchar          **out_device_path,
+                                                                         guint32         *out_timeout,
+                                                                         guint32         *out_request_timeout,
+                                                                         guint32         *out_max_pending_requests,
+                                                                         GError         **error);
+
+/* Transports that may be requested with the Transport command in the Proxy
+ * Control service, right after connecting to the proxy */
+typedef enum {
+    MBIM_PROXY_TRANSPORT_SOCKET        = 0,
+    MBIM_PROXY_TRANSPORT_SHARED_MEMORY = 1,
+} MbimProxyTransport;
+
+MbimMessage      *_mbim_proxy_helper_transport_set_new                   (MbimProxyTransport  transport);
+gboolean          _mbim_proxy_helper_transport_set_parse                 (MbimMessage         *message,
+                                                                         MbimProxyTransport  *out_transport,
+                                                                         GError             **error);
+
+MbimMessage      *_mbim_proxy_helper_memory_usage_query_new              (void);
+MbimMessage      *_mbim_proxy_helper_memory_usage_response_new           (MbimMessage                  *request,
+                                                                         const MbimDeviceMemoryUsage  *device_memory_usage,
+                                                                         GArray                       *client_memory_usage);
+gboolean          _mbim_proxy_helper_memory_usage_response_parse         (MbimMessage                  *message,
+                                                                         MbimDeviceMemoryUsage        *out_device_memory_usage,
+                                                                         GArray                      **out_client_memory_usage,
+                                                                         GError                      **error);
+
 G_END_DECLS
 
 #endif /* _LIBMBIM_GLIB_MBIM_PROXY_HELPERS_H_ */
@@ -11,14 +11,20 @@
 #include <ctype.h>
 #include <sys/file.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include <glib.h>
 #include <glib/gstdio.h>
+#include <glib-unix.h>
 #include <gio/gunixsocketaddress.h>
+#include <gio/gunixfdmessage.h>
 
 #include "config.h"
 #include "mbim-device.h"
+#include "mbim-device-private.h"
 #include "mbim-utils.h"
 #include "mbim-helpers.h"
 #include "mbim-proxy.h"
@@ -29,6 +35,8 @@
 #include "mbim-basic-connect.h"
 #include "mbim-ms-basic-connect-extensions.h"
 #include "mbim-proxy-helpers.h"
+#include "mbim-shm-channel.h"
+#include "mbim-probes.h"
 
 /* The mbim-proxy may be used for bulk data transfer, such as modem
  * firmware upgrade, and the BUFFER_SIZE should be at least equal
@@ -37,10 +45,69 @@
  */
 #define BUFFER_SIZE 4096
 
+/* Upper limit of the read size, adapted to the largest message received from
+ * each client */
+#define MAX_READ_SIZE (16 * BUFFER_SIZE)
+
+/* Maximum number of reads performed on a client socket in a single main loop
+ * iteration, even if there is still data pending */
+#define MAX_READS_PER_WAKEUP 16
+
 /* The proxy control "Version" indication reporting the last agreed
  * MBIMEx version, if any */
 #define MBIM_DEVICE_PROXY_CONTROL_VERSION "mbim-device-proxy-control-version"
 
+/* The timeout needs to be big enough for any kind of transaction to complete,
+ * otherwise the remote clients will lose the reply if they configured a
+ * timeout bigger than this internal one. Clients may request a lower one
+ * during the proxy configuration. */
+#define DEFAULT_REQUEST_TIMEOUT_SECS 300
+
+/* Maximum number of requests from a single client that may be ongoing at the
+ * same time; any request beyond this limit is rejected right away with a BUSY
+ * status. Clients may request a different one during the proxy configuration,
+ * up to MAX_PENDING_REQUESTS_LIMIT. */
+#define DEFAULT_MAX_PENDING_REQUESTS 128
+#define MAX_PENDING_REQUESTS_LIMIT   1024
+
+/* Maximum number of queued messages written to a client socket in a single
+ * sendmsg() call */
+#define MAX_FLUSH_VECTORS 64
+
+/* Maximum amount of data queued to be written to a client when no client
+ * memory limit is configured; clients not reading their messages at all are
+ * disconnected once reached */
+#define DEFAULT_MAX_OUTBOUND_SIZE (4 * 1024 * 1024)
+
+/* Abstract socket where a running proxy accepts a new proxy process taking
+ * over its devices and clients */
+#define HANDOFF_SOCKET_PATH MBIM_PROXY_SOCKET_PATH "-handoff"
+
+/* Maximum time the running proxy waits for its ongoing requests to complete
+ * before handing off, checked periodically, and maximum time each of the
+ * socket operations involved in the handoff may take */
+#define HANDOFF_DRAIN_TIMEOUT_MS 5000
+#define HANDOFF_DRAIN_CHECK_MS   50
+#define HANDOFF_TIMEOUT_SECS     5
+
+/* Maximum number of fds passed in a single message (SCM_MAX_FD), and
+ * maximum size of the serialized state */
+#define HANDOFF_MAX_FDS        253
+#define HANDOFF_MAX_STATE_SIZE (16 * 1024 * 1024)
+
+/* Listening socket, handoff socket, devices and clients */
+#define HANDOFF_STATE_TYPE "(hha(shuqyyayaya(ayau))a(hsuuayaya(ayau)hhh))"
+#define HANDOFF_ACK        0x01
+
+/* Maximum time a device worker being stopped waits for the requests of its
+ * clients to complete, checked periodically */
+#define DEVICE_WORKER_DRAIN_TIMEOUT_MS 5000
+#define DEVICE_WORKER_DRAIN_CHECK_MS   50
+
+/* Maximum number of sources already ready dispatched by a device worker
+ * after its loop quits */
+#define DEVICE_WORKER_MAX_FINAL_DISPATCHES 64
+
 G_DEFINE_TYPE (MbimProxy, mbim_proxy, G_TYPE_OBJECT)
 
 enum {
@@ -52,43 +119,424 @@ enum {
 
 static GParamSpec *properties[PROP_LAST];
 
+enum {
+    SIGNAL_HANDED_OFF,
+    SIGNAL_LAST
+};
+
+static guint signals[SIGNAL_LAST] = { 0 };
+
 struct _MbimProxyPrivate {
     /* Unix socket service */
     GSocketService *socket_service;
 
+    /* Main context, where connections are accepted */
+    GMainContext *context;
+
+    /* Device workers, if device threads enabled */
+    gboolean device_threads;
+    GHashTable *workers;
+
+    /* Lock protecting the lists of clients and devices, which may be
+     * accessed from the device workers */
+    GRecMutex lock;
+
     /* Clients */
     GList *clients;
 
     /* Devices */
     GList *devices;
     GList *opening_devices;
+
+    /* Listening socket, kept to be able to hand it off */
+    GSocket *listen_socket;
+
+    /* Handoff to a new proxy process, if enabled */
+    GSocketService *handoff_service;
+    GSocket *handoff_socket;
+    GSocketConnection *handoff_connection;
+    GSource *handoff_source;
+    gint64 handoff_deadline;
+
+    /* Capture of the control traffic of all devices, if enabled */
+    MbimCapture *capture;
+
+    /* Maximum memory each client may use, or 0 if unlimited */
+    guint64 client_memory_limit;
 };
 
-static void        track_device         (MbimProxy *self, MbimDevice *device);
-static void        untrack_device       (MbimProxy *self, MbimDevice *device);
-static MbimDevice *peek_device_for_path (MbimProxy *self, const gchar *path);
+static void          track_device            (MbimProxy *self, MbimDevice *device);
+static void          untrack_device          (MbimProxy *self, MbimDevice *device);
+static MbimDevice   *peek_device_for_path    (MbimProxy *self, const gchar *path);
+static GCancellable *peek_device_cancellable (MbimDevice *device);
 
 /*****************************************************************************/
 
 guint
 mbim_proxy_get_n_clients (MbimProxy *self)
 {
+    guint n_clients;
+
     g_return_val_if_fail (MBIM_IS_PROXY (self), 0);
 
-    return g_list_length (self->priv->clients);
+    g_rec_mutex_lock (&self->priv->lock);
+    n_clients = g_list_length (self->priv->clients);
+    g_rec_mutex_unlock (&self->priv->lock);
+
+    return n_clients;
 }
 
 guint
 mbim_proxy_get_n_devices (MbimProxy *self)
 {
+    guint n_devices;
+
     g_return_val_if_fail (MBIM_IS_PROXY (self), 0);
 
-    return g_list_length (self->priv->devices);
+    g_rec_mutex_lock (&self->priv->lock);
+    n_devices = g_list_length (self->priv->devices);
+    g_rec_mutex_unlock (&self->priv->lock);
+
+    return n_devices;
+}
+
+void
+mbim_proxy_set_device_threads (MbimProxy *self,
+                               gboolean   enabled)
+{
+    g_return_if_fail (MBIM_IS_PROXY (self));
+    g_return_if_fail (self->priv->clients == NULL);
+
+    self->priv->device_threads = enabled;
+}
+
+gboolean
+mbim_proxy_start_capture (MbimProxy    *self,
+                          const gchar  *path,
+                          guint64       max_file_size,
+                          guint         max_files,
+                          GError      **error)
+{
+    g_autoptr(MbimCapture)  capture = NULL;
+    MbimCapture            *previous;
+    GList                  *l;
+
+    g_return_val_if_fail (MBIM_IS_PROXY (self), FALSE);
+    g_return_val_if_fail (path != NULL, FALSE);
+
+    capture = _mbim_capture_new (path, max_file_size, max_files, error);
+    if (!capture)
+        return FALSE;
+
+    g_debug ("capturing control traffic of all devices into '%s'", path);
+
+    /* Devices tracked afterwards are added to the capture as well */
+    g_rec_mutex_lock (&self->priv->lock);
+    previous = self->priv->capture;
+    self->priv->capture = g_steal_pointer (&capture);
+    for (l = self->priv->devices; l; l = g_list_next (l))
+        _mbim_device_set_capture (MBIM_DEVICE (l->data), self->priv->capture);
+    g_rec_mutex_unlock (&self->priv->lock);
+
+    if (previous)
+        _mbim_capture_unref (previous);
+    return TRUE;
+}
+
+void
+mbim_proxy_stop_capture (MbimProxy *self)
+{
+    MbimCapture *previous;
+    GList       *l;
+
+    g_return_if_fail (MBIM_IS_PROXY (self));
+
+    g_rec_mutex_lock (&self->priv->lock);
+    previous = g_steal_pointer (&self->priv->capture);
+    for (l = self->priv->devices; l; l = g_list_next (l))
+        _mbim_device_set_capture (MBIM_DEVICE (l->data), NULL);
+    g_rec_mutex_unlock (&self->priv->lock);
+
+    if (previous)
+        _mbim_capture_unref (previous);
+}
+
+/*****************************************************************************/
+/* Property notifications
+ *
+ * The number of clients and devices may change in the device workers, but the
+ * notifications are always emitted in the main context.
+ */
+
+static gboolean
+notify_n_clients_cb (MbimProxy *self)
+{
+    g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_N_CLIENTS]);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+notify_n_devices_cb (MbimProxy *self)
+{
+    g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_N_DEVICES]);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+proxy_notify (MbimProxy *self,
+              guint      prop_id)
+{
+    GSourceFunc func;
+
+    func = (prop_id == PROP_N_CLIENTS) ? (GSourceFunc)notify_n_clients_cb : (GSourceFunc)notify_n_devices_cb;
+
+    if (!self->priv->device_threads || g_main_context_is_owner (self->priv->context)) {
+        func (self);
+        return;
+    }
+
+    g_main_context_invoke_full (self->priv->context,
+                                G_PRIORITY_DEFAULT,
+                                func,
+                                g_object_ref (self),
+                                g_object_unref);
+}
+
+/*****************************************************************************/
+/* Device workers
+ *
+ * When device threads are enabled, each device and all the clients using it
+ * are handled in a separate thread, running its own main context. The main
+ * context keeps on accepting new connections and reading the proxy config
+ * requests from new clients, which are then routed to the worker handling
+ * the requested device.
+ */
+
+typedef struct {
+    volatile gint  ref_count;
+    gchar         *path;
+    GMainContext  *context;
+    GMainLoop     *loop;
+    GThread       *thread;
+
+    /* Requests of the clients handled in the worker not yet completed */
+    volatile gint  n_requests;
+    gint64         drain_deadline;
+
+    /* Context where the thread is joined once the worker is retired */
+    GMainContext  *reap_context;
+} DeviceWorker;
+
+static DeviceWorker *
+device_worker_ref (DeviceWorker *worker)
+{
+    g_atomic_int_inc (&worker->ref_count);
+    return worker;
+}
+
+static void
+device_worker_unref (DeviceWorker *worker)
+{
+    if (g_atomic_int_dec_and_test (&worker->ref_count)) {
+        g_assert (!worker->thread);
+        g_main_loop_unref (worker->loop);
+        g_main_context_unref (worker->context);
+        if (worker->reap_context)
+            g_main_context_unref (worker->reap_context);
+        g_free (worker->path);
+        g_slice_free (DeviceWorker, worker);
+    }
+}
+
+static gboolean
+device_worker_reap_cb (DeviceWorker *worker)
+{
+    g_thread_join (worker->thread);
+    worker->thread = NULL;
+    g_debug ("[%s] device worker stopped", worker->path);
+    return G_SOURCE_REMOVE;
+}
+
+static gpointer
+device_worker_thread (DeviceWorker *worker)
+{
+    guint n_dispatches = 0;
+
+    g_main_context_push_thread_default (worker->context);
+    g_main_loop_run (worker->loop);
+
+    /* Dispatch whatever was already scheduled when the loop quit (e.g. the
+     * flush of the last responses), so that it isn't left attached to a
+     * context no one iterates */
+    while (n_dispatches++ < DEVICE_WORKER_MAX_FINAL_DISPATCHES &&
+           g_main_context_iteration (worker->context, FALSE))
+        ;
+    g_main_context_pop_thread_default (worker->context);
+
+    /* If retired, the reference is released once joined */
+    if (worker->reap_context)
+        g_main_context_invoke_full (worker->reap_context,
+                                    G_PRIORITY_DEFAULT,
+                                    (GSourceFunc)device_worker_reap_cb,
+                                    worker,
+                                    (GDestroyNotify)device_worker_unref);
+    return NULL;
+}
+
+static gboolean
+device_worker_drain_cb (DeviceWorker *worker)
+{
+    gint n_requests;
+
+    /* Let the requests of the clients complete, so that their callbacks are
+     * dispatched in this context before it is dropped */
+    n_requests = g_atomic_int_get (&worker->n_requests);
+    if (n_requests > 0 && g_get_monotonic_time () < worker->drain_deadline)
+        return G_SOURCE_CONTINUE;
+
+    if (n_requests > 0)
+        g_debug ("[%s] device worker stopping with %d requests still pending", worker->path, n_requests);
+    g_main_loop_quit (worker->loop);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+device_worker_quit_cb (DeviceWorker *worker)
+{
+    GSource *source;
+
+    worker->drain_deadline = g_get_monotonic_time () + (DEVICE_WORKER_DRAIN_TIMEOUT_MS * 1000);
+    if (device_worker_drain_cb (worker) == G_SOURCE_REMOVE)
+        return G_SOURCE_REMOVE;
+
+    source = g_timeout_source_new (DEVICE_WORKER_DRAIN_CHECK_MS);
+    g_source_set_callback (source, (GSourceFunc)device_worker_drain_cb, worker, NULL);
+    g_source_attach (source, worker->context);
+    g_source_unref (source);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+device_worker_stop (DeviceWorker *worker)
+{
+    if (!worker->thread || worker->thread == g_thread_self ())
+        return;
+
+    /* Quit the loop from within its own context, as it may not be running
+     * yet */
+    g_main_context_invoke (worker->context, (GSourceFunc)device_worker_quit_cb, worker);
+    g_thread_join (worker->thread);
+    worker->thread = NULL;
+    g_debug ("[%s] device worker stopped", worker->path);
+}
+
+static void
+device_worker_stop_foreach (const gchar  *path,
+                            DeviceWorker *worker)
+{
+    device_worker_stop (worker);
+}
+
+static void
+device_worker_free (DeviceWorker *worker)
+{
+    device_worker_stop (worker);
+    device_worker_unref (worker);
+}
+
+/* Stops the worker without blocking the calling context while the requests
+ * are drained; the thread is joined in that same context once done. Must be
+ * called from the main context, where workers are looked up. */
+static void
+device_worker_stop_async (MbimProxy    *self,
+                          DeviceWorker *worker)
+{
+    /* No longer found by new clients; the reference of the table is now
+     * owned by the thread */
+    g_hash_table_steal (self->priv->workers, worker->path);
+
+    worker->reap_context = g_main_context_ref (self->priv->context);
+    g_main_context_invoke (worker->context, (GSourceFunc)device_worker_quit_cb, worker);
+}
+
+static DeviceWorker *
+device_worker_get (MbimProxy   *self,
+                   const gchar *path)
+{
+    DeviceWorker *worker;
+
+    /* Workers are only created and looked up from the main context */
+    worker = g_hash_table_lookup (self->priv->workers, path);
+    if (worker)
+        return worker;
+
+    worker = g_slice_new0 (DeviceWorker);
+    worker->ref_count = 1;
+    worker->path = g_strdup (path);
+    worker->context = g_main_context_new ();
+    worker->loop = g_main_loop_new (worker->context, FALSE);
+    worker->thread = g_thread_new ("mbim-device", (GThreadFunc)device_worker_thread, worker);
+    g_hash_table_insert (self->priv->workers, worker->path, worker);
+    g_debug ("[%s] device worker started", worker->path);
+    return worker;
+}
+
+/* Runs the given function in the context owning the worker and waits for it,
+ * so that the state handled in the worker is never accessed from other
+ * threads */
+typedef struct {
+    GSourceFunc func;
+    gpointer    user_data;
+    GMutex      mutex;
+    GCond       cond;
+    gboolean    done;
+} DeviceWorkerInvokeContext;
+
+static gboolean
+device_worker_invoke_sync_cb (DeviceWorkerInvokeContext *ctx)
+{
+    ctx->func (ctx->user_data);
+
+    g_mutex_lock (&ctx->mutex);
+    ctx->done = TRUE;
+    g_cond_signal (&ctx->cond);
+    g_mutex_unlock (&ctx->mutex);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+device_worker_invoke_sync (DeviceWorker *worker,
+                           GSourceFunc   func,
+                           gpointer      user_data)
+{
+    DeviceWorkerInvokeContext ctx = { 0 };
+
+    /* If the worker isn't running, nothing else accesses its state */
+    if (!worker || !worker->thread || g_main_context_is_owner (worker->context)) {
+        func (user_data);
+        return;
+    }
+
+    ctx.func = func;
+    ctx.user_data = user_data;
+    g_mutex_init (&ctx.mutex);
+    g_cond_init (&ctx.cond);
+
+    g_mutex_lock (&ctx.mutex);
+    g_main_context_invoke (worker->context, (GSourceFunc)device_worker_invoke_sync_cb, &ctx);
+    while (!ctx.done)
+        g_cond_wait (&ctx.cond, &ctx.mutex);
+    g_mutex_unlock (&ctx.mutex);
+
+    g_mutex_clear (&ctx.mutex);
+    g_cond_clear (&ctx.cond);
 }
 
 /*****************************************************************************/
 /* Client info */
 
+typedef struct _Request Request;
+
 typedef struct {
     volatile gint ref_count;
     gulong        id;
@@ -97,32 +545,171 @@ typedef struct {
     GSocketConnection *connection;
     GSource *connection_readable_source;
     GByteArray *buffer;
+    gsize read_size;
+
+    /* Outbound messages pending to be written to the socket. The same message
+     * may be queued in multiple clients at the same time (e.g. indications),
+     * as they're never modified once built. */
+    GQueue *outbound;
+    gsize outbound_offset;
+    GSource *outbound_source;
+    gboolean outbound_overflow;
+
+    /* Shared memory channel, if negotiated by the client. The socket is kept
+     * open to detect when the client goes away. */
+    MbimShmChannel *shm;
+    GSource *shm_source;
 
     /* Only one proxy config allowed at a time */
     gboolean config_ongoing;
 
+    /* Limits requested by the client during the proxy config */
+    guint request_timeout_secs;
+    guint max_pending_requests;
+    guint n_pending_requests;
+
+    /* Transaction of the last multi-fragment request rejected on its first
+     * fragment, whose remaining fragments must be dropped */
+    guint32 rejected_transaction_id;
+
+    /* Memory used on behalf of the client */
+    MbimProxyClientMemoryUsage memory;
+
+    /* Indications dropped since the last one successfully queued */
+    guint indications_dropped;
+
     MbimDevice *device;
-    guint indication_id;
     MbimEventEntry **mbim_event_entry_array;
     gsize mbim_event_entry_array_size;
+
+    /* Device worker handling the client, if any, and the proxy config request
+     * pending to be routed to it */
+    DeviceWorker *worker;
+    Request *handoff_request;
 } Client;
 
 static gboolean connection_readable_cb (GSocket *socket, GIOCondition condition, Client *client);
+static gboolean shm_readable_cb        (gint fd, GIOCondition condition, Client *client);
 static void     track_client           (MbimProxy *self, Client *client);
 static void     untrack_client         (MbimProxy *self, Client *client);
+static void     client_schedule_flush  (Client *client, gboolean wait_writable);
+
+/*****************************************************************************/
+/* Client memory usage */
 
 static void
-client_disconnect (Client *client)
+memory_usage_update (guint64 *current,
+                     guint64 *peak,
+                     guint64  value)
 {
-    g_clear_pointer (&client->mbim_event_entry_array, mbim_event_entry_array_free);
-    client->mbim_event_entry_array_size = 0;
+    *current = value;
+    if (value > *peak)
+        *peak = value;
+}
+
+static guint64
+client_memory_usage_total (Client *client)
+{
+    return (client->memory.receive_buffer +
+            client->memory.pending_requests +
+            client->memory.outbound +
+            client->memory.subscriptions);
+}
+
+static void
+client_update_subscriptions_memory_usage (Client *client)
+{
+    guint64 size = 0;
+    gsize   i;
+
+    if (client->mbim_event_entry_array) {
+        size = (client->mbim_event_entry_array_size + 1) * sizeof (gpointer);
+        for (i = 0; i < client->mbim_event_entry_array_size; i++)
+            size += sizeof (MbimEventEntry) + client->mbim_event_entry_array[i]->cids_count * sizeof (guint32);
+    }
+
+    memory_usage_update (&client->memory.subscriptions, &client->memory.subscriptions_peak, size);
+}
+
+static void
+client_attach_shm (Client *client)
+{
+    client->shm_source = g_unix_fd_source_new (_mbim_shm_channel_get_fd (client->shm), G_IO_IN);
+    g_source_set_callback (client->shm_source,
+                           (GSourceFunc)shm_readable_cb,
+                           client,
+                           NULL);
+    g_source_attach (client->shm_source, g_main_context_get_thread_default ());
+}
+
+static void
+client_attach_connection (Client *client)
+{
+    /* Sources are always attached to the context the client is handled in */
+    client->connection_readable_source = g_socket_create_source (g_socket_connection_get_socket (client->connection),
+                                                                 G_IO_IN | G_IO_PRI | G_IO_ERR | G_IO_HUP,
+                                                                 NULL);
+    g_source_set_callback (client->connection_readable_source,
+                           (GSourceFunc)connection_readable_cb,
+                           client,
+                           NULL);
+    g_source_attach (client->connection_readable_source, g_main_context_get_thread_default ());
+}
+
+static void
+client_attach (Client *client)
+{
+    client_attach_connection (client);
+
+    if (client->shm)
+        client_attach_shm (client);
+
+    if (client->outbound && !g_queue_is_empty (client->outbound))
+        client_schedule_flush (client, FALSE);
+}
 
+static void
+client_detach (Client *client)
+{
     if (client->connection_readable_source) {
         g_source_destroy (client->connection_readable_source);
         g_source_unref (client->connection_readable_source);
         client->connection_readable_source = 0;
     }
 
+    if (client->outbound_source) {
+        g_source_destroy (client->outbound_source);
+        g_source_unref (client->outbound_source);
+        client->outbound_source = NULL;
+    }
+
+    if (client->shm_source) {
+        g_source_destroy (client->shm_source);
+        g_source_unref (client->shm_source);
+        client->shm_source = NULL;
+    }
+}
+
+static void
+client_disconnect (Client *client)
+{
+    g_clear_pointer (&client->mbim_event_entry_array, mbim_event_entry_array_free);
+    client->mbim_event_entry_array_size = 0;
+    client->memory.subscriptions = 0;
+
+    client_detach (client);
+    g_clear_pointer (&client->shm, _mbim_shm_channel_free);
+
+    if (client->outbound) {
+        if (!g_queue_is_empty (client->outbound))
+            g_debug ("[client %lu] discarding %u pending outbound messages",
+                     client->id, g_queue_get_length (client->outbound));
+        g_queue_free_full (client->outbound, (GDestroyNotify) mbim_message_unref);
+        client->outbound = NULL;
+        client->outbound_offset = 0;
+        client->memory.outbound = 0;
+    }
+
     if (client->connection) {
         g_debug ("[client %lu] connection closed", client->id);
         g_output_stream_close (g_io_stream_get_output_stream (G_IO_STREAM (client->connection)), NULL, NULL);
@@ -131,30 +718,15 @@ client_disconnect (Client *client)
     }
 }
 
-static void client_indication_cb (MbimDevice *device,
-                                  MbimMessage *message,
-                                  Client *client);
-
 static void
 client_set_device (Client *client,
                    MbimDevice *device)
 {
-    if (client->device) {
-        if (g_signal_handler_is_connected (client->device, client->indication_id))
-            g_signal_handler_disconnect (client->device, client->indication_id);
+    g_rec_mutex_lock (&client->self->priv->lock);
+    if (client->device)
         g_object_unref (client->device);
-    }
-
-    if (device) {
-        client->device = g_object_ref (device);
-        client->indication_id = g_signal_connect (client->device,
-                                                  MBIM_DEVICE_SIGNAL_INDICATE_STATUS,
-                                                  G_CALLBACK (client_indication_cb),
-                                                  client);
-    } else {
-        client->device = NULL;
-        client->indication_id = 0;
-    }
+    client->device = device ? g_object_ref (device) : NULL;
+    g_rec_mutex_unlock (&client->self->priv->lock);
 }
 
 static void
@@ -183,81 +755,301 @@ client_ref (Client *client)
     return client;
 }
 
+/*****************************************************************************/
+/* Client outbound queue
+ *
+ * Messages sent to the clients are not written right away; they're queued and
+ * flushed from the main loop, so that all messages generated in the same loop
+ * iteration (e.g. a burst of indications parsed from a single device read) are
+ * written with a single sendmsg() call. If the socket isn't writable, the flush
+ * is retried once it is, instead of blocking the whole proxy on a slow client.
+ */
+
 static gboolean
-client_send_message (Client       *client,
-                     MbimMessage  *message,
-                     GError      **error)
+client_flush_shm (Client  *client,
+                  GError **error)
 {
-    if (!client->connection) {
-        g_set_error (error,
-                     MBIM_CORE_ERROR,
-                     MBIM_CORE_ERROR_WRONG_STATE,
-                     "Cannot send message: not connected");
-        return FALSE;
-    }
+    gboolean notify = FALSE;
 
-    if (!g_output_stream_write_all (g_io_stream_get_output_stream (G_IO_STREAM (client->connection)),
-                                    message->data,
-                                    message->len,
-                                    NULL, /* bytes_written */
-                                    NULL, /* cancellable */
-                                    error)) {
-        g_prefix_error (error, "Cannot send message to client: ");
-        return FALSE;
+    while (!g_queue_is_empty (client->outbound)) {
+        MbimMessage *message;
+        gsize        written;
+
+        message = (MbimMessage *) g_queue_peek_head (client->outbound);
+        if (!_mbim_shm_channel_write (client->shm,
+                                      &message->data[client->outbound_offset],
+                                      message->len - client->outbound_offset,
+                                      &written,
+                                      error))
+            return FALSE;
+        if (written > 0)
+            notify = TRUE;
+
+        /* If the ring is full, the client will ring our doorbell once it
+         * releases space */
+        client->outbound_offset += written;
+        if (client->outbound_offset < message->len)
+            break;
+
+        client->outbound_offset = 0;
+        client->memory.outbound -= message->len;
+        mbim_message_unref ((MbimMessage *) g_queue_pop_head (client->outbound));
     }
 
+    /* Single wakeup for all the messages written */
+    if (notify)
+        _mbim_shm_channel_notify (client->shm);
     return TRUE;
 }
 
-/*****************************************************************************/
-/* Track/untrack clients */
-
-static void
-track_client (MbimProxy *self,
-              Client *client)
+static gboolean
+client_flush (Client  *client,
+              GError **error)
 {
-    self->priv->clients = g_list_append (self->priv->clients, client_ref (client));
-    g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_N_CLIENTS]);
-}
+    GSocket *socket;
+    gint     fd;
 
-static void
-untrack_client (MbimProxy *self,
-                Client *client)
-{
-    /* Disconnect the client explicitly when untracking */
-    client_disconnect (client);
+    g_assert (client->connection);
 
-    if (g_list_find (self->priv->clients, client)) {
-        self->priv->clients = g_list_remove (self->priv->clients, client);
-        client_unref (client);
-        g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_N_CLIENTS]);
+    if (client->shm)
+        return client_flush_shm (client, error);
+
+    socket = g_socket_connection_get_socket (client->connection);
+    fd = g_socket_get_fd (socket);
+
+    while (!g_queue_is_empty (client->outbound)) {
+        struct iovec   iov[MAX_FLUSH_VECTORS];
+        struct msghdr  msg;
+        GList         *l;
+        guint          n_iov = 0;
+        gssize         sent;
+
+        for (l = client->outbound->head; l && n_iov < MAX_FLUSH_VECTORS; l = g_list_next (l)) {
+            MbimMessage *message;
+            gsize        offset;
+
+            message = (MbimMessage *)l->data;
+            offset = (n_iov == 0) ? client->outbound_offset : 0;
+            iov[n_iov].iov_base = message->data + offset;
+            iov[n_iov].iov_len = message->len - offset;
+            n_iov++;
+        }
+
+        memset (&msg, 0, sizeof (msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n_iov;
+
+        sent = sendmsg (fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                client_schedule_flush (client, TRUE);
+                return TRUE;
+            }
+            g_set_error (error,
+                         G_IO_ERROR,
+                         g_io_error_from_errno (errno),
+                         "Cannot send message to client: %s",
+                         g_strerror (errno));
+            return FALSE;
+        }
+
+        /* Release all messages fully written, and keep track of the offset in
+         * the partially written one, if any */
+        while (sent > 0) {
+            MbimMessage *message;
+            gsize        pending;
+
+            message = (MbimMessage *) g_queue_peek_head (client->outbound);
+            pending = message->len - client->outbound_offset;
+            if ((gsize)sent < pending) {
+                client->outbound_offset += sent;
+                break;
+            }
+            sent -= pending;
+            client->outbound_offset = 0;
+            client->memory.outbound -= message->len;
+            mbim_message_unref ((MbimMessage *) g_queue_pop_head (client->outbound));
+        }
     }
-}
 
-/*****************************************************************************/
-/* Client indications */
+    return TRUE;
+}
 
 static void
-forward_indication (Client      *client,
-                    MbimMessage *message)
+client_outbound_dispatch (Client *client)
 {
     g_autoptr(GError) error = NULL;
 
-    if (!client_send_message (client, message, &error))
-        g_warning ("[client %lu] couldn't forward indication: %s", client->id, error->message);
-}
+    /* The source is removed after this dispatch; a new one will be scheduled
+     * by the flush if needed */
+    g_clear_pointer (&client->outbound_source, g_source_unref);
 
-static void
-client_indication_cb (MbimDevice *device,
-                      MbimMessage *message,
-                      Client *client)
-{
-    MbimEventEntry *entry;
+    if (!client->connection)
+        return;
+
+    if (client->outbound_overflow) {
+        g_warning ("[client %lu] client not reading its messages: %" G_GUINT64_FORMAT " bytes pending",
+                   client->id, client->memory.outbound);
+        untrack_client (client->self, client);
+        return;
+    }
+
+    /* If sending fails, always assume we have to close the connection */
+    if (!client_flush (client, &error)) {
+        g_warning ("[client %lu] couldn't send messages: %s", client->id, error->message);
+        untrack_client (client->self, client);
+    }
+}
+
+static gboolean
+client_outbound_idle_cb (Client *client)
+{
+    client_outbound_dispatch (client);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+client_outbound_writable_cb (GSocket      *socket,
+                             GIOCondition  condition,
+                             Client       *client)
+{
+    client_outbound_dispatch (client);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+client_schedule_flush (Client   *client,
+                       gboolean  wait_writable)
+{
+    if (client->outbound_source)
+        return;
+
+    if (wait_writable) {
+        client->outbound_source = g_socket_create_source (g_socket_connection_get_socket (client->connection),
+                                                          G_IO_OUT,
+                                                          NULL);
+        g_source_set_callback (client->outbound_source,
+                               (GSourceFunc)client_outbound_writable_cb,
+                               client_ref (client),
+                               (GDestroyNotify)client_unref);
+    } else {
+        client->outbound_source = g_idle_source_new ();
+        g_source_set_priority (client->outbound_source, G_PRIORITY_DEFAULT);
+        g_source_set_callback (client->outbound_source,
+                               (GSourceFunc)client_outbound_idle_cb,
+                               client_ref (client),
+                               (GDestroyNotify)client_unref);
+    }
+    g_source_attach (client->outbound_source, g_main_context_get_thread_default ());
+}
+
+/* The client is untracked from its own context, not from within the callers
+ * of client_send_message(), which may be iterating the list of clients */
+static void
+client_schedule_overflow (Client *client)
+{
+    if (client->outbound_overflow)
+        return;
+
+    client->outbound_overflow = TRUE;
+    if (client->outbound_source) {
+        g_source_destroy (client->outbound_source);
+        g_clear_pointer (&client->outbound_source, g_source_unref);
+    }
+    client_schedule_flush (client, FALSE);
+}
+
+static gboolean
+client_send_message (Client       *client,
+                     MbimMessage  *message,
+                     GError      **error)
+{
+    if (!client->connection) {
+        g_set_error (error,
+                     MBIM_CORE_ERROR,
+                     MBIM_CORE_ERROR_WRONG_STATE,
+                     "Cannot send message: not connected");
+        return FALSE;
+    }
+
+    /* Don't let a client not reading its messages make the queue grow
+     * without bound */
+    if (client->self->priv->client_memory_limit > 0 &&
+        client->memory.outbound + message->len > client->self->priv->client_memory_limit) {
+        g_set_error (error,
+                     MBIM_CORE_ERROR,
+                     MBIM_CORE_ERROR_FAILED,
+                     "Cannot send message: client memory limit reached (%" G_GUINT64_FORMAT " bytes pending)",
+                     client->memory.outbound);
+        return FALSE;
+    }
+
+    /* Not even when no limit is configured */
+    if (client->self->priv->client_memory_limit == 0 &&
+        client->memory.outbound + message->len > DEFAULT_MAX_OUTBOUND_SIZE) {
+        g_set_error (error,
+                     MBIM_CORE_ERROR,
+                     MBIM_CORE_ERROR_FAILED,
+                     "Cannot send message: too many messages pending (%" G_GUINT64_FORMAT " bytes)",
+                     client->memory.outbound);
+        client_schedule_overflow (client);
+        return FALSE;
+    }
+
+    /* Messages are never modified once built, so just keep a reference */
+    g_queue_push_tail (client->outbound, mbim_message_ref (message));
+    memory_usage_update (&client->memory.outbound, &client->memory.outbound_peak,
+                         client->memory.outbound + message->len);
+    client_schedule_flush (client, FALSE);
+    return TRUE;
+}
+
+/*****************************************************************************/
+/* Track/untrack clients */
+
+static void
+track_client (MbimProxy *self,
+              Client *client)
+{
+    g_rec_mutex_lock (&self->priv->lock);
+    self->priv->clients = g_list_append (self->priv->clients, client_ref (client));
+    g_rec_mutex_unlock (&self->priv->lock);
+    proxy_notify (self, PROP_N_CLIENTS);
+}
+
+static void
+untrack_client (MbimProxy *self,
+                Client *client)
+{
+    /* Disconnect the client explicitly when untracking */
+    client_disconnect (client);
+
+    g_rec_mutex_lock (&self->priv->lock);
+    if (g_list_find (self->priv->clients, client)) {
+        self->priv->clients = g_list_remove (self->priv->clients, client);
+        g_rec_mutex_unlock (&self->priv->lock);
+        client_unref (client);
+        proxy_notify (self, PROP_N_CLIENTS);
+        return;
+    }
+    g_rec_mutex_unlock (&self->priv->lock);
+}
+
+/*****************************************************************************/
+/* Client indications */
+
+static gboolean
+client_subscribed_to_indication (Client      *client,
+                                 MbimMessage *message)
+{
+    MbimEventEntry *entry;
     guint           i;
 
     /* if client doesn't have a subscribe list, we're done. */
     if (!client->mbim_event_entry_array)
-        return;
+        return FALSE;
 
     /* Look for the event list associated to the service */
     entry = NULL;
@@ -271,41 +1063,93 @@ client_indication_cb (MbimDevice *device,
 
     /* if client didn't subscribe to anything in this service, we're done */
     if (!entry)
-        return;
+        return FALSE;
 
     /* if client subscribed using the wildcard, no need to match specific cid */
-    if (entry->cids_count == 0) {
-        forward_indication (client, message);
-        return;
-    }
+    if (entry->cids_count == 0)
+        return TRUE;
 
     /* Look for the specific cid in the event list */
     for (i = 0; i < entry->cids_count; i++) {
-        if (mbim_message_indicate_status_get_cid (message) == entry->cids[i]) {
-            /* exact match in the subscription */
-            forward_indication (client, message);
-            return;
-        }
+        if (mbim_message_indicate_status_get_cid (message) == entry->cids[i])
+            return TRUE;
     }
+
+    return FALSE;
+}
+
+static gboolean
+client_send_indication (Client      *client,
+                        MbimMessage *indication)
+{
+    g_autoptr(GError) error = NULL;
+
+    /* A stuck client fails every indication, so only the first failure is
+     * reported, and the amount dropped once it recovers */
+    if (!client_send_message (client, indication, &error)) {
+        if (client->indications_dropped++ == 0)
+            g_warning ("[client %lu] couldn't forward indication: %s (further failures won't be reported)",
+                       client->id, error->message);
+        return FALSE;
+    }
+
+    if (client->indications_dropped > 0) {
+        g_message ("[client %lu] forwarding indications again: %u dropped",
+                   client->id, client->indications_dropped);
+        client->indications_dropped = 0;
+    }
+    return TRUE;
+}
+
+static void
+proxy_device_indication_cb (MbimDevice  *device,
+                            MbimMessage *message,
+                            MbimProxy   *self)
+{
+    GList *l;
+
+    /* The indication is received once from the device and the very same
+     * message is queued in all the clients subscribed to it */
+    g_rec_mutex_lock (&self->priv->lock);
+    for (l = self->priv->clients; l; l = g_list_next (l)) {
+        Client *client;
+
+        client = l->data;
+        if (client->device != device || !client_subscribed_to_indication (client, message))
+            continue;
+
+        client_send_indication (client, message);
+    }
+    g_rec_mutex_unlock (&self->priv->lock);
 }
 
 /*****************************************************************************/
 /* Request info */
 
-typedef struct {
+struct _Request {
     MbimProxy *self;
     Client *client;
     MbimMessage *message;
     MbimMessage *response;
     guint32 original_transaction_id;
+    /* Memory accounted to the client while the request is pending */
+    gsize memory_size;
     /* Only used in proxy config */
     guint32 timeout_secs;
-} Request;
+    gchar *path;
+    /* Device worker where the request is completed, if any */
+    DeviceWorker *worker;
+};
 
 static void
 request_complete_and_free (Request *request)
 {
-    if (request->response) {
+    if (request->response && !request->client->connection) {
+        /* e.g. clients removed along with their device */
+        g_debug ("[client %lu,0x%08x] client gone, response discarded",
+                 request->client->id, request->original_transaction_id);
+        mbim_message_unref (request->response);
+    } else if (request->response) {
         g_autoptr(GError) error = NULL;
 
         /* Try to send response to client; if it fails, always assume we have
@@ -322,6 +1166,14 @@ request_complete_and_free (Request *request)
 
     if (request->message)
         mbim_message_unref (request->message);
+    g_free (request->path);
+    g_assert (request->client->n_pending_requests > 0);
+    request->client->n_pending_requests--;
+    request->client->memory.pending_requests -= request->memory_size;
+    if (request->worker) {
+        g_atomic_int_add (&request->worker->n_requests, -1);
+        device_worker_unref (request->worker);
+    }
     client_unref (request->client);
     g_object_unref (request->self);
     g_slice_free (Request, request);
@@ -339,6 +1191,14 @@ request_new (MbimProxy   *self,
     request->client = client_ref (client);
     request->message = mbim_message_ref (message);
     request->original_transaction_id = mbim_message_get_transaction_id (message);
+    request->memory_size = sizeof (Request) + mbim_message_get_message_length (message);
+    if (client->worker) {
+        request->worker = device_worker_ref (client->worker);
+        g_atomic_int_inc (&request->worker->n_requests);
+    }
+    client->n_pending_requests++;
+    memory_usage_update (&client->memory.pending_requests, &client->memory.pending_requests_peak,
+                         client->memory.pending_requests + request->memory_size);
 
     return request;
 }
@@ -403,18 +1263,23 @@ static OpeningDevice *
 peek_opening_device_info (MbimProxy  *self,
                           MbimDevice *device)
 {
-    GList *l;
+    OpeningDevice *found = NULL;
+    GList         *l;
 
     /* If already being opened, queue it up */
+    g_rec_mutex_lock (&self->priv->lock);
     for (l = self->priv->opening_devices; l; l = g_list_next (l)) {
         OpeningDevice *info;
 
         info = (OpeningDevice *)(l->data);
-        if (device == info->device)
-            return info;
+        if (device == info->device) {
+            found = info;
+            break;
+        }
     }
+    g_rec_mutex_unlock (&self->priv->lock);
 
-    return NULL;
+    return found;
 }
 
 static void
@@ -428,7 +1293,9 @@ complete_opening_device (MbimProxy    *self,
     if (!info)
         return;
 
+    g_rec_mutex_lock (&self->priv->lock);
     self->priv->opening_devices = g_list_remove (self->priv->opening_devices, info);
+    g_rec_mutex_unlock (&self->priv->lock);
     opening_device_complete_and_free (info, error);
 }
 
@@ -488,7 +1355,9 @@ internal_open (GTask *task)
     info = g_slice_new0 (OpeningDevice);
     info->device = g_object_ref (ctx->device);
     info->pending = g_list_append (info->pending, task);
+    g_rec_mutex_lock (&self->priv->lock);
     self->priv->opening_devices = g_list_prepend (self->priv->opening_devices, info);
+    g_rec_mutex_unlock (&self->priv->lock);
 
     /* Note: for now, only the first timeout request is taken into account */
 
@@ -635,12 +1504,256 @@ process_internal_proxy_close (MbimProxy   *self,
     return TRUE;
 }
 
+/*****************************************************************************/
+/* Proxy transport */
+
+static gboolean
+client_send_message_with_shm_channel (Client          *client,
+                                      MbimMessage     *message,
+                                      MbimShmChannel  *shm,
+                                      GError         **error)
+{
+    g_autoptr(GUnixFDList)           fd_list = NULL;
+    g_autoptr(GSocketControlMessage) fd_message = NULL;
+    GOutputVector                    vector;
+    gssize                           sent;
+    gint                             memfd;
+    gint                             local_fd;
+    gint                             remote_fd;
+
+    /* The fds are duplicated in the list */
+    _mbim_shm_channel_get_peer_fds (shm, &memfd, &local_fd, &remote_fd);
+    fd_list = g_unix_fd_list_new ();
+    if (g_unix_fd_list_append (fd_list, memfd, error) < 0 ||
+        g_unix_fd_list_append (fd_list, local_fd, error) < 0 ||
+        g_unix_fd_list_append (fd_list, remote_fd, error) < 0)
+        return FALSE;
+    fd_message = g_unix_fd_message_new_with_fd_list (fd_list);
+
+    vector.buffer = message->data;
+    vector.size = message->len;
+    sent = g_socket_send_message (g_socket_connection_get_socket (client->connection),
+                                  NULL,
+                                  &vector,
+                                  1,
+                                  &fd_message,
+                                  1,
+                                  G_SOCKET_MSG_NONE,
+                                  NULL,
+                                  error);
+    if (sent < 0)
+        return FALSE;
+
+    if ((gsize)sent != message->len) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "Partial write: %" G_GSSIZE_FORMAT " of %u bytes", sent, message->len);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static MbimMessage *build_command_done (MbimMessage *message, MbimStatusError status);
+
+static gboolean
+process_internal_proxy_transport (MbimProxy   *self,
+                                  Client      *client,
+                                  MbimMessage *message)
+{
+    Request                    *request;
+    MbimProxyTransport          transport = MBIM_PROXY_TRANSPORT_SOCKET;
+    g_autoptr(MbimShmChannel)   shm = NULL;
+    g_autoptr(MbimMessage)      response = NULL;
+    g_autoptr(GError)           error = NULL;
+
+    /* create request holder */
+    request = request_new (self, client, message);
+
+    g_debug ("[client %lu,0x%08x] request to select transport",
+             request->client->id, request->original_transaction_id);
+
+    if (mbim_message_command_get_command_type (message) != MBIM_MESSAGE_COMMAND_TYPE_SET ||
+        !_mbim_proxy_helper_transport_set_parse (message, &transport, &error)) {
+        g_warning ("[client %lu,0x%08x] cannot select transport: invalid request%s%s",
+                   request->client->id, request->original_transaction_id,
+                   error ? ": " : "", error ? error->message : "");
+        request->response = build_command_done (message, MBIM_STATUS_ERROR_INVALID_PARAMETERS);
+        request_complete_and_free (request);
+        return TRUE;
+    }
+
+    /* The socket is always available */
+    if (transport == MBIM_PROXY_TRANSPORT_SOCKET) {
+        request->response = build_command_done (message, MBIM_STATUS_ERROR_NONE);
+        request_complete_and_free (request);
+        return TRUE;
+    }
+
+    if (transport != MBIM_PROXY_TRANSPORT_SHARED_MEMORY) {
+        g_warning ("[client %lu,0x%08x] cannot select transport: unknown transport %u",
+                   request->client->id, request->original_transaction_id, (guint) transport);
+        request->response = build_command_done (message, MBIM_STATUS_ERROR_INVALID_PARAMETERS);
+        request_complete_and_free (request);
+        return TRUE;
+    }
+
+    /* The transport may only be switched right after connecting, when no
+     * other request is ongoing and no other message is pending to be sent */
+    if (client->shm || client->device || client->config_ongoing ||
+        client->n_pending_requests > 1 || !g_queue_is_empty (client->outbound)) {
+        g_warning ("[client %lu,0x%08x] cannot select transport: wrong state",
+                   request->client->id, request->original_transaction_id);
+        request->response = build_command_done (message, MBIM_STATUS_ERROR_FAILURE);
+        request_complete_and_free (request);
+        return TRUE;
+    }
+
+    shm = _mbim_shm_channel_new (&error);
+    if (!shm) {
+        g_warning ("[client %lu,0x%08x] cannot select transport: %s",
+                   request->client->id, request->original_transaction_id, error->message);
+        request->response = build_command_done (message, MBIM_STATUS_ERROR_FAILURE);
+        request_complete_and_free (request);
+        return TRUE;
+    }
+
+    /* The response is sent right away over the socket along with the fds; all
+     * messages after it go through the shared memory channel */
+    response = build_command_done (message, MBIM_STATUS_ERROR_NONE);
+    if (!client_send_message_with_shm_channel (client, response, shm, &error)) {
+        g_warning ("[client %lu,0x%08x] cannot select transport: couldn't send response: %s",
+                   request->client->id, request->original_transaction_id, error->message);
+        /* Untrack client and complete without response */
+        untrack_client (self, client);
+        request_complete_and_free (request);
+        return TRUE;
+    }
+
+    g_debug ("[client %lu,0x%08x] shared memory transport selected",
+             request->client->id, request->original_transaction_id);
+    client->shm = g_steal_pointer (&shm);
+    client_attach_shm (client);
+    request_complete_and_free (request);
+    return TRUE;
+}
+
+/*****************************************************************************/
+/* Proxy memory usage */
+
+typedef struct {
+    Client                     *client;
+    MbimProxyClientMemoryUsage  memory_usage;
+} ClientMemoryUsageContext;
+
+static gboolean
+client_memory_usage_snapshot_cb (ClientMemoryUsageContext *ctx)
+{
+    ctx->memory_usage = ctx->client->memory;
+    ctx->memory_usage.client_id = ctx->client->id;
+    return G_SOURCE_REMOVE;
+}
+
+static GArray *
+proxy_get_client_memory_usage (MbimProxy  *self,
+                               gboolean    filter_device,
+                               MbimDevice *device)
+{
+    GArray *memory_usage;
+    GList  *clients = NULL;
+    GList  *l;
+
+    g_rec_mutex_lock (&self->priv->lock);
+    for (l = self->priv->clients; l; l = g_list_next (l)) {
+        Client *client;
+
+        client = l->data;
+        if (filter_device && client->device != device)
+            continue;
+        clients = g_list_prepend (clients, client_ref (client));
+    }
+    g_rec_mutex_unlock (&self->priv->lock);
+
+    /* The counters of clients handled in device workers are read in their own
+     * threads; the lock isn't held meanwhile, as the workers may need it */
+    memory_usage = g_array_new (FALSE, FALSE, sizeof (MbimProxyClientMemoryUsage));
+    for (l = g_list_last (clients); l; l = g_list_previous (l)) {
+        ClientMemoryUsageContext ctx = { 0 };
+
+        ctx.client = l->data;
+        device_worker_invoke_sync (ctx.client->worker, (GSourceFunc)client_memory_usage_snapshot_cb, &ctx);
+        g_array_append_val (memory_usage, ctx.memory_usage);
+    }
+    g_list_free_full (clients, (GDestroyNotify)client_unref);
+
+    return memory_usage;
+}
+
+GArray *
+mbim_proxy_get_client_memory_usage (MbimProxy *self)
+{
+    g_return_val_if_fail (MBIM_IS_PROXY (self), NULL);
+
+    return proxy_get_client_memory_usage (self, FALSE, NULL);
+}
+
+void
+mbim_proxy_set_client_memory_limit (MbimProxy *self,
+                                    guint64    limit)
+{
+    g_return_if_fail (MBIM_IS_PROXY (self));
+
+    self->priv->client_memory_limit = limit;
+}
+
+static gboolean
+process_internal_proxy_memory_usage (MbimProxy   *self,
+                                     Client      *client,
+                                     MbimMessage *message)
+{
+    Request               *request;
+    MbimDeviceMemoryUsage  device_memory_usage = { 0 };
+    g_autoptr(GArray)      client_memory_usage = NULL;
+
+    /* create request holder */
+    request = request_new (self, client, message);
+
+    g_debug ("[client %lu,0x%08x] request to query memory usage",
+             request->client->id, request->original_transaction_id);
+
+    if (mbim_message_command_get_command_type (message) != MBIM_MESSAGE_COMMAND_TYPE_QUERY) {
+        g_warning ("[client %lu,0x%08x] cannot query memory usage: invalid request",
+                   request->client->id, request->original_transaction_id);
+        request->response = build_command_done (message, MBIM_STATUS_ERROR_INVALID_PARAMETERS);
+        request_complete_and_free (request);
+        return TRUE;
+    }
+
+    /* Report the device used by the client, if any, and all the clients
+     * using that same device, which are all handled in this same context.
+     * Without device, the client may not be handled where the others are. */
+    if (client->device) {
+        mbim_device_get_memory_usage (client->device, &device_memory_usage);
+        client_memory_usage = proxy_get_client_memory_usage (self, TRUE, client->device);
+    } else {
+        ClientMemoryUsageContext ctx = { 0 };
+
+        ctx.client = client;
+        client_memory_usage_snapshot_cb (&ctx);
+        client_memory_usage = g_array_new (FALSE, FALSE, sizeof (MbimProxyClientMemoryUsage));
+        g_array_append_val (client_memory_usage, ctx.memory_usage);
+    }
+
+    request->response = _mbim_proxy_helper_memory_usage_response_new (message, &device_memory_usage, client_memory_usage);
+    request_complete_and_free (request);
+    return TRUE;
+}
+
 /*****************************************************************************/
 /* Proxy config */
 
 static MbimMessage *
-build_proxy_control_command_done (MbimMessage     *message,
-                                  MbimStatusError  status)
+build_command_done (MbimMessage     *message,
+                    MbimStatusError  status)
 {
     MbimMessage *response;
     struct command_done_message *command_done;
@@ -651,8 +1764,10 @@ build_proxy_control_command_done (MbimMessage     *message,
     command_done = &(((struct full_message *)(response->data))->message.command_done);
     command_done->fragment_header.total   = GUINT32_TO_LE (1);
     command_done->fragment_header.current = 0;
-    memcpy (command_done->service_id, MBIM_UUID_PROXY_CONTROL, sizeof (MbimUuid));
-    command_done->command_id  = GUINT32_TO_LE (mbim_message_command_get_cid (message));
+    /* Read from the header directly, as the message may be just the first
+     * fragment of the command */
+    memcpy (command_done->service_id, ((struct full_message *)(message->data))->message.command.service_id, sizeof (MbimUuid));
+    command_done->command_id  = ((struct full_message *)(message->data))->message.command.command_id;
     command_done->status_code = GUINT32_TO_LE (status);
     command_done->buffer_length = 0;
 
@@ -690,7 +1805,7 @@ proxy_config_internal_device_open_ready (MbimProxy    *self,
 
     if (request->client->config_ongoing == TRUE)
         request->client->config_ongoing = FALSE;
-    request->response = build_proxy_control_command_done (request->message, MBIM_STATUS_ERROR_NONE);
+    request->response = build_command_done (request->message, MBIM_STATUS_ERROR_NONE);
     request_complete_and_free (request);
 }
 
@@ -733,29 +1848,60 @@ device_new_ready (GObject      *source,
                           request);
 }
 
-static gboolean
-process_internal_proxy_config (MbimProxy   *self,
-                               Client      *client,
-                               MbimMessage *message)
+static void
+proxy_config_device (MbimProxy *self,
+                     Request   *request)
 {
-    Request           *request;
-    MbimDevice        *device;
-    g_autofree gchar  *incoming_path = NULL;
-    g_autofree gchar  *path = NULL;
-    g_autoptr(GFile)   file = NULL;
-    g_autoptr(GError)  error = NULL;
-
-    /* create request holder */
-    request = request_new (self, client, message);
-
-    g_debug ("[client %lu,0x%08x] request to configure proxy",
-             request->client->id, request->original_transaction_id);
+    MbimDevice       *device;
+    g_autoptr(GFile)  file = NULL;
+
+    /* Check if some other client already handled the same device */
+    device = peek_device_for_path (self, request->path);
+    if (device) {
+        /* Keep reference and continue */
+        client_set_device (request->client, device);
+        internal_device_open (self,
+                              device,
+                              request->timeout_secs,
+                              (GAsyncReadyCallback)proxy_config_internal_device_open_ready,
+                              request);
+        return;
+    }
+
+    /* Flag as ongoing */
+    request->client->config_ongoing = TRUE;
+
+    /* Create new MBIM device */
+    file = g_file_new_for_path (request->path);
+    mbim_device_new (file,
+                     NULL,
+                     (GAsyncReadyCallback)device_new_ready,
+                     request);
+}
+
+static gboolean
+process_internal_proxy_config (MbimProxy   *self,
+                               Client      *client,
+                               MbimMessage *message)
+{
+    Request           *request;
+    g_autofree gchar  *incoming_path = NULL;
+    g_autofree gchar  *path = NULL;
+    g_autoptr(GError)  error = NULL;
+    guint32            request_timeout_secs = 0;
+    guint32            max_pending_requests = 0;
+
+    /* create request holder */
+    request = request_new (self, client, message);
+
+    g_debug ("[client %lu,0x%08x] request to configure proxy",
+             request->client->id, request->original_transaction_id);
 
     /* Error out if there is already a proxy config ongoing */
     if (client->config_ongoing) {
         g_warning ("[client %lu,0x%08x] cannot configure proxy: another request already ongoing",
                    request->client->id, request->original_transaction_id);
-        request->response = build_proxy_control_command_done (message, MBIM_STATUS_ERROR_BUSY);
+        request->response = build_command_done (message, MBIM_STATUS_ERROR_BUSY);
         request_complete_and_free (request);
         return TRUE;
     }
@@ -764,20 +1910,34 @@ process_internal_proxy_config (MbimProxy   *self,
     if (mbim_message_command_get_command_type (message) != MBIM_MESSAGE_COMMAND_TYPE_SET) {
         g_warning ("[client %lu,0x%08x] cannot configure proxy: invalid request type",
                    request->client->id, request->original_transaction_id);
-        request->response = build_proxy_control_command_done (message, MBIM_STATUS_ERROR_INVALID_PARAMETERS);
+        request->response = build_command_done (message, MBIM_STATUS_ERROR_INVALID_PARAMETERS);
         request_complete_and_free (request);
         return TRUE;
     }
 
-    /* Retrieve path from request */
-    if (!_mbim_message_read_string (message, 0, 0, MBIM_STRING_ENCODING_UTF16, &incoming_path, &error)) {
-        g_warning ("[client %lu,0x%08x] cannot configure proxy: couldn't read device path from request: %s",
+    /* Retrieve path, timeout and client limits from request */
+    if (!_mbim_proxy_helper_configuration_set_parse (message,
+                                                     &incoming_path,
+                                                     &request->timeout_secs,
+                                                     &request_timeout_secs,
+                                                     &max_pending_requests,
+                                                     &error)) {
+        g_warning ("[client %lu,0x%08x] cannot configure proxy: couldn't parse request: %s",
                    request->client->id, request->original_transaction_id, error->message);
-        request->response = build_proxy_control_command_done (message, MBIM_STATUS_ERROR_INVALID_PARAMETERS);
+        request->response = build_command_done (message, MBIM_STATUS_ERROR_INVALID_PARAMETERS);
         request_complete_and_free (request);
         return TRUE;
     }
 
+    /* Apply the client limits, if any given */
+    if (request_timeout_secs)
+        client->request_timeout_secs = MIN (request_timeout_secs, DEFAULT_REQUEST_TIMEOUT_SECS);
+    if (max_pending_requests)
+        client->max_pending_requests = MIN (max_pending_requests, MAX_PENDING_REQUESTS_LIMIT);
+    g_debug ("[client %lu,0x%08x] request timeout: %us, max pending requests: %u",
+             request->client->id, request->original_transaction_id,
+             client->request_timeout_secs, client->max_pending_requests);
+
     /* The incoming path may be a symlink. In the proxy, we always use the real path of the
      * device, so that clients using different symlinks for the same file don't collide with
      * each other. */
@@ -785,7 +1945,7 @@ process_internal_proxy_config (MbimProxy   *self,
     if (!path) {
         g_warning ("[client %lu,0x%08x] cannot configure proxy: couldn't lookup real device path: %s",
                    request->client->id, request->original_transaction_id, error->message);
-        request->response = build_proxy_control_command_done (message, MBIM_STATUS_ERROR_INVALID_PARAMETERS);
+        request->response = build_command_done (message, MBIM_STATUS_ERROR_INVALID_PARAMETERS);
         request_complete_and_free (request);
         return TRUE;
     }
@@ -795,47 +1955,31 @@ process_internal_proxy_config (MbimProxy   *self,
         if (g_str_equal (path, mbim_device_get_path (client->device))) {
             g_debug ("[client %lu,0x%08x] proxy re-configured",
                        request->client->id, request->original_transaction_id);
-            request->response = build_proxy_control_command_done (message, MBIM_STATUS_ERROR_NONE);
+            request->response = build_command_done (message, MBIM_STATUS_ERROR_NONE);
         } else {
             g_warning ("[client %lu,0x%08x] cannot configure proxy: different device path given",
                        request->client->id, request->original_transaction_id);
-            request->response = build_proxy_control_command_done (message, MBIM_STATUS_ERROR_FAILURE);
+            request->response = build_command_done (message, MBIM_STATUS_ERROR_FAILURE);
         }
         request_complete_and_free (request);
         return TRUE;
     }
 
-    /* Read requested timeout value */
-    if (!_mbim_message_read_guint32 (message, 8, &request->timeout_secs, &error)) {
-        g_warning ("[client %lu,0x%08x] cannot configure proxy: couldn't read timeout from request: %s",
-                   request->client->id, request->original_transaction_id, error->message);
-        request->response = build_proxy_control_command_done (message, MBIM_STATUS_ERROR_INVALID_PARAMETERS);
-        request_complete_and_free (request);
-        return TRUE;
-    }
+    request->path = g_steal_pointer (&path);
 
-    /* Check if some other client already handled the same device */
-    device = peek_device_for_path (self, path);
-    if (device) {
-        /* Keep reference and continue */
-        client_set_device (client, device);
-        internal_device_open (self,
-                              device,
-                              request->timeout_secs,
-                              (GAsyncReadyCallback)proxy_config_internal_device_open_ready,
-                              request);
+    /* If device threads enabled, route the client to the worker of the device;
+     * the config will be completed there once we're done with the client in
+     * the main context */
+    if (self->priv->device_threads && !client->worker) {
+        client->worker = device_worker_get (self, request->path);
+        client->config_ongoing = TRUE;
+        client->handoff_request = request;
+        g_debug ("[client %lu,0x%08x] routing to device worker",
+                 request->client->id, request->original_transaction_id);
         return TRUE;
     }
 
-    /* Flag as ongoing */
-    client->config_ongoing = TRUE;
-
-    /* Create new MBIM device */
-    file = g_file_new_for_path (path);
-    mbim_device_new (file,
-                     NULL,
-                     (GAsyncReadyCallback)device_new_ready,
-                     request);
+    proxy_config_device (self, request);
     return TRUE;
 }
 
@@ -862,6 +2006,7 @@ track_service_subscribe_list (Client      *client,
     g_clear_pointer (&client->mbim_event_entry_array, mbim_event_entry_array_free);
     client->mbim_event_entry_array = g_steal_pointer (&mbim_event_entry_array);
     client->mbim_event_entry_array_size = mbim_event_entry_array_size;
+    client_update_subscriptions_memory_usage (client);
 
     if (mbim_utils_get_traces_enabled ()) {
         g_debug ("[client %lu] service subscribe list built", client->id);
@@ -966,8 +2111,8 @@ process_device_service_subscribe_list (MbimProxy   *self,
              request->client->id, request->original_transaction_id);
     mbim_device_command (client->device,
                          request_message,
-                         300,
-                         NULL,
+                         client->request_timeout_secs,
+                         peek_device_cancellable (client->device),
                          (GAsyncReadyCallback)device_service_subscribe_list_set_ready,
                          request);
     return TRUE;
@@ -1037,21 +2182,19 @@ monitor_ms_basic_connect_extensions_version_response (MbimProxy   *self,
 
     /* notify to all clients about the MBIMEx version update */
     indication = build_proxy_control_version_notification (mbim_version, ms_mbimex_version);
+    g_rec_mutex_lock (&self->priv->lock);
     for (l = self->priv->clients; l; l = g_list_next (l)) {
-        g_autoptr(GError)  error = NULL;
-        Client            *client;
+        Client *client;
 
         client = l->data;
         if (client->device != device)
             continue;
 
-        if (!client_send_message (client, indication, &error))
-            g_warning ("[client %lu] couldn't report MBIMEx version update to %x.%02x: %s",
-                       client->id, ms_mbimex_version_major, ms_mbimex_version_minor, error->message);
-        else
+        if (client_send_indication (client, indication))
             g_debug ("[client %lu] reported MBIMEx version update to %x.%02x",
                      client->id, ms_mbimex_version_major, ms_mbimex_version_minor);
     }
+    g_rec_mutex_unlock (&self->priv->lock);
 
     /* the indication is stored as data associated to the device, so that it can
      * be reused any time new clients attempt an open */
@@ -1093,6 +2236,15 @@ device_command_ready (MbimDevice   *device,
     g_debug ("[client %lu,0x%08x] response from device received",
              request->client->id, request->original_transaction_id);
 
+    MBIM_PROBE (proxy_response,
+                request->client->id,
+                request->original_transaction_id,
+                mbim_message_get_transaction_id (request->response),
+                _mbim_probe_message_service (request->response),
+                _mbim_probe_message_cid (request->response),
+                mbim_message_get_message_length (request->response),
+                g_get_monotonic_time ());
+
     /* try to match the MBIMEx version exchange */
     monitor_ms_basic_connect_extensions_version_response (request->self, device, request->response);
 
@@ -1100,6 +2252,24 @@ device_command_ready (MbimDevice   *device,
     request_complete_and_free (request);
 }
 
+static void
+process_command_reject (MbimProxy       *self,
+                        Client          *client,
+                        MbimMessage     *message,
+                        MbimStatusError  status)
+{
+    Request *request;
+
+    /* The single reply goes out right away, so if more fragments of the same
+     * request follow, they must not be forwarded on their own */
+    if (_mbim_message_fragment_get_total (message) > 1)
+        client->rejected_transaction_id = mbim_message_get_transaction_id (message);
+
+    request = request_new (self, client, message);
+    request->response = build_command_done (message, status);
+    request_complete_and_free (request);
+}
+
 static gboolean
 process_command (MbimProxy   *self,
                  Client      *client,
@@ -1110,14 +2280,63 @@ process_command (MbimProxy   *self,
     const gchar *command_type;
     const gchar *service;
 
+    /* Drop the remaining fragments of a request already rejected */
+    if (_mbim_message_fragment_get_current (message) > 0) {
+        if (client->rejected_transaction_id &&
+            client->rejected_transaction_id == mbim_message_get_transaction_id (message)) {
+            g_debug ("[client %lu,0x%08x] dropping fragment %u/%u of rejected request",
+                     client->id, client->rejected_transaction_id,
+                     _mbim_message_fragment_get_current (message) + 1,
+                     _mbim_message_fragment_get_total (message));
+            if (_mbim_message_fragment_get_current (message) + 1 >= _mbim_message_fragment_get_total (message))
+                client->rejected_transaction_id = 0;
+            return TRUE;
+        }
+    } else
+        client->rejected_transaction_id = 0;
+
     command = mbim_cid_get_printable (mbim_message_command_get_service (message),
                                       mbim_message_command_get_cid (message));
     command_type = mbim_message_command_type_get_string (mbim_message_command_get_command_type (message));
     service = mbim_service_get_string (mbim_message_command_get_service (message));
 
+    /* Reject new requests right away if the client already reached the limit
+     * of pending ones; this avoids queueing requests without bound when the
+     * device is not replying. Only the first fragment is checked, so that we
+     * don't reject fragments of an already accepted request. */
+    if ((_mbim_message_fragment_get_current (message) == 0) &&
+        (client->n_pending_requests >= client->max_pending_requests)) {
+        g_debug ("[client %lu,0x%08x] rejecting request to device: too many pending requests (%u)",
+                 client->id, mbim_message_get_transaction_id (message), client->n_pending_requests);
+        process_command_reject (self, client, message, MBIM_STATUS_ERROR_BUSY);
+        return TRUE;
+    }
+
+    /* Same if the request would take the client above its memory limit. All
+     * fragments but the last one are full, so the size of the whole request
+     * is bounded by the size of the first one times the number of them. */
+    if ((_mbim_message_fragment_get_current (message) == 0) &&
+        (self->priv->client_memory_limit > 0) &&
+        (client_memory_usage_total (client) +
+         (guint64) mbim_message_get_message_length (message) * _mbim_message_fragment_get_total (message) > self->priv->client_memory_limit)) {
+        g_debug ("[client %lu,0x%08x] rejecting request to device: client memory limit reached (%" G_GUINT64_FORMAT " bytes used)",
+                 client->id, mbim_message_get_transaction_id (message), client_memory_usage_total (client));
+        process_command_reject (self, client, message, MBIM_STATUS_ERROR_BUSY);
+        return TRUE;
+    }
+
     /* create request holder */
     request = request_new (self, client, message);
 
+    /* Nothing to forward the request to until the proxy is configured */
+    if (!client->device) {
+        g_debug ("[client %lu,0x%08x] cannot forward request to device: proxy not configured",
+                 client->id, request->original_transaction_id);
+        request->response = build_command_done (message, MBIM_STATUS_ERROR_FAILURE);
+        request_complete_and_free (request);
+        return TRUE;
+    }
+
     g_debug ("[client %lu,0x%08x] forwarding request to device: %s, %s, %s",
              client->id, request->original_transaction_id,
              service      ? service      : "unknown service",
@@ -1131,15 +2350,19 @@ process_command (MbimProxy   *self,
         /* avoid incrementing transaction until the last fragment is processed */
         mbim_message_set_transaction_id (message, mbim_device_get_transaction_id (client->device));
 
-    /* The timeout needs to be big enough for any kind of transaction to
-     * complete, otherwise the remote clients will lose the reply if they
-     * configured a timeout bigger than this internal one. We should likely
-     * make this value configurable per-client, instead of a hardcoded value.
-     */
+    MBIM_PROBE (proxy_request,
+                client->id,
+                request->original_transaction_id,
+                mbim_message_get_transaction_id (message),
+                _mbim_probe_message_service (message),
+                _mbim_probe_message_cid (message),
+                mbim_message_get_message_length (message),
+                g_get_monotonic_time ());
+
     mbim_device_command (client->device,
                          message,
-                         300,
-                         NULL,
+                         client->request_timeout_secs,
+                         peek_device_cancellable (client->device),
                          (GAsyncReadyCallback)device_command_ready,
                          request);
     return TRUE;
@@ -1163,6 +2386,12 @@ process_message (MbimProxy   *self,
         if (mbim_message_command_get_service (message) == MBIM_SERVICE_PROXY_CONTROL &&
             mbim_message_command_get_cid (message) == MBIM_CID_PROXY_CONTROL_CONFIGURATION)
             return process_internal_proxy_config (self, client, message);
+        if (mbim_message_command_get_service (message) == MBIM_SERVICE_PROXY_CONTROL &&
+            mbim_message_command_get_cid (message) == MBIM_CID_PROXY_CONTROL_TRANSPORT)
+            return process_internal_proxy_transport (self, client, message);
+        if (mbim_message_command_get_service (message) == MBIM_SERVICE_PROXY_CONTROL &&
+            mbim_message_command_get_cid (message) == MBIM_CID_PROXY_CONTROL_MEMORY_USAGE)
+            return process_internal_proxy_memory_usage (self, client, message);
         /* device service subscribe list message? */
         if (mbim_message_command_get_service (message) == MBIM_SERVICE_BASIC_CONNECT &&
             mbim_message_command_get_cid (message) == MBIM_CID_BASIC_CONNECT_DEVICE_SERVICE_SUBSCRIBE_LIST)
@@ -1185,8 +2414,8 @@ process_message (MbimProxy   *self,
 }
 
 static void
-parse_request (MbimProxy *self,
-               Client    *client)
+parse_request_messages (MbimProxy *self,
+                        Client    *client)
 {
     do {
         g_autoptr(MbimMessage) message = NULL;
@@ -1205,9 +2434,78 @@ parse_request (MbimProxy *self,
         message = mbim_message_dup ((const MbimMessage *)client->buffer);
         g_assert (message);
 
+        /* Size the next reads from the largest message seen so far */
+        client->read_size = CLAMP (MAX (client->read_size, mbim_message_get_message_length (message)),
+                                   BUFFER_SIZE, MAX_READ_SIZE);
+
+        /* The message is accounted from now on as a request, not as part of
+         * the receive buffer */
         g_byte_array_remove_range (client->buffer, 0, mbim_message_get_message_length (message));
+        memory_usage_update (&client->memory.receive_buffer, &client->memory.receive_buffer_peak, client->buffer->len);
         process_message (self, client, message);
-    } while (client->buffer->len > 0);
+    } while (client->buffer->len > 0 && !client->handoff_request);
+}
+
+static void
+parse_request (MbimProxy *self,
+               Client    *client)
+{
+    guint64 limit;
+
+    /* The peak is taken with all the data just read */
+    memory_usage_update (&client->memory.receive_buffer, &client->memory.receive_buffer_peak, client->buffer->len);
+    parse_request_messages (self, client);
+
+    /* Processing the messages may end up untracking the client */
+    if (!client->buffer)
+        return;
+
+    memory_usage_update (&client->memory.receive_buffer, &client->memory.receive_buffer_peak, client->buffer->len);
+
+    /* Partial messages larger than the limit will never be accepted */
+    limit = self->priv->client_memory_limit;
+    if (limit > 0 && client->connection && client->buffer->len > limit) {
+        g_warning ("[client %lu] client memory limit reached: %u bytes pending to be processed",
+                   client->id, client->buffer->len);
+        untrack_client (self, client);
+    }
+}
+
+static gboolean
+client_handoff_cb (Client *client)
+{
+    Request *request;
+
+    request = g_steal_pointer (&client->handoff_request);
+
+    /* Client gone while being routed, complete without response */
+    if (!client->connection) {
+        request_complete_and_free (request);
+        return G_SOURCE_REMOVE;
+    }
+
+    g_debug ("[client %lu] handled by device worker", client->id);
+    client_attach (client);
+    proxy_config_device (client->self, request);
+
+    /* Process any other request already received */
+    if (client->connection && client->buffer && client->buffer->len > 0)
+        parse_request (client->self, client);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void
+client_handoff (Client *client)
+{
+    /* Stop handling the client in the main context, and keep on in the
+     * device worker */
+    client_detach (client);
+    g_main_context_invoke_full (client->worker->context,
+                                G_PRIORITY_DEFAULT,
+                                (GSourceFunc)client_handoff_cb,
+                                client_ref (client),
+                                (GDestroyNotify)client_unref);
 }
 
 static gboolean
@@ -1215,10 +2513,8 @@ connection_readable_cb (GSocket *socket,
                         GIOCondition condition,
                         Client *client)
 {
-    MbimProxy         *self;
-    guint8             buffer[BUFFER_SIZE];
-    g_autoptr(GError)  error = NULL;
-    gssize             r;
+    MbimProxy *self;
+    guint      n_reads;
 
     /* Recover proxy pointer soon */
     self = client->self;
@@ -1231,30 +2527,148 @@ connection_readable_cb (GSocket *socket,
     if (!(condition & G_IO_IN || condition & G_IO_PRI))
         return TRUE;
 
-    r = g_input_stream_read (g_io_stream_get_input_stream (G_IO_STREAM (client->connection)),
-                             buffer,
-                             BUFFER_SIZE,
-                             NULL,
-                             &error);
-    if (r < 0) {
-        g_warning ("[client %lu] error reading from istream: %s", client->id, error ? error->message : "unknown");
-        /* Close the device */
-        untrack_client (self, client);
-        return FALSE;
+    if (!G_UNLIKELY (client->buffer))
+        client->buffer = g_byte_array_sized_new (client->read_size);
+
+    /* Processing the requests may end up untracking the client, so make sure
+     * a valid reference is available during the whole loop */
+    client_ref (client);
+
+    /* Read until the socket is drained, but only up to a maximum number of
+     * reads, so that a single busy client doesn't starve the others */
+    for (n_reads = 0; n_reads < MAX_READS_PER_WAKEUP && client->connection && !client->handoff_request; n_reads++) {
+        g_autoptr(GError) error = NULL;
+        guint             offset;
+        gsize             read_size;
+        gssize            r;
+
+        /* Read straight into the client buffer, trying to get at least the
+         * whole pending message if its length is already known */
+        read_size = client->read_size;
+        if (client->buffer->len >= sizeof (struct header)) {
+            guint32 pending_length;
+
+            pending_length = MBIM_MESSAGE_GET_MESSAGE_LENGTH (client->buffer);
+            if (pending_length > client->buffer->len)
+                read_size = CLAMP (pending_length - client->buffer->len, read_size, MAX_READ_SIZE);
+        }
+
+        offset = client->buffer->len;
+        g_byte_array_set_size (client->buffer, offset + read_size);
+        r = g_socket_receive_with_blocking (socket,
+                                            (gchar *)&client->buffer->data[offset],
+                                            read_size,
+                                            FALSE,
+                                            NULL,
+                                            &error);
+        g_byte_array_set_size (client->buffer, offset + MAX (r, 0));
+
+        if (r < 0) {
+            /* Drained */
+            if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+                break;
+            g_warning ("[client %lu] error reading from socket: %s", client->id, error ? error->message : "unknown");
+            /* Close the device */
+            untrack_client (self, client);
+            break;
+        }
+
+        if (r == 0)
+            break;
+
+        /* else, r > 0; try to parse input messages */
+        parse_request (self, client);
+
+        /* Short read, nothing else pending */
+        if ((gsize)r < read_size)
+            break;
     }
 
-    if (r == 0)
-        return TRUE;
+    /* If the client needs to be routed to a device worker, do it once we're
+     * done with it here */
+    if (client->handoff_request) {
+        if (client->connection)
+            client_handoff (client);
+        else
+            request_complete_and_free (g_steal_pointer (&client->handoff_request));
+    }
+
+    client_unref (client);
+
+    return TRUE;
+}
+
+static gboolean
+shm_readable_cb (gint          fd,
+                 GIOCondition  condition,
+                 Client       *client)
+{
+    MbimProxy *self;
+
+    self = client->self;
+
+    /* The doorbell is rung both when new requests are available and when the
+     * client released space for our pending responses */
+    _mbim_shm_channel_acknowledge (client->shm);
 
-    /* else, r > 0 */
     if (!G_UNLIKELY (client->buffer))
-        client->buffer = g_byte_array_sized_new (r);
-    g_byte_array_append (client->buffer, buffer, r);
+        client->buffer = g_byte_array_sized_new (client->read_size);
 
-    /* Try to parse input messages */
-    parse_request (self, client);
+    client_ref (client);
 
-    return TRUE;
+    if (client->outbound && !g_queue_is_empty (client->outbound)) {
+        g_autoptr(GError) error = NULL;
+
+        if (!client_flush_shm (client, &error)) {
+            g_warning ("[client %lu] couldn't send messages: %s", client->id, error->message);
+            untrack_client (self, client);
+            client_unref (client);
+            return G_SOURCE_REMOVE;
+        }
+    }
+
+    /* Everything available in the ring is read in one go; no new requests
+     * are read while handing off to a new proxy */
+    if (!self->priv->handoff_connection && _mbim_shm_channel_read (client->shm, client->buffer) > 0)
+        parse_request (self, client);
+
+    if (client->handoff_request) {
+        if (client->connection)
+            client_handoff (client);
+        else
+            request_complete_and_free (g_steal_pointer (&client->handoff_request));
+    }
+
+    client_unref (client);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* Shared by the clients connected to this proxy and the ones handed off to
+ * it by a previous proxy */
+static gulong client_id = 0;
+
+static Client *
+client_new (MbimProxy         *self,
+            GSocketConnection *connection)
+{
+    Client *client;
+
+    client = g_slice_new0 (Client);
+    client->self = self;
+    client->ref_count = 1;
+    client->id = client_id;
+    client->connection = g_object_ref (connection);
+    client->request_timeout_secs = DEFAULT_REQUEST_TIMEOUT_SECS;
+    client->max_pending_requests = DEFAULT_MAX_PENDING_REQUESTS;
+    client->outbound = g_queue_new ();
+    client->read_size = BUFFER_SIZE;
+
+    /* By default, a new client has all the standard services enabled for indications */
+    client->mbim_event_entry_array = _mbim_proxy_helper_service_subscribe_list_new_standard (&client->mbim_event_entry_array_size);
+    client_update_subscriptions_memory_usage (client);
+
+    return client;
 }
 
 static void
@@ -1263,7 +2677,6 @@ incoming_cb (GSocketService    *service,
              GObject           *unused,
              MbimProxy         *self)
 {
-    static gulong            client_id = 0;
     Client                  *client;
     g_autoptr(GCredentials)  credentials = NULL;
     g_autoptr(GError)        error = NULL;
@@ -1293,302 +2706,1423 @@ incoming_cb (GSocketService    *service,
     }
 
     /* Create client */
-    client = g_slice_new0 (Client);
-    client->self = self;
-    client->ref_count = 1;
-    client->id = client_id;
-    client->connection = g_object_ref (connection);
+    client = client_new (self, connection);
+    client_attach (client);
 
-    /* By default, a new client has all the standard services enabled for indications */
-    client->mbim_event_entry_array = _mbim_proxy_helper_service_subscribe_list_new_standard (&client->mbim_event_entry_array_size);
+    /* Keep the client info around */
+    track_client (self, client);
 
-    client->connection_readable_source = g_socket_create_source (g_socket_connection_get_socket (client->connection),
-                                                                 G_IO_IN | G_IO_PRI | G_IO_ERR | G_IO_HUP,
-                                                                 NULL);
-    g_source_set_callback (client->connection_readable_source,
-                           (GSourceFunc)connection_readable_cb,
-                           client,
-                           NULL);
-    g_source_attach (client->connection_readable_source, g_main_context_get_thread_default ());
+    client_unref (client);
+}
+
+static GSocket *
+listen_socket_new (gint          listen_fd,
+                   const gchar  *path,
+                   GError      **error)
+{
+    g_autoptr(GSocketAddress) socket_address = NULL;
+    g_autoptr(GSocket)        socket = NULL;
+
+    if (listen_fd >= 0) {
+        /* Socket already bound and listening, e.g. when socket activated */
+        socket = g_socket_new_from_fd (listen_fd, error);
+        if (!socket) {
+            close (listen_fd);
+            return NULL;
+        }
+
+        if (g_socket_get_family (socket) != G_SOCKET_FAMILY_UNIX ||
+            g_socket_get_socket_type (socket) != G_SOCKET_TYPE_STREAM) {
+            g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_ARGS,
+                         "Listening socket is not a unix stream socket");
+            return NULL;
+        }
+
+        g_debug ("using listening UNIX socket (fd %d)...", listen_fd);
+    } else {
+        socket = g_socket_new (G_SOCKET_FAMILY_UNIX,
+                               G_SOCKET_TYPE_STREAM,
+                               G_SOCKET_PROTOCOL_DEFAULT,
+                               error);
+        if (!socket)
+            return NULL;
+
+        /* Bind to address */
+        socket_address = (g_unix_socket_address_new_with_type (
+                              path,
+                              -1,
+                              G_UNIX_SOCKET_ADDRESS_ABSTRACT));
+        if (!g_socket_bind (socket, socket_address, TRUE, error))
+            return NULL;
+
+        g_debug ("creating UNIX socket service...");
+
+        /* Listen */
+        if (!g_socket_listen (socket, error))
+            return NULL;
+    }
+
+    return g_steal_pointer (&socket);
+}
+
+static gboolean
+setup_socket_service (MbimProxy  *self,
+                      gint        listen_fd,
+                      GError    **error)
+{
+    g_autoptr(GSocket) socket = NULL;
+
+    socket = listen_socket_new (listen_fd, MBIM_PROXY_SOCKET_PATH, error);
+    if (!socket)
+        return FALSE;
+
+    /* Create socket service */
+    self->priv->socket_service = g_socket_service_new ();
+    g_signal_connect (self->priv->socket_service, "incoming", G_CALLBACK (incoming_cb), self);
+    if (!g_socket_listener_add_socket (G_SOCKET_LISTENER (self->priv->socket_service),
+                                       socket,
+                                       NULL, /* don't pass an object, will take a reference */
+                                       error)) {
+        g_prefix_error (error, "Error adding socket at '%s' to socket service: ", MBIM_PROXY_SOCKET_PATH);
+        return FALSE;
+    }
+
+    /* Keep the socket around, so that it can be handed off */
+    self->priv->listen_socket = g_steal_pointer (&socket);
+
+    g_debug ("starting UNIX socket service at '%s'...", MBIM_PROXY_SOCKET_PATH);
+    g_socket_service_start (self->priv->socket_service);
+    return TRUE;
+}
+
+/*****************************************************************************/
+/* Device tracking */
+
+#define DEVICE_CONTEXT_TAG "device-context-tag"
+static GQuark device_context_quark;
+
+typedef struct {
+    /* Combined events array */
+    MbimEventEntry **mbim_event_entry_array;
+    gsize            mbim_event_entry_array_size;
+    /* Cancels the requests of the clients once the device is untracked */
+    GCancellable    *cancellable;
+} DeviceContext;
+
+static void
+device_context_free (DeviceContext *ctx)
+{
+    mbim_event_entry_array_free (ctx->mbim_event_entry_array);
+    g_object_unref (ctx->cancellable);
+    g_slice_free (DeviceContext, ctx);
+}
+
+static DeviceContext *
+device_context_get (MbimDevice *device)
+{
+    DeviceContext *ctx;
+
+    if (G_UNLIKELY (!device_context_quark))
+        device_context_quark = g_quark_from_static_string (DEVICE_CONTEXT_TAG);
+
+    ctx = g_object_get_qdata (G_OBJECT (device), device_context_quark);
+    if (!ctx) {
+        ctx = g_slice_new0 (DeviceContext);
+        ctx->mbim_event_entry_array = _mbim_proxy_helper_service_subscribe_list_new_standard (&ctx->mbim_event_entry_array_size);
+        ctx->cancellable = g_cancellable_new ();
+
+        g_debug ("[%s] initial device subscribe list...", mbim_device_get_path (device));
+        _mbim_proxy_helper_service_subscribe_list_debug ((const MbimEventEntry * const *)ctx->mbim_event_entry_array, ctx->mbim_event_entry_array_size);
+
+        g_object_set_qdata_full (G_OBJECT (device), device_context_quark, ctx, (GDestroyNotify)device_context_free);
+    }
+
+    return ctx;
+}
+
+static GCancellable *
+peek_device_cancellable (MbimDevice *device)
+{
+    return device_context_get (device)->cancellable;
+}
+
+static MbimEventEntry **
+merge_client_service_subscribe_lists (MbimProxy  *self,
+                                      MbimDevice *device,
+                                      gsize      *out_size)
+{
+    GList                          *l;
+    g_autoptr(MbimEventEntryArray)  updated = NULL;
+    gsize                           updated_size = 0;
+    DeviceContext                  *ctx;
+
+    g_debug ("[%s] merging client service subscribe lists...", mbim_device_get_path (device));
+    ctx = device_context_get (device);
+    g_assert (ctx);
+
+    g_assert (out_size != NULL);
+
+    /* Init default list */
+    updated = _mbim_proxy_helper_service_subscribe_list_new_standard (&updated_size);
+
+    /* Lookup all clients with this device */
+    g_rec_mutex_lock (&self->priv->lock);
+    for (l = self->priv->clients; l; l = g_list_next (l)) {
+        Client *client;
+
+        /* Clients of other devices may be handled in other threads, so
+         * nothing else is read from them */
+        client = l->data;
+        if (client->device != device || !client->mbim_event_entry_array)
+            continue;
+
+        /* Add per-client list */
+        updated = _mbim_proxy_helper_service_subscribe_list_merge (updated, updated_size,
+                                                                   client->mbim_event_entry_array, client->mbim_event_entry_array_size,
+                                                                   &updated_size);
+    }
+    g_rec_mutex_unlock (&self->priv->lock);
+
+    /* If lists are equal, ignore re-setting them up */
+    if (_mbim_proxy_helper_service_subscribe_list_cmp (
+            (const MbimEventEntry *const *)updated, updated_size,
+            (const MbimEventEntry *const *)ctx->mbim_event_entry_array, ctx->mbim_event_entry_array_size)) {
+        g_debug ("[%s] merged service subscribe list not updated", mbim_device_get_path (device));
+        return NULL;
+    }
+
+    /* Lists are different, update stored one */
+    g_clear_pointer (&ctx->mbim_event_entry_array, mbim_event_entry_array_free);
+    ctx->mbim_event_entry_array = g_steal_pointer (&updated);
+    ctx->mbim_event_entry_array_size = updated_size;
+
+    if (mbim_utils_get_traces_enabled ()) {
+        g_debug ("[%s] merged service subscribe list built", mbim_device_get_path (device));
+        _mbim_proxy_helper_service_subscribe_list_debug ((const MbimEventEntry * const *)ctx->mbim_event_entry_array,
+                                                         ctx->mbim_event_entry_array_size);
+    }
+
+    *out_size = ctx->mbim_event_entry_array_size;
+    return ctx->mbim_event_entry_array;
+}
+
+static void
+reset_client_service_subscribe_lists (MbimProxy  *self,
+                                      MbimDevice *device)
+{
+    DeviceContext *ctx;
+    GList         *l;
+
+    g_debug ("[%s] reseting client service subscribe lists...", mbim_device_get_path (device));
+    ctx = device_context_get (device);
+    g_assert (ctx);
+
+    /* make sure that all clients of this device don't track any event registered */
+    g_rec_mutex_lock (&self->priv->lock);
+    for (l = self->priv->clients; l; l = g_list_next (l)) {
+        Client *client;
+
+        client = l->data;
+        if (client->device != device || !client->mbim_event_entry_array)
+            continue;
+
+        g_clear_pointer (&client->mbim_event_entry_array, mbim_event_entry_array_free);
+        client->mbim_event_entry_array = _mbim_proxy_helper_service_subscribe_list_new_standard (&client->mbim_event_entry_array_size);
+        client_update_subscriptions_memory_usage (client);
+    }
+    g_rec_mutex_unlock (&self->priv->lock);
+
+    /* And reset the device-specific merged list */
+    g_clear_pointer (&ctx->mbim_event_entry_array, mbim_event_entry_array_free);
+    ctx->mbim_event_entry_array = _mbim_proxy_helper_service_subscribe_list_new_standard (&ctx->mbim_event_entry_array_size);
+}
+
+static void
+proxy_device_error_cb (MbimDevice *device,
+                       GError     *error,
+                       MbimProxy  *self)
+{
+    if (g_error_matches (error, MBIM_PROTOCOL_ERROR, MBIM_PROTOCOL_ERROR_NOT_OPENED)) {
+        g_debug ("[%s] reports as being closed...", mbim_device_get_path (device));
+        reset_client_service_subscribe_lists (self, device);
+        mbim_device_close_force (device, NULL);
+    }
+}
+
+static MbimDevice *
+peek_device_for_path (MbimProxy   *self,
+                      const gchar *path)
+{
+    MbimDevice *found = NULL;
+    GList      *l;
+
+    g_rec_mutex_lock (&self->priv->lock);
+    for (l = self->priv->devices; l; l = g_list_next (l)) {
+        /* Return if found */
+        if (g_str_equal (mbim_device_get_path ((MbimDevice *)l->data), path)) {
+            found = (MbimDevice *)l->data;
+            break;
+        }
+    }
+    g_rec_mutex_unlock (&self->priv->lock);
+
+    return found;
+}
+
+static void
+proxy_device_removed_cb (MbimDevice *device,
+                         MbimProxy  *self)
+{
+    untrack_device (self, device);
+}
+
+/* Untracking the device happens in its worker, which cannot join itself, so
+ * the worker is stopped from the main context, where workers are looked up */
+typedef struct {
+    MbimProxy *self;
+    gchar     *path;
+} DeviceWorkerRetireContext;
+
+static void
+device_worker_retire_context_free (DeviceWorkerRetireContext *ctx)
+{
+    g_object_unref (ctx->self);
+    g_free (ctx->path);
+    g_slice_free (DeviceWorkerRetireContext, ctx);
+}
+
+static gboolean
+device_worker_retire_cb (DeviceWorkerRetireContext *ctx)
+{
+    MbimProxy    *self;
+    DeviceWorker *worker;
+    GList        *l;
+
+    self = ctx->self;
+    worker = g_hash_table_lookup (self->priv->workers, ctx->path);
+    if (!worker)
+        return G_SOURCE_REMOVE;
+
+    /* Keep the worker if the device was opened again, or if new clients were
+     * routed to it in the meantime */
+    if (peek_device_for_path (self, ctx->path))
+        return G_SOURCE_REMOVE;
+
+    g_rec_mutex_lock (&self->priv->lock);
+    for (l = self->priv->clients; l; l = g_list_next (l)) {
+        if (((Client *)(l->data))->worker == worker)
+            break;
+    }
+    g_rec_mutex_unlock (&self->priv->lock);
+    if (l)
+        return G_SOURCE_REMOVE;
+
+    /* The requests still pending (e.g. the ones of the clients just removed,
+     * completed with an error) are drained before the thread is joined */
+    device_worker_stop_async (self, worker);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+device_worker_retire (MbimProxy   *self,
+                      const gchar *path)
+{
+    DeviceWorkerRetireContext *ctx;
+
+    ctx = g_slice_new0 (DeviceWorkerRetireContext);
+    ctx->self = g_object_ref (self);
+    ctx->path = g_strdup (path);
+    g_main_context_invoke_full (self->priv->context,
+                                G_PRIORITY_DEFAULT,
+                                (GSourceFunc)device_worker_retire_cb,
+                                ctx,
+                                (GDestroyNotify)device_worker_retire_context_free);
+}
+
+static void
+untrack_device (MbimProxy  *self,
+                MbimDevice *device)
+{
+    GList *l;
+    GList *to_remove = NULL;
+
+    g_debug ("[%s] untracking device...", mbim_device_get_path (device));
+
+    g_rec_mutex_lock (&self->priv->lock);
+    l = g_list_find (self->priv->devices, device);
+    g_rec_mutex_unlock (&self->priv->lock);
+    if (!l)
+        return;
+
+    /* Disconnect right away */
+    g_signal_handlers_disconnect_by_func (device, proxy_device_error_cb, self);
+    g_signal_handlers_disconnect_by_func (device, proxy_device_removed_cb, self);
+    g_signal_handlers_disconnect_by_func (device, proxy_device_indication_cb, self);
+
+    /* If pending openings ongoing, complete them with error */
+    cancel_opening_device (self, device);
+
+    /* Abort the requests still pending in the device, instead of waiting for
+     * them to time out, so that they're all completed in this context */
+    g_cancellable_cancel (peek_device_cancellable (device));
+
+    /* Lookup all clients with this device */
+    g_rec_mutex_lock (&self->priv->lock);
+    for (l = self->priv->clients; l; l = g_list_next (l)) {
+        if (((Client *)(l->data))->device == device)
+            to_remove = g_list_append (to_remove, l->data);
+    }
+    g_rec_mutex_unlock (&self->priv->lock);
+
+    /* Remove all these clients */
+    for (l = to_remove; l; l = g_list_next (l))
+        untrack_client (self, (Client *)(l->data));
+    g_list_free (to_remove);
+
+    /* And finally, remove the device */
+    g_rec_mutex_lock (&self->priv->lock);
+    self->priv->devices = g_list_remove (self->priv->devices, device);
+    g_rec_mutex_unlock (&self->priv->lock);
+    _mbim_device_set_capture (device, NULL);
+
+    /* The worker of the device is no longer needed once the device and all
+     * its clients are gone */
+    if (self->priv->device_threads)
+        device_worker_retire (self, mbim_device_get_path (device));
+
+    g_object_unref (device);
+    proxy_notify (self, PROP_N_DEVICES);
+}
+
+static void
+track_device (MbimProxy *self,
+              MbimDevice *device)
+{
+    g_signal_connect (device,
+                      MBIM_DEVICE_SIGNAL_REMOVED,
+                      G_CALLBACK (proxy_device_removed_cb),
+                      self);
+
+    g_signal_connect (device,
+                      MBIM_DEVICE_SIGNAL_ERROR,
+                      G_CALLBACK (proxy_device_error_cb),
+                      self);
+
+    g_signal_connect (device,
+                      MBIM_DEVICE_SIGNAL_INDICATE_STATUS,
+                      G_CALLBACK (proxy_device_indication_cb),
+                      self);
+
+    g_rec_mutex_lock (&self->priv->lock);
+    self->priv->devices = g_list_append (self->priv->devices, g_object_ref (device));
+    if (self->priv->capture)
+        _mbim_device_set_capture (device, self->priv->capture);
+    g_rec_mutex_unlock (&self->priv->lock);
+    proxy_notify (self, PROP_N_DEVICES);
+}
+
+/*****************************************************************************/
+/* Handoff
+ *
+ * A new proxy process may take over the devices and clients of a running one
+ * (e.g. during an upgrade), without re-opening the devices and without the
+ * clients having to reconnect.
+ *
+ * When the new proxy connects to the handoff socket, the running proxy stops
+ * accepting clients and reading new requests, and waits for the ongoing ones
+ * to complete, and for the messages received in several fragments from the
+ * devices to be fully collected. It then stops reading from the devices and
+ * writing to the clients, and passes the listening sockets, the open device
+ * files and the client connections to the new proxy using SCM_RIGHTS, along
+ * with the state associated to each of them (transaction ids, subscribe
+ * lists, partial requests and responses, messages not yet sent to the
+ * clients...), serialized as a GVariant.
+ *
+ * Once the new proxy acknowledges the handoff, the running proxy releases all
+ * its devices and clients without closing them in the other end, and emits
+ * the handed-off signal. If the handoff fails at any point, the running proxy
+ * resumes its operation as if nothing happened.
+ */
+
+static GVariant *
+event_entry_array_to_variant (MbimEventEntry **array,
+                              gsize            array_size)
+{
+    GVariantBuilder builder;
+    gsize           i;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ayau)"));
+    for (i = 0; i < array_size; i++)
+        g_variant_builder_add (&builder, "(@ay@au)",
+                               g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+                                                          &array[i]->device_service_id,
+                                                          sizeof (MbimUuid),
+                                                          sizeof (guint8)),
+                               g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32,
+                                                          array[i]->cids,
+                                                          array[i]->cids_count,
+                                                          sizeof (guint32)));
+    return g_variant_builder_end (&builder);
+}
+
+static MbimEventEntry **
+event_entry_array_from_variant (GVariant *variant,
+                                gsize    *out_size)
+{
+    MbimEventEntry **array;
+    gsize            n_entries;
+    gsize            i;
+
+    n_entries = g_variant_n_children (variant);
+    array = g_new0 (MbimEventEntry *, n_entries + 1);
+    for (i = 0; i < n_entries; i++) {
+        g_autoptr(GVariant) uuid = NULL;
+        g_autoptr(GVariant) cids = NULL;
+        gconstpointer       data;
+        gsize               n_elements;
+
+        g_variant_get_child (variant, i, "(@ay@au)", &uuid, &cids);
+        array[i] = g_new0 (MbimEventEntry, 1);
+
+        data = g_variant_get_fixed_array (uuid, &n_elements, sizeof (guint8));
+        if (n_elements == sizeof (MbimUuid))
+            memcpy (&array[i]->device_service_id, data, sizeof (MbimUuid));
+
+        data = g_variant_get_fixed_array (cids, &n_elements, sizeof (guint32));
+        array[i]->cids_count = n_elements;
+        array[i]->cids = n_elements ? g_memdup (data, sizeof (guint32) * n_elements) : NULL;
+    }
+
+    *out_size = n_entries;
+    return array;
+}
+
+static gboolean
+handoff_idle (MbimProxy *self)
+{
+    GList    *l;
+    gboolean  idle = TRUE;
+
+    if (self->priv->opening_devices)
+        return FALSE;
+
+    /* Messages received from the devices in several fragments are only
+     * handed off once all their fragments have been collected */
+    for (l = self->priv->devices; l; l = g_list_next (l)) {
+        if (_mbim_device_has_partial_transactions (MBIM_DEVICE (l->data)))
+            return FALSE;
+    }
+
+    g_rec_mutex_lock (&self->priv->lock);
+    for (l = self->priv->clients; l && idle; l = g_list_next (l)) {
+        Client *client;
+
+        /* Messages not yet sent to the client (e.g. indications, which may
+         * keep on coming) don't need to be waited for, as they're handed off */
+        client = l->data;
+        if (client->config_ongoing || client->n_pending_requests > 0)
+            idle = FALSE;
+    }
+    g_rec_mutex_unlock (&self->priv->lock);
+
+    return idle;
+}
+
+static GVariant *
+handoff_state_build (MbimProxy    *self,
+                     GUnixFDList  *fd_list,
+                     GError      **error)
+{
+    g_auto(GVariantBuilder)  devices = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a(shuqyyayaya(ayau))"));
+    g_auto(GVariantBuilder)  clients = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a(hsuuayaya(ayau)hhh)"));
+    gint                     listen_handle;
+    gint                     handoff_handle;
+    GList                   *l;
+
+    listen_handle = g_unix_fd_list_append (fd_list, g_socket_get_fd (self->priv->listen_socket), error);
+    if (listen_handle < 0)
+        return NULL;
+    handoff_handle = g_unix_fd_list_append (fd_list, g_socket_get_fd (self->priv->handoff_socket), error);
+    if (handoff_handle < 0)
+        return NULL;
+
+    for (l = self->priv->devices; l; l = g_list_next (l)) {
+        MbimDevice    *device;
+        MbimMessage   *indication;
+        DeviceContext *ctx;
+        const guint8  *partial_response;
+        gsize          partial_response_length;
+        gint           fd;
+        gint           handle;
+        guint8         ms_mbimex_version_major;
+        guint8         ms_mbimex_version_minor = 0;
+
+        /* Devices not open are not handed off; the new proxy will open them
+         * again when requested */
+        device = l->data;
+        fd = _mbim_device_get_fd (device);
+        if (fd < 0) {
+            g_debug ("[%s] device not open, not handed off", mbim_device_get_path (device));
+            continue;
+        }
+
+        handle = g_unix_fd_list_append (fd_list, fd, error);
+        if (handle < 0)
+            return NULL;
+
+        ms_mbimex_version_major = mbim_device_get_ms_mbimex_version (device, &ms_mbimex_version_minor);
+        indication = g_object_get_data (G_OBJECT (device), MBIM_DEVICE_PROXY_CONTROL_VERSION);
+        partial_response = _mbim_device_peek_partial_response (device, &partial_response_length);
+        ctx = device_context_get (device);
+
+        g_variant_builder_add (&devices, "(shuqyy@ay@ay@a(ayau))",
+                               mbim_device_get_path (device),
+                               handle,
+                               mbim_device_get_transaction_id (device),
+                               _mbim_device_get_max_control_transfer (device),
+                               ms_mbimex_version_major,
+                               ms_mbimex_version_minor,
+                               g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+                                                          indication ? indication->data : NULL,
+                                                          indication ? indication->len : 0,
+                                                          sizeof (guint8)),
+                               g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+                                                          partial_response,
+                                                          partial_response_length,
+                                                          sizeof (guint8)),
+                               event_entry_array_to_variant (ctx->mbim_event_entry_array,
+                                                             ctx->mbim_event_entry_array_size));
+    }
+
+    g_rec_mutex_lock (&self->priv->lock);
+    for (l = self->priv->clients; l; l = g_list_next (l)) {
+        g_autoptr(GByteArray) outbound = NULL;
+        Client               *client;
+        gint                  handle;
+        gint                  shm_handles[3] = { -1, -1, -1 };
+
+        client = l->data;
+        if (!client->connection)
+            continue;
+
+        handle = g_unix_fd_list_append (fd_list, g_socket_get_fd (g_socket_connection_get_socket (client->connection)), error);
+        if (handle < 0) {
+            g_rec_mutex_unlock (&self->priv->lock);
+            return NULL;
+        }
+
+        if (client->shm) {
+            gint shm_fds[3];
+            guint i;
+
+            _mbim_shm_channel_get_fds (client->shm, &shm_fds[0], &shm_fds[1], &shm_fds[2]);
+            for (i = 0; i < G_N_ELEMENTS (shm_fds); i++) {
+                shm_handles[i] = g_unix_fd_list_append (fd_list, shm_fds[i], error);
+                if (shm_handles[i] < 0) {
+                    g_rec_mutex_unlock (&self->priv->lock);
+                    return NULL;
+                }
+            }
+        }
+
+        /* Messages not yet sent, skipping what was already written of the
+         * first one */
+        outbound = g_byte_array_new ();
+        if (client->outbound) {
+            GList *m;
+            gsize  offset;
+
+            offset = client->outbound_offset;
+            for (m = client->outbound->head; m; m = g_list_next (m)) {
+                MbimMessage *message;
+
+                message = m->data;
+                g_byte_array_append (outbound, &message->data[offset], message->len - offset);
+                offset = 0;
+            }
+        }
+
+        g_variant_builder_add (&clients, "(hsuu@ay@ay@a(ayau)hhh)",
+                               handle,
+                               client->device ? mbim_device_get_path (client->device) : "",
+                               client->request_timeout_secs,
+                               client->max_pending_requests,
+                               g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+                                                          client->buffer ? client->buffer->data : NULL,
+                                                          client->buffer ? client->buffer->len : 0,
+                                                          sizeof (guint8)),
+                               g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+                                                          outbound->data,
+                                                          outbound->len,
+                                                          sizeof (guint8)),
+                               event_entry_array_to_variant (client->mbim_event_entry_array,
+                                                             client->mbim_event_entry_array_size),
+                               shm_handles[0],
+                               shm_handles[1],
+                               shm_handles[2]);
+    }
+    g_rec_mutex_unlock (&self->priv->lock);
+
+    return g_variant_ref_sink (g_variant_new ("(hh@a(shuqyyayaya(ayau))@a(hsuuayaya(ayau)hhh))",
+                                              listen_handle,
+                                              handoff_handle,
+                                              g_variant_builder_end (&devices),
+                                              g_variant_builder_end (&clients)));
+}
+
+static gboolean
+handoff_send (MbimProxy  *self,
+              GError    **error)
+{
+    g_autoptr(GUnixFDList)           fd_list = NULL;
+    g_autoptr(GSocketControlMessage) fd_message = NULL;
+    g_autoptr(GVariant)              state = NULL;
+    g_autoptr(GByteArray)            data = NULL;
+    GSocket                         *socket;
+    GOutputVector                    vector;
+    guint32                          state_size;
+    gssize                           sent;
+
+    fd_list = g_unix_fd_list_new ();
+    state = handoff_state_build (self, fd_list, error);
+    if (!state)
+        return FALSE;
+
+    if (g_unix_fd_list_get_length (fd_list) > HANDOFF_MAX_FDS) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_UNSUPPORTED,
+                     "Too many fds to hand off: %d", g_unix_fd_list_get_length (fd_list));
+        return FALSE;
+    }
+
+    /* The state is preceded by its size, and the fds go along with the
+     * first message */
+    state_size = g_variant_get_size (state);
+    data = g_byte_array_sized_new (sizeof (state_size) + state_size);
+    g_byte_array_append (data, (const guint8 *)&state_size, sizeof (state_size));
+    g_byte_array_append (data, g_variant_get_data (state), state_size);
+
+    socket = g_socket_connection_get_socket (self->priv->handoff_connection);
+    fd_message = g_unix_fd_message_new_with_fd_list (fd_list);
+    vector.buffer = data->data;
+    vector.size = data->len;
+    sent = g_socket_send_message (socket, NULL, &vector, 1, &fd_message, 1, G_SOCKET_MSG_NONE, NULL, error);
+    if (sent < 0)
+        return FALSE;
+
+    while ((gsize) sent < data->len) {
+        gssize r;
+
+        r = g_socket_send (socket, (const gchar *)&data->data[sent], data->len - sent, NULL, error);
+        if (r < 0)
+            return FALSE;
+        sent += r;
+    }
+
+    g_debug ("handoff state sent (%u bytes, %d fds), waiting for new proxy to take over...",
+             state_size, g_unix_fd_list_get_length (fd_list));
+    return TRUE;
+}
+
+static gboolean
+handoff_receive_ack (MbimProxy  *self,
+                     GError    **error)
+{
+    GSocket *socket;
+    guint8   ack = 0;
+    gssize   received;
+
+    /* The socket has a timeout, so this fails right away if the source was
+     * dispatched because it expired */
+    socket = g_socket_connection_get_socket (self->priv->handoff_connection);
+    received = g_socket_receive (socket, (gchar *)&ack, sizeof (ack), NULL, error);
+    if (received < 0)
+        return FALSE;
+    if (received == 0 || ack != HANDOFF_ACK) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "New proxy didn't take over");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+handoff_clear (MbimProxy *self)
+{
+    if (self->priv->handoff_source) {
+        g_source_destroy (self->priv->handoff_source);
+        g_source_unref (self->priv->handoff_source);
+        self->priv->handoff_source = NULL;
+    }
+    g_clear_object (&self->priv->handoff_connection);
+}
+
+/* Once the state is built, nothing else is read from the devices or written
+ * to the clients, as it is the new proxy the one that will do it */
+static void
+handoff_freeze (MbimProxy *self)
+{
+    GList *l;
+
+    for (l = self->priv->devices; l; l = g_list_next (l))
+        _mbim_device_suspend_reading (MBIM_DEVICE (l->data));
+
+    g_rec_mutex_lock (&self->priv->lock);
+    for (l = self->priv->clients; l; l = g_list_next (l))
+        client_detach ((Client *) l->data);
+    g_rec_mutex_unlock (&self->priv->lock);
+}
+
+static void
+handoff_resume (MbimProxy *self)
+{
+    GList *l;
+
+    handoff_clear (self);
+
+    for (l = self->priv->devices; l; l = g_list_next (l))
+        _mbim_device_resume_reading (MBIM_DEVICE (l->data));
+
+    g_rec_mutex_lock (&self->priv->lock);
+    for (l = self->priv->clients; l; l = g_list_next (l)) {
+        Client *client;
+
+        client = l->data;
+        if (!client->connection)
+            continue;
+        client_detach (client);
+        client_attach (client);
+        /* Requests may have been left in the ring while not reading */
+        if (client->shm)
+            _mbim_shm_channel_wakeup (client->shm);
+    }
+    g_rec_mutex_unlock (&self->priv->lock);
+
+    g_socket_service_start (self->priv->socket_service);
+    g_socket_service_start (self->priv->handoff_service);
+    g_message ("proxy operation resumed");
+}
+
+static void
+handoff_release (MbimProxy *self)
+{
+    GList *clients;
+    GList *devices;
+    GList *l;
+
+    handoff_clear (self);
+
+    g_signal_emit (self, signals[SIGNAL_HANDED_OFF], 0);
+
+    /* The listening sockets are in use by the new proxy */
+    g_clear_object (&self->priv->socket_service);
+    g_clear_object (&self->priv->listen_socket);
+    g_clear_object (&self->priv->handoff_service);
+    g_clear_object (&self->priv->handoff_socket);
+
+    /* The clients and devices belong to the new proxy now; closing the fds in
+     * this process doesn't affect the ones passed over, and no CLOSE message
+     * is sent to the devices */
+    g_rec_mutex_lock (&self->priv->lock);
+    clients = g_steal_pointer (&self->priv->clients);
+    devices = g_steal_pointer (&self->priv->devices);
+    g_rec_mutex_unlock (&self->priv->lock);
+
+    g_message ("handoff completed: %u devices and %u clients taken over by new proxy",
+               g_list_length (devices), g_list_length (clients));
+
+    g_list_foreach (clients, (GFunc) client_disconnect, NULL);
+    g_list_free_full (clients, (GDestroyNotify) client_unref);
+
+    for (l = devices; l; l = g_list_next (l)) {
+        g_signal_handlers_disconnect_by_func (l->data, proxy_device_error_cb, self);
+        g_signal_handlers_disconnect_by_func (l->data, proxy_device_removed_cb, self);
+        g_signal_handlers_disconnect_by_func (l->data, proxy_device_indication_cb, self);
+    }
+    g_list_free_full (devices, g_object_unref);
+
+    proxy_notify (self, PROP_N_CLIENTS);
+    proxy_notify (self, PROP_N_DEVICES);
+}
+
+static gboolean
+handoff_ack_cb (GSocket      *socket,
+                GIOCondition  condition,
+                MbimProxy    *self)
+{
+    g_autoptr(GError) error = NULL;
+
+    if (!handoff_receive_ack (self, &error)) {
+        g_warning ("handoff aborted: %s", error->message);
+        handoff_resume (self);
+        return G_SOURCE_REMOVE;
+    }
+
+    handoff_release (self);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+handoff_drain_cb (MbimProxy *self)
+{
+    g_autoptr(GError) error = NULL;
+
+    if (!handoff_idle (self)) {
+        if (g_get_monotonic_time () < self->priv->handoff_deadline)
+            return G_SOURCE_CONTINUE;
+        g_warning ("handoff aborted: ongoing requests didn't complete in time");
+        handoff_resume (self);
+        return G_SOURCE_REMOVE;
+    }
+
+    handoff_freeze (self);
+    if (!handoff_send (self, &error)) {
+        g_warning ("handoff aborted: %s", error->message);
+        handoff_resume (self);
+        return G_SOURCE_REMOVE;
+    }
+
+    /* The acknowledgement is waited for without blocking the main loop;
+     * nothing is read or written meanwhile, as everything is frozen */
+    g_source_destroy (self->priv->handoff_source);
+    g_source_unref (self->priv->handoff_source);
+    self->priv->handoff_source = g_socket_create_source (g_socket_connection_get_socket (self->priv->handoff_connection),
+                                                         G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                                         NULL);
+    g_source_set_callback (self->priv->handoff_source,
+                           (GSourceFunc)handoff_ack_cb,
+                           self,
+                           NULL);
+    g_source_attach (self->priv->handoff_source, self->priv->context);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+handoff_incoming_cb (GSocketService    *service,
+                     GSocketConnection *connection,
+                     GObject           *unused,
+                     MbimProxy         *self)
+{
+    g_autoptr(GCredentials)  credentials = NULL;
+    g_autoptr(GError)        error = NULL;
+    GSocket                 *socket;
+    GList                   *l;
+    uid_t                    uid;
+
+    socket = g_socket_connection_get_socket (connection);
+
+    credentials = g_socket_get_credentials (socket, &error);
+    if (!credentials) {
+        g_warning ("handoff not allowed: error getting socket credentials: %s", error->message);
+        return;
+    }
+
+    uid = g_credentials_get_unix_user (credentials, &error);
+    if (error) {
+        g_warning ("handoff not allowed: error getting unix user id: %s", error->message);
+        return;
+    }
+
+    /* Only a proxy running as the same user may take over */
+    if (uid != getuid ()) {
+        g_warning ("handoff not allowed: unexpected user id %u", (guint) uid);
+        return;
+    }
+
+    if (self->priv->handoff_connection) {
+        g_warning ("handoff not allowed: already ongoing");
+        return;
+    }
+
+    if (self->priv->device_threads) {
+        g_warning ("handoff not allowed: unsupported with device threads");
+        return;
+    }
+
+    g_message ("handoff requested: waiting for ongoing requests to complete...");
+    self->priv->handoff_connection = g_object_ref (connection);
+    g_socket_set_blocking (socket, TRUE);
+    g_socket_set_timeout (socket, HANDOFF_TIMEOUT_SECS);
+
+    /* Stop accepting new clients, which are kept in the listening socket
+     * backlog for the new proxy, and stop reading new requests */
+    g_socket_service_stop (self->priv->socket_service);
+    g_socket_service_stop (self->priv->handoff_service);
 
-    /* Keep the client info around */
-    track_client (self, client);
+    g_rec_mutex_lock (&self->priv->lock);
+    for (l = self->priv->clients; l; l = g_list_next (l)) {
+        Client *client;
 
-    client_unref (client);
+        client = l->data;
+        if (client->connection_readable_source) {
+            g_source_destroy (client->connection_readable_source);
+            g_source_unref (client->connection_readable_source);
+            client->connection_readable_source = NULL;
+        }
+    }
+    g_rec_mutex_unlock (&self->priv->lock);
+
+    self->priv->handoff_deadline = g_get_monotonic_time () + (HANDOFF_DRAIN_TIMEOUT_MS * 1000);
+    self->priv->handoff_source = g_timeout_source_new (HANDOFF_DRAIN_CHECK_MS);
+    g_source_set_callback (self->priv->handoff_source,
+                           (GSourceFunc)handoff_drain_cb,
+                           self,
+                           NULL);
+    g_source_attach (self->priv->handoff_source, self->priv->context);
 }
 
 static gboolean
-setup_socket_service (MbimProxy  *self,
-                      GError    **error)
+setup_handoff_service (MbimProxy  *self,
+                       gint        listen_fd,
+                       GError    **error)
 {
-    g_autoptr(GSocketAddress) socket_address = NULL;
-    g_autoptr(GSocket)        socket = NULL;
+    g_autoptr(GSocket) socket = NULL;
 
-    socket = g_socket_new (G_SOCKET_FAMILY_UNIX,
-                           G_SOCKET_TYPE_STREAM,
-                           G_SOCKET_PROTOCOL_DEFAULT,
-                           error);
+    socket = listen_socket_new (listen_fd, HANDOFF_SOCKET_PATH, error);
     if (!socket)
         return FALSE;
 
-    /* Bind to address */
-    socket_address = (g_unix_socket_address_new_with_type (
-                          MBIM_PROXY_SOCKET_PATH,
-                          -1,
-                          G_UNIX_SOCKET_ADDRESS_ABSTRACT));
-    if (!g_socket_bind (socket, socket_address, TRUE, error))
-        return FALSE;
-
-    g_debug ("creating UNIX socket service...");
-
-    /* Listen */
-    if (!g_socket_listen (socket, error))
-        return FALSE;
-
-    /* Create socket service */
-    self->priv->socket_service = g_socket_service_new ();
-    g_signal_connect (self->priv->socket_service, "incoming", G_CALLBACK (incoming_cb), self);
-    if (!g_socket_listener_add_socket (G_SOCKET_LISTENER (self->priv->socket_service),
+    self->priv->handoff_service = g_socket_service_new ();
+    g_signal_connect (self->priv->handoff_service, "incoming", G_CALLBACK (handoff_incoming_cb), self);
+    if (!g_socket_listener_add_socket (G_SOCKET_LISTENER (self->priv->handoff_service),
                                        socket,
                                        NULL, /* don't pass an object, will take a reference */
                                        error)) {
-        g_prefix_error (error, "Error adding socket at '%s' to socket service: ", MBIM_PROXY_SOCKET_PATH);
+        g_prefix_error (error, "Error adding socket at '%s' to handoff service: ", HANDOFF_SOCKET_PATH);
         return FALSE;
     }
 
-    g_debug ("starting UNIX socket service at '%s'...", MBIM_PROXY_SOCKET_PATH);
-    g_socket_service_start (self->priv->socket_service);
+    self->priv->handoff_socket = g_steal_pointer (&socket);
+
+    g_debug ("starting UNIX socket handoff service at '%s'...", HANDOFF_SOCKET_PATH);
+    g_socket_service_start (self->priv->handoff_service);
     return TRUE;
 }
 
-/*****************************************************************************/
-/* Device tracking */
+gboolean
+mbim_proxy_enable_handoff (MbimProxy  *self,
+                           GError    **error)
+{
+    g_return_val_if_fail (MBIM_IS_PROXY (self), FALSE);
 
-#define DEVICE_CONTEXT_TAG "device-context-tag"
-static GQuark device_context_quark;
+    if (self->priv->handoff_service)
+        return TRUE;
 
-typedef struct {
-    /* Combined events array */
-    MbimEventEntry **mbim_event_entry_array;
-    gsize            mbim_event_entry_array_size;
-} DeviceContext;
+    return setup_handoff_service (self, -1, error);
+}
 
-static void
-device_context_free (DeviceContext *ctx)
+/* The new proxy owns all the fds received, and takes them one by one */
+static gint
+handoff_take_fd (gint   *fds,
+                 gint    n_fds,
+                 gint32  handle)
 {
-    mbim_event_entry_array_free (ctx->mbim_event_entry_array);
-    g_slice_free (DeviceContext, ctx);
+    gint fd;
+
+    if (handle < 0 || handle >= n_fds)
+        return -1;
+
+    fd = fds[handle];
+    fds[handle] = -1;
+    return fd;
 }
 
-static DeviceContext *
-device_context_get (MbimDevice *device)
+static GVariant *
+handoff_receive (GSocket      *socket,
+                 GUnixFDList **out_fd_list,
+                 GError      **error)
 {
-    DeviceContext *ctx;
+    g_autoptr(GUnixFDList)   fd_list = NULL;
+    GSocketControlMessage  **messages = NULL;
+    gint                     n_messages = 0;
+    gint                     flags = 0;
+    GInputVector             vector;
+    guint32                  state_size = 0;
+    guint8                  *data;
+    gsize                    received;
+    gssize                   r;
+    gint                     i;
+
+    vector.buffer = &state_size;
+    vector.size = sizeof (state_size);
+    r = g_socket_receive_message (socket, NULL, &vector, 1, &messages, &n_messages, &flags, NULL, error);
+    if (r < 0)
+        return NULL;
 
-    if (G_UNLIKELY (!device_context_quark))
-        device_context_quark = g_quark_from_static_string (DEVICE_CONTEXT_TAG);
+    for (i = 0; i < n_messages; i++) {
+        if (!fd_list && G_IS_UNIX_FD_MESSAGE (messages[i]))
+            fd_list = g_object_ref (g_unix_fd_message_get_fd_list (G_UNIX_FD_MESSAGE (messages[i])));
+        g_object_unref (messages[i]);
+    }
+    g_free (messages);
 
-    ctx = g_object_get_qdata (G_OBJECT (device), device_context_quark);
-    if (!ctx) {
-        ctx = g_slice_new0 (DeviceContext);
-        ctx->mbim_event_entry_array = _mbim_proxy_helper_service_subscribe_list_new_standard (&ctx->mbim_event_entry_array_size);
+    if (r == 0) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "Handoff rejected by the running proxy");
+        return NULL;
+    }
 
-        g_debug ("[%s] initial device subscribe list...", mbim_device_get_path (device));
-        _mbim_proxy_helper_service_subscribe_list_debug ((const MbimEventEntry * const *)ctx->mbim_event_entry_array, ctx->mbim_event_entry_array_size);
+    if (r != sizeof (state_size) || !fd_list || state_size == 0 || state_size > HANDOFF_MAX_STATE_SIZE) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_MESSAGE,
+                     "Invalid handoff state received");
+        return NULL;
+    }
 
-        g_object_set_qdata_full (G_OBJECT (device), device_context_quark, ctx, (GDestroyNotify)device_context_free);
+    data = g_malloc (state_size);
+    for (received = 0; received < state_size; received += r) {
+        r = g_socket_receive (socket, (gchar *)&data[received], state_size - received, NULL, error);
+        if (r <= 0) {
+            if (r == 0)
+                g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_MESSAGE,
+                             "Truncated handoff state received");
+            g_free (data);
+            return NULL;
+        }
     }
 
-    return ctx;
+    *out_fd_list = g_steal_pointer (&fd_list);
+    return g_variant_ref_sink (g_variant_new_from_data (G_VARIANT_TYPE (HANDOFF_STATE_TYPE),
+                                                        data, state_size, FALSE,
+                                                        g_free, data));
 }
 
-static MbimEventEntry **
-merge_client_service_subscribe_lists (MbimProxy  *self,
-                                      MbimDevice *device,
-                                      gsize      *out_size)
+static gboolean
+handoff_adopt_device (MbimProxy  *self,
+                      GVariant   *device_state,
+                      gint       *fds,
+                      gint        n_fds,
+                      GError    **error)
 {
-    GList                          *l;
-    g_autoptr(MbimEventEntryArray)  updated = NULL;
-    gsize                           updated_size = 0;
-    DeviceContext                  *ctx;
+    g_autoptr(GVariant)    indication = NULL;
+    g_autoptr(GVariant)    partial_response = NULL;
+    g_autoptr(GVariant)    subscribe_list = NULL;
+    g_autoptr(GFile)       file = NULL;
+    g_autoptr(MbimDevice)  device = NULL;
+    const gchar           *path;
+    gint32                 handle;
+    guint32                transaction_id;
+    guint16                max_control_transfer;
+    guint8                 ms_mbimex_version_major;
+    guint8                 ms_mbimex_version_minor;
+    gconstpointer          indication_data;
+    gsize                  indication_size;
+    gconstpointer          partial_response_data;
+    gsize                  partial_response_size;
+    DeviceContext         *ctx;
+    gint                   fd;
+
+    g_variant_get (device_state, "(&shuqyy@ay@ay@a(ayau))",
+                   &path,
+                   &handle,
+                   &transaction_id,
+                   &max_control_transfer,
+                   &ms_mbimex_version_major,
+                   &ms_mbimex_version_minor,
+                   &indication,
+                   &partial_response,
+                   &subscribe_list);
+
+    fd = handoff_take_fd (fds, n_fds, handle);
+    if (fd < 0) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_MESSAGE,
+                     "Invalid fd handed off for device '%s'", path);
+        return FALSE;
+    }
 
-    g_debug ("[%s] merging client service subscribe lists...", mbim_device_get_path (device));
+    /* The device was already validated and opened by the previous proxy,
+     * which may have read part of a message already */
+    partial_response_data = g_variant_get_fixed_array (partial_response, &partial_response_size, sizeof (guint8));
+    file = g_file_new_for_path (path);
+    device = g_object_new (MBIM_TYPE_DEVICE, MBIM_DEVICE_FILE, file, NULL);
+    if (!_mbim_device_adopt_fd (device, fd, transaction_id, max_control_transfer,
+                                partial_response_data, partial_response_size, error)) {
+        g_prefix_error (error, "Couldn't adopt device '%s': ", path);
+        return FALSE;
+    }
+    mbim_device_set_ms_mbimex_version (device, ms_mbimex_version_major, ms_mbimex_version_minor, NULL);
+
+    indication_data = g_variant_get_fixed_array (indication, &indication_size, sizeof (guint8));
+    if (indication_size > 0)
+        g_object_set_data_full (G_OBJECT (device),
+                                MBIM_DEVICE_PROXY_CONTROL_VERSION,
+                                mbim_message_new (indication_data, indication_size),
+                                (GDestroyNotify)mbim_message_unref);
+
+    /* The device is already subscribed to the merged list of the clients */
     ctx = device_context_get (device);
-    g_assert (ctx);
+    g_clear_pointer (&ctx->mbim_event_entry_array, mbim_event_entry_array_free);
+    ctx->mbim_event_entry_array = event_entry_array_from_variant (subscribe_list, &ctx->mbim_event_entry_array_size);
 
-    g_assert (out_size != NULL);
+    g_debug ("[%s] device handed off (transaction id %u)", path, transaction_id);
+    track_device (self, device);
+    return TRUE;
+}
 
-    /* Init default list */
-    updated = _mbim_proxy_helper_service_subscribe_list_new_standard (&updated_size);
+static gboolean
+handoff_adopt_client (MbimProxy  *self,
+                      GVariant   *client_state,
+                      gint       *fds,
+                      gint        n_fds,
+                      GError    **error)
+{
+    g_autoptr(GVariant)          buffer = NULL;
+    g_autoptr(GVariant)          outbound = NULL;
+    g_autoptr(GVariant)          subscribe_list = NULL;
+    g_autoptr(GSocket)           socket = NULL;
+    g_autoptr(GSocketConnection) connection = NULL;
+    const gchar                 *device_path;
+    gint32                       handle;
+    gint32                       shm_handles[3];
+    guint32                      request_timeout_secs;
+    guint32                      max_pending_requests;
+    gconstpointer                buffer_data;
+    gsize                        buffer_size;
+    gconstpointer                outbound_data;
+    gsize                        outbound_size;
+    Client                      *client;
+    gint                         fd;
+
+    g_variant_get (client_state, "(h&suu@ay@ay@a(ayau)hhh)",
+                   &handle,
+                   &device_path,
+                   &request_timeout_secs,
+                   &max_pending_requests,
+                   &buffer,
+                   &outbound,
+                   &subscribe_list,
+                   &shm_handles[0],
+                   &shm_handles[1],
+                   &shm_handles[2]);
+
+    fd = handoff_take_fd (fds, n_fds, handle);
+    if (fd < 0) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_MESSAGE,
+                     "Invalid fd handed off for client");
+        return FALSE;
+    }
 
-    /* Lookup all clients with this device */
-    for (l = self->priv->clients; l; l = g_list_next (l)) {
-        Client *client;
+    socket = g_socket_new_from_fd (fd, error);
+    if (!socket) {
+        close (fd);
+        return FALSE;
+    }
+    connection = g_socket_connection_factory_create_connection (socket);
 
-        client = l->data;
-        if (!client->mbim_event_entry_array)
-            continue;
+    client_id++;
+    client = client_new (self, connection);
+    client->request_timeout_secs = request_timeout_secs;
+    client->max_pending_requests = max_pending_requests;
 
-        /* Add per-client list */
-        if (client->device == device)
-            updated = _mbim_proxy_helper_service_subscribe_list_merge (updated, updated_size,
-                                                                       client->mbim_event_entry_array, client->mbim_event_entry_array_size,
-                                                                       &updated_size);
+    if (device_path[0]) {
+        MbimDevice *device;
+
+        device = peek_device_for_path (self, device_path);
+        if (device)
+            client_set_device (client, device);
+        else
+            g_debug ("[client %lu] device '%s' not handed off", client->id, device_path);
     }
 
-    /* If lists are equal, ignore re-setting them up */
-    if (_mbim_proxy_helper_service_subscribe_list_cmp (
-            (const MbimEventEntry *const *)updated, updated_size,
-            (const MbimEventEntry *const *)ctx->mbim_event_entry_array, ctx->mbim_event_entry_array_size)) {
-        g_debug ("[%s] merged service subscribe list not updated", mbim_device_get_path (device));
-        return NULL;
+    g_clear_pointer (&client->mbim_event_entry_array, mbim_event_entry_array_free);
+    client->mbim_event_entry_array = event_entry_array_from_variant (subscribe_list, &client->mbim_event_entry_array_size);
+    client_update_subscriptions_memory_usage (client);
+
+    /* Partial request received by the previous proxy */
+    buffer_data = g_variant_get_fixed_array (buffer, &buffer_size, sizeof (guint8));
+    if (buffer_size > 0) {
+        client->buffer = g_byte_array_sized_new (MAX (buffer_size, client->read_size));
+        g_byte_array_append (client->buffer, buffer_data, buffer_size);
+        memory_usage_update (&client->memory.receive_buffer, &client->memory.receive_buffer_peak, buffer_size);
     }
 
-    /* Lists are different, update stored one */
-    g_clear_pointer (&ctx->mbim_event_entry_array, mbim_event_entry_array_free);
-    ctx->mbim_event_entry_array = g_steal_pointer (&updated);
-    ctx->mbim_event_entry_array_size = updated_size;
+    /* Messages not yet sent by the previous proxy, queued as a whole; they
+     * are written as they are, so they don't need to be split */
+    outbound_data = g_variant_get_fixed_array (outbound, &outbound_size, sizeof (guint8));
+    if (outbound_size > 0) {
+        g_queue_push_tail (client->outbound, mbim_message_new (outbound_data, outbound_size));
+        memory_usage_update (&client->memory.outbound, &client->memory.outbound_peak,
+                             client->memory.outbound + outbound_size);
+    }
 
-    if (mbim_utils_get_traces_enabled ()) {
-        g_debug ("[%s] merged service subscribe list built", mbim_device_get_path (device));
-        _mbim_proxy_helper_service_subscribe_list_debug ((const MbimEventEntry * const *)ctx->mbim_event_entry_array,
-                                                         ctx->mbim_event_entry_array_size);
+    if (shm_handles[0] >= 0) {
+        /* The channel takes ownership of the fds, even on error */
+        client->shm = _mbim_shm_channel_new_proxy_from_fds (handoff_take_fd (fds, n_fds, shm_handles[0]),
+                                                            handoff_take_fd (fds, n_fds, shm_handles[1]),
+                                                            handoff_take_fd (fds, n_fds, shm_handles[2]),
+                                                            error);
+        if (!client->shm) {
+            client_unref (client);
+            return FALSE;
+        }
     }
 
-    *out_size = ctx->mbim_event_entry_array_size;
-    return ctx->mbim_event_entry_array;
+    g_debug ("[client %lu] client handed off", client->id);
+    client_attach (client);
+    track_client (self, client);
+
+    /* Requests may have been left in the ring by the previous proxy */
+    if (client->shm)
+        _mbim_shm_channel_wakeup (client->shm);
+
+    client_unref (client);
+    return TRUE;
 }
 
-static void
-reset_client_service_subscribe_lists (MbimProxy  *self,
-                                      MbimDevice *device)
+static gboolean
+handoff_adopt (MbimProxy    *self,
+               GVariant     *state,
+               GUnixFDList  *fd_list,
+               GError      **error)
 {
-    DeviceContext *ctx;
-    GList         *l;
-
-    g_debug ("[%s] reseting client service subscribe lists...", mbim_device_get_path (device));
-    ctx = device_context_get (device);
-    g_assert (ctx);
+    g_autoptr(GVariant)  devices = NULL;
+    g_autoptr(GVariant)  clients = NULL;
+    gint32               listen_handle;
+    gint32               handoff_handle;
+    gint                 listen_fd;
+    gint                 handoff_fd;
+    gint                *fds;
+    gint                 n_fds = 0;
+    gsize                i;
+    gboolean             success = FALSE;
+
+    g_variant_get (state, "(hh@a(shuqyyayaya(ayau))@a(hsuuayaya(ayau)hhh))",
+                   &listen_handle,
+                   &handoff_handle,
+                   &devices,
+                   &clients);
+
+    fds = g_unix_fd_list_steal_fds (fd_list, &n_fds);
+
+    listen_fd = handoff_take_fd (fds, n_fds, listen_handle);
+    handoff_fd = handoff_take_fd (fds, n_fds, handoff_handle);
+    if (listen_fd < 0 || handoff_fd < 0) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_MESSAGE,
+                     "Invalid listening sockets handed off");
+        if (listen_fd >= 0)
+            close (listen_fd);
+        if (handoff_fd >= 0)
+            close (handoff_fd);
+        goto out;
+    }
 
-    /* make sure that all clients of this device don't track any event registered */
-    for (l = self->priv->clients; l; l = g_list_next (l)) {
-        Client *client;
+    /* Both take ownership of the fds, even on error */
+    if (!setup_socket_service (self, listen_fd, error)) {
+        close (handoff_fd);
+        goto out;
+    }
+    if (!setup_handoff_service (self, handoff_fd, error))
+        goto out;
 
-        client = l->data;
-        if (!client->mbim_event_entry_array)
-            continue;
+    /* Devices first, so that clients are associated to them */
+    for (i = 0; i < g_variant_n_children (devices); i++) {
+        g_autoptr(GVariant) device_state = NULL;
 
-        if (client->device == device) {
-            g_clear_pointer (&client->mbim_event_entry_array, mbim_event_entry_array_free);
-            client->mbim_event_entry_array = _mbim_proxy_helper_service_subscribe_list_new_standard (&client->mbim_event_entry_array_size);
-        }
+        device_state = g_variant_get_child_value (devices, i);
+        if (!handoff_adopt_device (self, device_state, fds, n_fds, error))
+            goto out;
     }
 
-    /* And reset the device-specific merged list */
-    g_clear_pointer (&ctx->mbim_event_entry_array, mbim_event_entry_array_free);
-    ctx->mbim_event_entry_array = _mbim_proxy_helper_service_subscribe_list_new_standard (&ctx->mbim_event_entry_array_size);
-}
+    for (i = 0; i < g_variant_n_children (clients); i++) {
+        g_autoptr(GVariant) client_state = NULL;
 
-static void
-proxy_device_error_cb (MbimDevice *device,
-                       GError     *error,
-                       MbimProxy  *self)
-{
-    if (g_error_matches (error, MBIM_PROTOCOL_ERROR, MBIM_PROTOCOL_ERROR_NOT_OPENED)) {
-        g_debug ("[%s] reports as being closed...", mbim_device_get_path (device));
-        reset_client_service_subscribe_lists (self, device);
-        mbim_device_close_force (device, NULL);
+        client_state = g_variant_get_child_value (clients, i);
+        if (!handoff_adopt_client (self, client_state, fds, n_fds, error))
+            goto out;
     }
-}
 
-static MbimDevice *
-peek_device_for_path (MbimProxy   *self,
-                      const gchar *path)
-{
-    GList *l;
+    success = TRUE;
 
-    for (l = self->priv->devices; l; l = g_list_next (l)) {
-        /* Return if found */
-        if (g_str_equal (mbim_device_get_path ((MbimDevice *)l->data), path))
-            return (MbimDevice *)l->data;
+out:
+    /* Close any fd not taken */
+    for (i = 0; i < (gsize) n_fds; i++) {
+        if (fds[i] >= 0)
+            close (fds[i]);
     }
-
-    return NULL;
+    g_free (fds);
+    return success;
 }
 
-static void
-proxy_device_removed_cb (MbimDevice *device,
-                         MbimProxy  *self)
+MbimProxy *
+mbim_proxy_new_from_handoff (GError **error)
 {
-    untrack_device (self, device);
-}
+    g_autoptr(MbimProxy)         self = NULL;
+    g_autoptr(GSocketClient)     socket_client = NULL;
+    g_autoptr(GSocketAddress)    socket_address = NULL;
+    g_autoptr(GSocketConnection) connection = NULL;
+    g_autoptr(GUnixFDList)       fd_list = NULL;
+    g_autoptr(GVariant)          state = NULL;
+    GSocket                     *socket;
+    guint8                       ack = HANDOFF_ACK;
 
-static void
-untrack_device (MbimProxy  *self,
-                MbimDevice *device)
-{
-    GList *l;
-    GList *to_remove = NULL;
+    if (!mbim_helpers_check_user_allowed (getuid(), error))
+        return NULL;
 
-    g_debug ("[%s] untracking device...", mbim_device_get_path (device));
+    socket_client = g_socket_client_new ();
+    g_socket_client_set_family (socket_client, G_SOCKET_FAMILY_UNIX);
+    g_socket_client_set_socket_type (socket_client, G_SOCKET_TYPE_STREAM);
+    g_socket_client_set_protocol (socket_client, G_SOCKET_PROTOCOL_DEFAULT);
+    /* The running proxy may need to wait for ongoing requests first */
+    g_socket_client_set_timeout (socket_client, HANDOFF_TIMEOUT_SECS + (HANDOFF_DRAIN_TIMEOUT_MS / 1000));
 
-    if (!g_list_find (self->priv->devices, device))
-        return;
+    socket_address = g_unix_socket_address_new_with_type (HANDOFF_SOCKET_PATH, -1, G_UNIX_SOCKET_ADDRESS_ABSTRACT);
+    connection = g_socket_client_connect (socket_client, G_SOCKET_CONNECTABLE (socket_address), NULL, error);
+    if (!connection)
+        return NULL;
 
-    /* Disconnect right away */
-    g_signal_handlers_disconnect_by_func (device, proxy_device_error_cb, self);
-    g_signal_handlers_disconnect_by_func (device, proxy_device_removed_cb, self);
+    g_debug ("requesting handoff to running proxy...");
+    socket = g_socket_connection_get_socket (connection);
+    state = handoff_receive (socket, &fd_list, error);
+    if (!state)
+        return NULL;
 
-    /* If pending openings ongoing, complete them with error */
-    cancel_opening_device (self, device);
+    self = g_object_new (MBIM_TYPE_PROXY, NULL);
+    if (!handoff_adopt (self, state, fd_list, error))
+        return NULL;
 
-    /* Lookup all clients with this device */
-    for (l = self->priv->clients; l; l = g_list_next (l)) {
-        if (((Client *)(l->data))->device == device)
-            to_remove = g_list_append (to_remove, l->data);
+    /* Nothing has been read from the devices or clients yet, so if the ack
+     * cannot be sent the previous proxy just resumes its operation */
+    if (g_socket_send (socket, (const gchar *)&ack, sizeof (ack), NULL, error) < 0) {
+        g_prefix_error (error, "Couldn't acknowledge handoff: ");
+        return NULL;
     }
 
-    /* Remove all these clients */
-    for (l = to_remove; l; l = g_list_next (l))
-        untrack_client (self, (Client *)(l->data));
-    g_list_free (to_remove);
-
-    /* And finally, remove the device */
-    self->priv->devices = g_list_remove (self->priv->devices, device);
-    g_object_unref (device);
-    g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_N_DEVICES]);
+    g_message ("took over %u devices and %u clients from previous proxy",
+               g_list_length (self->priv->devices), g_list_length (self->priv->clients));
+    return g_steal_pointer (&self);
 }
 
-static void
-track_device (MbimProxy *self,
-              MbimDevice *device)
+/*****************************************************************************/
+
+MbimProxy *
+mbim_proxy_new (GError **error)
 {
-    g_signal_connect (device,
-                      MBIM_DEVICE_SIGNAL_REMOVED,
-                      G_CALLBACK (proxy_device_removed_cb),
-                      self);
+    g_autoptr(MbimProxy) self = NULL;
 
-    g_signal_connect (device,
-                      MBIM_DEVICE_SIGNAL_ERROR,
-                      G_CALLBACK (proxy_device_error_cb),
-                      self);
+    if (!mbim_helpers_check_user_allowed (getuid(), error))
+        return NULL;
 
-    self->priv->devices = g_list_append (self->priv->devices, g_object_ref (device));
-    g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_N_DEVICES]);
-}
+    self = g_object_new (MBIM_TYPE_PROXY, NULL);
+    if (!setup_socket_service (self, -1, error))
+        return NULL;
 
-/*****************************************************************************/
+    return g_steal_pointer (&self);
+}
 
 MbimProxy *
-mbim_proxy_new (GError **error)
+mbim_proxy_new_with_listen_fd (gint     fd,
+                               GError **error)
 {
     g_autoptr(MbimProxy) self = NULL;
 
-    if (!mbim_helpers_check_user_allowed (getuid(), error))
+    g_return_val_if_fail (fd >= 0, NULL);
+
+    if (!mbim_helpers_check_user_allowed (getuid(), error)) {
+        close (fd);
         return NULL;
+    }
 
     self = g_object_new (MBIM_TYPE_PROXY, NULL);
-    if (!setup_socket_service (self, error))
+    if (!setup_socket_service (self, fd, error))
         return NULL;
 
     return g_steal_pointer (&self);
@@ -1598,6 +4132,9 @@ static void
 mbim_proxy_init (MbimProxy *self)
 {
     self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, MBIM_TYPE_PROXY, MbimProxyPrivate);
+    self->priv->context = g_main_context_ref_thread_default ();
+    self->priv->workers = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)device_worker_free);
+    g_rec_mutex_init (&self->priv->lock);
 }
 
 static void
@@ -1610,10 +4147,10 @@ get_property (GObject    *object,
 
     switch (prop_id) {
     case PROP_N_CLIENTS:
-        g_value_set_uint (value, g_list_length (self->priv->clients));
+        g_value_set_uint (value, mbim_proxy_get_n_clients (self));
         break;
     case PROP_N_DEVICES:
-        g_value_set_uint (value, g_list_length (self->priv->devices));
+        g_value_set_uint (value, mbim_proxy_get_n_devices (self));
         break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
@@ -1624,17 +4161,29 @@ get_property (GObject    *object,
 static void
 dispose (GObject *object)
 {
-    MbimProxyPrivate *priv = MBIM_PROXY (object)->priv;
+    MbimProxy        *self = MBIM_PROXY (object);
+    MbimProxyPrivate *priv = self->priv;
+    GList            *l;
 
     /* This list should always be empty when disposing */
     g_assert (priv->opening_devices == NULL);
 
+    /* Stop all device workers before releasing the clients and devices they
+     * handle; the worker contexts are kept until those are released */
+    if (priv->workers)
+        g_hash_table_foreach (priv->workers, (GHFunc)device_worker_stop_foreach, NULL);
+
     if (priv->clients) {
+        /* Disconnect explicitly, so that pending outbound flushes don't keep
+         * the clients alive */
+        g_list_foreach (priv->clients, (GFunc) client_disconnect, NULL);
         g_list_free_full (priv->clients, (GDestroyNotify) client_unref);
         priv->clients = NULL;
     }
 
     if (priv->devices) {
+        for (l = priv->devices; l; l = g_list_next (l))
+            g_signal_handlers_disconnect_by_func (l->data, proxy_device_indication_cb, self);
         g_list_free_full (priv->devices, g_object_unref);
         priv->devices = NULL;
     }
@@ -1646,10 +4195,31 @@ dispose (GObject *object)
         g_unlink (MBIM_PROXY_SOCKET_PATH);
         g_debug ("UNIX socket service at '%s' stopped", MBIM_PROXY_SOCKET_PATH);
     }
+    g_clear_object (&priv->listen_socket);
+
+    handoff_clear (self);
+    if (priv->handoff_service) {
+        if (g_socket_service_is_active (priv->handoff_service))
+            g_socket_service_stop (priv->handoff_service);
+        g_clear_object (&priv->handoff_service);
+    }
+    g_clear_object (&priv->handoff_socket);
+
+    g_clear_pointer (&priv->workers, g_hash_table_unref);
+    g_clear_pointer (&priv->context, g_main_context_unref);
+    g_clear_pointer (&priv->capture, _mbim_capture_unref);
 
     G_OBJECT_CLASS (mbim_proxy_parent_class)->dispose (object);
 }
 
+static void
+finalize (GObject *object)
+{
+    g_rec_mutex_clear (&MBIM_PROXY (object)->priv->lock);
+
+    G_OBJECT_CLASS (mbim_proxy_parent_class)->finalize (object);
+}
+
 static void
 mbim_proxy_class_init (MbimProxyClass *proxy_class)
 {
@@ -1660,6 +4230,7 @@ mbim_proxy_class_init (MbimProxyClass *proxy_class)
     /* Virtual methods */
     object_class->get_property = get_property;
     object_class->dispose = dispose;
+    object_class->finalize = finalize;
 
     /**
      * MbimProxy:mbim-proxy-n-clients
@@ -1690,4 +4261,20 @@ mbim_proxy_class_init (MbimProxyClass *proxy_class)
                            0,
                            G_PARAM_READABLE);
     g_object_class_install_property (object_class, PROP_N_DEVICES, properties[PROP_N_DEVICES]);
+
+    /**
+     * MbimProxy::mbim-proxy-handed-off:
+     * @self: the #MbimProxy
+     *
+     * The ::mbim-proxy-handed-off signal is emitted when a new proxy has taken
+     * over all the devices and clients of this one.
+     *
+     * Since: 1.30
+     */
+    signals[SIGNAL_HANDED_OFF] =
+        g_signal_new (MBIM_PROXY_SIGNAL_HANDED_OFF,
+                      G_OBJECT_CLASS_TYPE (G_OBJECT_CLASS (proxy_class)),
+                      G_SIGNAL_RUN_LAST,
+                      0, NULL, NULL, NULL,
+                      G_TYPE_NONE, 0);
 }
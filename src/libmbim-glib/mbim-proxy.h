@@ -17,6 +17,8 @@
 #include <glib-object.h>
 #include <gio/gio.h>
 
+#include "mbim-device.h"
+
 G_BEGIN_DECLS
 
 /**
@@ -71,6 +73,15 @@ typedef struct _MbimProxyPrivate MbimProxyPrivate;
  */
 #define MBIM_PROXY_N_DEVICES "mbim-proxy-n-devices"
 
+/**
+ * MBIM_PROXY_SIGNAL_HANDED_OFF:
+ *
+ * Symbol defining the #MbimProxy::mbim-proxy-handed-off signal.
+ *
+ * Since: 1.30
+ */
+#define MBIM_PROXY_SIGNAL_HANDED_OFF "mbim-proxy-handed-off"
+
 /**
  * MbimProxy:
  *
@@ -103,6 +114,66 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC (MbimProxy, g_object_unref)
  */
 MbimProxy *mbim_proxy_new (GError **error);
 
+/**
+ * mbim_proxy_new_with_listen_fd:
+ * @fd: a file descriptor of an already bound and listening unix socket.
+ * @error: Return location for error or %NULL.
+ *
+ * Creates a #MbimProxy object accepting connections in the given socket,
+ * instead of creating and binding its own one. This allows the proxy to be
+ * socket activated.
+ *
+ * The #MbimProxy takes ownership of @fd, even on failure.
+ *
+ * Returns: (transfer full): a newly created #MbimProxy, or #NULL if @error is set.
+ *
+ * Since: 1.30
+ */
+MbimProxy *mbim_proxy_new_with_listen_fd (gint     fd,
+                                          GError **error);
+
+/**
+ * mbim_proxy_new_from_handoff:
+ * @error: Return location for error or %NULL.
+ *
+ * Creates a #MbimProxy object taking over all the devices and clients of an
+ * already running #MbimProxy which has handoff enabled with
+ * mbim_proxy_enable_handoff().
+ *
+ * The running proxy waits for its ongoing requests to complete, and then
+ * passes its listening socket, its open devices and its client connections to
+ * the new one, so that the devices are not re-opened and the clients don't
+ * need to reconnect. Once done, the running proxy emits the
+ * #MbimProxy::mbim-proxy-handed-off signal.
+ *
+ * The new #MbimProxy has handoff enabled as well.
+ *
+ * Returns: (transfer full): a newly created #MbimProxy, or #NULL if @error is
+ * set. If there is no running proxy accepting the handoff, the error will be
+ * %G_IO_ERROR_CONNECTION_REFUSED.
+ *
+ * Since: 1.30
+ */
+MbimProxy *mbim_proxy_new_from_handoff (GError **error);
+
+/**
+ * mbim_proxy_enable_handoff:
+ * @self: a #MbimProxy.
+ * @error: Return location for error or %NULL.
+ *
+ * Allows a new proxy process to take over all the devices and clients
+ * managed by @self, using mbim_proxy_new_from_handoff().
+ *
+ * Handoff is not supported when device threads are enabled with
+ * mbim_proxy_set_device_threads().
+ *
+ * Returns: %TRUE if handoff was enabled, %FALSE if @error is set.
+ *
+ * Since: 1.30
+ */
+gboolean mbim_proxy_enable_handoff (MbimProxy  *self,
+                                    GError    **error);
+
 /**
  * mbim_proxy_get_n_clients: (skip)
  * @self: a #MbimProxy.
@@ -127,6 +198,100 @@ guint mbim_proxy_get_n_clients (MbimProxy *self);
  */
 guint mbim_proxy_get_n_devices (MbimProxy *self);
 
+/**
+ * mbim_proxy_set_device_threads:
+ * @self: a #MbimProxy.
+ * @enabled: %TRUE to handle each device in its own thread.
+ *
+ * Configures whether each device managed by the proxy, along with all the
+ * clients using it, should be handled in a separate thread running its own
+ * #GMainContext. New connections and proxy configuration requests are always
+ * handled in the main context where the proxy was created.
+ *
+ * This setting must be applied before any client connects to the proxy.
+ *
+ * Since: 1.30
+ */
+void mbim_proxy_set_device_threads (MbimProxy *self,
+                                    gboolean   enabled);
+
+/**
+ * mbim_proxy_get_client_memory_usage:
+ * @self: a #MbimProxy.
+ *
+ * Gets the memory used by the proxy on behalf of each of the clients
+ * currently connected.
+ *
+ * The values of the clients handled in device threads are read in their own
+ * threads, so this method must be called from the #GMainContext where the
+ * proxy was created.
+ *
+ * Returns: (transfer full) (element-type MbimProxyClientMemoryUsage): a
+ *  #GArray of #MbimProxyClientMemoryUsage, one for each client. The returned
+ *  value should be freed with g_array_unref().
+ *
+ * Since: 1.30
+ */
+GArray *mbim_proxy_get_client_memory_usage (MbimProxy *self);
+
+/**
+ * mbim_proxy_set_client_memory_limit:
+ * @self: a #MbimProxy.
+ * @limit: maximum number of bytes, or 0 to disable the limit.
+ *
+ * Sets the maximum amount of memory the proxy may use on behalf of each
+ * client, as reported by mbim_proxy_get_client_memory_usage().
+ *
+ * Requests that would take a client above the limit are rejected right away
+ * with a %MBIM_STATUS_ERROR_BUSY status. Indications that don't fit in the
+ * queue of messages pending to be sent to a client are discarded, and
+ * clients that don't read their responses, or that send messages larger than
+ * the limit, are disconnected.
+ *
+ * When no limit is set, clients are only disconnected if they don't read the
+ * messages sent to them at all, once several megabytes are pending.
+ *
+ * Since: 1.30
+ */
+void mbim_proxy_set_client_memory_limit (MbimProxy *self,
+                                         guint64    limit);
+
+/**
+ * mbim_proxy_start_capture:
+ * @self: a #MbimProxy.
+ * @path: path of the capture file.
+ * @max_file_size: size in bytes after which the capture file is rotated, or
+ *  0 to never rotate it.
+ * @max_files: maximum number of capture files to keep when rotating,
+ *  including the one being written.
+ * @error: Return location for error or %NULL.
+ *
+ * Starts capturing the MBIM messages exchanged with all the devices managed
+ * by the proxy, including the ones opened later, into a single pcapng file.
+ * Each device is shown as a different interface in the capture.
+ *
+ * See mbim_device_start_capture() for details.
+ *
+ * Returns: %TRUE if the capture was started, %FALSE if @error is set.
+ *
+ * Since: 1.30
+ */
+gboolean mbim_proxy_start_capture (MbimProxy    *self,
+                                   const gchar  *path,
+                                   guint64       max_file_size,
+                                   guint         max_files,
+                                   GError      **error);
+
+/**
+ * mbim_proxy_stop_capture:
+ * @self: a #MbimProxy.
+ *
+ * Stops the capture started with mbim_proxy_start_capture(), if any.
+ *
+ * Since: 1.30
+ */
+void mbim_proxy_stop_capture (MbimProxy *self);
+
 G_END_DECLS
 
 #endif /* MBIM_PROXY_H */
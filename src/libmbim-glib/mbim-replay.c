@@ -0,0 +1,883 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * libmbim-glib -- GLib/GIO based library to control MBIM devices
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+
+#include "config.h"
+#include "mbim-replay.h"
+#include "mbim-device-private.h"
+#include "mbim-message.h"
+#include "mbim-message-private.h"
+#include "mbim-error-types.h"
+#include "mbim-errors.h"
+
+/*****************************************************************************/
+
+#define PCAPNG_BLOCK_TYPE_SHB    0x0A0D0D0A
+#define PCAPNG_BLOCK_TYPE_IDB    0x00000001
+#define PCAPNG_BLOCK_TYPE_EPB    0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC  0x1A2B3C4D
+#define PCAPNG_OPT_ENDOFOPT      0
+#define PCAPNG_OPT_IF_TSRESOL    9
+
+#define LINKTYPE_WIRESHARK_UPPER_PDU 252
+#define EXP_PDU_TAG_END_OF_OPT       0
+
+/* Header of every MBIM message, plus the fragment header of the ones that
+ * may be fragmented */
+#define MESSAGE_HEADER_SIZE  12
+#define FRAGMENT_HEADER_SIZE 20
+
+typedef struct {
+    gint64      timestamp;
+    GByteArray *data;
+} Record;
+
+struct _MbimReplay {
+    GArray *records;
+};
+
+/*****************************************************************************/
+
+static guint32
+read_guint32 (const guint8 *data,
+              gboolean      swapped)
+{
+    guint32 value;
+
+    memcpy (&value, data, sizeof (value));
+    return swapped ? GUINT32_SWAP_LE_BE (value) : value;
+}
+
+static guint16
+read_guint16 (const guint8 *data,
+              gboolean      swapped)
+{
+    guint16 value;
+
+    memcpy (&value, data, sizeof (value));
+    return swapped ? GUINT16_SWAP_LE_BE (value) : value;
+}
+
+static void
+record_clear (Record *record)
+{
+    g_byte_array_unref (record->data);
+}
+
+static void
+replay_add (MbimReplay   *self,
+            gint64        timestamp,
+            const guint8 *data,
+            gsize         length)
+{
+    Record record;
+
+    /* Only complete messages can be replayed */
+    if (length < MESSAGE_HEADER_SIZE || read_guint32 (&data[4], G_BYTE_ORDER == G_BIG_ENDIAN) != length) {
+        g_debug ("ignoring %" G_GSIZE_FORMAT " bytes in capture: not a complete message", length);
+        return;
+    }
+
+    record.timestamp = timestamp;
+    record.data = g_byte_array_sized_new (length);
+    g_byte_array_append (record.data, data, length);
+    g_array_append_val (self->records, record);
+}
+
+/*****************************************************************************/
+/* pcapng */
+
+typedef struct {
+    guint16 linktype;
+    gdouble ts_to_usec;
+} Interface;
+
+static gdouble
+parse_tsresol (guint8 tsresol)
+{
+    gdouble units = 1.0;
+    guint   i;
+
+    /* Negative power of 2 or of 10 of a second */
+    for (i = 0; i < (guint) (tsresol & 0x7F); i++)
+        units *= (tsresol & 0x80) ? 2.0 : 10.0;
+    return G_USEC_PER_SEC / units;
+}
+
+static gboolean
+load_pcapng (MbimReplay    *self,
+             const guint8  *contents,
+             gsize          length,
+             guint          interface_id,
+             GError       **error)
+{
+    g_autoptr(GArray) interfaces = NULL;
+    gboolean          swapped = FALSE;
+    gsize             offset = 0;
+
+    interfaces = g_array_new (FALSE, FALSE, sizeof (Interface));
+
+    while (offset + 12 <= length) {
+        const guint8 *body;
+        gsize         body_length;
+        guint32       type;
+        guint32       total;
+
+        /* The section header type is the same in both byte orders */
+        type = read_guint32 (&contents[offset], swapped);
+        if (type == PCAPNG_BLOCK_TYPE_SHB) {
+            guint32 magic;
+
+            magic = read_guint32 (&contents[offset + 8], FALSE);
+            if (magic == PCAPNG_BYTE_ORDER_MAGIC)
+                swapped = FALSE;
+            else if (GUINT32_SWAP_LE_BE (magic) == PCAPNG_BYTE_ORDER_MAGIC)
+                swapped = TRUE;
+            else {
+                g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_MESSAGE,
+                             "Invalid pcapng section header");
+                return FALSE;
+            }
+            /* Interfaces are defined per section */
+            g_array_set_size (interfaces, 0);
+        }
+
+        total = read_guint32 (&contents[offset + 4], swapped);
+        if (total < 12 || (total % 4) || total > length - offset) {
+            g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_MESSAGE,
+                         "Invalid pcapng block at offset %" G_GSIZE_FORMAT, offset);
+            return FALSE;
+        }
+        body = &contents[offset + 8];
+        body_length = total - 12;
+        offset += total;
+
+        if (type == PCAPNG_BLOCK_TYPE_IDB && body_length >= 8) {
+            Interface iface;
+            gsize     option = 8;
+
+            iface.linktype = read_guint16 (body, swapped);
+            iface.ts_to_usec = 1.0;
+            while (option + 4 <= body_length) {
+                guint16 code;
+                guint16 option_length;
+
+                code = read_guint16 (&body[option], swapped);
+                option_length = read_guint16 (&body[option + 2], swapped);
+                if (code == PCAPNG_OPT_ENDOFOPT || option + 4 + option_length > body_length)
+                    break;
+                if (code == PCAPNG_OPT_IF_TSRESOL && option_length == 1)
+                    iface.ts_to_usec = parse_tsresol (body[option + 4]);
+                option += 4 + ((option_length + 3) & ~3);
+            }
+            g_array_append_val (interfaces, iface);
+            continue;
+        }
+
+        if (type == PCAPNG_BLOCK_TYPE_EPB && body_length >= 20) {
+            const Interface *iface;
+            guint32          epb_interface;
+            guint64          ts;
+            guint32          captured;
+            gsize            pdu = 20;
+
+            epb_interface = read_guint32 (body, swapped);
+            if (epb_interface != interface_id)
+                continue;
+            if (epb_interface >= interfaces->len) {
+                g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_MESSAGE,
+                             "Packet references unknown interface %u", epb_interface);
+                return FALSE;
+            }
+            iface = &g_array_index (interfaces, Interface, epb_interface);
+            if (iface->linktype != LINKTYPE_WIRESHARK_UPPER_PDU) {
+                g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_UNSUPPORTED,
+                             "Unsupported link type %u in interface %u", iface->linktype, epb_interface);
+                return FALSE;
+            }
+
+            ts = ((guint64) read_guint32 (&body[4], swapped) << 32) | read_guint32 (&body[8], swapped);
+            captured = read_guint32 (&body[12], swapped);
+            if (captured > body_length - 20)
+                continue;
+
+            /* Skip the exported PDU tags, always big endian */
+            while (pdu + 4 <= 20 + captured) {
+                guint16 tag;
+                guint16 tag_length;
+
+                tag = GUINT16_FROM_BE (read_guint16 (&body[pdu], FALSE));
+                tag_length = GUINT16_FROM_BE (read_guint16 (&body[pdu + 2], FALSE));
+                pdu += 4 + tag_length;
+                if (tag == EXP_PDU_TAG_END_OF_OPT)
+                    break;
+            }
+            if (pdu > 20 + captured)
+                continue;
+
+            replay_add (self, (gint64) (ts * iface->ts_to_usec), &body[pdu], 20 + captured - pdu);
+        }
+    }
+
+    return TRUE;
+}
+
+/*****************************************************************************/
+/* Debug logs */
+
+static const gchar *months[] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+};
+
+/* Lines as printed by mbimcli and mbim-proxy start with the time, with second
+ * resolution, e.g. '[18 Oct 2026, 10:00:00]' */
+static gboolean
+parse_log_timestamp (const gchar *line,
+                     gint64      *out_timestamp)
+{
+    g_autoptr(GDateTime) datetime = NULL;
+    gchar                month[4] = { 0 };
+    gint                 day, year, hour, minute, second;
+    guint                i;
+
+    if (sscanf (line, "[%d %3s %d, %d:%d:%d]", &day, month, &year, &hour, &minute, &second) != 6)
+        return FALSE;
+
+    for (i = 0; i < G_N_ELEMENTS (months); i++) {
+        if (g_str_equal (month, months[i]))
+            break;
+    }
+    if (i == G_N_ELEMENTS (months))
+        return FALSE;
+
+    datetime = g_date_time_new_local (year, i + 1, day, hour, minute, second);
+    if (!datetime)
+        return FALSE;
+
+    *out_timestamp = g_date_time_to_unix (datetime) * G_USEC_PER_SEC;
+    return TRUE;
+}
+
+static GByteArray *
+parse_hex (const gchar *hex)
+{
+    g_autoptr(GByteArray) array = NULL;
+
+    array = g_byte_array_new ();
+    while (*hex) {
+        gint   high;
+        gint   low;
+        guint8 value;
+
+        high = g_ascii_xdigit_value (hex[0]);
+        low = high >= 0 ? g_ascii_xdigit_value (hex[1]) : -1;
+        /* Also when truncated with '...' */
+        if (low < 0)
+            return NULL;
+
+        value = (guint8) ((high << 4) | low);
+        g_byte_array_append (array, &value, 1);
+        hex += 2;
+        if (*hex == ':')
+            hex++;
+    }
+
+    return g_steal_pointer (&array);
+}
+
+static void
+load_log (MbimReplay *self,
+          gchar      *contents)
+{
+    g_auto(GStrv) lines = NULL;
+    gint64        timestamp = 0;
+    guint         n_truncated = 0;
+    guint         i;
+
+    lines = g_strsplit (contents, "\n", -1);
+    for (i = 0; lines[i]; i++) {
+        g_autoptr(GByteArray)  data = NULL;
+        const gchar           *hex;
+
+        g_strchomp (lines[i]);
+        parse_log_timestamp (lines[i], &timestamp);
+
+        hex = strstr (lines[i], "<<<<<<   data   = ");
+        if (!hex)
+            hex = strstr (lines[i], ">>>>>>   data   = ");
+        if (!hex)
+            continue;
+
+        hex += strlen ("<<<<<<   data   = ");
+        data = parse_hex (hex);
+        if (!data) {
+            n_truncated++;
+            continue;
+        }
+        replay_add (self, timestamp, data->data, data->len);
+    }
+
+    if (n_truncated)
+        g_debug ("ignored %u truncated messages in log: personal info must be shown to replay them", n_truncated);
+}
+
+/*****************************************************************************/
+
+MbimReplay *
+_mbim_replay_new_from_file (const gchar  *path,
+                            guint         interface_id,
+                            GError      **error)
+{
+    g_autoptr(MbimReplay)  self = NULL;
+    g_autofree gchar      *contents = NULL;
+    gsize                  length = 0;
+
+    if (!g_file_get_contents (path, &contents, &length, error))
+        return NULL;
+
+    self = g_new0 (MbimReplay, 1);
+    self->records = g_array_new (FALSE, FALSE, sizeof (Record));
+    g_array_set_clear_func (self->records, (GDestroyNotify)record_clear);
+
+    if (length >= 4 && read_guint32 ((const guint8 *)contents, FALSE) == PCAPNG_BLOCK_TYPE_SHB) {
+        if (!load_pcapng (self, (const guint8 *)contents, length, interface_id, error))
+            return NULL;
+    } else
+        load_log (self, contents);
+
+    if (!self->records->len) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_ARGS,
+                     "No messages found in '%s'", path);
+        return NULL;
+    }
+
+    return g_steal_pointer (&self);
+}
+
+void
+_mbim_replay_free (MbimReplay *self)
+{
+    if (self->records)
+        g_array_unref (self->records);
+    g_free (self);
+}
+
+guint
+_mbim_replay_get_n_messages (MbimReplay *self)
+{
+    return self->records->len;
+}
+
+gint64
+_mbim_replay_get_duration (MbimReplay *self)
+{
+    return (g_array_index (self->records, Record, self->records->len - 1).timestamp -
+            g_array_index (self->records, Record, 0).timestamp);
+}
+
+/*****************************************************************************/
+/* Run */
+
+typedef struct {
+    MbimReplay           *self;
+    MbimDevice           *device;
+    gdouble               speed;
+    guint                 command_timeout;
+    gint64                start_time;
+    gboolean              completed;
+    GError               *error;
+
+    /* Our end of the socketpair */
+    gint                  fd;
+    GSource              *read_source;
+    GSource              *write_source;
+    GSource              *timeout_source;
+    GByteArray           *buffer;
+    GByteArray           *out;
+    gsize                 out_offset;
+
+    /* Next record to replay */
+    guint                 cursor;
+
+    /* Recorded transaction IDs of the commands requested but not yet sent by
+     * the device, in order; and the transaction ID used by the device for
+     * each recorded one */
+    GQueue               *pending;
+    GHashTable           *transactions;
+
+    /* Fragments of the command being collected */
+    MbimMessage          *collector;
+
+    guint                 n_ongoing;
+    MbimReplayStatistics  statistics;
+} RunContext;
+
+typedef struct {
+    GTask   *task;
+    guint32  recorded_transaction_id;
+} CommandContext;
+
+static void run_pump (GTask *task);
+
+static void
+run_teardown (RunContext *ctx)
+{
+    if (ctx->read_source) {
+        g_source_destroy (ctx->read_source);
+        g_clear_pointer (&ctx->read_source, g_source_unref);
+    }
+    if (ctx->write_source) {
+        g_source_destroy (ctx->write_source);
+        g_clear_pointer (&ctx->write_source, g_source_unref);
+    }
+    if (ctx->timeout_source) {
+        g_source_destroy (ctx->timeout_source);
+        g_clear_pointer (&ctx->timeout_source, g_source_unref);
+    }
+    /* The device sees the hangup */
+    if (ctx->fd >= 0) {
+        close (ctx->fd);
+        ctx->fd = -1;
+    }
+    g_clear_pointer (&ctx->out, g_byte_array_unref);
+    g_clear_pointer (&ctx->collector, mbim_message_unref);
+}
+
+static void
+run_context_free (RunContext *ctx)
+{
+    run_teardown (ctx);
+    g_clear_error (&ctx->error);
+    g_byte_array_unref (ctx->buffer);
+    g_queue_free (ctx->pending);
+    g_hash_table_unref (ctx->transactions);
+    g_object_unref (ctx->device);
+    g_slice_free (RunContext, ctx);
+}
+
+static void
+run_complete_if_done (GTask *task)
+{
+    RunContext *ctx;
+
+    ctx = g_task_get_task_data (task);
+    if (ctx->completed || ctx->cursor < ctx->self->records->len || ctx->out || ctx->n_ongoing)
+        return;
+
+    ctx->completed = TRUE;
+    run_teardown (ctx);
+    if (ctx->error)
+        g_task_return_error (task, g_steal_pointer (&ctx->error));
+    else
+        g_task_return_boolean (task, TRUE);
+    g_object_unref (task);
+}
+
+static void
+run_fail (GTask  *task,
+          GError *error)
+{
+    RunContext *ctx;
+
+    ctx = g_task_get_task_data (task);
+    if (!ctx->error)
+        ctx->error = error;
+    else
+        g_error_free (error);
+
+    /* Stop replaying, and wait for the ongoing commands to fail */
+    ctx->cursor = ctx->self->records->len;
+    run_teardown (ctx);
+    run_complete_if_done (task);
+}
+
+static void
+command_ready (MbimDevice     *device,
+               GAsyncResult   *res,
+               CommandContext *cmd)
+{
+    g_autoptr(MbimMessage)  response = NULL;
+    g_autoptr(GError)       error = NULL;
+    RunContext             *ctx;
+
+    ctx = g_task_get_task_data (cmd->task);
+
+    response = mbim_device_command_finish (device, res, &error);
+    if (response)
+        ctx->statistics.n_responses++;
+    else {
+        g_debug ("replayed command failed: %s", error->message);
+        ctx->statistics.n_errors++;
+        /* If never sent, its response can't be replayed */
+        g_queue_remove (ctx->pending, GUINT_TO_POINTER (cmd->recorded_transaction_id));
+    }
+
+    ctx->n_ongoing--;
+    run_pump (cmd->task);
+
+    g_object_unref (cmd->task);
+    g_slice_free (CommandContext, cmd);
+}
+
+static void
+run_command (GTask        *task,
+             const Record *record)
+{
+    g_autoptr(MbimMessage)  message = NULL;
+    g_autoptr(GError)       error = NULL;
+    const MbimMessage      *fragment;
+    RunContext             *ctx;
+    CommandContext         *cmd;
+    guint32                 recorded_transaction_id;
+
+    ctx = g_task_get_task_data (task);
+    fragment = (const MbimMessage *)record->data;
+
+    if (record->data->len < FRAGMENT_HEADER_SIZE) {
+        ctx->statistics.n_skipped++;
+        return;
+    }
+
+    /* Fragmented commands are requested once complete */
+    if (_mbim_message_fragment_get_total (fragment) <= 1)
+        message = mbim_message_dup (fragment);
+    else if (_mbim_message_fragment_get_current (fragment) == 0) {
+        g_clear_pointer (&ctx->collector, mbim_message_unref);
+        ctx->collector = _mbim_message_fragment_collector_init (fragment, &error);
+        return;
+    } else {
+        if (!ctx->collector || !_mbim_message_fragment_collector_add (ctx->collector, fragment, &error)) {
+            g_debug ("skipping command fragment: %s", error ? error->message : "no first fragment");
+            g_clear_pointer (&ctx->collector, mbim_message_unref);
+            ctx->statistics.n_skipped++;
+            return;
+        }
+        if (!_mbim_message_fragment_collector_complete (ctx->collector))
+            return;
+        message = g_steal_pointer (&ctx->collector);
+    }
+
+    recorded_transaction_id = mbim_message_get_transaction_id (message);
+    g_hash_table_remove (ctx->transactions, GUINT_TO_POINTER (recorded_transaction_id));
+    g_queue_push_tail (ctx->pending, GUINT_TO_POINTER (recorded_transaction_id));
+
+    /* A new transaction ID is assigned by the device */
+    mbim_message_set_transaction_id (message, 0);
+
+    cmd = g_slice_new (CommandContext);
+    cmd->task = g_object_ref (task);
+    cmd->recorded_transaction_id = recorded_transaction_id;
+
+    ctx->statistics.n_commands++;
+    ctx->n_ongoing++;
+    mbim_device_command (ctx->device,
+                         message,
+                         ctx->command_timeout,
+                         g_task_get_cancellable (task),
+                         (GAsyncReadyCallback)command_ready,
+                         cmd);
+}
+
+static gboolean
+run_writable_cb (gint          fd,
+                 GIOCondition  condition,
+                 GTask        *task)
+{
+    RunContext *ctx;
+
+    ctx = g_task_get_task_data (task);
+    g_clear_pointer (&ctx->write_source, g_source_unref);
+    run_pump (task);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+run_timeout_cb (GTask *task)
+{
+    RunContext *ctx;
+
+    ctx = g_task_get_task_data (task);
+    g_clear_pointer (&ctx->timeout_source, g_source_unref);
+    run_pump (task);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+run_flush (GTask *task)
+{
+    RunContext *ctx;
+
+    ctx = g_task_get_task_data (task);
+    while (ctx->out_offset < ctx->out->len) {
+        gssize n;
+
+        n = write (ctx->fd, &ctx->out->data[ctx->out_offset], ctx->out->len - ctx->out_offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!ctx->write_source) {
+                    ctx->write_source = g_unix_fd_source_new (ctx->fd, G_IO_OUT);
+                    g_source_set_callback (ctx->write_source,
+                                           (GSourceFunc)run_writable_cb,
+                                           g_object_ref (task),
+                                           g_object_unref);
+                    g_source_attach (ctx->write_source, g_main_context_get_thread_default ());
+                }
+                return FALSE;
+            }
+            run_fail (task, g_error_new (MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                                         "Couldn't write message: %s", g_strerror (errno)));
+            return FALSE;
+        }
+        ctx->out_offset += n;
+    }
+
+    g_clear_pointer (&ctx->out, g_byte_array_unref);
+    ctx->out_offset = 0;
+    return TRUE;
+}
+
+static void
+run_write (RunContext   *ctx,
+           const Record *record,
+           guint32       transaction_id)
+{
+    ctx->out = g_byte_array_sized_new (record->data->len);
+    g_byte_array_append (ctx->out, record->data->data, record->data->len);
+    transaction_id = GUINT32_TO_LE (transaction_id);
+    memcpy (&ctx->out->data[8], &transaction_id, sizeof (transaction_id));
+    ctx->out_offset = 0;
+}
+
+static void
+run_pump (GTask *task)
+{
+    RunContext *ctx;
+    GArray     *records;
+
+    ctx = g_task_get_task_data (task);
+    if (ctx->completed)
+        return;
+
+    if (g_task_return_error_if_cancelled (task)) {
+        ctx->completed = TRUE;
+        run_teardown (ctx);
+        g_object_unref (task);
+        return;
+    }
+
+    records = ctx->self->records;
+    while (ctx->cursor < records->len) {
+        const Record *record;
+        guint32       transaction_id;
+        gpointer      live_transaction_id;
+
+        if (ctx->out && !run_flush (task))
+            return;
+
+        record = &g_array_index (records, Record, ctx->cursor);
+
+        if (ctx->speed > 0) {
+            gint64 due;
+            gint64 now;
+
+            due = ctx->start_time + (gint64) ((record->timestamp - g_array_index (records, Record, 0).timestamp) / ctx->speed);
+            now = g_get_monotonic_time ();
+            if (due > now) {
+                if (!ctx->timeout_source) {
+                    ctx->timeout_source = g_timeout_source_new ((due - now + 999) / 1000);
+                    g_source_set_callback (ctx->timeout_source,
+                                           (GSourceFunc)run_timeout_cb,
+                                           g_object_ref (task),
+                                           g_object_unref);
+                    g_source_attach (ctx->timeout_source, g_main_context_get_thread_default ());
+                }
+                return;
+            }
+        }
+
+        transaction_id = MBIM_MESSAGE_GET_TRANSACTION_ID ((const MbimMessage *)record->data);
+
+        switch (MBIM_MESSAGE_GET_MESSAGE_TYPE ((const MbimMessage *)record->data)) {
+        case MBIM_MESSAGE_TYPE_COMMAND:
+            run_command (task, record);
+            break;
+
+        case MBIM_MESSAGE_TYPE_COMMAND_DONE:
+        case MBIM_MESSAGE_TYPE_FUNCTION_ERROR:
+            if (!g_hash_table_lookup_extended (ctx->transactions,
+                                               GUINT_TO_POINTER (transaction_id),
+                                               NULL,
+                                               &live_transaction_id)) {
+                /* Wait until the device sends the request */
+                if (g_queue_find (ctx->pending, GUINT_TO_POINTER (transaction_id)))
+                    return;
+                /* Request not in the capture */
+                ctx->statistics.n_skipped++;
+                break;
+            }
+            run_write (ctx, record, GPOINTER_TO_UINT (live_transaction_id));
+            break;
+
+        case MBIM_MESSAGE_TYPE_INDICATE_STATUS:
+            if (record->data->len >= FRAGMENT_HEADER_SIZE &&
+                _mbim_message_fragment_get_current ((const MbimMessage *)record->data) == 0)
+                ctx->statistics.n_indications++;
+            run_write (ctx, record, transaction_id);
+            break;
+
+        case MBIM_MESSAGE_TYPE_INVALID:
+        case MBIM_MESSAGE_TYPE_OPEN:
+        case MBIM_MESSAGE_TYPE_CLOSE:
+        case MBIM_MESSAGE_TYPE_HOST_ERROR:
+        case MBIM_MESSAGE_TYPE_OPEN_DONE:
+        case MBIM_MESSAGE_TYPE_CLOSE_DONE:
+        default:
+            ctx->statistics.n_skipped++;
+            break;
+        }
+
+        ctx->cursor++;
+    }
+
+    if (ctx->out && !run_flush (task))
+        return;
+
+    run_complete_if_done (task);
+}
+
+static gboolean
+run_readable_cb (gint          fd,
+                 GIOCondition  condition,
+                 GTask        *task)
+{
+    RunContext *ctx;
+    guint8      buffer[4096];
+    gssize      n;
+
+    ctx = g_task_get_task_data (task);
+
+    n = read (fd, buffer, sizeof (buffer));
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return G_SOURCE_CONTINUE;
+    if (n <= 0) {
+        run_fail (task, g_error_new (MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                                     "Device channel closed"));
+        return G_SOURCE_REMOVE;
+    }
+
+    g_byte_array_append (ctx->buffer, buffer, n);
+    while (ctx->buffer->len >= MESSAGE_HEADER_SIZE) {
+        const MbimMessage *message;
+        guint32            length;
+
+        message = (const MbimMessage *)ctx->buffer;
+        length = MBIM_MESSAGE_GET_MESSAGE_LENGTH (message);
+        if (length < MESSAGE_HEADER_SIZE) {
+            run_fail (task, g_error_new (MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_MESSAGE,
+                                         "Invalid message sent by the device"));
+            return G_SOURCE_REMOVE;
+        }
+        if (ctx->buffer->len < length)
+            break;
+
+        /* Commands are sent in the same order as requested */
+        if (MBIM_MESSAGE_GET_MESSAGE_TYPE (message) == MBIM_MESSAGE_TYPE_COMMAND &&
+            length >= FRAGMENT_HEADER_SIZE &&
+            _mbim_message_fragment_get_current (message) == 0 &&
+            !g_queue_is_empty (ctx->pending))
+            g_hash_table_insert (ctx->transactions,
+                                 g_queue_pop_head (ctx->pending),
+                                 GUINT_TO_POINTER (MBIM_MESSAGE_GET_TRANSACTION_ID (message)));
+
+        g_byte_array_remove_range (ctx->buffer, 0, length);
+    }
+
+    run_pump (task);
+    return G_SOURCE_CONTINUE;
+}
+
+void
+_mbim_replay_run (MbimReplay          *self,
+                  MbimDevice          *device,
+                  gdouble              speed,
+                  guint                command_timeout,
+                  GCancellable        *cancellable,
+                  GAsyncReadyCallback  callback,
+                  gpointer             user_data)
+{
+    GTask      *task;
+    RunContext *ctx;
+    GError     *error = NULL;
+    gint        fds[2];
+
+    task = g_task_new (NULL, cancellable, callback, user_data);
+
+    if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+        g_task_return_new_error (task, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                                 "Couldn't create socketpair: %s", g_strerror (errno));
+        g_object_unref (task);
+        return;
+    }
+
+    /* The device owns its end from now on, also on error */
+    if (!_mbim_device_adopt_fd (device, fds[0], 0, 0, NULL, 0, &error) ||
+        !g_unix_set_fd_nonblocking (fds[1], TRUE, &error)) {
+        close (fds[1]);
+        g_task_return_error (task, error);
+        g_object_unref (task);
+        return;
+    }
+
+    ctx = g_slice_new0 (RunContext);
+    ctx->self = self;
+    ctx->device = g_object_ref (device);
+    ctx->speed = speed;
+    ctx->command_timeout = command_timeout;
+    ctx->fd = fds[1];
+    ctx->buffer = g_byte_array_new ();
+    ctx->pending = g_queue_new ();
+    ctx->transactions = g_hash_table_new (g_direct_hash, g_direct_equal);
+    g_task_set_task_data (task, ctx, (GDestroyNotify)run_context_free);
+
+    ctx->read_source = g_unix_fd_source_new (ctx->fd, G_IO_IN | G_IO_HUP | G_IO_ERR);
+    g_source_set_callback (ctx->read_source,
+                           (GSourceFunc)run_readable_cb,
+                           g_object_ref (task),
+                           g_object_unref);
+    g_source_attach (ctx->read_source, g_main_context_get_thread_default ());
+
+    ctx->start_time = g_get_monotonic_time ();
+    run_pump (task);
+}
+
+gboolean
+_mbim_replay_run_finish (MbimReplay            *self,
+                         GAsyncResult          *res,
+                         MbimReplayStatistics  *out_statistics,
+                         GError               **error)
+{
+    RunContext *ctx;
+
+    ctx = g_task_get_task_data (G_TASK (res));
+    if (out_statistics) {
+        if (ctx)
+            *out_statistics = ctx->statistics;
+        else
+            memset (out_statistics, 0, sizeof (MbimReplayStatistics));
+    }
+    return g_task_propagate_boolean (G_TASK (res), error);
+}
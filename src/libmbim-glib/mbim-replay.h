@@ -0,0 +1,74 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * libmbim-glib -- GLib/GIO based library to control MBIM devices
+ *
+ * This is a private non-installed header
+ */
+
+#ifndef _LIBMBIM_GLIB_MBIM_REPLAY_H_
+#define _LIBMBIM_GLIB_MBIM_REPLAY_H_
+
+#if !defined (LIBMBIM_GLIB_COMPILATION)
+#error "This is a private header!!"
+#endif
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "mbim-device.h"
+
+G_BEGIN_DECLS
+
+/*
+ * Replay of a captured MBIM session against a real MbimDevice.
+ *
+ * The session is loaded either from a pcapng file (as written by
+ * mbim_device_start_capture()) or from the '<<<<<< RAW' and '>>>>>> RAW'
+ * hex dumps of a debug log. The device adopts one end of a socketpair as if
+ * it were the control port fd, and the replay serves the other end:
+ *
+ *  - Commands sent by the host in the capture are sent again through the
+ *    device with mbim_device_command(), and their responses are written back
+ *    once the device has sent them, with the transaction ID rewritten.
+ *  - Indications are written as recorded.
+ *  - The open and close sequences are skipped, as the device is adopted
+ *    already open.
+ *
+ * Messages are replayed in the recorded order, with the recorded timing
+ * scaled by the given speed, or as fast as possible with speed 0.
+ */
+
+typedef struct _MbimReplay MbimReplay;
+
+typedef struct {
+    guint n_commands;
+    guint n_responses;
+    guint n_errors;
+    guint n_indications;
+    guint n_skipped;
+} MbimReplayStatistics;
+
+MbimReplay *_mbim_replay_new_from_file  (const gchar           *path,
+                                         guint                  interface_id,
+                                         GError               **error);
+void        _mbim_replay_free           (MbimReplay            *self);
+guint       _mbim_replay_get_n_messages (MbimReplay            *self);
+gint64      _mbim_replay_get_duration   (MbimReplay            *self);
+void        _mbim_replay_run            (MbimReplay            *self,
+                                         MbimDevice            *device,
+                                         gdouble                speed,
+                                         guint                  command_timeout,
+                                         GCancellable          *cancellable,
+                                         GAsyncReadyCallback    callback,
+                                         gpointer               user_data);
+gboolean    _mbim_replay_run_finish     (MbimReplay            *self,
+                                         GAsyncResult          *res,
+                                         MbimReplayStatistics  *out_statistics,
+                                         GError               **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (MbimReplay, _mbim_replay_free)
+
+G_END_DECLS
+
+#endif /* _LIBMBIM_GLIB_MBIM_REPLAY_H_ */
@@ -0,0 +1,416 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * libmbim-glib -- GLib/GIO based library to control MBIM devices
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "config.h"
+#include "mbim-shm-channel.h"
+#include "mbim-error-types.h"
+#include "mbim-errors.h"
+
+/*****************************************************************************/
+
+#define RING_MAGIC 0x4d42494d /* "MBIM" */
+
+/* The producer and consumer counters are kept in different cache lines */
+struct ring_header {
+    guint32 magic;
+    guint32 size;
+    gint    head;     /* total bytes written by the producer, wrapping */
+    guint8  reserved1[52];
+    gint    tail;     /* total bytes read by the consumer, wrapping */
+    gint    waiting;  /* producer waiting for space to be released */
+    guint8  reserved2[56];
+};
+
+G_STATIC_ASSERT (sizeof (struct ring_header) == 128);
+
+/* Layout of the shared memory: both headers first, then both data areas */
+#define RING_CLIENT_TO_PROXY 0
+#define RING_PROXY_TO_CLIENT 1
+#define SHM_SIZE(ring_size) (2 * sizeof (struct ring_header) + 2 * (ring_size))
+
+typedef struct {
+    struct ring_header *header;
+    guint8             *data;
+    guint32             size;
+} Ring;
+
+struct _MbimShmChannel {
+    gint    memfd;
+    gint    local_fd;  /* doorbell we poll */
+    gint    remote_fd; /* doorbell of the peer */
+    guint8 *map;
+    gsize   map_size;
+    Ring    rx;
+    Ring    tx;
+    /* Set once the peer corrupted the counters of our ring */
+    gboolean broken;
+};
+
+static void
+ring_init (Ring    *ring,
+           guint8  *map,
+           guint    index,
+           guint32  size)
+{
+    ring->header = (struct ring_header *)(map + index * sizeof (struct ring_header));
+    ring->data = map + 2 * sizeof (struct ring_header) + index * size;
+    ring->size = size;
+}
+
+static void
+doorbell_ring (gint fd)
+{
+    guint64 value = 1;
+
+    /* The doorbell is non-blocking; if the counter is about to overflow the
+     * peer has plenty of pending wakeups anyway */
+    if (write (fd, &value, sizeof (value)) < 0 && errno != EAGAIN)
+        g_debug ("couldn't ring shared memory channel doorbell: %s", g_strerror (errno));
+}
+
+/*****************************************************************************/
+
+MbimShmChannel *
+_mbim_shm_channel_new (GError **error)
+{
+#if defined HAVE_MEMFD_CREATE
+    g_autoptr(MbimShmChannel) self = NULL;
+    struct ring_header       *header;
+    guint                     i;
+
+    self = g_slice_new0 (MbimShmChannel);
+    self->memfd = -1;
+    self->local_fd = -1;
+    self->remote_fd = -1;
+
+    self->memfd = memfd_create ("mbim-proxy-shm", MFD_CLOEXEC);
+    if (self->memfd < 0) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "Couldn't create shared memory: %s", g_strerror (errno));
+        return NULL;
+    }
+
+    self->map_size = SHM_SIZE (MBIM_SHM_CHANNEL_RING_SIZE);
+    if (ftruncate (self->memfd, self->map_size) < 0) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "Couldn't allocate shared memory: %s", g_strerror (errno));
+        return NULL;
+    }
+
+    self->map = mmap (NULL, self->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, self->memfd, 0);
+    if (self->map == MAP_FAILED) {
+        self->map = NULL;
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "Couldn't map shared memory: %s", g_strerror (errno));
+        return NULL;
+    }
+
+    for (i = RING_CLIENT_TO_PROXY; i <= RING_PROXY_TO_CLIENT; i++) {
+        header = (struct ring_header *)(self->map + i * sizeof (struct ring_header));
+        header->magic = RING_MAGIC;
+        header->size = MBIM_SHM_CHANNEL_RING_SIZE;
+    }
+
+    self->local_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    self->remote_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (self->local_fd < 0 || self->remote_fd < 0) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "Couldn't create shared memory doorbells: %s", g_strerror (errno));
+        return NULL;
+    }
+
+    /* The channel is always created by the proxy */
+    ring_init (&self->rx, self->map, RING_CLIENT_TO_PROXY, MBIM_SHM_CHANNEL_RING_SIZE);
+    ring_init (&self->tx, self->map, RING_PROXY_TO_CLIENT, MBIM_SHM_CHANNEL_RING_SIZE);
+
+    return g_steal_pointer (&self);
+#else
+    g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_UNSUPPORTED,
+                 "Shared memory channels are not supported");
+    return NULL;
+#endif
+}
+
+static MbimShmChannel *
+channel_new_from_fds (gint       memfd,
+                      gint       local_fd,
+                      gint       remote_fd,
+                      gboolean   proxy,
+                      GError   **error)
+{
+    g_autoptr(MbimShmChannel) self = NULL;
+    struct stat               st;
+    struct ring_header       *header;
+    guint32                   size;
+    guint                     i;
+
+    /* The channel takes ownership of the fds right away */
+    self = g_slice_new0 (MbimShmChannel);
+    self->memfd = memfd;
+    self->local_fd = local_fd;
+    self->remote_fd = remote_fd;
+
+    if (self->memfd < 0 || self->local_fd < 0 || self->remote_fd < 0) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_ARGS,
+                     "Invalid shared memory fds");
+        return NULL;
+    }
+
+    if (fstat (self->memfd, &st) < 0) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "Couldn't query shared memory size: %s", g_strerror (errno));
+        return NULL;
+    }
+
+    if (st.st_size < (off_t) SHM_SIZE (0)) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_ARGS,
+                     "Shared memory too small: %" G_GINT64_FORMAT " bytes", (gint64) st.st_size);
+        return NULL;
+    }
+
+    self->map_size = st.st_size;
+    self->map = mmap (NULL, self->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, self->memfd, 0);
+    if (self->map == MAP_FAILED) {
+        self->map = NULL;
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "Couldn't map shared memory: %s", g_strerror (errno));
+        return NULL;
+    }
+
+    /* Both rings must have the same power-of-two size, covering the whole
+     * shared memory */
+    size = ((struct ring_header *)self->map)->size;
+    for (i = RING_CLIENT_TO_PROXY; i <= RING_PROXY_TO_CLIENT; i++) {
+        header = (struct ring_header *)(self->map + i * sizeof (struct ring_header));
+        if (header->magic != RING_MAGIC ||
+            header->size != size ||
+            size == 0 ||
+            (size & (size - 1)) != 0 ||
+            SHM_SIZE (size) != self->map_size) {
+            g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_ARGS,
+                         "Invalid shared memory layout");
+            return NULL;
+        }
+    }
+
+    ring_init (&self->rx, self->map, proxy ? RING_CLIENT_TO_PROXY : RING_PROXY_TO_CLIENT, size);
+    ring_init (&self->tx, self->map, proxy ? RING_PROXY_TO_CLIENT : RING_CLIENT_TO_PROXY, size);
+
+    return g_steal_pointer (&self);
+}
+
+MbimShmChannel *
+_mbim_shm_channel_new_from_fds (gint     memfd,
+                                gint     local_fd,
+                                gint     remote_fd,
+                                GError **error)
+{
+    /* The peer of the proxy is always the client */
+    return channel_new_from_fds (memfd, local_fd, remote_fd, FALSE, error);
+}
+
+MbimShmChannel *
+_mbim_shm_channel_new_proxy_from_fds (gint     memfd,
+                                      gint     local_fd,
+                                      gint     remote_fd,
+                                      GError **error)
+{
+    /* Proxy side of an already existing channel, e.g. when handing off the
+     * clients to a new proxy process */
+    return channel_new_from_fds (memfd, local_fd, remote_fd, TRUE, error);
+}
+
+void
+_mbim_shm_channel_free (MbimShmChannel *self)
+{
+    if (self->map)
+        munmap (self->map, self->map_size);
+    if (self->memfd >= 0)
+        close (self->memfd);
+    if (self->local_fd >= 0)
+        close (self->local_fd);
+    if (self->remote_fd >= 0)
+        close (self->remote_fd);
+    g_slice_free (MbimShmChannel, self);
+}
+
+void
+_mbim_shm_channel_get_peer_fds (MbimShmChannel *self,
+                                gint           *out_memfd,
+                                gint           *out_peer_local_fd,
+                                gint           *out_peer_remote_fd)
+{
+    /* Our doorbells are swapped in the peer */
+    *out_memfd = self->memfd;
+    *out_peer_local_fd = self->remote_fd;
+    *out_peer_remote_fd = self->local_fd;
+}
+
+void
+_mbim_shm_channel_get_fds (MbimShmChannel *self,
+                           gint           *out_memfd,
+                           gint           *out_local_fd,
+                           gint           *out_remote_fd)
+{
+    *out_memfd = self->memfd;
+    *out_local_fd = self->local_fd;
+    *out_remote_fd = self->remote_fd;
+}
+
+gint
+_mbim_shm_channel_get_fd (MbimShmChannel *self)
+{
+    return self->local_fd;
+}
+
+void
+_mbim_shm_channel_acknowledge (MbimShmChannel *self)
+{
+    guint64 value;
+
+    /* Reset the doorbell; the rings are always fully processed afterwards */
+    if (read (self->local_fd, &value, sizeof (value)) < 0 && errno != EAGAIN)
+        g_debug ("couldn't reset shared memory channel doorbell: %s", g_strerror (errno));
+}
+
+void
+_mbim_shm_channel_wakeup (MbimShmChannel *self)
+{
+    /* Ring our own doorbell, e.g. if data was read from the ring outside of
+     * the doorbell handler and needs to be processed there */
+    doorbell_ring (self->local_fd);
+}
+
+/*****************************************************************************/
+
+gboolean
+_mbim_shm_channel_write (MbimShmChannel  *self,
+                         const guint8    *data,
+                         gsize            data_length,
+                         gsize           *out_written,
+                         GError         **error)
+{
+    struct ring_header *header;
+    guint32             head;
+    gsize               written = 0;
+    gboolean            waiting = FALSE;
+
+    header = self->tx.header;
+    *out_written = 0;
+
+    if (self->broken) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "Shared memory channel is broken");
+        return FALSE;
+    }
+
+    /* We're the only producer, so the head is only updated by us */
+    head = (guint32) g_atomic_int_get (&header->head);
+
+    while (written < data_length) {
+        guint32 tail;
+        guint32 available;
+        guint32 offset;
+        guint32 chunk;
+        guint32 n;
+
+        tail = (guint32) g_atomic_int_get (&header->tail);
+
+        /* Don't trust the counters updated by the peer; a tail ahead of the
+         * head would have us write past the end of the ring */
+        if (head - tail > self->tx.size) {
+            g_warning ("invalid shared memory channel state: %u bytes pending", head - tail);
+            self->broken = TRUE;
+            g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                         "Shared memory channel is broken: invalid ring state");
+            *out_written = written;
+            return FALSE;
+        }
+
+        available = self->tx.size - (head - tail);
+        if (available == 0) {
+            /* Already flagged as waiting and checked again; the consumer will
+             * ring our doorbell once it releases space */
+            if (waiting)
+                break;
+            /* Flag as waiting before checking again, so that a read happening
+             * in between isn't lost */
+            g_atomic_int_set (&header->waiting, 1);
+            waiting = TRUE;
+            continue;
+        }
+
+        n = MIN (available, data_length - written);
+        offset = head & (self->tx.size - 1);
+        chunk = MIN (n, self->tx.size - offset);
+        memcpy (&self->tx.data[offset], &data[written], chunk);
+        memcpy (&self->tx.data[0], &data[written + chunk], n - chunk);
+
+        /* Publish the data */
+        head += n;
+        g_atomic_int_set (&header->head, (gint) head);
+        written += n;
+    }
+
+    *out_written = written;
+    return TRUE;
+}
+
+void
+_mbim_shm_channel_notify (MbimShmChannel *self)
+{
+    doorbell_ring (self->remote_fd);
+}
+
+gsize
+_mbim_shm_channel_read (MbimShmChannel *self,
+                        GByteArray     *buffer)
+{
+    struct ring_header *header;
+    guint32             head;
+    guint32             tail;
+    guint32             offset;
+    guint32             chunk;
+    guint32             n;
+
+    header = self->rx.header;
+
+    /* We're the only consumer, so the tail is only updated by us */
+    tail = (guint32) g_atomic_int_get (&header->tail);
+    head = (guint32) g_atomic_int_get (&header->head);
+    n = head - tail;
+    if (n == 0)
+        return 0;
+
+    /* Don't trust the counters updated by the peer */
+    if (n > self->rx.size) {
+        g_warning ("invalid shared memory channel state: %u bytes pending", n);
+        n = self->rx.size;
+    }
+
+    offset = tail & (self->rx.size - 1);
+    chunk = MIN (n, self->rx.size - offset);
+    g_byte_array_append (buffer, &self->rx.data[offset], chunk);
+    g_byte_array_append (buffer, &self->rx.data[0], n - chunk);
+
+    /* Release the space, and wake up the producer if it was waiting for it */
+    g_atomic_int_set (&header->tail, (gint)(tail + n));
+    if (g_atomic_int_compare_and_exchange (&header->waiting, 1, 0))
+        doorbell_ring (self->remote_fd);
+
+    return n;
+}
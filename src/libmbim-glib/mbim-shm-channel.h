@@ -0,0 +1,72 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * libmbim-glib -- GLib/GIO based library to control MBIM devices
+ *
+ * This is a private non-installed header
+ */
+
+#ifndef _LIBMBIM_GLIB_MBIM_SHM_CHANNEL_H_
+#define _LIBMBIM_GLIB_MBIM_SHM_CHANNEL_H_
+
+#if !defined (LIBMBIM_GLIB_COMPILATION)
+#error "This is a private header!!"
+#endif
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Shared memory channel between mbim-proxy and its local clients.
+ *
+ * The channel is a memfd holding two single-producer/single-consumer byte
+ * rings, one per direction, and two eventfds used as doorbells, one per
+ * peer. Each peer only polls its own doorbell, which is rung by the other
+ * peer whenever new data is available to read, or whenever space has been
+ * released in a ring where the writer was waiting for it.
+ *
+ * The channel is created by the proxy, and the fds are passed to the client
+ * over the unix socket.
+ */
+
+typedef struct _MbimShmChannel MbimShmChannel;
+
+/* Size of each of the rings, in bytes */
+#define MBIM_SHM_CHANNEL_RING_SIZE (256 * 1024)
+
+MbimShmChannel *_mbim_shm_channel_new          (GError         **error);
+MbimShmChannel *_mbim_shm_channel_new_from_fds (gint             memfd,
+                                                gint             local_fd,
+                                                gint             remote_fd,
+                                                GError         **error);
+MbimShmChannel *_mbim_shm_channel_new_proxy_from_fds (gint       memfd,
+                                                      gint       local_fd,
+                                                      gint       remote_fd,
+                                                      GError   **error);
+void            _mbim_shm_channel_free         (MbimShmChannel  *self);
+void            _mbim_shm_channel_get_peer_fds (MbimShmChannel  *self,
+                                                gint            *out_memfd,
+                                                gint            *out_peer_local_fd,
+                                                gint            *out_peer_remote_fd);
+void            _mbim_shm_channel_get_fds      (MbimShmChannel  *self,
+                                                gint            *out_memfd,
+                                                gint            *out_local_fd,
+                                                gint            *out_remote_fd);
+gint            _mbim_shm_channel_get_fd       (MbimShmChannel  *self);
+void            _mbim_shm_channel_acknowledge  (MbimShmChannel  *self);
+void            _mbim_shm_channel_wakeup       (MbimShmChannel  *self);
+gboolean        _mbim_shm_channel_write        (MbimShmChannel  *self,
+                                                const guint8    *data,
+                                                gsize            data_length,
+                                                gsize           *out_written,
+                                                GError         **error);
+void            _mbim_shm_channel_notify       (MbimShmChannel  *self);
+gsize           _mbim_shm_channel_read         (MbimShmChannel  *self,
+                                                GByteArray      *buffer);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (MbimShmChannel, _mbim_shm_channel_free)
+
+G_END_DECLS
+
+#endif /* _LIBMBIM_GLIB_MBIM_SHM_CHANNEL_H_ */
@@ -0,0 +1,743 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * libmbim-glib -- GLib/GIO based library to control MBIM devices
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <liburing.h>
+
+#include <glib.h>
+
+#include "config.h"
+#include "mbim-uring-channel.h"
+#include "mbim-error-types.h"
+#include "mbim-errors.h"
+
+/*****************************************************************************/
+
+#define QUEUE_DEPTH     64
+#define MAX_WRITE_BATCH 32
+
+/* Time given to the last writes when freeing the channel, and to the
+ * cancelled operations to complete before tearing down the ring */
+#define FREE_FLUSH_TIMEOUT_MS 100
+#define TEARDOWN_TIMEOUT_MS   100
+
+/* Provided buffers for multishot reads */
+#define READ_BUFFER_GROUP 0
+#define N_READ_BUFFERS    16
+
+typedef enum {
+    OP_READ,
+    OP_POLL,
+    OP_WRITE,
+} OpType;
+
+typedef struct {
+    OpType type;
+} Op;
+
+typedef struct {
+    Op      op;
+    guint64 seq;
+    guint8 *data;
+    gsize   length;
+    gsize   offset;
+} WriteRequest;
+
+struct _MbimUringChannel {
+    gint            fd;
+    gint            event_fd;
+    struct io_uring ring;
+    gsize           read_size;
+
+    /* Reads */
+    Op        read_op;
+    Op        poll_op;
+    gboolean  read_armed;
+    gboolean  multishot;
+    guint8   *read_buffers;
+#if defined HAVE_IO_URING_READ_MULTISHOT
+    struct io_uring_buf_ring *buf_ring;
+#endif
+
+    /* Data or read status received while no callback was available, e.g.
+     * while flushing writes */
+    GByteArray *stash;
+    gssize      stash_status;
+
+    /* Writes pending to be submitted, sorted by seq, and writes already
+     * submitted, owned by the ring until their completion is reaped */
+    GQueue  *writes;
+    guint64  next_write_seq;
+    GQueue  *in_flight;
+
+    /* Negative errno of the first write that failed; no more writes are
+     * submitted after it */
+    gint     write_error;
+
+    /* The channel may be freed by the callback while dispatching; if so,
+     * the ring is torn down once the dispatch is over */
+    gboolean dispatching;
+    gboolean closed;
+};
+
+/*****************************************************************************/
+
+static void
+write_request_free (WriteRequest *request)
+{
+    g_free (request->data);
+    g_slice_free (WriteRequest, request);
+}
+
+static gint
+write_request_cmp (const WriteRequest *a,
+                   const WriteRequest *b,
+                   gpointer            user_data)
+{
+    return (a->seq < b->seq) ? -1 : (a->seq > b->seq);
+}
+
+static struct io_uring_sqe *
+channel_get_sqe (MbimUringChannel *self)
+{
+    struct io_uring_sqe *sqe;
+
+    /* Submission queue full, submit what we have to make room */
+    sqe = io_uring_get_sqe (&self->ring);
+    if (!sqe) {
+        io_uring_submit (&self->ring);
+        sqe = io_uring_get_sqe (&self->ring);
+    }
+    return sqe;
+}
+
+static void
+channel_arm_read (MbimUringChannel *self)
+{
+    struct io_uring_sqe *sqe;
+
+    if (self->read_armed || self->closed)
+        return;
+
+    sqe = channel_get_sqe (self);
+    if (!sqe)
+        return;
+
+#if defined HAVE_IO_URING_READ_MULTISHOT
+    if (self->multishot) {
+        io_uring_prep_read_multishot (sqe, self->fd, 0, 0, READ_BUFFER_GROUP);
+        io_uring_sqe_set_data (sqe, &self->read_op);
+        self->read_armed = TRUE;
+        return;
+    }
+#endif
+
+    io_uring_prep_read (sqe, self->fd, self->read_buffers, self->read_size, 0);
+    io_uring_sqe_set_data (sqe, &self->read_op);
+    self->read_armed = TRUE;
+}
+
+static void
+channel_arm_poll (MbimUringChannel *self)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = channel_get_sqe (self);
+    if (!sqe)
+        return;
+
+    io_uring_prep_poll_add (sqe, self->fd, POLLIN);
+    io_uring_sqe_set_data (sqe, &self->poll_op);
+    self->read_armed = TRUE;
+}
+
+static void
+channel_submit_writes (MbimUringChannel *self)
+{
+    struct io_uring_sqe *previous = NULL;
+    WriteRequest        *request;
+    guint                n_writes = 0;
+
+    /* Only one batch in flight, so that order is kept across batches */
+    if (!g_queue_is_empty (self->in_flight) || self->closed || self->write_error)
+        return;
+
+    while (n_writes < MAX_WRITE_BATCH && (request = g_queue_peek_head (self->writes)) != NULL) {
+        struct io_uring_sqe *sqe;
+
+        sqe = io_uring_get_sqe (&self->ring);
+        if (!sqe)
+            break;
+
+        /* Link each write with the next one, so that they're run in order */
+        if (previous)
+            io_uring_sqe_set_flags (previous, IOSQE_IO_LINK);
+        io_uring_prep_write (sqe, self->fd, &request->data[request->offset], request->length - request->offset, 0);
+        io_uring_sqe_set_data (sqe, request);
+        previous = sqe;
+
+        g_queue_push_tail (self->in_flight, g_queue_pop_head (self->writes));
+        n_writes++;
+    }
+}
+
+static void
+channel_stash (MbimUringChannel *self,
+               const guint8     *data,
+               gssize            length)
+{
+    if (length > 0)
+        g_byte_array_append (self->stash, data, length);
+    else if (!self->stash_status)
+        self->stash_status = (length == 0) ? G_MINSSIZE : length;
+}
+
+/* Returns FALSE if the callback requested to stop */
+static gboolean
+channel_deliver (MbimUringChannel         *self,
+                 const guint8             *data,
+                 gssize                    length,
+                 MbimUringChannelReadFunc  callback,
+                 gpointer                  user_data)
+{
+    if (!callback) {
+        channel_stash (self, data, length);
+        return TRUE;
+    }
+    return callback (data, length, user_data);
+}
+
+static gboolean
+channel_process_write (MbimUringChannel *self,
+                       WriteRequest     *request,
+                       gint              res)
+{
+    g_queue_remove (self->in_flight, request);
+
+    /* Cancelled because of a failure in a previous linked write, or would
+     * block: retry, keeping the original order */
+    if (res == -ECANCELED || res == -EAGAIN || res == -EINTR) {
+        g_queue_insert_sorted (self->writes, request, (GCompareDataFunc)write_request_cmp, NULL);
+        return TRUE;
+    }
+
+    if (res < 0) {
+        write_request_free (request);
+        return FALSE;
+    }
+
+    request->offset += res;
+    if (request->offset < request->length)
+        g_queue_insert_sorted (self->writes, request, (GCompareDataFunc)write_request_cmp, NULL);
+    else
+        write_request_free (request);
+    return TRUE;
+}
+
+/* Returns FALSE if the callback requested to stop */
+static gboolean
+channel_process_read (MbimUringChannel         *self,
+                      gint                      res,
+                      guint32                   flags,
+                      MbimUringChannelReadFunc  callback,
+                      gpointer                  user_data)
+{
+    gboolean keep_going = TRUE;
+
+    /* Still armed, more completions will come for the same request */
+    if (!(flags & IORING_CQE_F_MORE))
+        self->read_armed = FALSE;
+
+#if defined HAVE_IO_URING_READ_MULTISHOT
+    if (self->multishot) {
+        if (flags & IORING_CQE_F_BUFFER) {
+            guint16  bid;
+            guint8  *buffer;
+
+            bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            buffer = &self->read_buffers[bid * self->read_size];
+            if (res >= 0)
+                keep_going = channel_deliver (self, buffer, res, callback, user_data);
+
+            /* Give the buffer back to the kernel */
+            io_uring_buf_ring_add (self->buf_ring, buffer, self->read_size, bid,
+                                   io_uring_buf_ring_mask (N_READ_BUFFERS), 0);
+            io_uring_buf_ring_advance (self->buf_ring, 1);
+            return keep_going;
+        }
+
+        /* Multishot reads not supported by the running kernel */
+        if (res == -EINVAL) {
+            g_debug ("io_uring multishot reads unsupported: falling back to single reads");
+            io_uring_free_buf_ring (&self->ring, self->buf_ring, N_READ_BUFFERS, READ_BUFFER_GROUP);
+            self->buf_ring = NULL;
+            self->multishot = FALSE;
+            return TRUE;
+        }
+
+        /* Out of buffers; re-armed once processed */
+        if (res == -ENOBUFS)
+            return TRUE;
+    }
+#endif
+
+    if (res == -EAGAIN) {
+        /* Non-blocking fd without data; wait for it */
+        channel_arm_poll (self);
+        return TRUE;
+    }
+
+    if (res == -EINTR)
+        return TRUE;
+
+    return channel_deliver (self, self->read_buffers, res, callback, user_data);
+}
+
+/* Returns FALSE if the callback requested to stop */
+static gboolean
+channel_process_completions (MbimUringChannel         *self,
+                             MbimUringChannelReadFunc  callback,
+                             gpointer                  user_data)
+{
+    struct io_uring_cqe *cqe;
+    gboolean             keep_going = TRUE;
+    gboolean             read_failed = FALSE;
+    gint                 write_error = 0;
+
+    while (keep_going && !self->closed && io_uring_peek_cqe (&self->ring, &cqe) == 0) {
+        Op      *op;
+        gint     res;
+        guint32  flags;
+
+        /* Consumed before processing, as the callback may flush the ring */
+        op = io_uring_cqe_get_data (cqe);
+        res = cqe->res;
+        flags = cqe->flags;
+        io_uring_cqe_seen (&self->ring, cqe);
+
+        switch (op->type) {
+        case OP_READ:
+            keep_going = channel_process_read (self, res, flags, callback, user_data);
+            if (!self->read_armed && res <= 0 && res != -EAGAIN && res != -EINTR &&
+                res != -ENOBUFS && res != -EINVAL)
+                read_failed = TRUE;
+            break;
+        case OP_POLL:
+            self->read_armed = FALSE;
+            break;
+        case OP_WRITE:
+            if (!channel_process_write (self, (WriteRequest *)op, res) && !self->write_error)
+                write_error = res;
+            break;
+        default:
+            g_assert_not_reached ();
+        }
+    }
+
+    if (self->closed)
+        return FALSE;
+
+    /* A failed write is as fatal as a failed read: the messages queued after
+     * it are discarded and the error is reported through the read callback,
+     * so that the pending transactions are not left to time out */
+    if (write_error) {
+        self->write_error = write_error;
+        g_queue_free_full (self->writes, (GDestroyNotify)write_request_free);
+        self->writes = g_queue_new ();
+        if (keep_going)
+            keep_going = channel_deliver (self, NULL, write_error, callback, user_data);
+        read_failed = TRUE;
+    }
+
+    /* Keep a read always posted, unless the port is gone */
+    if (keep_going && !read_failed)
+        channel_arm_read (self);
+    channel_submit_writes (self);
+    io_uring_submit (&self->ring);
+
+    return keep_going;
+}
+
+/*****************************************************************************/
+
+void
+_mbim_uring_channel_write (MbimUringChannel *self,
+                           const guint8     *data,
+                           gsize             data_length)
+{
+    WriteRequest *request;
+
+    /* Already reported as a fatal error */
+    if (self->write_error)
+        return;
+
+    /* Submitted along with all the other writes queued in the same main
+     * loop iteration */
+    request = g_slice_new0 (WriteRequest);
+    request->op.type = OP_WRITE;
+    request->seq = self->next_write_seq++;
+    request->data = g_memdup (data, data_length);
+    request->length = data_length;
+    g_queue_push_tail (self->writes, request);
+}
+
+gboolean
+_mbim_uring_channel_flush (MbimUringChannel  *self,
+                           guint              timeout_ms,
+                           GError           **error)
+{
+    gint64 deadline;
+
+    deadline = g_get_monotonic_time () + (gint64) timeout_ms * 1000;
+
+    channel_submit_writes (self);
+    io_uring_submit (&self->ring);
+
+    while (!g_queue_is_empty (self->in_flight) || !g_queue_is_empty (self->writes)) {
+        struct __kernel_timespec  ts;
+        struct io_uring_cqe      *cqe;
+        gint64                    remaining;
+        gint                      ret;
+
+        /* Completions already available are processed without waiting, so
+         * that a zero timeout still flushes the writes that don't block.
+         * Reads completed meanwhile are stashed until the next dispatch. */
+        if (io_uring_cq_ready (&self->ring) > 0) {
+            channel_process_completions (self, NULL, NULL);
+            continue;
+        }
+
+        remaining = deadline - g_get_monotonic_time ();
+        if (remaining <= 0) {
+            g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_TIMEOUT,
+                         "Timed out flushing writes");
+            return FALSE;
+        }
+
+        ts.tv_sec = remaining / G_USEC_PER_SEC;
+        ts.tv_nsec = (remaining % G_USEC_PER_SEC) * 1000;
+        ret = io_uring_wait_cqe_timeout (&self->ring, &cqe, &ts);
+        if (ret < 0 && ret != -ETIME && ret != -EINTR) {
+            g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                         "Couldn't wait for completions: %s", g_strerror (-ret));
+            return FALSE;
+        }
+    }
+
+    if (self->write_error) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "Couldn't write to the control port: %s", g_strerror (-self->write_error));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+gboolean
+_mbim_uring_channel_is_multishot (MbimUringChannel *self)
+{
+    return self->multishot;
+}
+
+/*****************************************************************************/
+/* GSource */
+
+typedef struct {
+    GSource           source;
+    MbimUringChannel *channel;
+    gpointer          tag;
+} UringSource;
+
+static gboolean
+uring_source_prepare (GSource *source,
+                      gint    *timeout)
+{
+    MbimUringChannel *self = ((UringSource *)source)->channel;
+
+    /* Batch all writes queued during the last iteration */
+    if (!g_queue_is_empty (self->writes) && g_queue_is_empty (self->in_flight)) {
+        channel_submit_writes (self);
+        io_uring_submit (&self->ring);
+    }
+
+    *timeout = -1;
+    return (self->stash->len > 0 || self->stash_status || io_uring_cq_ready (&self->ring) > 0);
+}
+
+static gboolean
+uring_source_check (GSource *source)
+{
+    UringSource      *uring_source = (UringSource *)source;
+    MbimUringChannel *self = uring_source->channel;
+
+    return (self->stash->len > 0 ||
+            self->stash_status ||
+            io_uring_cq_ready (&self->ring) > 0 ||
+            (g_source_query_unix_fd (source, uring_source->tag) & G_IO_IN));
+}
+
+static void channel_teardown (MbimUringChannel *self);
+
+static gboolean
+channel_dispatch (MbimUringChannel         *self,
+                  MbimUringChannelReadFunc  func,
+                  gpointer                  user_data)
+{
+    guint64 value;
+
+    /* Reset the eventfd counter; completions are checked below anyway */
+    if (read (self->event_fd, &value, sizeof (value)) < 0 && errno != EAGAIN)
+        g_warning ("couldn't read io_uring eventfd: %s", g_strerror (errno));
+
+    if (self->stash->len > 0) {
+        g_autoptr(GByteArray) stash = NULL;
+
+        stash = self->stash;
+        self->stash = g_byte_array_new ();
+        if (!func (stash->data, stash->len, user_data))
+            return G_SOURCE_REMOVE;
+    }
+
+    if (self->stash_status) {
+        gssize status;
+
+        status = (self->stash_status == G_MINSSIZE) ? 0 : self->stash_status;
+        self->stash_status = 0;
+        if (!func (NULL, status, user_data))
+            return G_SOURCE_REMOVE;
+    }
+
+    return channel_process_completions (self, func, user_data) ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+static gboolean
+uring_source_dispatch (GSource     *source,
+                       GSourceFunc  callback,
+                       gpointer     user_data)
+{
+    MbimUringChannel *self = ((UringSource *)source)->channel;
+    gboolean          ret;
+
+    g_warn_if_fail (callback != NULL);
+
+    self->dispatching = TRUE;
+    ret = channel_dispatch (self, (MbimUringChannelReadFunc)callback, user_data);
+    self->dispatching = FALSE;
+
+    /* Freed by the callback */
+    if (self->closed) {
+        channel_teardown (self);
+        return G_SOURCE_REMOVE;
+    }
+
+    return ret;
+}
+
+static GSourceFuncs uring_source_funcs = {
+    uring_source_prepare,
+    uring_source_check,
+    uring_source_dispatch,
+    NULL, NULL, NULL
+};
+
+GSource *
+_mbim_uring_channel_create_source (MbimUringChannel *self)
+{
+    UringSource *source;
+
+    /* The source must be destroyed before the channel is freed */
+    source = (UringSource *) g_source_new (&uring_source_funcs, sizeof (UringSource));
+    source->channel = self;
+    source->tag = g_source_add_unix_fd ((GSource *)source, self->event_fd, G_IO_IN);
+    g_source_set_name ((GSource *)source, "mbim-uring-channel");
+    return (GSource *)source;
+}
+
+/*****************************************************************************/
+
+static void
+channel_cancel_op (MbimUringChannel *self,
+                   gpointer          op)
+{
+    struct io_uring_sqe *sqe;
+
+    /* Completed with no data, so that it's told apart from the operations */
+    sqe = channel_get_sqe (self);
+    if (sqe) {
+        io_uring_prep_cancel (sqe, op, 0);
+        io_uring_sqe_set_data (sqe, NULL);
+    }
+}
+
+/* The buffers of the operations still posted, e.g. writes that couldn't be
+ * flushed, may be used by the kernel until their completions are reaped, so
+ * cancel them and wait for them before releasing the buffers */
+static void
+channel_cancel_posted (MbimUringChannel *self)
+{
+    GList  *l;
+    gint64  deadline;
+
+    /* The read may be posted either as a read or as a poll */
+    if (self->read_armed) {
+        channel_cancel_op (self, &self->read_op);
+        channel_cancel_op (self, &self->poll_op);
+    }
+    for (l = self->in_flight->head; l; l = g_list_next (l))
+        channel_cancel_op (self, l->data);
+    io_uring_submit (&self->ring);
+
+    deadline = g_get_monotonic_time () + TEARDOWN_TIMEOUT_MS * 1000;
+    while (self->read_armed || !g_queue_is_empty (self->in_flight)) {
+        struct __kernel_timespec  ts;
+        struct io_uring_cqe      *cqe;
+        Op                       *op;
+        gint64                    remaining;
+
+        remaining = deadline - g_get_monotonic_time ();
+        if (remaining <= 0)
+            break;
+        ts.tv_sec = remaining / G_USEC_PER_SEC;
+        ts.tv_nsec = (remaining % G_USEC_PER_SEC) * 1000;
+        if (io_uring_wait_cqe_timeout (&self->ring, &cqe, &ts) < 0)
+            continue;
+
+        op = io_uring_cqe_get_data (cqe);
+        if (op && op->type == OP_WRITE) {
+            g_queue_remove (self->in_flight, op);
+            write_request_free ((WriteRequest *)op);
+        } else if (op && !(cqe->flags & IORING_CQE_F_MORE))
+            self->read_armed = FALSE;
+        io_uring_cqe_seen (&self->ring, cqe);
+    }
+
+    /* Not reaped in time: better leak them than free them under the kernel */
+    if (self->read_armed || !g_queue_is_empty (self->in_flight)) {
+        g_debug ("io_uring operations still posted: leaking %u write buffers",
+                 g_queue_get_length (self->in_flight));
+        g_queue_free (self->in_flight);
+        self->in_flight = NULL;
+        self->read_buffers = NULL;
+    }
+}
+
+static void
+channel_teardown (MbimUringChannel *self)
+{
+    channel_cancel_posted (self);
+
+#if defined HAVE_IO_URING_READ_MULTISHOT
+    if (self->buf_ring)
+        io_uring_free_buf_ring (&self->ring, self->buf_ring, N_READ_BUFFERS, READ_BUFFER_GROUP);
+#endif
+    io_uring_queue_exit (&self->ring);
+    close (self->event_fd);
+
+    g_queue_free_full (self->writes, (GDestroyNotify)write_request_free);
+    if (self->in_flight)
+        g_queue_free (self->in_flight);
+    g_byte_array_unref (self->stash);
+    g_free (self->read_buffers);
+    g_slice_free (MbimUringChannel, self);
+}
+
+void
+_mbim_uring_channel_free (MbimUringChannel *self)
+{
+    g_autoptr(GError) error = NULL;
+
+    /* Don't lose the last writes, e.g. a close request, as long as they can
+     * be done right away; the fd is closed right after this, so no more
+     * submissions are allowed */
+    if (!_mbim_uring_channel_flush (self, FREE_FLUSH_TIMEOUT_MS, &error))
+        g_debug ("couldn't flush pending writes: %s", error->message);
+    self->closed = TRUE;
+
+    if (!self->dispatching)
+        channel_teardown (self);
+}
+
+MbimUringChannel *
+_mbim_uring_channel_new (gint     fd,
+                         gsize    read_size,
+                         GError **error)
+{
+    MbimUringChannel *self;
+    gint              ret;
+
+    g_assert (fd >= 0);
+    g_assert (read_size > 0);
+
+    self = g_slice_new0 (MbimUringChannel);
+    self->fd = fd;
+    self->read_size = read_size;
+    self->read_op.type = OP_READ;
+    self->poll_op.type = OP_POLL;
+    self->writes = g_queue_new ();
+    self->in_flight = g_queue_new ();
+    self->stash = g_byte_array_new ();
+
+    self->event_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (self->event_fd < 0) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED,
+                     "Couldn't create eventfd: %s", g_strerror (errno));
+        goto error_event_fd;
+    }
+
+    /* e.g. io_uring disabled with the kernel.io_uring_disabled sysctl, or
+     * blocked by a seccomp filter */
+    ret = io_uring_queue_init (QUEUE_DEPTH, &self->ring, 0);
+    if (ret < 0) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_UNSUPPORTED,
+                     "Couldn't setup io_uring: %s", g_strerror (-ret));
+        goto error_ring;
+    }
+
+    ret = io_uring_register_eventfd (&self->ring, self->event_fd);
+    if (ret < 0) {
+        g_set_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_UNSUPPORTED,
+                     "Couldn't register io_uring eventfd: %s", g_strerror (-ret));
+        goto error_eventfd_registration;
+    }
+
+#if defined HAVE_IO_URING_READ_MULTISHOT
+    self->buf_ring = io_uring_setup_buf_ring (&self->ring, N_READ_BUFFERS, READ_BUFFER_GROUP, 0, &ret);
+    if (self->buf_ring) {
+        guint i;
+
+        self->read_buffers = g_malloc (N_READ_BUFFERS * read_size);
+        for (i = 0; i < N_READ_BUFFERS; i++)
+            io_uring_buf_ring_add (self->buf_ring, &self->read_buffers[i * read_size], read_size, i,
+                                   io_uring_buf_ring_mask (N_READ_BUFFERS), i);
+        io_uring_buf_ring_advance (self->buf_ring, N_READ_BUFFERS);
+        self->multishot = TRUE;
+    } else
+        g_debug ("io_uring provided buffers unsupported: %s", g_strerror (-ret));
+#endif
+
+    if (!self->read_buffers)
+        self->read_buffers = g_malloc (read_size);
+
+    channel_arm_read (self);
+    io_uring_submit (&self->ring);
+    return self;
+
+error_eventfd_registration:
+    io_uring_queue_exit (&self->ring);
+error_ring:
+    close (self->event_fd);
+error_event_fd:
+    g_queue_free (self->writes);
+    g_queue_free (self->in_flight);
+    g_byte_array_unref (self->stash);
+    g_slice_free (MbimUringChannel, self);
+    return NULL;
+}
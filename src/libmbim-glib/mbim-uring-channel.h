@@ -0,0 +1,56 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * libmbim-glib -- GLib/GIO based library to control MBIM devices
+ *
+ * This is a private non-installed header
+ */
+
+#ifndef _LIBMBIM_GLIB_MBIM_URING_CHANNEL_H_
+#define _LIBMBIM_GLIB_MBIM_URING_CHANNEL_H_
+
+#if !defined (LIBMBIM_GLIB_COMPILATION)
+#error "This is a private header!!"
+#endif
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * io_uring based I/O on a control port fd.
+ *
+ * Reads are kept posted in the ring (in multishot mode when supported by
+ * liburing and the kernel), and writes are queued and submitted in batches
+ * once per main loop iteration, linked so that they're run in order. The
+ * ring completions are notified through an eventfd, polled by a GSource.
+ *
+ * The channel doesn't own the fd.
+ */
+
+typedef struct _MbimUringChannel MbimUringChannel;
+
+/* Called with the data read, or with @length 0 on EOF, or with a negative
+ * errno on a fatal read or write error. Returning FALSE removes the source. */
+typedef gboolean (* MbimUringChannelReadFunc) (const guint8 *data,
+                                               gssize        length,
+                                               gpointer      user_data);
+
+MbimUringChannel *_mbim_uring_channel_new           (gint               fd,
+                                                     gsize              read_size,
+                                                     GError           **error);
+void              _mbim_uring_channel_free          (MbimUringChannel  *self);
+gboolean          _mbim_uring_channel_is_multishot  (MbimUringChannel  *self);
+GSource          *_mbim_uring_channel_create_source (MbimUringChannel  *self);
+void              _mbim_uring_channel_write         (MbimUringChannel  *self,
+                                                     const guint8      *data,
+                                                     gsize              data_length);
+gboolean          _mbim_uring_channel_flush         (MbimUringChannel  *self,
+                                                     guint              timeout_ms,
+                                                     GError           **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (MbimUringChannel, _mbim_uring_channel_free)
+
+G_END_DECLS
+
+#endif /* _LIBMBIM_GLIB_MBIM_URING_CHANNEL_H_ */
@@ -6,6 +6,9 @@
  * Copyright (C) 2013 - 2019 Aleksander Morgado <aleksander@aleksander.es>
  */
 
+#include <string.h>
+
+#include "mbim-common.h"
 #include "mbim-utils.h"
 
 /**
@@ -43,3 +46,334 @@ mbim_utils_get_show_personal_info (void)
 {
     return (gboolean) g_atomic_int_get (&__hide_personal_info);
 }
+
+/*****************************************************************************/
+/* Trace sink */
+
+/* Producers only wake up the sink thread if they can do it without blocking,
+ * so the thread also checks the queue periodically while idle */
+#define TRACE_SINK_IDLE_TIMEOUT (100 * G_TIME_SPAN_MILLISECOND)
+
+#define TRACE_SINK_MAX_RECORDS (1 << 20)
+
+typedef struct {
+    gint64          timestamp;
+    GLogLevelFlags  log_level;
+    gchar          *message;
+    /* Raw data to print after the message, if any */
+    guint8         *raw;
+    gsize           raw_size;
+    gsize           raw_max_size;
+} TraceRecord;
+
+/* The queue is a bounded array of slots, each with a sequence number telling
+ * whether the slot is free for the producer at that position (equal to the
+ * position), or whether it holds a record for the consumer (position + 1) */
+typedef struct {
+    gint         sequence;
+    TraceRecord *record;
+} TraceSlot;
+
+typedef struct {
+    TraceSlot              *slots;
+    guint                   n_slots;
+    gint                    tail;
+    guint                   head;
+    guint                   dropped_reported;
+    gint                    stopping;
+    GMutex                  mutex;
+    GCond                   cond;
+    GThread                *thread;
+    MbimUtilsTraceSinkFunc  func;
+    gpointer                user_data;
+} TraceSink;
+
+static TraceSink *__trace_sink;
+static volatile gint __trace_sink_dropped;
+/* Number of producers holding a reference to the running sink */
+static volatile gint __trace_sink_refs;
+
+/* The producer count is raised before the pointer is loaded, so a concurrent
+ * stop either makes the producer see no sink, or waits for it to finish
+ * queueing before the sink is freed */
+static TraceSink *
+trace_sink_ref (void)
+{
+    TraceSink *sink;
+
+    g_atomic_int_inc (&__trace_sink_refs);
+    sink = g_atomic_pointer_get (&__trace_sink);
+    if (!sink)
+        g_atomic_int_add (&__trace_sink_refs, -1);
+    return sink;
+}
+
+static void
+trace_sink_unref (void)
+{
+    g_atomic_int_add (&__trace_sink_refs, -1);
+}
+
+static void
+trace_record_free (TraceRecord *record)
+{
+    g_free (record->message);
+    g_free (record->raw);
+    g_free (record);
+}
+
+/* Multiple producers */
+static gboolean
+trace_sink_enqueue (TraceSink   *sink,
+                    TraceRecord *record)
+{
+    TraceSlot *slot;
+    guint      position;
+    gint       diff;
+
+    position = (guint) g_atomic_int_get (&sink->tail);
+    for (;;) {
+        slot = &sink->slots[position & (sink->n_slots - 1)];
+        diff = (gint) ((guint) g_atomic_int_get (&slot->sequence) - position);
+        if (diff == 0) {
+            if (g_atomic_int_compare_and_exchange (&sink->tail, (gint) position, (gint) (position + 1)))
+                break;
+        } else if (diff < 0) {
+            /* Queue full */
+            return FALSE;
+        }
+        position = (guint) g_atomic_int_get (&sink->tail);
+    }
+
+    g_atomic_pointer_set (&slot->record, record);
+    g_atomic_int_set (&slot->sequence, (gint) (position + 1));
+    return TRUE;
+}
+
+/* Single consumer, the sink thread */
+static TraceRecord *
+trace_sink_dequeue (TraceSink *sink)
+{
+    TraceSlot   *slot;
+    TraceRecord *record;
+
+    slot = &sink->slots[sink->head & (sink->n_slots - 1)];
+    if ((guint) g_atomic_int_get (&slot->sequence) != sink->head + 1)
+        return NULL;
+
+    record = g_atomic_pointer_get (&slot->record);
+    g_atomic_int_set (&slot->sequence, (gint) (sink->head + sink->n_slots));
+    sink->head++;
+    return record;
+}
+
+static gboolean
+trace_sink_is_empty (TraceSink *sink)
+{
+    return (guint) g_atomic_int_get (&sink->slots[sink->head & (sink->n_slots - 1)].sequence) != sink->head + 1;
+}
+
+static void
+trace_sink_push_record (TraceSink   *sink,
+                        TraceRecord *record)
+{
+    if (!trace_sink_enqueue (sink, record)) {
+        g_atomic_int_inc (&__trace_sink_dropped);
+        trace_record_free (record);
+        return;
+    }
+
+    if (g_mutex_trylock (&sink->mutex)) {
+        g_cond_signal (&sink->cond);
+        g_mutex_unlock (&sink->mutex);
+    }
+}
+
+static void
+trace_sink_write (TraceSink   *sink,
+                  TraceRecord *record)
+{
+    g_autofree gchar *hex = NULL;
+    g_autofree gchar *message = NULL;
+
+    if (!record->raw) {
+        sink->func (record->timestamp, record->log_level, record->message, sink->user_data);
+        return;
+    }
+
+    /* Same contents as the traces logged when there is no sink */
+    hex = mbim_common_str_hex_truncated (record->raw, record->raw_size, record->raw_max_size, ':');
+    message = g_strconcat (record->message, hex, "\n", NULL);
+    sink->func (record->timestamp, record->log_level, message, sink->user_data);
+}
+
+static void
+trace_sink_report_dropped (TraceSink *sink)
+{
+    g_autofree gchar *message = NULL;
+    guint             dropped;
+
+    dropped = (guint) g_atomic_int_get (&__trace_sink_dropped);
+    if (dropped == sink->dropped_reported)
+        return;
+
+    message = g_strdup_printf ("%u trace records dropped", dropped - sink->dropped_reported);
+    sink->dropped_reported = dropped;
+    sink->func (g_get_real_time (), G_LOG_LEVEL_WARNING, message, sink->user_data);
+}
+
+static gpointer
+trace_sink_thread (TraceSink *sink)
+{
+    TraceRecord *record;
+    gboolean     stopping;
+
+    for (;;) {
+        /* Records queued before stopping was set are all written below */
+        stopping = g_atomic_int_get (&sink->stopping);
+
+        while ((record = trace_sink_dequeue (sink)) != NULL) {
+            trace_sink_write (sink, record);
+            trace_record_free (record);
+        }
+        trace_sink_report_dropped (sink);
+
+        if (stopping)
+            break;
+
+        g_mutex_lock (&sink->mutex);
+        if (!g_atomic_int_get (&sink->stopping) && trace_sink_is_empty (sink))
+            g_cond_wait_until (&sink->cond, &sink->mutex, g_get_monotonic_time () + TRACE_SINK_IDLE_TIMEOUT);
+        g_mutex_unlock (&sink->mutex);
+    }
+
+    return NULL;
+}
+
+/* Stops the thread once all queued records are written */
+static void
+trace_sink_free (TraceSink *sink)
+{
+    g_mutex_lock (&sink->mutex);
+    g_atomic_int_set (&sink->stopping, TRUE);
+    g_cond_signal (&sink->cond);
+    g_mutex_unlock (&sink->mutex);
+    g_thread_join (sink->thread);
+
+    g_mutex_clear (&sink->mutex);
+    g_cond_clear (&sink->cond);
+    g_free (sink->slots);
+    g_free (sink);
+}
+
+gboolean
+mbim_utils_trace_sink_start (guint                  max_records,
+                             MbimUtilsTraceSinkFunc func,
+                             gpointer               user_data)
+{
+    TraceSink *sink;
+    guint      i;
+
+    g_return_val_if_fail (func != NULL, FALSE);
+
+    if (g_atomic_pointer_get (&__trace_sink))
+        return FALSE;
+
+    sink = g_new0 (TraceSink, 1);
+    /* Positions wrap around at 2^32, so the number of slots must be a power
+     * of 2 for them to keep mapping to the same slot */
+    max_records = CLAMP (max_records, 2, TRACE_SINK_MAX_RECORDS);
+    sink->n_slots = 1u << g_bit_storage (max_records - 1);
+    sink->slots = g_new0 (TraceSlot, sink->n_slots);
+    for (i = 0; i < sink->n_slots; i++)
+        sink->slots[i].sequence = (gint) i;
+    sink->dropped_reported = (guint) g_atomic_int_get (&__trace_sink_dropped);
+    sink->func = func;
+    sink->user_data = user_data;
+    g_mutex_init (&sink->mutex);
+    g_cond_init (&sink->cond);
+    sink->thread = g_thread_new ("mbim-trace-sink", (GThreadFunc) trace_sink_thread, sink);
+
+    /* Only one of several concurrent callers gets its sink published */
+    if (!g_atomic_pointer_compare_and_exchange (&__trace_sink, NULL, sink)) {
+        trace_sink_free (sink);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void
+mbim_utils_trace_sink_stop (void)
+{
+    TraceSink *sink;
+
+    /* Any record logged from now on is not queued; only one caller gets to
+     * stop the sink, so this may also run from an exit handler */
+    do {
+        sink = g_atomic_pointer_get (&__trace_sink);
+        if (!sink)
+            return;
+    } while (!g_atomic_pointer_compare_and_exchange (&__trace_sink, sink, NULL));
+
+    /* Wait for the producers that got the sink before it was unset */
+    while (g_atomic_int_get (&__trace_sink_refs) > 0)
+        g_thread_yield ();
+
+    trace_sink_free (sink);
+}
+
+gboolean
+mbim_utils_trace_sink_push (GLogLevelFlags  log_level,
+                            const gchar    *message)
+{
+    TraceSink   *sink;
+    TraceRecord *record;
+
+    sink = trace_sink_ref ();
+    if (!sink)
+        return FALSE;
+
+    record = g_new0 (TraceRecord, 1);
+    record->timestamp = g_get_real_time ();
+    record->log_level = log_level;
+    record->message = g_strdup (message);
+    trace_sink_push_record (sink, record);
+    trace_sink_unref ();
+    return TRUE;
+}
+
+gboolean
+mbim_utils_trace_sink_push_raw (GLogLevelFlags  log_level,
+                                const gchar    *header,
+                                gconstpointer   data,
+                                gsize           size,
+                                gsize           max_size)
+{
+    TraceSink   *sink;
+    TraceRecord *record;
+
+    sink = trace_sink_ref ();
+    if (!sink)
+        return FALSE;
+
+    record = g_new0 (TraceRecord, 1);
+    record->timestamp = g_get_real_time ();
+    record->log_level = log_level;
+    record->message = g_strdup (header);
+    /* Only the printed bytes are copied; the buffer is allocated even if
+     * empty, as raw records are told apart by having one */
+    record->raw_size = size;
+    record->raw_max_size = MIN (size, max_size);
+    record->raw = g_malloc (record->raw_max_size + 1);
+    if (record->raw_max_size)
+        memcpy (record->raw, data, record->raw_max_size);
+    trace_sink_push_record (sink, record);
+    trace_sink_unref ();
+    return TRUE;
+}
+
+guint
+mbim_utils_trace_sink_get_dropped (void)
+{
+    return (guint) g_atomic_int_get (&__trace_sink_dropped);
+}
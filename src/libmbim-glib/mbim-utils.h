@@ -61,6 +61,116 @@ void mbim_utils_set_show_personal_info (gboolean show_personal_info);
  */
 gboolean mbim_utils_get_show_personal_info (void);
 
+/* Asynchronous trace sink */
+
+/**
+ * MbimUtilsTraceSinkFunc:
+ * @timestamp: the wall-clock time at which the record was queued, in microseconds.
+ * @log_level: the log level of the record.
+ * @message: the record contents.
+ * @user_data: the data given to mbim_utils_trace_sink_start().
+ *
+ * Writes a trace record to its final destination. It is always called from
+ * the trace sink thread, one record at a time, in the order in which records
+ * were queued.
+ *
+ * Since: 1.30
+ */
+typedef void (* MbimUtilsTraceSinkFunc) (gint64          timestamp,
+                                         GLogLevelFlags  log_level,
+                                         const gchar    *message,
+                                         gpointer        user_data);
+
+/**
+ * mbim_utils_trace_sink_start:
+ * @max_records: maximum number of records waiting to be written.
+ * @func: a #MbimUtilsTraceSinkFunc.
+ * @user_data: user data to pass to @func.
+ *
+ * Starts a background thread writing trace records with @func.
+ *
+ * Records are handed over to the thread through a bounded lock-free queue,
+ * so queueing them never blocks the caller on a slow destination. When the
+ * queue is full new records are dropped, and the number of dropped records
+ * is reported with a %G_LOG_LEVEL_WARNING record once there is room again.
+ *
+ * While the sink is running, #MbimDevice queues its raw message traces
+ * directly, and formats them in the sink thread.
+ *
+ * Returns: %TRUE if the sink was started, %FALSE if it was already running.
+ *
+ * Since: 1.30
+ */
+gboolean mbim_utils_trace_sink_start (guint                  max_records,
+                                      MbimUtilsTraceSinkFunc func,
+                                      gpointer               user_data);
+
+/**
+ * mbim_utils_trace_sink_stop:
+ *
+ * Writes all queued records and stops the trace sink thread.
+ *
+ * Records queued concurrently from other threads are either written or
+ * rejected, never lost after being accepted. Calling this method when the
+ * sink is not running does nothing, so it may also be registered with atexit()
+ * to flush the queued records on any exit path.
+ *
+ * Since: 1.30
+ */
+void mbim_utils_trace_sink_stop (void);
+
+/**
+ * mbim_utils_trace_sink_push:
+ * @log_level: the log level of the record.
+ * @message: the record contents.
+ *
+ * Queues a copy of @message in the trace sink. This method never blocks, and
+ * may be called from any thread.
+ *
+ * Returns: %TRUE if the trace sink is running, in which case the record was
+ * either queued or counted as dropped, %FALSE otherwise.
+ *
+ * Since: 1.30
+ */
+gboolean mbim_utils_trace_sink_push (GLogLevelFlags  log_level,
+                                     const gchar    *message);
+
+/**
+ * mbim_utils_trace_sink_push_raw:
+ * @log_level: the log level of the record.
+ * @header: text to print before the data.
+ * @data: the raw data.
+ * @size: size of @data.
+ * @max_size: maximum number of bytes of @data to print.
+ *
+ * Queues a record with @header followed by the hexadecimal representation of
+ * at most @max_size bytes of @data and a newline, as #MbimDevice logs them
+ * when the sink isn't running. Only those bytes are copied, and they are
+ * formatted in the trace sink thread. This method never blocks, and may be
+ * called from any thread.
+ *
+ * Returns: %TRUE if the trace sink is running, in which case the record was
+ * either queued or counted as dropped, %FALSE otherwise.
+ *
+ * Since: 1.30
+ */
+gboolean mbim_utils_trace_sink_push_raw (GLogLevelFlags  log_level,
+                                         const gchar    *header,
+                                         gconstpointer   data,
+                                         gsize           size,
+                                         gsize           max_size);
+
+/**
+ * mbim_utils_trace_sink_get_dropped:
+ *
+ * Gets the number of records dropped because the trace sink queue was full.
+ *
+ * Returns: the number of dropped records.
+ *
+ * Since: 1.30
+ */
+guint mbim_utils_trace_sink_get_dropped (void);
+
 G_END_DECLS
 
 #endif /* _LIBMBIM_GLIB_MBIM_UTILS_H_ */
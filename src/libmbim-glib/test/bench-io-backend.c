@@ -0,0 +1,276 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * Loopback benchmark comparing the GIOChannel and io_uring based I/O on a
+ * control port: messages are written to one end of a socketpair, echoed back
+ * by a separate thread, and read in the main loop.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "mbim-uring-channel.h"
+
+#define DEFAULT_N_MESSAGES 100000
+#define DEFAULT_MESSAGE_SIZE 48
+#define DEFAULT_WINDOW 8
+
+static gint n_messages   = DEFAULT_N_MESSAGES;
+static gint message_size = DEFAULT_MESSAGE_SIZE;
+static gint window       = DEFAULT_WINDOW;
+
+static GOptionEntry entries[] = {
+    { "messages", 'n', 0, G_OPTION_ARG_INT, &n_messages,
+      "Number of messages to send", "[N]"
+    },
+    { "size", 's', 0, G_OPTION_ARG_INT, &message_size,
+      "Size of each message, in bytes", "[SIZE]"
+    },
+    { "window", 'w', 0, G_OPTION_ARG_INT, &window,
+      "Maximum number of messages in flight", "[N]"
+    },
+    { NULL, 0, 0, 0, NULL, NULL, NULL }
+};
+
+/*****************************************************************************/
+
+static gpointer
+echo_thread (gpointer user_data)
+{
+    gint   fd = GPOINTER_TO_INT (user_data);
+    guint8 buffer[4096];
+
+    for (;;) {
+        gssize n;
+        gssize written = 0;
+
+        n = read (fd, buffer, sizeof (buffer));
+        if (n <= 0)
+            break;
+        while (written < n) {
+            gssize ret;
+
+            ret = write (fd, &buffer[written], n - written);
+            if (ret <= 0)
+                return NULL;
+            written += ret;
+        }
+    }
+    return NULL;
+}
+
+typedef struct {
+    GMainLoop *loop;
+    guint8    *message;
+    guint64    sent;
+    guint64    received_bytes;
+    guint64    total_bytes;
+    gboolean (* write) (gpointer channel, const guint8 *data, gsize length);
+    gpointer   channel;
+} Bench;
+
+static void
+bench_refill (Bench *bench)
+{
+    /* Keep the window full */
+    while (bench->sent < (guint64) n_messages &&
+           (bench->sent * message_size) - bench->received_bytes < (guint64) window * message_size) {
+        bench->write (bench->channel, bench->message, message_size);
+        bench->sent++;
+    }
+}
+
+static gboolean
+bench_received (Bench *bench,
+                gsize  length)
+{
+    bench->received_bytes += length;
+    if (bench->received_bytes >= bench->total_bytes) {
+        g_main_loop_quit (bench->loop);
+        return FALSE;
+    }
+    bench_refill (bench);
+    return TRUE;
+}
+
+/*****************************************************************************/
+/* GIOChannel */
+
+static gboolean
+iochannel_write (GIOChannel   *channel,
+                 const guint8 *data,
+                 gsize         length)
+{
+    gsize written = 0;
+
+    while (written < length) {
+        gsize n = 0;
+
+        if (g_io_channel_write_chars (channel, (const gchar *)&data[written], length - written, &n, NULL) == G_IO_STATUS_ERROR)
+            return FALSE;
+        written += n;
+    }
+    return TRUE;
+}
+
+static gboolean
+iochannel_available (GIOChannel   *channel,
+                     GIOCondition  condition,
+                     Bench        *bench)
+{
+    guint8 buffer[4096];
+    gsize  n = 0;
+
+    if (condition & (G_IO_HUP | G_IO_ERR))
+        g_error ("unexpected hangup");
+
+    if (g_io_channel_read_chars (channel, (gchar *)buffer, sizeof (buffer), &n, NULL) == G_IO_STATUS_ERROR)
+        g_error ("read failed");
+    return bench_received (bench, n);
+}
+
+static void
+run_iochannel (gint   fd,
+               Bench *bench)
+{
+    GIOChannel *channel;
+
+    channel = g_io_channel_unix_new (fd);
+    g_io_channel_set_encoding (channel, NULL, NULL);
+    g_io_channel_set_buffered (channel, FALSE);
+    g_io_channel_set_flags (channel, G_IO_FLAG_NONBLOCK, NULL);
+
+    bench->channel = channel;
+    bench->write = (gpointer)iochannel_write;
+    g_io_add_watch (channel, G_IO_IN | G_IO_HUP | G_IO_ERR, (GIOFunc)iochannel_available, bench);
+
+    bench_refill (bench);
+    g_main_loop_run (bench->loop);
+
+    g_io_channel_unref (channel);
+}
+
+/*****************************************************************************/
+/* io_uring */
+
+static gboolean
+uring_write (MbimUringChannel *channel,
+             const guint8     *data,
+             gsize             length)
+{
+    _mbim_uring_channel_write (channel, data, length);
+    return TRUE;
+}
+
+static gboolean
+uring_available (const guint8 *data,
+                 gssize        length,
+                 Bench        *bench)
+{
+    if (length <= 0)
+        g_error ("unexpected hangup");
+    return bench_received (bench, length);
+}
+
+static gboolean
+run_uring (gint   fd,
+           Bench *bench)
+{
+    g_autoptr(GError)  error = NULL;
+    MbimUringChannel  *channel;
+    GSource           *source;
+
+    channel = _mbim_uring_channel_new (fd, 16 * 4096, &error);
+    if (!channel) {
+        g_printerr ("io_uring unavailable: %s\n", error->message);
+        return FALSE;
+    }
+
+    bench->channel = channel;
+    bench->write = (gpointer)uring_write;
+    source = _mbim_uring_channel_create_source (channel);
+    g_source_set_callback (source, (GSourceFunc)uring_available, bench, NULL);
+    g_source_attach (source, NULL);
+
+    bench_refill (bench);
+    g_main_loop_run (bench->loop);
+
+    g_source_destroy (source);
+    g_source_unref (source);
+    _mbim_uring_channel_free (channel);
+    return TRUE;
+}
+
+/*****************************************************************************/
+
+static void
+run (const gchar *name,
+     gboolean     use_uring)
+{
+    GThread *thread;
+    Bench    bench = { 0 };
+    gint     fds[2];
+    gint64   start;
+    gint64   elapsed;
+    gboolean ran = TRUE;
+
+    if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+        g_error ("couldn't create socketpair: %s", g_strerror (errno));
+    fcntl (fds[0], F_SETFL, O_NONBLOCK);
+
+    bench.loop = g_main_loop_new (NULL, FALSE);
+    bench.message = g_malloc0 (message_size);
+    bench.total_bytes = (guint64) n_messages * message_size;
+
+    thread = g_thread_new ("echo", echo_thread, GINT_TO_POINTER (fds[1]));
+
+    start = g_get_monotonic_time ();
+    if (use_uring)
+        ran = run_uring (fds[0], &bench);
+    else
+        run_iochannel (fds[0], &bench);
+    elapsed = g_get_monotonic_time () - start;
+
+    /* Stops the echo thread */
+    shutdown (fds[0], SHUT_RDWR);
+    g_thread_join (thread);
+    close (fds[0]);
+    close (fds[1]);
+
+    if (ran)
+        g_print ("%-10s %8d messages in %8.3f ms: %10.0f msg/s\n",
+                 name, n_messages, elapsed / 1000.0,
+                 n_messages / (elapsed / (gdouble) G_USEC_PER_SEC));
+
+    g_free (bench.message);
+    g_main_loop_unref (bench.loop);
+}
+
+int main (int argc, char **argv)
+{
+    g_autoptr(GOptionContext) context = NULL;
+    g_autoptr(GError)         error = NULL;
+
+    context = g_option_context_new ("- benchmark control port I/O backends");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("error: %s\n", error->message);
+        return 1;
+    }
+
+    if (n_messages <= 0 || message_size <= 0 || window <= 0) {
+        g_printerr ("error: invalid arguments\n");
+        return 1;
+    }
+
+    run ("GIOChannel", FALSE);
+    run ("io_uring", TRUE);
+    return 0;
+}
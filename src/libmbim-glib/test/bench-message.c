@@ -0,0 +1,494 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * Micro benchmarks of the message encode and decode hot paths. Each case is
+ * run in batches of increasing size until a batch takes at least the minimum
+ * time, and the results of the last batch are reported in JSON, so that they
+ * can be compared between releases.
+ */
+
+#include <config.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "mbim-common.h"
+#include "mbim-message.h"
+#include "mbim-message-private.h"
+#include "mbim-uuid.h"
+#include "mbim-basic-connect.h"
+#include "mbim-ms-basic-connect-extensions.h"
+
+#define DEFAULT_MIN_TIME 0.5
+#define N_ELEMENTS       64
+
+static gdouble  min_time = DEFAULT_MIN_TIME;
+static gchar   *filter;
+static gchar   *output_path;
+
+static GOptionEntry entries[] = {
+    { "min-time", 't', 0, G_OPTION_ARG_DOUBLE, &min_time,
+      "Minimum time to run each benchmark, in seconds (default: 0.5)", "[SECS]"
+    },
+    { "filter", 'f', 0, G_OPTION_ARG_STRING, &filter,
+      "Only run the benchmarks with names containing the given string", "[STRING]"
+    },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output_path,
+      "Write the JSON results to the given file instead of stdout", "[PATH]"
+    },
+    { NULL, 0, 0, 0, NULL, NULL, NULL }
+};
+
+/*****************************************************************************/
+/* Inputs, built once */
+
+static MbimMessage *visible_providers;
+static MbimMessage *provisioned_contexts;
+static MbimMessage *base_stations_info;
+static MbimMessage *long_string;
+static GPtrArray   *fragments;
+
+static void
+append_guint32 (GByteArray *array,
+                guint32     value)
+{
+    value = GUINT32_TO_LE (value);
+    g_byte_array_append (array, (const guint8 *)&value, 4);
+}
+
+static void
+set_guint32 (GByteArray *array,
+             guint32     offset,
+             guint32     value)
+{
+    value = GUINT32_TO_LE (value);
+    memcpy (&array->data[offset], &value, 4);
+}
+
+static MbimMessage *
+command_done_new (MbimService  service,
+                  guint32      cid,
+                  GByteArray  *information_buffer)
+{
+    GByteArray *message;
+
+    message = g_byte_array_new ();
+    append_guint32 (message, MBIM_MESSAGE_TYPE_COMMAND_DONE);
+    append_guint32 (message, 48 + information_buffer->len);
+    append_guint32 (message, 1);
+    append_guint32 (message, 1);
+    append_guint32 (message, 0);
+    g_byte_array_append (message, (const guint8 *)mbim_uuid_from_service (service), sizeof (MbimUuid));
+    append_guint32 (message, cid);
+    append_guint32 (message, MBIM_STATUS_ERROR_NONE);
+    append_guint32 (message, information_buffer->len);
+    g_byte_array_append (message, information_buffer->data, information_buffer->len);
+    g_byte_array_unref (information_buffer);
+    return (MbimMessage *)message;
+}
+
+/* Elements are referenced by offset and size, and follow the table */
+static GByteArray *
+ref_struct_array_new (GByteArray **elements,
+                      guint        n_elements)
+{
+    GByteArray *out;
+    guint       i;
+
+    out = g_byte_array_new ();
+    append_guint32 (out, n_elements);
+    for (i = 0; i < n_elements; i++) {
+        append_guint32 (out, 0);
+        append_guint32 (out, 0);
+    }
+
+    for (i = 0; i < n_elements; i++) {
+        set_guint32 (out, 4 + (8 * i), out->len);
+        set_guint32 (out, 8 + (8 * i), elements[i]->len);
+        g_byte_array_append (out, elements[i]->data, elements[i]->len);
+        g_byte_array_unref (elements[i]);
+    }
+    return out;
+}
+
+static void
+build_inputs (void)
+{
+    GByteArray *elements[N_ELEMENTS];
+    GByteArray *buffer;
+    guint       i;
+
+    for (i = 0; i < N_ELEMENTS; i++) {
+        MbimStructBuilder *builder;
+        g_autofree gchar  *provider_id = NULL;
+        g_autofree gchar  *provider_name = NULL;
+
+        provider_id = g_strdup_printf ("%05u", 21400 + i);
+        provider_name = g_strdup_printf ("Operator number %u", i);
+        builder = _mbim_struct_builder_new ();
+        _mbim_struct_builder_append_string (builder, provider_id);
+        _mbim_struct_builder_append_guint32 (builder, MBIM_PROVIDER_STATE_VISIBLE);
+        _mbim_struct_builder_append_string (builder, provider_name);
+        _mbim_struct_builder_append_guint32 (builder, MBIM_CELLULAR_CLASS_GSM);
+        _mbim_struct_builder_append_guint32 (builder, 20);
+        _mbim_struct_builder_append_guint32 (builder, 0);
+        elements[i] = _mbim_struct_builder_complete (builder);
+    }
+    visible_providers = command_done_new (MBIM_SERVICE_BASIC_CONNECT,
+                                          MBIM_CID_BASIC_CONNECT_VISIBLE_PROVIDERS,
+                                          ref_struct_array_new (elements, N_ELEMENTS));
+
+    for (i = 0; i < N_ELEMENTS; i++) {
+        MbimStructBuilder *builder;
+        g_autofree gchar  *access_string = NULL;
+
+        access_string = g_strdup_printf ("internet%u.operator.example.com", i);
+        builder = _mbim_struct_builder_new ();
+        _mbim_struct_builder_append_guint32 (builder, i + 1);
+        _mbim_struct_builder_append_uuid (builder, mbim_uuid_from_context_type (MBIM_CONTEXT_TYPE_INTERNET));
+        _mbim_struct_builder_append_string (builder, access_string);
+        _mbim_struct_builder_append_string (builder, "user");
+        _mbim_struct_builder_append_string (builder, "password");
+        _mbim_struct_builder_append_guint32 (builder, MBIM_COMPRESSION_NONE);
+        _mbim_struct_builder_append_guint32 (builder, MBIM_AUTH_PROTOCOL_CHAP);
+        elements[i] = _mbim_struct_builder_complete (builder);
+    }
+    provisioned_contexts = command_done_new (MBIM_SERVICE_BASIC_CONNECT,
+                                             MBIM_CID_BASIC_CONNECT_PROVISIONED_CONTEXTS,
+                                             ref_struct_array_new (elements, N_ELEMENTS));
+
+    /* System type, 4 serving cells and 5 neighboring cell arrays, with only
+     * the LTE neighboring cells given */
+    buffer = g_byte_array_new ();
+    append_guint32 (buffer, MBIM_DATA_CLASS_LTE);
+    for (i = 0; i < 18; i++)
+        append_guint32 (buffer, 0);
+    set_guint32 (buffer, 60, buffer->len);
+    set_guint32 (buffer, 64, 4 + (N_ELEMENTS * 32));
+    append_guint32 (buffer, N_ELEMENTS);
+    for (i = 0; i < N_ELEMENTS; i++) {
+        append_guint32 (buffer, 0); /* provider id offset */
+        append_guint32 (buffer, 0); /* provider id size */
+        append_guint32 (buffer, 0x1000 + i);
+        append_guint32 (buffer, 6300);
+        append_guint32 (buffer, i);
+        append_guint32 (buffer, 0x10);
+        append_guint32 (buffer, (guint32) -95);
+        append_guint32 (buffer, (guint32) -11);
+    }
+    base_stations_info = command_done_new (MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS,
+                                           MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_BASE_STATIONS_INFO,
+                                           buffer);
+
+    {
+        MbimStructBuilder *builder;
+
+        builder = _mbim_struct_builder_new ();
+        _mbim_struct_builder_append_string (builder,
+                                            "A fairly long string, as the firmware and hardware info "
+                                            "strings usually are in device caps responses");
+        long_string = command_done_new (MBIM_SERVICE_BASIC_CONNECT,
+                                        MBIM_CID_BASIC_CONNECT_DEVICE_CAPS,
+                                        _mbim_struct_builder_complete (builder));
+    }
+
+    /* The visible providers response, split as with a 512 byte max control
+     * transfer */
+    {
+        struct fragment_info *info;
+        guint                 n_fragments;
+
+        info = _mbim_message_split_fragments (visible_providers, 512, &n_fragments);
+        g_assert (info);
+        fragments = g_ptr_array_new_with_free_func ((GDestroyNotify)mbim_message_unref);
+        for (i = 0; i < n_fragments; i++) {
+            GByteArray *fragment;
+
+            fragment = g_byte_array_new ();
+            g_byte_array_append (fragment, (const guint8 *)&info[i].header, sizeof (info[i].header));
+            g_byte_array_append (fragment, (const guint8 *)&info[i].fragment_header, sizeof (info[i].fragment_header));
+            g_byte_array_append (fragment, info[i].data, info[i].data_length);
+            g_ptr_array_add (fragments, fragment);
+        }
+        g_free (info);
+    }
+}
+
+static void
+free_inputs (void)
+{
+    mbim_message_unref (visible_providers);
+    mbim_message_unref (provisioned_contexts);
+    mbim_message_unref (base_stations_info);
+    mbim_message_unref (long_string);
+    g_ptr_array_unref (fragments);
+}
+
+/*****************************************************************************/
+/* Benchmark cases, each running the operation the given number of times */
+
+static void
+bench_validate (guint64 iterations)
+{
+    guint64 i;
+
+    for (i = 0; i < iterations; i++)
+        g_assert (mbim_message_validate (visible_providers, NULL));
+}
+
+static void
+bench_read_string_utf16 (guint64 iterations)
+{
+    guint64 i;
+
+    for (i = 0; i < iterations; i++) {
+        g_autofree gchar *str = NULL;
+
+        g_assert (_mbim_message_read_string (long_string, 0, 0, MBIM_STRING_ENCODING_UTF16, &str, NULL));
+    }
+}
+
+static void
+bench_parse_visible_providers (guint64 iterations)
+{
+    guint64 i;
+
+    for (i = 0; i < iterations; i++) {
+        g_autoptr(MbimProviderArray) providers = NULL;
+        guint32                      n_providers = 0;
+
+        g_assert (mbim_message_visible_providers_response_parse (visible_providers, &n_providers, &providers, NULL));
+        g_assert_cmpuint (n_providers, ==, N_ELEMENTS);
+    }
+}
+
+static void
+bench_parse_provisioned_contexts (guint64 iterations)
+{
+    guint64 i;
+
+    for (i = 0; i < iterations; i++) {
+        g_autoptr(MbimProvisionedContextElementArray) contexts = NULL;
+        guint32                                       n_contexts = 0;
+
+        g_assert (mbim_message_provisioned_contexts_response_parse (provisioned_contexts, &n_contexts, &contexts, NULL));
+        g_assert_cmpuint (n_contexts, ==, N_ELEMENTS);
+    }
+}
+
+static void
+bench_parse_base_stations_info (guint64 iterations)
+{
+    guint64 i;
+
+    for (i = 0; i < iterations; i++) {
+        g_autoptr(MbimCellInfoNeighboringLteArray) lte = NULL;
+        guint32                                    n_lte = 0;
+
+        g_assert (mbim_message_ms_basic_connect_extensions_base_stations_info_response_parse (
+                      base_stations_info,
+                      NULL, NULL, NULL, NULL, NULL,
+                      NULL, NULL, NULL, NULL, NULL, NULL,
+                      &n_lte, &lte,
+                      NULL, NULL,
+                      NULL));
+        g_assert_cmpuint (n_lte, ==, N_ELEMENTS);
+    }
+}
+
+static void
+bench_struct_builder (guint64 iterations)
+{
+    guint64 i;
+
+    for (i = 0; i < iterations; i++) {
+        MbimStructBuilder *builder;
+        GByteArray        *bytes;
+
+        builder = _mbim_struct_builder_new ();
+        _mbim_struct_builder_append_guint32 (builder, 1);
+        _mbim_struct_builder_append_uuid (builder, mbim_uuid_from_context_type (MBIM_CONTEXT_TYPE_INTERNET));
+        _mbim_struct_builder_append_string (builder, "internet.operator.example.com");
+        _mbim_struct_builder_append_string (builder, "user");
+        _mbim_struct_builder_append_string (builder, "password");
+        _mbim_struct_builder_append_guint32 (builder, MBIM_COMPRESSION_NONE);
+        _mbim_struct_builder_append_guint32 (builder, MBIM_AUTH_PROTOCOL_CHAP);
+        bytes = _mbim_struct_builder_complete (builder);
+        g_byte_array_unref (bytes);
+    }
+}
+
+static void
+bench_split_fragments (guint64 iterations)
+{
+    guint64 i;
+
+    for (i = 0; i < iterations; i++) {
+        struct fragment_info *info;
+        guint                 n_fragments;
+
+        info = _mbim_message_split_fragments (visible_providers, 512, &n_fragments);
+        g_assert (info);
+        g_free (info);
+    }
+}
+
+static void
+bench_collect_fragments (guint64 iterations)
+{
+    guint64 i;
+
+    for (i = 0; i < iterations; i++) {
+        MbimMessage *message;
+        guint        j;
+
+        message = _mbim_message_fragment_collector_init (g_ptr_array_index (fragments, 0), NULL);
+        g_assert (message);
+        for (j = 1; j < fragments->len; j++)
+            g_assert (_mbim_message_fragment_collector_add (message, g_ptr_array_index (fragments, j), NULL));
+        g_assert (_mbim_message_fragment_collector_complete (message));
+        mbim_message_unref (message);
+    }
+}
+
+static void
+bench_uuid_to_service (guint64 iterations)
+{
+    guint64 i;
+
+    for (i = 0; i < iterations; i++) {
+        MbimService service;
+
+        /* Cycle through all known services, so that lookups of the last ones
+         * in the list are measured as well */
+        service = (MbimService) (1 + (i % (MBIM_SERVICE_LAST - 1)));
+        g_assert_cmpuint (mbim_uuid_to_service (mbim_uuid_from_service (service)), ==, service);
+    }
+}
+
+static void
+bench_printable (guint64 iterations)
+{
+    guint64 i;
+
+    for (i = 0; i < iterations; i++) {
+        g_autofree gchar *printable = NULL;
+
+        printable = mbim_message_get_printable_full (visible_providers, 1, 0, "", FALSE, NULL);
+        g_assert (printable);
+    }
+}
+
+static void
+bench_str_hex (guint64 iterations)
+{
+    const guint8 *raw;
+    guint32       raw_length;
+    guint64       i;
+
+    raw = mbim_message_get_raw (visible_providers, &raw_length, NULL);
+    for (i = 0; i < iterations; i++) {
+        g_autofree gchar *str = NULL;
+
+        str = mbim_common_str_hex (raw, raw_length, ':');
+        g_assert (str);
+    }
+}
+
+typedef struct {
+    const gchar *name;
+    void       (*run) (guint64 iterations);
+} Benchmark;
+
+static const Benchmark benchmarks[] = {
+    { "message-validate",               bench_validate                   },
+    { "read-string-utf16",              bench_read_string_utf16          },
+    { "parse-visible-providers",        bench_parse_visible_providers    },
+    { "parse-provisioned-contexts",     bench_parse_provisioned_contexts },
+    { "parse-base-stations-info",       bench_parse_base_stations_info   },
+    { "struct-builder",                 bench_struct_builder             },
+    { "split-fragments",                bench_split_fragments            },
+    { "collect-fragments",              bench_collect_fragments          },
+    { "uuid-to-service",                bench_uuid_to_service            },
+    { "message-printable",              bench_printable                  },
+    { "str-hex",                        bench_str_hex                    },
+};
+
+/*****************************************************************************/
+
+static void
+run_benchmark (const Benchmark *benchmark,
+               GString         *json,
+               gboolean         first)
+{
+    guint64 iterations = 1;
+    gint64  elapsed;
+
+    /* Warm up */
+    benchmark->run (1);
+
+    for (;;) {
+        gint64 start;
+
+        start = g_get_monotonic_time ();
+        benchmark->run (iterations);
+        elapsed = g_get_monotonic_time () - start;
+        if (elapsed >= (gint64) (min_time * G_USEC_PER_SEC))
+            break;
+        iterations *= 2;
+    }
+
+    g_string_append_printf (json,
+                            "%s\n    { \"name\": \"%s\", \"iterations\": %" G_GUINT64_FORMAT ", "
+                            "\"ns_per_op\": %.1f, \"ops_per_sec\": %.0f }",
+                            first ? "" : ",",
+                            benchmark->name,
+                            iterations,
+                            (elapsed * 1000.0) / iterations,
+                            iterations / (elapsed / (gdouble) G_USEC_PER_SEC));
+}
+
+int main (int argc, char **argv)
+{
+    g_autoptr(GOptionContext) context = NULL;
+    g_autoptr(GError)         error = NULL;
+    g_autoptr(GString)        json = NULL;
+    gboolean                  first = TRUE;
+    guint                     i;
+
+    context = g_option_context_new ("- benchmark message encoding and decoding");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("error: %s\n", error->message);
+        return 1;
+    }
+
+    if (min_time <= 0) {
+        g_printerr ("error: invalid arguments\n");
+        return 1;
+    }
+
+    build_inputs ();
+
+    json = g_string_new ("{\n  \"version\": \"" PACKAGE_VERSION "\",\n  \"benchmarks\": [");
+    for (i = 0; i < G_N_ELEMENTS (benchmarks); i++) {
+        if (filter && !strstr (benchmarks[i].name, filter))
+            continue;
+        run_benchmark (&benchmarks[i], json, first);
+        first = FALSE;
+    }
+    g_string_append (json, "\n  ]\n}\n");
+
+    free_inputs ();
+
+    if (output_path) {
+        if (!g_file_set_contents (output_path, json->str, json->len, &error)) {
+            g_printerr ("error: couldn't write results: %s\n", error->message);
+            return 1;
+        }
+    } else
+        g_print ("%s", json->str);
+
+    return 0;
+}
@@ -0,0 +1,199 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <config.h>
+#include <string.h>
+
+#include <glib/gstdio.h>
+
+#include "mbim-capture.h"
+
+/*****************************************************************************/
+
+#define BLOCK_TYPE_SHB 0x0A0D0D0A
+#define BLOCK_TYPE_IDB 0x00000001
+#define BLOCK_TYPE_EPB 0x00000006
+
+/* Exported PDU tags prepended to each message */
+#define EXP_PDU_HEADER_SIZE 20
+
+typedef struct {
+    guint32       type;
+    const guint8 *body;
+    guint32       body_length;
+} Block;
+
+static GArray *
+parse_blocks (const gchar *path,
+              gchar      **out_contents)
+{
+    GArray *blocks;
+    gchar  *contents = NULL;
+    gsize   length = 0;
+    gsize   offset = 0;
+
+    g_assert (g_file_get_contents (path, &contents, &length, NULL));
+
+    blocks = g_array_new (FALSE, FALSE, sizeof (Block));
+    while (offset < length) {
+        Block   block;
+        guint32 total;
+        guint32 trailer;
+
+        g_assert_cmpuint (length - offset, >=, 12);
+        memcpy (&block.type, &contents[offset], 4);
+        memcpy (&total, &contents[offset + 4], 4);
+        g_assert_cmpuint (total % 4, ==, 0);
+        g_assert_cmpuint (total, <=, length - offset);
+        memcpy (&trailer, &contents[offset + total - 4], 4);
+        g_assert_cmpuint (trailer, ==, total);
+
+        block.body = (const guint8 *)&contents[offset + 8];
+        block.body_length = total - 12;
+        g_array_append_val (blocks, block);
+        offset += total;
+    }
+
+    *out_contents = contents;
+    return blocks;
+}
+
+static void
+check_epb (const Block  *block,
+           guint32       interface_id,
+           guint32       flags,
+           const guint8 *data,
+           gsize         data_length)
+{
+    guint32 value;
+    guint32 packet_length;
+    gsize   options;
+    guint16 code;
+
+    g_assert_cmpuint (block->type, ==, BLOCK_TYPE_EPB);
+
+    memcpy (&value, &block->body[0], 4);
+    g_assert_cmpuint (value, ==, interface_id);
+    memcpy (&packet_length, &block->body[12], 4);
+    g_assert_cmpuint (packet_length, ==, EXP_PDU_HEADER_SIZE + data_length);
+    g_assert (memcmp (&block->body[20 + 4], "mbim.control", 12) == 0);
+    g_assert (memcmp (&block->body[20 + EXP_PDU_HEADER_SIZE], data, data_length) == 0);
+
+    options = 20 + ((packet_length + 3) & ~3);
+    memcpy (&code, &block->body[options], 2);
+    g_assert_cmpuint (code, ==, 2);
+    memcpy (&value, &block->body[options + 4], 4);
+    g_assert_cmpuint (value, ==, flags);
+}
+
+static void
+test_write (void)
+{
+    g_autoptr(GError)  error = NULL;
+    g_autofree gchar  *dir = NULL;
+    g_autofree gchar  *path = NULL;
+    g_autofree gchar  *contents = NULL;
+    MbimCapture       *capture;
+    GArray            *blocks;
+    guint32            first;
+    guint32            second;
+    static const guint8 request[] = { 0x03, 0x00, 0x00, 0x00, 0x0C, 0x00, 0x00, 0x00, 0x07, 0x00, 0x00, 0x00 };
+    static const guint8 response[] = { 0x03, 0x00, 0x00, 0x80, 0x0D, 0x00, 0x00, 0x00, 0x07, 0x00, 0x00, 0x00, 0xFF };
+
+    dir = g_dir_make_tmp ("test-capture-XXXXXX", &error);
+    g_assert_no_error (error);
+    path = g_build_filename (dir, "capture.pcapng", NULL);
+
+    capture = _mbim_capture_new (path, 0, 1, &error);
+    g_assert_no_error (error);
+    g_assert (capture);
+
+    first = _mbim_capture_add_interface (capture, "/dev/cdc-wdm0");
+    second = _mbim_capture_add_interface (capture, "/dev/cdc-wdm1");
+    g_assert_cmpuint (first, ==, 0);
+    g_assert_cmpuint (second, ==, 1);
+
+    _mbim_capture_add (capture, first, MBIM_CAPTURE_DIRECTION_OUT, request, sizeof (request));
+    _mbim_capture_add (capture, second, MBIM_CAPTURE_DIRECTION_IN, response, sizeof (response));
+    _mbim_capture_flush (capture);
+    g_assert_cmpuint (_mbim_capture_get_n_dropped (capture), ==, 0);
+
+    blocks = parse_blocks (path, &contents);
+    g_assert_cmpuint (blocks->len, ==, 5);
+    g_assert_cmpuint (g_array_index (blocks, Block, 0).type, ==, BLOCK_TYPE_SHB);
+    g_assert_cmpuint (g_array_index (blocks, Block, 1).type, ==, BLOCK_TYPE_IDB);
+    g_assert_cmpuint (g_array_index (blocks, Block, 2).type, ==, BLOCK_TYPE_IDB);
+    check_epb (&g_array_index (blocks, Block, 3), first, 2, request, sizeof (request));
+    check_epb (&g_array_index (blocks, Block, 4), second, 1, response, sizeof (response));
+    g_array_unref (blocks);
+
+    _mbim_capture_unref (capture);
+    g_unlink (path);
+    g_rmdir (dir);
+}
+
+static void
+test_rotate (void)
+{
+    g_autoptr(GError)  error = NULL;
+    g_autofree gchar  *dir = NULL;
+    g_autofree gchar  *path = NULL;
+    MbimCapture       *capture;
+    guint32            interface_id;
+    guint8             message[256] = { 0 };
+    guint              i;
+
+    dir = g_dir_make_tmp ("test-capture-XXXXXX", &error);
+    g_assert_no_error (error);
+    path = g_build_filename (dir, "capture.pcapng", NULL);
+
+    capture = _mbim_capture_new (path, 1024, 3, &error);
+    g_assert_no_error (error);
+    interface_id = _mbim_capture_add_interface (capture, "/dev/cdc-wdm0");
+
+    for (i = 0; i < 32; i++)
+        _mbim_capture_add (capture, interface_id, MBIM_CAPTURE_DIRECTION_OUT, message, sizeof (message));
+    _mbim_capture_flush (capture);
+
+    /* Each file is complete on its own, starting with the section and
+     * interface descriptions */
+    for (i = 0; i < 3; i++) {
+        g_autofree gchar *file = NULL;
+        g_autofree gchar *contents = NULL;
+        GArray           *blocks;
+
+        file = i ? g_strdup_printf ("%s.%u", path, i) : g_strdup (path);
+        g_assert (g_file_test (file, G_FILE_TEST_EXISTS));
+
+        blocks = parse_blocks (file, &contents);
+        g_assert_cmpuint (blocks->len, >=, 3);
+        g_assert_cmpuint (g_array_index (blocks, Block, 0).type, ==, BLOCK_TYPE_SHB);
+        g_assert_cmpuint (g_array_index (blocks, Block, 1).type, ==, BLOCK_TYPE_IDB);
+        check_epb (&g_array_index (blocks, Block, 2), interface_id, 2, message, sizeof (message));
+        g_array_unref (blocks);
+        g_unlink (file);
+    }
+
+    /* No more than the maximum number of files */
+    {
+        g_autofree gchar *file = NULL;
+
+        file = g_strdup_printf ("%s.3", path);
+        g_assert (!g_file_test (file, G_FILE_TEST_EXISTS));
+    }
+
+    _mbim_capture_unref (capture);
+    g_rmdir (dir);
+}
+
+/*****************************************************************************/
+
+int main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/libmbim-glib/capture/write", test_write);
+    g_test_add_func ("/libmbim-glib/capture/rotate", test_rotate);
+
+    return g_test_run ();
+}
@@ -0,0 +1,166 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <config.h>
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include "mbim-device-cache.h"
+
+/*****************************************************************************/
+
+static gchar *
+cache_path_new (void)
+{
+    GError *error = NULL;
+    gchar  *dir;
+    gchar  *path;
+
+    dir = g_dir_make_tmp ("test-device-cache-XXXXXX", &error);
+    g_assert_no_error (error);
+    /* Also test that the parent directories are created */
+    path = g_build_filename (dir, "libmbim", "device-open.cache", NULL);
+    g_free (dir);
+    return path;
+}
+
+static void
+cache_path_free (gchar *path)
+{
+    gchar *dir;
+    gchar *parent;
+
+    g_unlink (path);
+    dir = g_path_get_dirname (path);
+    g_rmdir (dir);
+    parent = g_path_get_dirname (dir);
+    g_rmdir (parent);
+    g_free (parent);
+    g_free (dir);
+    g_free (path);
+}
+
+static void
+test_store_load (void)
+{
+    gchar                *path;
+    GError               *error = NULL;
+    MbimDeviceCacheEntry  entry = { 0 };
+    MbimDeviceCacheEntry  loaded = { 0 };
+
+    path = cache_path_new ();
+
+    /* Nothing stored yet */
+    g_assert (!_mbim_device_cache_load (path, "/dev/cdc-wdm0", "abcd", &loaded));
+
+    entry.max_control_transfer = 4096;
+    entry.ms_mbimex_version_support = MBIM_DEVICE_CACHE_SUPPORT_YES;
+    entry.ms_mbimex_version_major = 3;
+    entry.ms_mbimex_version_minor = 0;
+    g_assert (_mbim_device_cache_store (path, "/dev/cdc-wdm0", "abcd", &entry, &error));
+    g_assert_no_error (error);
+
+    entry.max_control_transfer = 512;
+    entry.ms_mbimex_version_support = MBIM_DEVICE_CACHE_SUPPORT_NO;
+    entry.ms_mbimex_version_major = 1;
+    g_assert (_mbim_device_cache_store (path, "/dev/cdc-wdm1", "efgh", &entry, &error));
+    g_assert_no_error (error);
+
+    g_assert (_mbim_device_cache_load (path, "/dev/cdc-wdm0", "abcd", &loaded));
+    g_assert_cmpuint (loaded.max_control_transfer, ==, 4096);
+    g_assert_cmpuint (loaded.ms_mbimex_version_support, ==, MBIM_DEVICE_CACHE_SUPPORT_YES);
+    g_assert_cmpuint (loaded.ms_mbimex_version_major, ==, 3);
+    g_assert_cmpuint (loaded.ms_mbimex_version_minor, ==, 0);
+
+    g_assert (_mbim_device_cache_load (path, "/dev/cdc-wdm1", "efgh", &loaded));
+    g_assert_cmpuint (loaded.max_control_transfer, ==, 512);
+    g_assert_cmpuint (loaded.ms_mbimex_version_support, ==, MBIM_DEVICE_CACHE_SUPPORT_NO);
+    g_assert_cmpuint (loaded.ms_mbimex_version_major, ==, 1);
+
+    cache_path_free (path);
+}
+
+static void
+test_key_mismatch (void)
+{
+    gchar                *path;
+    GError               *error = NULL;
+    MbimDeviceCacheEntry  entry = { 0 };
+    MbimDeviceCacheEntry  loaded = { 0 };
+
+    path = cache_path_new ();
+
+    entry.max_control_transfer = 4096;
+    g_assert (_mbim_device_cache_store (path, "/dev/cdc-wdm0", "abcd", &entry, &error));
+    g_assert_no_error (error);
+
+    /* e.g. firmware upgraded */
+    g_assert (!_mbim_device_cache_load (path, "/dev/cdc-wdm0", "dcba", &loaded));
+    g_assert (_mbim_device_cache_load (path, "/dev/cdc-wdm0", "abcd", &loaded));
+
+    cache_path_free (path);
+}
+
+static void
+test_invalidate (void)
+{
+    gchar                *path;
+    GError               *error = NULL;
+    MbimDeviceCacheEntry  entry = { 0 };
+    MbimDeviceCacheEntry  loaded = { 0 };
+
+    path = cache_path_new ();
+
+    entry.max_control_transfer = 4096;
+    g_assert (_mbim_device_cache_store (path, "/dev/cdc-wdm0", "abcd", &entry, &error));
+    g_assert_no_error (error);
+    g_assert (_mbim_device_cache_store (path, "/dev/cdc-wdm1", "efgh", &entry, &error));
+    g_assert_no_error (error);
+
+    _mbim_device_cache_invalidate (path, "/dev/cdc-wdm0");
+    g_assert (!_mbim_device_cache_load (path, "/dev/cdc-wdm0", "abcd", &loaded));
+    g_assert (_mbim_device_cache_load (path, "/dev/cdc-wdm1", "efgh", &loaded));
+
+    cache_path_free (path);
+}
+
+static void
+test_corrupted (void)
+{
+    gchar                *path;
+    gchar                *dir;
+    GError               *error = NULL;
+    MbimDeviceCacheEntry  entry = { 0 };
+    MbimDeviceCacheEntry  loaded = { 0 };
+
+    path = cache_path_new ();
+    dir = g_path_get_dirname (path);
+    g_assert_cmpint (g_mkdir_with_parents (dir, 0700), ==, 0);
+    g_free (dir);
+
+    /* A corrupted cache is ignored, and overwritten */
+    g_assert (g_file_set_contents (path, "\x01\x02garbage[[", -1, &error));
+    g_assert_no_error (error);
+    g_assert (!_mbim_device_cache_load (path, "/dev/cdc-wdm0", "abcd", &loaded));
+
+    entry.max_control_transfer = 4096;
+    g_assert (_mbim_device_cache_store (path, "/dev/cdc-wdm0", "abcd", &entry, &error));
+    g_assert_no_error (error);
+    g_assert (_mbim_device_cache_load (path, "/dev/cdc-wdm0", "abcd", &loaded));
+
+    cache_path_free (path);
+}
+
+/*****************************************************************************/
+
+int main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/libmbim-glib/device-cache/store-load",   test_store_load);
+    g_test_add_func ("/libmbim-glib/device-cache/key-mismatch", test_key_mismatch);
+    g_test_add_func ("/libmbim-glib/device-cache/invalidate",   test_invalidate);
+    g_test_add_func ("/libmbim-glib/device-cache/corrupted",    test_corrupted);
+
+    return g_test_run ();
+}
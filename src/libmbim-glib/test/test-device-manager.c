@@ -0,0 +1,139 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <config.h>
+
+#include <gio/gio.h>
+
+#include "mbim-device-manager.h"
+#include "mbim-basic-connect.h"
+
+#include "test-fake-modem.h"
+
+#define TIMEOUT_SECS 5
+#define N_MODEMS     3
+#define N_IO_THREADS 2
+
+/*****************************************************************************/
+
+static void
+async_ready (GObject       *source,
+             GAsyncResult  *res,
+             GAsyncResult **out_res)
+{
+    *out_res = g_object_ref (res);
+}
+
+static GAsyncResult *
+async_wait (GAsyncResult **res)
+{
+    while (!*res)
+        g_main_context_iteration (NULL, TRUE);
+    return *res;
+}
+
+static void
+manager_open (MbimDeviceManager  *manager,
+              FakeModem         **modems)
+{
+    g_autoptr(GAsyncResult) res = NULL;
+    g_autoptr(GError)       error = NULL;
+    const gchar            *paths[N_MODEMS + 1] = { NULL };
+    guint                   i;
+
+    for (i = 0; i < N_MODEMS; i++)
+        paths[i] = fake_modem_get_path (modems[i]);
+
+    mbim_device_manager_open (manager, paths, MBIM_DEVICE_OPEN_FLAGS_NONE, TIMEOUT_SECS, NULL,
+                              (GAsyncReadyCallback)async_ready, &res);
+    g_assert (mbim_device_manager_open_finish (manager, async_wait (&res), &error));
+    g_assert_no_error (error);
+    g_assert_cmpuint (mbim_device_manager_get_n_devices (manager), ==, N_MODEMS);
+    for (i = 0; i < N_MODEMS; i++)
+        g_assert_cmpuint (fake_modem_get_n_opens (modems[i]), ==, 1);
+}
+
+/*****************************************************************************/
+
+static void
+test_command (void)
+{
+    g_autoptr(MbimDeviceManager) manager = NULL;
+    g_autoptr(MbimMessage)       request = NULL;
+    g_autoptr(GAsyncResult)      res = NULL;
+    g_autoptr(GAsyncResult)      close_res = NULL;
+    g_autoptr(GHashTable)        responses = NULL;
+    g_autoptr(GHashTable)        errors = NULL;
+    g_autoptr(GError)            error = NULL;
+    FakeModem                   *modems[N_MODEMS];
+    GHashTableIter               iter;
+    MbimMessage                 *response;
+    guint                        i;
+
+    for (i = 0; i < N_MODEMS; i++)
+        modems[i] = fake_modem_new ();
+
+    manager = mbim_device_manager_new (N_IO_THREADS);
+    manager_open (manager, modems);
+
+    /* The same request is sent to all the devices, and each one replies */
+    request = mbim_message_radio_state_query_new (NULL);
+    mbim_device_manager_command (manager, request, TIMEOUT_SECS, NULL, (GAsyncReadyCallback)async_ready, &res);
+    responses = mbim_device_manager_command_finish (manager, async_wait (&res), &errors, &error);
+    g_assert_no_error (error);
+    g_assert (responses);
+    g_assert_cmpuint (g_hash_table_size (responses), ==, N_MODEMS);
+    g_assert_cmpuint (g_hash_table_size (errors), ==, 0);
+
+    g_hash_table_iter_init (&iter, responses);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&response)) {
+        g_assert (mbim_message_response_get_result (response, MBIM_MESSAGE_TYPE_COMMAND_DONE, &error));
+        g_assert_no_error (error);
+    }
+    for (i = 0; i < N_MODEMS; i++)
+        g_assert_cmpuint (fake_modem_get_n_commands (modems[i]), ==, 1);
+
+    mbim_device_manager_close (manager, TIMEOUT_SECS, NULL, (GAsyncReadyCallback)async_ready, &close_res);
+    g_assert (mbim_device_manager_close_finish (manager, async_wait (&close_res), &error));
+    g_assert_no_error (error);
+    g_assert_cmpuint (mbim_device_manager_get_n_devices (manager), ==, 0);
+    for (i = 0; i < N_MODEMS; i++)
+        g_assert_cmpuint (fake_modem_get_n_closes (modems[i]), ==, 1);
+
+    for (i = 0; i < N_MODEMS; i++)
+        fake_modem_free (modems[i]);
+}
+
+static void
+test_dispose (void)
+{
+    MbimDeviceManager *manager;
+    FakeModem         *modems[N_MODEMS];
+    guint              i;
+
+    for (i = 0; i < N_MODEMS; i++)
+        modems[i] = fake_modem_new ();
+
+    /* Devices left open are closed when the manager goes away, without
+     * running the main context */
+    manager = mbim_device_manager_new (N_IO_THREADS);
+    manager_open (manager, modems);
+    g_object_unref (manager);
+    for (i = 0; i < N_MODEMS; i++)
+        g_assert_cmpuint (fake_modem_get_n_closes (modems[i]), ==, 1);
+
+    for (i = 0; i < N_MODEMS; i++)
+        fake_modem_free (modems[i]);
+}
+
+/*****************************************************************************/
+
+int main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/libmbim-glib/device-manager/command", test_command);
+    g_test_add_func ("/libmbim-glib/device-manager/dispose", test_dispose);
+
+    return g_test_run ();
+}
@@ -0,0 +1,572 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <config.h>
+
+#include <string.h>
+
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include "mbim-device.h"
+#include "mbim-basic-connect.h"
+
+#include "test-fake-modem.h"
+
+#define TIMEOUT_SECS 5
+
+/*****************************************************************************/
+
+static void
+async_ready (GObject       *source,
+             GAsyncResult  *res,
+             GAsyncResult **out_res)
+{
+    *out_res = g_object_ref (res);
+}
+
+static GAsyncResult *
+async_wait (GAsyncResult **res)
+{
+    while (!*res)
+        g_main_context_iteration (NULL, TRUE);
+    return *res;
+}
+
+static MbimDevice *
+device_new (FakeModem *modem)
+{
+    g_autoptr(GFile)        file = NULL;
+    g_autoptr(GAsyncResult) res = NULL;
+    g_autoptr(GError)       error = NULL;
+    MbimDevice             *device;
+
+    file = g_file_new_for_path (fake_modem_get_path (modem));
+    mbim_device_new (file, NULL, (GAsyncReadyCallback)async_ready, &res);
+    device = mbim_device_new_finish (async_wait (&res), &error);
+    g_assert_no_error (error);
+    return device;
+}
+
+static gboolean
+device_open (MbimDevice           *device,
+             MbimDeviceOpenFlags   flags,
+             GError              **error)
+{
+    g_autoptr(GAsyncResult) res = NULL;
+
+    mbim_device_open_full (device, flags, TIMEOUT_SECS, NULL, (GAsyncReadyCallback)async_ready, &res);
+    return mbim_device_open_full_finish (device, async_wait (&res), error);
+}
+
+static void
+device_close (MbimDevice *device)
+{
+    g_autoptr(GAsyncResult) res = NULL;
+    g_autoptr(GError)       error = NULL;
+
+    mbim_device_close (device, TIMEOUT_SECS, NULL, (GAsyncReadyCallback)async_ready, &res);
+    g_assert (mbim_device_close_finish (device, async_wait (&res), &error));
+    g_assert_no_error (error);
+}
+
+static MbimMessage *
+device_command (MbimDevice   *device,
+                MbimMessage  *request,
+                guint         timeout,
+                GError      **error)
+{
+    g_autoptr(GAsyncResult) res = NULL;
+    g_autoptr(MbimMessage)  response = NULL;
+
+    mbim_device_command (device, request, timeout, NULL, (GAsyncReadyCallback)async_ready, &res);
+    response = mbim_device_command_finish (device, async_wait (&res), error);
+    if (!response || !mbim_message_response_get_result (response, MBIM_MESSAGE_TYPE_COMMAND_DONE, error))
+        return NULL;
+    return g_steal_pointer (&response);
+}
+
+/*****************************************************************************/
+
+static void
+test_open (void)
+{
+    g_autoptr(FakeModem)  modem = NULL;
+    g_autoptr(MbimDevice) device = NULL;
+    g_autoptr(GError)     error = NULL;
+
+    modem = fake_modem_new ();
+    device = device_new (modem);
+
+    /* The version exchange waits for the device services response */
+    g_assert (device_open (device, MBIM_DEVICE_OPEN_FLAGS_MS_MBIMEX_V2, &error));
+    g_assert_no_error (error);
+    g_assert_cmpuint (fake_modem_get_n_opens (modem), ==, 1);
+    g_assert_cmpuint (fake_modem_get_n_commands (modem), ==, 2);
+    g_assert_cmpuint (fake_modem_get_max_pending (modem), ==, 1);
+    g_assert (mbim_device_check_ms_mbimex_version (device, 2, 0));
+
+    device_close (device);
+}
+
+static void
+test_open_pipelined (void)
+{
+    g_autoptr(FakeModem)  modem = NULL;
+    g_autoptr(MbimDevice) device = NULL;
+    g_autoptr(GError)     error = NULL;
+
+    modem = fake_modem_new ();
+    device = device_new (modem);
+
+    /* Both queries are sent without waiting for the first response; if they
+     * weren't, the held device services response would never be sent and
+     * the open would time out */
+    fake_modem_hold_responses (modem, 2);
+    g_assert (device_open (device, MBIM_DEVICE_OPEN_FLAGS_MS_MBIMEX_V2 | MBIM_DEVICE_OPEN_FLAGS_PIPELINED, &error));
+    g_assert_no_error (error);
+    g_assert_cmpuint (fake_modem_get_n_commands (modem), ==, 2);
+    g_assert_cmpuint (fake_modem_get_max_pending (modem), ==, 2);
+    g_assert (mbim_device_check_ms_mbimex_version (device, 2, 0));
+
+    device_close (device);
+}
+
+static void
+test_adaptive_timeouts (void)
+{
+    g_autoptr(FakeModem)  modem = NULL;
+    g_autoptr(MbimDevice) device = NULL;
+    g_autoptr(GError)     error = NULL;
+    g_autoptr(GArray)     request_statistics = NULL;
+    g_autoptr(MbimMessage) request = NULL;
+    g_autoptr(MbimMessage) response = NULL;
+    guint                  typical;
+    guint                  i;
+
+    modem = fake_modem_new ();
+    device = device_new (modem);
+    g_assert (device_open (device, MBIM_DEVICE_OPEN_FLAGS_ADAPTIVE_TIMEOUTS, &error));
+    g_assert_no_error (error);
+
+    /* Enough fast queries to adapt their timeout */
+    for (i = 0; i < 20; i++) {
+        g_autoptr(MbimMessage) query = NULL;
+        g_autoptr(MbimMessage) query_response = NULL;
+
+        query = mbim_message_radio_state_query_new (NULL);
+        query_response = device_command (device, query, TIMEOUT_SECS, &error);
+        g_assert_no_error (error);
+        g_assert (query_response);
+    }
+    g_assert (mbim_device_get_expected_latency (device, MBIM_SERVICE_BASIC_CONNECT, MBIM_CID_BASIC_CONNECT_RADIO_STATE,
+                                                MBIM_MESSAGE_COMMAND_TYPE_QUERY, &typical, NULL));
+    g_assert (!mbim_device_get_expected_latency (device, MBIM_SERVICE_BASIC_CONNECT, MBIM_CID_BASIC_CONNECT_RADIO_STATE,
+                                                 MBIM_MESSAGE_COMMAND_TYPE_SET, NULL, NULL));
+
+    /* A slow set of the same CID isn't timed out with the timeout of the
+     * queries, which would be the minimum of 2s */
+    fake_modem_set_response_delay (modem, 2500);
+    request = mbim_message_radio_state_set_new (MBIM_RADIO_SWITCH_STATE_ON, NULL);
+    response = device_command (device, request, TIMEOUT_SECS, &error);
+    g_assert_no_error (error);
+    g_assert (response);
+
+    mbim_device_get_statistics (device, NULL, &request_statistics);
+    g_assert_cmpuint (request_statistics->len, ==, 2);
+    g_assert_cmpuint (g_array_index (request_statistics, MbimDeviceRequestStatistics, 0).command_type, ==, MBIM_MESSAGE_COMMAND_TYPE_QUERY);
+    g_assert_cmpuint (g_array_index (request_statistics, MbimDeviceRequestStatistics, 0).n_requests, ==, 20);
+    g_assert_cmpuint (g_array_index (request_statistics, MbimDeviceRequestStatistics, 1).command_type, ==, MBIM_MESSAGE_COMMAND_TYPE_SET);
+    g_assert_cmpuint (g_array_index (request_statistics, MbimDeviceRequestStatistics, 1).n_requests, ==, 1);
+
+    fake_modem_set_response_delay (modem, 0);
+    device_close (device);
+}
+
+static void
+test_statistics (void)
+{
+    g_autoptr(FakeModem)   modem = NULL;
+    g_autoptr(MbimDevice)  device = NULL;
+    g_autoptr(GError)      error = NULL;
+    g_autoptr(GArray)      request_statistics = NULL;
+    g_autoptr(MbimMessage) request = NULL;
+    g_autoptr(MbimMessage) response = NULL;
+    MbimDeviceStatistics   before;
+    MbimDeviceStatistics   after;
+    guint64                bytes_out = 0;
+    guint64                bytes_in = 0;
+    guint                  i;
+
+    modem = fake_modem_new ();
+    device = device_new (modem);
+    g_assert (device_open (device, MBIM_DEVICE_OPEN_FLAGS_NONE, &error));
+    g_assert_no_error (error);
+
+    mbim_device_get_statistics (device, &before, NULL);
+    for (i = 0; i < 10; i++) {
+        g_autoptr(MbimMessage) query = NULL;
+        g_autoptr(MbimMessage) query_response = NULL;
+
+        query = mbim_message_radio_state_query_new (NULL);
+        query_response = device_command (device, query, TIMEOUT_SECS, &error);
+        g_assert_no_error (error);
+        g_assert (query_response);
+        bytes_out += mbim_message_get_message_length (query);
+        bytes_in += mbim_message_get_message_length (query_response);
+    }
+    mbim_device_get_statistics (device, &after, NULL);
+    g_assert_cmpuint (after.messages_out - before.messages_out, ==, 10);
+    g_assert_cmpuint (after.messages_in - before.messages_in, ==, 10);
+    g_assert_cmpuint (after.bytes_out - before.bytes_out, ==, bytes_out);
+    g_assert_cmpuint (after.bytes_in - before.bytes_in, ==, bytes_in);
+    g_assert_cmpuint (after.fragments_in, ==, before.fragments_in);
+    g_assert_cmpuint (after.reassemblies, ==, before.reassemblies);
+
+    /* A response split in several fragments is accounted once reassembled */
+    before = after;
+    fake_modem_set_max_control_transfer (modem, 32);
+    request = mbim_message_radio_state_query_new (NULL);
+    response = device_command (device, request, TIMEOUT_SECS, &error);
+    g_assert_no_error (error);
+    g_assert (response);
+    mbim_device_get_statistics (device, &after, NULL);
+    g_assert_cmpuint (after.messages_in - before.messages_in, ==, 1);
+    g_assert_cmpuint (after.fragments_in - before.fragments_in, >, 1);
+    g_assert_cmpuint (after.reassemblies - before.reassemblies, ==, 1);
+    g_clear_pointer (&request, mbim_message_unref);
+    g_clear_pointer (&response, mbim_message_unref);
+
+    /* And a request never replied as a timeout */
+    before = after;
+    fake_modem_set_silent (modem, TRUE);
+    request = mbim_message_radio_state_query_new (NULL);
+    response = device_command (device, request, 1, &error);
+    g_assert_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_TIMEOUT);
+    g_assert (!response);
+    mbim_device_get_statistics (device, &after, NULL);
+    g_assert_cmpuint (after.messages_out - before.messages_out, ==, 1);
+    g_assert_cmpuint (after.timeouts - before.timeouts, ==, 1);
+    g_assert_cmpuint (after.aborts, ==, before.aborts);
+    g_assert_cmpuint (after.function_errors, ==, 0);
+    g_assert_cmpuint (after.validation_failures, ==, 0);
+
+    mbim_device_get_statistics (device, NULL, &request_statistics);
+    g_assert_cmpuint (request_statistics->len, ==, 1);
+    g_assert_cmpuint (g_array_index (request_statistics, MbimDeviceRequestStatistics, 0).service, ==, MBIM_SERVICE_BASIC_CONNECT);
+    g_assert_cmpuint (g_array_index (request_statistics, MbimDeviceRequestStatistics, 0).cid, ==, MBIM_CID_BASIC_CONNECT_RADIO_STATE);
+    g_assert_cmpuint (g_array_index (request_statistics, MbimDeviceRequestStatistics, 0).n_requests, ==, 12);
+    g_assert_cmpuint (g_array_index (request_statistics, MbimDeviceRequestStatistics, 0).latency_max, >=, 1000);
+
+    fake_modem_set_silent (modem, FALSE);
+    device_close (device);
+}
+
+#define SYNC_THREADS  4
+#define SYNC_COMMANDS 10
+
+static gpointer
+sync_thread (MbimDevice *device)
+{
+    guint i;
+
+    for (i = 0; i < SYNC_COMMANDS; i++) {
+        g_autoptr(MbimMessage) request = NULL;
+        g_autoptr(MbimMessage) response = NULL;
+        g_autoptr(GError)      error = NULL;
+
+        request = mbim_message_radio_state_query_new (NULL);
+        response = mbim_device_command_sync (device, request, TIMEOUT_SECS, NULL, &error);
+        g_assert_no_error (error);
+        g_assert (mbim_message_response_get_result (response, MBIM_MESSAGE_TYPE_COMMAND_DONE, &error));
+        g_assert_no_error (error);
+    }
+    return NULL;
+}
+
+static void
+test_sync (void)
+{
+    g_autoptr(FakeModem)  modem = NULL;
+    g_autoptr(MbimDevice) device = NULL;
+    g_autoptr(GError)     error = NULL;
+    GThread              *threads[SYNC_THREADS];
+    guint                 i;
+
+    modem = fake_modem_new ();
+    device = device_new (modem);
+
+    /* Without any main loop running, from several threads at once */
+    g_assert (mbim_device_open_sync (device, MBIM_DEVICE_OPEN_FLAGS_NONE, TIMEOUT_SECS, NULL, &error));
+    g_assert_no_error (error);
+    for (i = 0; i < SYNC_THREADS; i++)
+        threads[i] = g_thread_new ("sync", (GThreadFunc)sync_thread, device);
+    for (i = 0; i < SYNC_THREADS; i++)
+        g_thread_join (threads[i]);
+    g_assert_cmpuint (fake_modem_get_n_commands (modem), ==, SYNC_THREADS * SYNC_COMMANDS);
+
+    g_assert (mbim_device_close_sync (device, TIMEOUT_SECS, NULL, &error));
+    g_assert_no_error (error);
+    g_assert (mbim_device_close_sync (device, TIMEOUT_SECS, NULL, &error));
+    g_assert_no_error (error);
+}
+
+typedef struct {
+    MbimDevice *device;
+    gboolean    done;
+} SyncOwnerContext;
+
+static gboolean
+sync_owner_idle (SyncOwnerContext *ctx)
+{
+    g_autoptr(MbimMessage) request = NULL;
+    g_autoptr(MbimMessage) response = NULL;
+    g_autoptr(GError)      error = NULL;
+
+    /* Running in the context of the device, the operation is rejected */
+    request = mbim_message_radio_state_query_new (NULL);
+    response = mbim_device_command_sync (ctx->device, request, TIMEOUT_SECS, NULL, &error);
+    g_assert_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_WRONG_STATE);
+    g_assert (!response);
+
+    ctx->done = TRUE;
+    return G_SOURCE_REMOVE;
+}
+
+static gpointer
+sync_owner_thread (SyncOwnerContext *ctx)
+{
+    sync_thread (ctx->device);
+    g_atomic_int_set (&ctx->done, TRUE);
+    g_main_context_wakeup (NULL);
+    return NULL;
+}
+
+static void
+test_sync_owner (void)
+{
+    g_autoptr(FakeModem)  modem = NULL;
+    g_autoptr(MbimDevice) device = NULL;
+    g_autoptr(GError)     error = NULL;
+    SyncOwnerContext      ctx = { 0 };
+    GThread              *thread;
+
+    modem = fake_modem_new ();
+    device = device_new (modem);
+    g_assert (device_open (device, MBIM_DEVICE_OPEN_FLAGS_NONE, &error));
+    g_assert_no_error (error);
+    ctx.device = device;
+
+    g_idle_add ((GSourceFunc)sync_owner_idle, &ctx);
+    while (!ctx.done)
+        g_main_context_iteration (NULL, TRUE);
+
+    /* From another thread, while the context of the device keeps running */
+    ctx.done = FALSE;
+    thread = g_thread_new ("sync", (GThreadFunc)sync_owner_thread, &ctx);
+    while (!g_atomic_int_get (&ctx.done))
+        g_main_context_iteration (NULL, TRUE);
+    g_thread_join (thread);
+
+    device_close (device);
+}
+
+#define CONCURRENT_THREADS  8
+#define CONCURRENT_COMMANDS 50
+
+typedef struct {
+    MbimDevice    *device;
+    GThread       *thread;
+    GMainContext  *context;
+    guint32        transaction_ids[CONCURRENT_COMMANDS];
+    guint          n_completed;
+    volatile gint *n_done;
+} ConcurrentThread;
+
+typedef struct {
+    ConcurrentThread *thread;
+    guint             i;
+} ConcurrentCommand;
+
+static void
+concurrent_command_ready (MbimDevice        *device,
+                          GAsyncResult      *res,
+                          ConcurrentCommand *command)
+{
+    g_autoptr(MbimMessage) response = NULL;
+    g_autoptr(GError)      error = NULL;
+    ConcurrentThread      *thread;
+
+    thread = command->thread;
+
+    /* In the thread issuing the command, with the response to that same
+     * command */
+    g_assert (g_thread_self () == thread->thread);
+    response = mbim_device_command_finish (device, res, &error);
+    g_assert_no_error (error);
+    g_assert_cmpuint (mbim_message_get_transaction_id (response), ==, thread->transaction_ids[command->i]);
+
+    thread->n_completed++;
+    g_slice_free (ConcurrentCommand, command);
+}
+
+static gpointer
+concurrent_thread (ConcurrentThread *thread)
+{
+    guint i;
+
+    g_main_context_push_thread_default (thread->context);
+
+    for (i = 0; i < CONCURRENT_COMMANDS; i++) {
+        g_autoptr(MbimMessage)  request = NULL;
+        ConcurrentCommand      *command;
+
+        command = g_slice_new (ConcurrentCommand);
+        command->thread = thread;
+        command->i = i;
+
+        request = mbim_message_radio_state_query_new (NULL);
+        mbim_device_command (thread->device, request, TIMEOUT_SECS, NULL,
+                             (GAsyncReadyCallback)concurrent_command_ready, command);
+        thread->transaction_ids[i] = mbim_message_get_transaction_id (request);
+    }
+
+    while (thread->n_completed < CONCURRENT_COMMANDS)
+        g_main_context_iteration (thread->context, TRUE);
+
+    g_main_context_pop_thread_default (thread->context);
+
+    g_atomic_int_inc (thread->n_done);
+    g_main_context_wakeup (NULL);
+    return NULL;
+}
+
+static void
+test_concurrent_commands (void)
+{
+    g_autoptr(FakeModem)   modem = NULL;
+    g_autoptr(MbimDevice)  device = NULL;
+    g_autoptr(GError)      error = NULL;
+    g_autoptr(GHashTable)  transaction_ids = NULL;
+    ConcurrentThread       threads[CONCURRENT_THREADS];
+    volatile gint          n_done = 0;
+    guint                  i;
+    guint                  j;
+
+    modem = fake_modem_new ();
+    device = device_new (modem);
+    g_assert (device_open (device, MBIM_DEVICE_OPEN_FLAGS_NONE, &error));
+    g_assert_no_error (error);
+
+    /* All the threads issue their commands at once, while this thread runs
+     * the context of the device */
+    memset (threads, 0, sizeof (threads));
+    for (i = 0; i < CONCURRENT_THREADS; i++) {
+        threads[i].device = device;
+        threads[i].n_done = &n_done;
+        threads[i].context = g_main_context_new ();
+        threads[i].thread = g_thread_new ("command", (GThreadFunc)concurrent_thread, &threads[i]);
+    }
+    while (g_atomic_int_get (&n_done) < CONCURRENT_THREADS)
+        g_main_context_iteration (NULL, TRUE);
+
+    transaction_ids = g_hash_table_new (g_direct_hash, g_direct_equal);
+    for (i = 0; i < CONCURRENT_THREADS; i++) {
+        g_thread_join (threads[i].thread);
+        for (j = 0; j < CONCURRENT_COMMANDS; j++)
+            g_hash_table_add (transaction_ids, GUINT_TO_POINTER (threads[i].transaction_ids[j]));
+        g_main_context_unref (threads[i].context);
+    }
+    g_assert_cmpuint (g_hash_table_size (transaction_ids), ==, CONCURRENT_THREADS * CONCURRENT_COMMANDS);
+    g_assert_cmpuint (fake_modem_get_n_commands (modem), ==, CONCURRENT_THREADS * CONCURRENT_COMMANDS);
+
+    device_close (device);
+}
+
+/*****************************************************************************/
+
+static gint64 recovery_warning_time;
+
+static gboolean
+recovery_log_fatal_handler (const gchar    *log_domain,
+                            GLogLevelFlags  log_level,
+                            const gchar    *message,
+                            gpointer        user_data)
+{
+    /* The repeated reopen failures are warned about, only once */
+    if ((log_level & G_LOG_LEVEL_WARNING) && strstr (message, "couldn't reopen device after")) {
+        g_assert_cmpint (recovery_warning_time, ==, 0);
+        recovery_warning_time = g_get_monotonic_time ();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+device_recovered_cb (MbimDevice *device,
+                     gboolean   *recovered)
+{
+    *recovered = TRUE;
+}
+
+static void
+test_recovery_backoff (void)
+{
+    g_autoptr(FakeModem)   modem = NULL;
+    g_autoptr(MbimDevice)  device = NULL;
+    g_autoptr(MbimMessage) request = NULL;
+    g_autoptr(MbimMessage) response = NULL;
+    g_autoptr(GError)      error = NULL;
+    gboolean               recovered = FALSE;
+    gint64                 recovery_time;
+
+    modem = fake_modem_new ();
+    device = device_new (modem);
+    g_assert (device_open (device, MBIM_DEVICE_OPEN_FLAGS_AUTO_RECOVER, &error));
+    g_assert_no_error (error);
+    g_signal_connect (device, MBIM_DEVICE_SIGNAL_RECOVERED, G_CALLBACK (device_recovered_cb), &recovered);
+
+    /* Force a hangup, and leave something that can't be opened in place of
+     * the control port, so that every reopen attempt fails right away */
+    recovery_warning_time = 0;
+    g_test_log_set_fatal_handler (recovery_log_fatal_handler, NULL);
+    fake_modem_unplug (modem);
+    g_assert_cmpint (g_mkdir (fake_modem_get_path (modem), 0700), ==, 0);
+    while (!recovery_warning_time)
+        g_main_context_iteration (NULL, TRUE);
+
+    /* The attempt following the warning is delayed by the backoff */
+    g_assert_cmpint (g_rmdir (fake_modem_get_path (modem)), ==, 0);
+    fake_modem_plug (modem);
+    while (!recovered)
+        g_main_context_iteration (NULL, TRUE);
+    recovery_time = g_get_monotonic_time ();
+    g_test_log_set_fatal_handler (NULL, NULL);
+    g_assert_cmpint (recovery_time - recovery_warning_time, >=, 1500 * 1000);
+    g_assert_cmpuint (fake_modem_get_n_opens (modem), ==, 2);
+
+    request = mbim_message_radio_state_query_new (NULL);
+    response = device_command (device, request, TIMEOUT_SECS, &error);
+    g_assert_no_error (error);
+    g_assert (response);
+
+    device_close (device);
+}
+
+/*****************************************************************************/
+
+int main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/libmbim-glib/device/open", test_open);
+    g_test_add_func ("/libmbim-glib/device/open-pipelined", test_open_pipelined);
+    g_test_add_func ("/libmbim-glib/device/adaptive-timeouts", test_adaptive_timeouts);
+    g_test_add_func ("/libmbim-glib/device/statistics", test_statistics);
+    g_test_add_func ("/libmbim-glib/device/sync", test_sync);
+    g_test_add_func ("/libmbim-glib/device/sync-owner", test_sync_owner);
+    g_test_add_func ("/libmbim-glib/device/concurrent-commands", test_concurrent_commands);
+    g_test_add_func ("/libmbim-glib/device/recovery-backoff", test_recovery_backoff);
+
+    return g_test_run ();
+}
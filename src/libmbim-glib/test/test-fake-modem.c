@@ -0,0 +1,684 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <config.h>
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+#include <glib-unix.h>
+
+#include "mbim-message.h"
+#include "mbim-uuid.h"
+#include "mbim-cid.h"
+
+#include "test-fake-modem.h"
+
+/* Message header (12 bytes) plus fragment header (8 bytes) */
+#define FRAGMENT_HEADER_SIZE 20
+
+#define MAX_CONTROL_TRANSFER_DEFAULT 4096
+
+struct _FakeModem {
+    gchar        *dir;
+    gchar        *path;
+    GMainContext *context;
+    GMainLoop    *loop;
+    GThread      *thread;
+
+    /* Only used in the modem thread */
+    gint        master_fd;
+    gint        slave_fd;
+    GSource    *input_source;
+    GSource    *output_source;
+    GByteArray *input;
+    GByteArray *output;
+    GQueue     *held;
+
+    /* Shared with the test thread */
+    GMutex   mutex;
+    GCond    cond;
+    guint    hold_commands;
+    guint    response_delay;
+    gboolean silent;
+    guint    max_control_transfer;
+    guint    n_opens;
+    guint    n_closes;
+    guint    n_commands;
+    guint    n_pending;
+    guint    max_pending;
+};
+
+/*****************************************************************************/
+/* Output */
+
+static gboolean output_ready (gint fd, GIOCondition condition, FakeModem *modem);
+
+static void
+output_flush (FakeModem *modem)
+{
+    while (modem->output->len > 0 && modem->master_fd >= 0) {
+        gssize written;
+
+        written = write (modem->master_fd, modem->output->data, modem->output->len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                /* Wait until the host reads */
+                if (!modem->output_source) {
+                    modem->output_source = g_unix_fd_source_new (modem->master_fd, G_IO_OUT);
+                    g_source_set_callback (modem->output_source, (GSourceFunc)output_ready, modem, NULL);
+                    g_source_attach (modem->output_source, modem->context);
+                }
+                return;
+            }
+            g_byte_array_set_size (modem->output, 0);
+            break;
+        }
+        g_byte_array_remove_range (modem->output, 0, (guint) written);
+    }
+
+    if (modem->output_source) {
+        g_source_destroy (modem->output_source);
+        g_clear_pointer (&modem->output_source, g_source_unref);
+    }
+}
+
+static gboolean
+output_ready (gint          fd,
+              GIOCondition  condition,
+              FakeModem    *modem)
+{
+    g_clear_pointer (&modem->output_source, g_source_unref);
+    output_flush (modem);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+append_guint32 (GByteArray *array,
+                guint32     value)
+{
+    value = GUINT32_TO_LE (value);
+    g_byte_array_append (array, (const guint8 *)&value, 4);
+}
+
+/* Queue the given body (everything after the fragment header), split in as
+ * many fragments as the max control transfer requires */
+static void
+send_fragmented (FakeModem    *modem,
+                 guint32       type,
+                 guint32       transaction_id,
+                 const guint8 *body,
+                 guint32       body_length)
+{
+    guint32 max_chunk;
+    guint32 total;
+    guint32 i;
+
+    g_mutex_lock (&modem->mutex);
+    max_chunk = modem->max_control_transfer - FRAGMENT_HEADER_SIZE;
+    g_mutex_unlock (&modem->mutex);
+    total = MAX (1, (body_length + max_chunk - 1) / max_chunk);
+
+    for (i = 0; i < total; i++) {
+        guint32 chunk;
+
+        chunk = MIN (max_chunk, body_length - (i * max_chunk));
+        append_guint32 (modem->output, type);
+        append_guint32 (modem->output, FRAGMENT_HEADER_SIZE + chunk);
+        append_guint32 (modem->output, transaction_id);
+        append_guint32 (modem->output, total);
+        append_guint32 (modem->output, i);
+        g_byte_array_append (modem->output, &body[i * max_chunk], chunk);
+    }
+
+    output_flush (modem);
+}
+
+static void
+send_message (FakeModem   *modem,
+              MbimMessage *message)
+{
+    const guint8 *raw;
+    guint32       raw_length;
+
+    raw = mbim_message_get_raw (message, &raw_length, NULL);
+    g_byte_array_append (modem->output, raw, raw_length);
+    output_flush (modem);
+}
+
+/*****************************************************************************/
+/* Responses */
+
+typedef struct {
+    FakeModem  *modem;
+    guint32     transaction_id;
+    GByteArray *body;
+} Reply;
+
+static void
+reply_free (Reply *reply)
+{
+    g_byte_array_unref (reply->body);
+    g_slice_free (Reply, reply);
+}
+
+static void
+reply_send (Reply *reply)
+{
+    FakeModem *modem = reply->modem;
+
+    send_fragmented (modem, MBIM_MESSAGE_TYPE_COMMAND_DONE, reply->transaction_id, reply->body->data, reply->body->len);
+
+    g_mutex_lock (&modem->mutex);
+    modem->n_pending--;
+    g_mutex_unlock (&modem->mutex);
+}
+
+static gboolean
+reply_timeout (Reply *reply)
+{
+    reply_send (reply);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+reply_schedule (Reply *reply)
+{
+    FakeModem *modem = reply->modem;
+    GSource   *source;
+    guint      delay;
+
+    g_mutex_lock (&modem->mutex);
+    delay = modem->response_delay;
+    g_mutex_unlock (&modem->mutex);
+
+    if (!delay) {
+        reply_send (reply);
+        reply_free (reply);
+        return;
+    }
+
+    source = g_timeout_source_new (delay);
+    g_source_set_callback (source, (GSourceFunc)reply_timeout, reply, (GDestroyNotify)reply_free);
+    g_source_attach (source, modem->context);
+    g_source_unref (source);
+}
+
+/* Device services list with just the MS MBIMEx version command */
+static void
+append_device_services (GByteArray *buffer)
+{
+    append_guint32 (buffer, 1);  /* services count */
+    append_guint32 (buffer, 0);  /* max DSS sessions */
+    append_guint32 (buffer, 16); /* offset of the first element */
+    append_guint32 (buffer, 32); /* size of the first element */
+    g_byte_array_append (buffer, (const guint8 *)MBIM_UUID_MS_BASIC_CONNECT_EXTENSIONS, sizeof (MbimUuid));
+    append_guint32 (buffer, 0);  /* DSS payload */
+    append_guint32 (buffer, 0);  /* max DSS instances */
+    append_guint32 (buffer, 1);  /* CIDs count */
+    append_guint32 (buffer, MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_VERSION);
+}
+
+static void
+append_version (GByteArray *buffer)
+{
+    /* MBIM 1.0, MBIMEx 2.0 */
+    static const guint8 version[] = { 0x00, 0x01, 0x00, 0x02 };
+
+    g_byte_array_append (buffer, version, sizeof (version));
+}
+
+static void
+handle_command (FakeModem   *modem,
+                MbimMessage *message)
+{
+    g_autoptr(GByteArray)  information_buffer = NULL;
+    MbimService            service;
+    guint32                cid;
+    Reply                 *reply;
+    gboolean               silent;
+    gboolean               holding;
+    gboolean               release = FALSE;
+
+    service = mbim_message_command_get_service (message);
+    cid = mbim_message_command_get_cid (message);
+
+    g_mutex_lock (&modem->mutex);
+    silent = modem->silent;
+    modem->n_commands++;
+    if (!silent) {
+        modem->n_pending++;
+        modem->max_pending = MAX (modem->max_pending, modem->n_pending);
+    }
+    holding = (modem->hold_commands > 0);
+    if (holding && modem->n_commands >= modem->hold_commands) {
+        modem->hold_commands = 0;
+        release = TRUE;
+    }
+    g_mutex_unlock (&modem->mutex);
+
+    if (silent)
+        return;
+
+    information_buffer = g_byte_array_new ();
+    if (service == MBIM_SERVICE_BASIC_CONNECT && cid == MBIM_CID_BASIC_CONNECT_DEVICE_SERVICES)
+        append_device_services (information_buffer);
+    else if (service == MBIM_SERVICE_MS_BASIC_CONNECT_EXTENSIONS && cid == MBIM_CID_MS_BASIC_CONNECT_EXTENSIONS_VERSION)
+        append_version (information_buffer);
+
+    reply = g_slice_new0 (Reply);
+    reply->modem = modem;
+    reply->transaction_id = mbim_message_get_transaction_id (message);
+    reply->body = g_byte_array_new ();
+    g_byte_array_append (reply->body, (const guint8 *)mbim_message_command_get_service_id (message), sizeof (MbimUuid));
+    append_guint32 (reply->body, cid);
+    append_guint32 (reply->body, MBIM_STATUS_ERROR_NONE);
+    append_guint32 (reply->body, information_buffer->len);
+    g_byte_array_append (reply->body, information_buffer->data, information_buffer->len);
+
+    if (!holding) {
+        reply_schedule (reply);
+        return;
+    }
+
+    /* Send all the held responses, in order, once the last command expected
+     * has been received */
+    g_queue_push_tail (modem->held, reply);
+    if (release) {
+        while ((reply = g_queue_pop_head (modem->held)) != NULL)
+            reply_schedule (reply);
+    }
+}
+
+/*****************************************************************************/
+/* Input */
+
+static void
+process_message (FakeModem    *modem,
+                 const guint8 *data,
+                 guint32       length)
+{
+    g_autoptr(MbimMessage) message = NULL;
+    g_autoptr(MbimMessage) reply = NULL;
+
+    message = mbim_message_new (data, length);
+
+    switch ((guint) mbim_message_get_message_type (message)) {
+    case MBIM_MESSAGE_TYPE_OPEN:
+        g_mutex_lock (&modem->mutex);
+        modem->n_opens++;
+        g_mutex_unlock (&modem->mutex);
+        reply = mbim_message_open_done_new (mbim_message_get_transaction_id (message), MBIM_STATUS_ERROR_NONE);
+        send_message (modem, reply);
+        return;
+
+    case MBIM_MESSAGE_TYPE_CLOSE:
+        g_mutex_lock (&modem->mutex);
+        modem->n_closes++;
+        g_mutex_unlock (&modem->mutex);
+        reply = mbim_message_close_done_new (mbim_message_get_transaction_id (message), MBIM_STATUS_ERROR_NONE);
+        send_message (modem, reply);
+        return;
+
+    case MBIM_MESSAGE_TYPE_COMMAND:
+        /* Commands sent by the tests always fit in a single fragment */
+        handle_command (modem, message);
+        return;
+
+    default:
+        return;
+    }
+}
+
+static gboolean
+input_ready (gint          fd,
+             GIOCondition  condition,
+             FakeModem    *modem)
+{
+    guint8 buffer[4096];
+    gssize n_read;
+
+    n_read = read (fd, buffer, sizeof (buffer));
+    if (n_read < 0 && (errno == EINTR || errno == EAGAIN))
+        return G_SOURCE_CONTINUE;
+    if (n_read <= 0) {
+        g_clear_pointer (&modem->input_source, g_source_unref);
+        return G_SOURCE_REMOVE;
+    }
+    g_byte_array_append (modem->input, buffer, (guint) n_read);
+
+    /* The pty is a byte stream, split it in messages */
+    while (modem->input->len >= 12) {
+        guint32 length;
+
+        memcpy (&length, &modem->input->data[4], 4);
+        length = GUINT32_FROM_LE (length);
+        if (length < 12) {
+            g_byte_array_set_size (modem->input, 0);
+            break;
+        }
+        if (modem->input->len < length)
+            break;
+
+        process_message (modem, modem->input->data, length);
+        g_byte_array_remove_range (modem->input, 0, length);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/*****************************************************************************/
+/* Control port */
+
+static void
+port_close (FakeModem *modem)
+{
+    if (modem->input_source) {
+        g_source_destroy (modem->input_source);
+        g_clear_pointer (&modem->input_source, g_source_unref);
+    }
+    if (modem->output_source) {
+        g_source_destroy (modem->output_source);
+        g_clear_pointer (&modem->output_source, g_source_unref);
+    }
+    g_queue_foreach (modem->held, (GFunc)reply_free, NULL);
+    g_queue_clear (modem->held);
+    g_byte_array_set_size (modem->input, 0);
+    g_byte_array_set_size (modem->output, 0);
+
+    g_unlink (modem->path);
+    if (modem->slave_fd >= 0) {
+        close (modem->slave_fd);
+        modem->slave_fd = -1;
+    }
+    if (modem->master_fd >= 0) {
+        close (modem->master_fd);
+        modem->master_fd = -1;
+    }
+
+    g_mutex_lock (&modem->mutex);
+    modem->n_pending = 0;
+    g_mutex_unlock (&modem->mutex);
+}
+
+static void
+port_open (FakeModem *modem)
+{
+    struct termios  tio;
+    const gchar    *slave_path;
+
+    modem->master_fd = posix_openpt (O_RDWR | O_NOCTTY);
+    g_assert_cmpint (modem->master_fd, >=, 0);
+    g_assert_cmpint (grantpt (modem->master_fd), ==, 0);
+    g_assert_cmpint (unlockpt (modem->master_fd), ==, 0);
+    slave_path = ptsname (modem->master_fd);
+    g_assert (slave_path);
+
+    /* Keep the slave open ourselves, so that the master doesn't see a hangup
+     * every time the host closes the control port */
+    modem->slave_fd = open (slave_path, O_RDWR | O_NOCTTY);
+    g_assert_cmpint (modem->slave_fd, >=, 0);
+
+    /* MBIM messages are binary, no line discipline processing */
+    g_assert_cmpint (tcgetattr (modem->slave_fd, &tio), ==, 0);
+    cfmakeraw (&tio);
+    g_assert_cmpint (tcsetattr (modem->slave_fd, TCSANOW, &tio), ==, 0);
+    g_assert (g_unix_set_fd_nonblocking (modem->master_fd, TRUE, NULL));
+
+    g_assert_cmpint (symlink (slave_path, modem->path), ==, 0);
+
+    modem->input_source = g_unix_fd_source_new (modem->master_fd, G_IO_IN);
+    g_source_set_callback (modem->input_source, (GSourceFunc)input_ready, modem, NULL);
+    g_source_attach (modem->input_source, modem->context);
+}
+
+/*****************************************************************************/
+/* Running in the modem thread */
+
+typedef struct {
+    FakeModem *modem;
+    void     (*func) (FakeModem *modem, guint value);
+    guint      value;
+    gboolean   done;
+} ModemCall;
+
+static gboolean
+modem_call_cb (ModemCall *call)
+{
+    FakeModem *modem = call->modem;
+
+    call->func (modem, call->value);
+
+    g_mutex_lock (&modem->mutex);
+    call->done = TRUE;
+    g_cond_broadcast (&modem->cond);
+    g_mutex_unlock (&modem->mutex);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+modem_call (FakeModem  *modem,
+            void      (*func) (FakeModem *modem, guint value),
+            guint       value)
+{
+    ModemCall call = { modem, func, value, FALSE };
+
+    g_main_context_invoke (modem->context, (GSourceFunc)modem_call_cb, &call);
+
+    g_mutex_lock (&modem->mutex);
+    while (!call.done)
+        g_cond_wait (&modem->cond, &modem->mutex);
+    g_mutex_unlock (&modem->mutex);
+}
+
+static gpointer
+modem_thread (FakeModem *modem)
+{
+    g_main_context_push_thread_default (modem->context);
+    g_main_loop_run (modem->loop);
+    g_main_context_pop_thread_default (modem->context);
+    return NULL;
+}
+
+/*****************************************************************************/
+
+static void
+do_send_indications (FakeModem *modem,
+                     guint      n_indications)
+{
+    g_autoptr(GByteArray) body = NULL;
+    guint                 i;
+
+    body = g_byte_array_new ();
+    g_byte_array_append (body, (const guint8 *)MBIM_UUID_BASIC_CONNECT, sizeof (MbimUuid));
+    append_guint32 (body, MBIM_CID_BASIC_CONNECT_SIGNAL_STATE);
+    append_guint32 (body, 0);
+
+    for (i = 0; i < n_indications; i++)
+        send_fragmented (modem, MBIM_MESSAGE_TYPE_INDICATE_STATUS, 0, body->data, body->len);
+}
+
+void
+fake_modem_send_indications (FakeModem *modem,
+                             guint      n_indications)
+{
+    modem_call (modem, do_send_indications, n_indications);
+}
+
+static void
+do_unplug (FakeModem *modem,
+           guint      unused)
+{
+    port_close (modem);
+}
+
+void
+fake_modem_unplug (FakeModem *modem)
+{
+    modem_call (modem, do_unplug, 0);
+}
+
+static void
+do_plug (FakeModem *modem,
+         guint      unused)
+{
+    if (modem->master_fd < 0)
+        port_open (modem);
+}
+
+void
+fake_modem_plug (FakeModem *modem)
+{
+    modem_call (modem, do_plug, 0);
+}
+
+void
+fake_modem_hold_responses (FakeModem *modem,
+                           guint      n_commands)
+{
+    g_mutex_lock (&modem->mutex);
+    modem->hold_commands = modem->n_commands + n_commands;
+    g_mutex_unlock (&modem->mutex);
+}
+
+void
+fake_modem_set_response_delay (FakeModem *modem,
+                               guint      delay_ms)
+{
+    g_mutex_lock (&modem->mutex);
+    modem->response_delay = delay_ms;
+    g_mutex_unlock (&modem->mutex);
+}
+
+void
+fake_modem_set_silent (FakeModem *modem,
+                       gboolean   silent)
+{
+    g_mutex_lock (&modem->mutex);
+    modem->silent = silent;
+    g_mutex_unlock (&modem->mutex);
+}
+
+void
+fake_modem_set_max_control_transfer (FakeModem *modem,
+                                     guint      max_control_transfer)
+{
+    g_assert_cmpuint (max_control_transfer, >, FRAGMENT_HEADER_SIZE);
+
+    g_mutex_lock (&modem->mutex);
+    modem->max_control_transfer = max_control_transfer;
+    g_mutex_unlock (&modem->mutex);
+}
+
+guint
+fake_modem_get_n_opens (FakeModem *modem)
+{
+    guint n;
+
+    g_mutex_lock (&modem->mutex);
+    n = modem->n_opens;
+    g_mutex_unlock (&modem->mutex);
+    return n;
+}
+
+guint
+fake_modem_get_n_closes (FakeModem *modem)
+{
+    guint n;
+
+    g_mutex_lock (&modem->mutex);
+    n = modem->n_closes;
+    g_mutex_unlock (&modem->mutex);
+    return n;
+}
+
+guint
+fake_modem_get_n_commands (FakeModem *modem)
+{
+    guint n;
+
+    g_mutex_lock (&modem->mutex);
+    n = modem->n_commands;
+    g_mutex_unlock (&modem->mutex);
+    return n;
+}
+
+guint
+fake_modem_get_max_pending (FakeModem *modem)
+{
+    guint n;
+
+    g_mutex_lock (&modem->mutex);
+    n = modem->max_pending;
+    g_mutex_unlock (&modem->mutex);
+    return n;
+}
+
+const gchar *
+fake_modem_get_path (FakeModem *modem)
+{
+    return modem->path;
+}
+
+FakeModem *
+fake_modem_new (void)
+{
+    FakeModem *modem;
+
+    modem = g_new0 (FakeModem, 1);
+    modem->master_fd = -1;
+    modem->slave_fd = -1;
+    modem->max_control_transfer = MAX_CONTROL_TRANSFER_DEFAULT;
+    modem->input = g_byte_array_new ();
+    modem->output = g_byte_array_new ();
+    modem->held = g_queue_new ();
+    g_mutex_init (&modem->mutex);
+    g_cond_init (&modem->cond);
+
+    /* Not named like a real control port, so that no sysfs info is found */
+    modem->dir = g_dir_make_tmp ("test-fake-modem-XXXXXX", NULL);
+    g_assert (modem->dir);
+    modem->path = g_build_filename (modem->dir, "fake-wdm0", NULL);
+
+    modem->context = g_main_context_new ();
+    modem->loop = g_main_loop_new (modem->context, FALSE);
+    modem->thread = g_thread_new ("fake-modem", (GThreadFunc)modem_thread, modem);
+
+    fake_modem_plug (modem);
+    return modem;
+}
+
+static gboolean
+modem_quit_cb (FakeModem *modem)
+{
+    port_close (modem);
+    g_main_loop_quit (modem->loop);
+    return G_SOURCE_REMOVE;
+}
+
+void
+fake_modem_free (FakeModem *modem)
+{
+    g_main_context_invoke (modem->context, (GSourceFunc)modem_quit_cb, modem);
+    g_thread_join (modem->thread);
+
+    g_main_loop_unref (modem->loop);
+    g_main_context_unref (modem->context);
+    g_queue_free (modem->held);
+    g_byte_array_unref (modem->input);
+    g_byte_array_unref (modem->output);
+    g_mutex_clear (&modem->mutex);
+    g_cond_clear (&modem->cond);
+    g_rmdir (modem->dir);
+    g_free (modem->path);
+    g_free (modem->dir);
+    g_free (modem);
+}
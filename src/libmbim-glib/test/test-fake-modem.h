@@ -0,0 +1,58 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * Fake MBIM modem for the tests that need a real control port: a pty served
+ * from its own thread, reachable through a symlink in a temporary directory
+ * so that it can be unplugged and plugged back at the same path.
+ *
+ * It replies to every command with a successful empty response, except for
+ * the device services query, which lists the MS MBIMEx version command, and
+ * the version exchange itself, which agrees on MBIMEx 2.0.
+ */
+
+#ifndef _TEST_FAKE_MODEM_H_
+#define _TEST_FAKE_MODEM_H_
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _FakeModem FakeModem;
+
+FakeModem   *fake_modem_new                      (void);
+void         fake_modem_free                     (FakeModem *modem);
+const gchar *fake_modem_get_path                 (FakeModem *modem);
+
+/* Hold the responses back until the given number of commands have been
+ * received, and then send them all at once */
+void         fake_modem_hold_responses           (FakeModem *modem,
+                                                  guint      n_commands);
+/* Delay every response by the given time */
+void         fake_modem_set_response_delay       (FakeModem *modem,
+                                                  guint      delay_ms);
+/* Don't reply to commands at all */
+void         fake_modem_set_silent               (FakeModem *modem,
+                                                  gboolean   silent);
+/* Split the responses in fragments of at most this size */
+void         fake_modem_set_max_control_transfer (FakeModem *modem,
+                                                  guint      max_control_transfer);
+
+guint        fake_modem_get_n_opens              (FakeModem *modem);
+guint        fake_modem_get_n_closes             (FakeModem *modem);
+guint        fake_modem_get_n_commands           (FakeModem *modem);
+/* Maximum number of commands received and not yet replied at once */
+guint        fake_modem_get_max_pending          (FakeModem *modem);
+
+void         fake_modem_send_indications         (FakeModem *modem,
+                                                  guint      n_indications);
+
+/* Remove the control port, as a modem reset would, and bring it back */
+void         fake_modem_unplug                   (FakeModem *modem);
+void         fake_modem_plug                     (FakeModem *modem);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FakeModem, fake_modem_free)
+
+G_END_DECLS
+
+#endif /* _TEST_FAKE_MODEM_H_ */
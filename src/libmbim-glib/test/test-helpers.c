@@ -0,0 +1,126 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <config.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+#include "mbim-helpers.h"
+#include "mbim-error-types.h"
+
+/*****************************************************************************/
+
+static void
+sysfs_add_port (const gchar *root,
+                const gchar *subsystem,
+                const gchar *name,
+                const gchar *driver,
+                const gchar *type)
+{
+    g_autofree gchar *port_dir = NULL;
+    g_autofree gchar *device_dir = NULL;
+    g_autofree gchar *driver_link = NULL;
+    g_autofree gchar *driver_target = NULL;
+    g_autofree gchar *type_path = NULL;
+    GError           *error = NULL;
+
+    port_dir = g_build_filename (root, "class", subsystem, name, NULL);
+    device_dir = g_build_filename (port_dir, "device", NULL);
+    g_assert_cmpint (g_mkdir_with_parents (device_dir, 0700), ==, 0);
+
+    if (driver) {
+        driver_link = g_build_filename (device_dir, "driver", NULL);
+        driver_target = g_build_filename ("..", "..", "bus", "usb", "drivers", driver, NULL);
+        g_assert_cmpint (symlink (driver_target, driver_link), ==, 0);
+    }
+
+    if (type) {
+        type_path = g_build_filename (port_dir, "type", NULL);
+        g_assert (g_file_set_contents (type_path, type, -1, &error));
+        g_assert_no_error (error);
+    }
+}
+
+static void
+sysfs_remove (const gchar *path)
+{
+    g_autoptr(GDir)  dir = NULL;
+    const gchar     *name;
+
+    dir = g_dir_open (path, 0, NULL);
+    if (dir) {
+        while ((name = g_dir_read_name (dir)) != NULL) {
+            g_autofree gchar *child = NULL;
+
+            child = g_build_filename (path, name, NULL);
+            if (!g_file_test (child, G_FILE_TEST_IS_SYMLINK))
+                sysfs_remove (child);
+            else
+                g_unlink (child);
+        }
+    }
+    g_remove (path);
+}
+
+static void
+test_list_control_ports (void)
+{
+    g_autofree gchar     *root = NULL;
+    g_autoptr(GPtrArray)  ports = NULL;
+    GError               *error = NULL;
+
+    root = g_dir_make_tmp ("test-helpers-XXXXXX", &error);
+    g_assert_no_error (error);
+
+    sysfs_add_port (root, "usbmisc", "cdc-wdm1", "cdc_mbim", NULL);
+    sysfs_add_port (root, "usbmisc", "cdc-wdm0", "cdc_mbim", NULL);
+    /* QMI port, ignored */
+    sysfs_add_port (root, "usbmisc", "cdc-wdm2", "qmi_wwan", NULL);
+    /* wwan ports, with and without type */
+    sysfs_add_port (root, "wwan", "wwan0mbim0", NULL, "MBIM\n");
+    sysfs_add_port (root, "wwan", "wwan0at0", NULL, "AT\n");
+    sysfs_add_port (root, "wwan", "wwan1mbim0", NULL, NULL);
+    sysfs_add_port (root, "wwan", "wwan1qmi0", NULL, NULL);
+
+    ports = mbim_helpers_list_control_ports (root, &error);
+    g_assert_no_error (error);
+    g_assert (ports);
+    g_assert_cmpuint (ports->len, ==, 4);
+    g_assert_cmpstr (g_ptr_array_index (ports, 0), ==, "/dev/cdc-wdm0");
+    g_assert_cmpstr (g_ptr_array_index (ports, 1), ==, "/dev/cdc-wdm1");
+    g_assert_cmpstr (g_ptr_array_index (ports, 2), ==, "/dev/wwan0mbim0");
+    g_assert_cmpstr (g_ptr_array_index (ports, 3), ==, "/dev/wwan1mbim0");
+
+    sysfs_remove (root);
+}
+
+static void
+test_list_control_ports_no_sysfs (void)
+{
+    g_autofree gchar     *root = NULL;
+    g_autoptr(GPtrArray)  ports = NULL;
+    GError               *error = NULL;
+
+    root = g_dir_make_tmp ("test-helpers-XXXXXX", &error);
+    g_assert_no_error (error);
+
+    ports = mbim_helpers_list_control_ports (root, &error);
+    g_assert_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_UNSUPPORTED);
+    g_assert (!ports);
+    g_error_free (error);
+
+    sysfs_remove (root);
+}
+
+/*****************************************************************************/
+
+int main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/libmbim-glib/helpers/list-control-ports",          test_list_control_ports);
+    g_test_add_func ("/libmbim-glib/helpers/list-control-ports-no-sysfs", test_list_control_ports_no_sysfs);
+
+    return g_test_run ();
+}
@@ -0,0 +1,100 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <config.h>
+
+#include "mbim-latency-histogram.h"
+
+/*****************************************************************************/
+
+static void
+test_empty (void)
+{
+    MbimLatencyHistogram *histogram;
+    guint latency = 0;
+
+    histogram = _mbim_latency_histogram_new ();
+    g_assert_cmpuint (_mbim_latency_histogram_get_n_samples (histogram), ==, 0);
+    g_assert (!_mbim_latency_histogram_get_percentile (histogram, 50, &latency));
+    _mbim_latency_histogram_free (histogram);
+}
+
+static void
+test_percentiles (void)
+{
+    MbimLatencyHistogram *histogram;
+    guint latency = 0;
+    guint i;
+
+    histogram = _mbim_latency_histogram_new ();
+
+    /* 90 fast requests and 10 slow ones */
+    for (i = 0; i < 90; i++)
+        _mbim_latency_histogram_add (histogram, 40);
+    for (i = 0; i < 10; i++)
+        _mbim_latency_histogram_add (histogram, 8000);
+    g_assert_cmpuint (_mbim_latency_histogram_get_n_samples (histogram), ==, 100);
+
+    /* Reported as the upper limit of the bucket */
+    g_assert (_mbim_latency_histogram_get_percentile (histogram, 50, &latency));
+    g_assert_cmpuint (latency, ==, 50);
+    g_assert (_mbim_latency_histogram_get_percentile (histogram, 90, &latency));
+    g_assert_cmpuint (latency, ==, 50);
+    g_assert (_mbim_latency_histogram_get_percentile (histogram, 91, &latency));
+    g_assert_cmpuint (latency, ==, 10000);
+    g_assert (_mbim_latency_histogram_get_percentile (histogram, 100, &latency));
+    g_assert_cmpuint (latency, ==, 10000);
+
+    _mbim_latency_histogram_free (histogram);
+}
+
+static void
+test_overflow (void)
+{
+    MbimLatencyHistogram *histogram;
+    guint latency = 0;
+
+    /* Above the last bucket, the maximum observed is reported */
+    histogram = _mbim_latency_histogram_new ();
+    _mbim_latency_histogram_add (histogram, 400000);
+    _mbim_latency_histogram_add (histogram, 300000);
+    g_assert (_mbim_latency_histogram_get_percentile (histogram, 99, &latency));
+    g_assert_cmpuint (latency, ==, 400000);
+    _mbim_latency_histogram_free (histogram);
+}
+
+static void
+test_decay (void)
+{
+    MbimLatencyHistogram *histogram;
+    guint latency = 0;
+    guint i;
+
+    histogram = _mbim_latency_histogram_new ();
+
+    /* The device was slow for a while, and then it becomes fast */
+    for (i = 0; i < 256; i++)
+        _mbim_latency_histogram_add (histogram, 20000);
+    for (i = 0; i < 1024; i++)
+        _mbim_latency_histogram_add (histogram, 100);
+
+    g_assert_cmpuint (_mbim_latency_histogram_get_n_samples (histogram), <=, 256);
+    g_assert (_mbim_latency_histogram_get_percentile (histogram, 99, &latency));
+    g_assert_cmpuint (latency, ==, 100);
+
+    _mbim_latency_histogram_free (histogram);
+}
+
+/*****************************************************************************/
+
+int main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/libmbim-glib/latency-histogram/empty", test_empty);
+    g_test_add_func ("/libmbim-glib/latency-histogram/percentiles", test_percentiles);
+    g_test_add_func ("/libmbim-glib/latency-histogram/overflow", test_overflow);
+    g_test_add_func ("/libmbim-glib/latency-histogram/decay", test_decay);
+
+    return g_test_run ();
+}
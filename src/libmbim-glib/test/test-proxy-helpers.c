@@ -10,6 +10,7 @@
 #include "mbim-cid.h"
 #include "mbim-uuid.h"
 #include "mbim-basic-connect.h"
+#include "mbim-proxy-control.h"
 #include "mbim-proxy-helpers.h"
 
 /*****************************************************************************/
@@ -396,6 +397,159 @@ test_merge_list_merged_services (void)
 
 /*****************************************************************************/
 
+static void
+test_configuration_parse_basic (void)
+{
+    MbimMessage *message;
+    GError *error = NULL;
+    gchar *device_path = NULL;
+    guint32 timeout = 0;
+    guint32 request_timeout = 1;
+    guint32 max_pending_requests = 1;
+    gboolean result;
+
+    /* Request built without the client limits */
+    message = mbim_message_proxy_control_configuration_set_new ("/dev/cdc-wdm0", 30, &error);
+    g_assert_no_error (error);
+    g_assert (message != NULL);
+
+    result = _mbim_proxy_helper_configuration_set_parse (message, &device_path, &timeout, &request_timeout, &max_pending_requests, &error);
+    g_assert_no_error (error);
+    g_assert (result);
+    g_assert_cmpstr (device_path, ==, "/dev/cdc-wdm0");
+    g_assert_cmpuint (timeout, ==, 30);
+    g_assert_cmpuint (request_timeout, ==, 0);
+    g_assert_cmpuint (max_pending_requests, ==, 0);
+
+    g_free (device_path);
+    mbim_message_unref (message);
+}
+
+static void
+test_configuration_parse_extended (void)
+{
+    MbimMessage *message;
+    GError *error = NULL;
+    gchar *device_path = NULL;
+    guint32 timeout = 0;
+    guint32 request_timeout = 0;
+    guint32 max_pending_requests = 0;
+    gboolean result;
+
+    /* Request built with the client limits */
+    message = _mbim_proxy_helper_configuration_set_new ("/dev/cdc-wdm0", 30, 20, 10);
+    g_assert (message != NULL);
+
+    result = _mbim_proxy_helper_configuration_set_parse (message, &device_path, &timeout, &request_timeout, &max_pending_requests, &error);
+    g_assert_no_error (error);
+    g_assert (result);
+    g_assert_cmpstr (device_path, ==, "/dev/cdc-wdm0");
+    g_assert_cmpuint (timeout, ==, 30);
+    g_assert_cmpuint (request_timeout, ==, 20);
+    g_assert_cmpuint (max_pending_requests, ==, 10);
+
+    g_free (device_path);
+    mbim_message_unref (message);
+}
+
+static void
+test_transport_parse (void)
+{
+    MbimMessage *message;
+    GError *error = NULL;
+    MbimProxyTransport transport = MBIM_PROXY_TRANSPORT_SOCKET;
+    gboolean result;
+
+    message = _mbim_proxy_helper_transport_set_new (MBIM_PROXY_TRANSPORT_SHARED_MEMORY);
+    g_assert (message != NULL);
+    g_assert_cmpuint (mbim_message_command_get_service (message), ==, MBIM_SERVICE_PROXY_CONTROL);
+    g_assert_cmpuint (mbim_message_command_get_cid (message), ==, MBIM_CID_PROXY_CONTROL_TRANSPORT);
+
+    result = _mbim_proxy_helper_transport_set_parse (message, &transport, &error);
+    g_assert_no_error (error);
+    g_assert (result);
+    g_assert_cmpuint (transport, ==, MBIM_PROXY_TRANSPORT_SHARED_MEMORY);
+
+    mbim_message_unref (message);
+}
+
+static void
+test_memory_usage_parse (void)
+{
+    MbimMessage *request;
+    MbimMessage *response;
+    GError *error = NULL;
+    MbimDeviceMemoryUsage device_memory_usage = { 1, 2, 3, 4, 5, 6 };
+    MbimDeviceMemoryUsage parsed_device_memory_usage = { 0 };
+    MbimProxyClientMemoryUsage client_memory_usage[] = {
+        { 0, 10, 11, 12, 13, 14, 15, 16, 17 },
+        { 1, 20, 21, 22, 23, 24, 25, 26, 27 },
+    };
+    GArray *clients;
+    GArray *parsed_clients = NULL;
+    gboolean result;
+
+    request = _mbim_proxy_helper_memory_usage_query_new ();
+    g_assert (request != NULL);
+    g_assert_cmpuint (mbim_message_command_get_service (request), ==, MBIM_SERVICE_PROXY_CONTROL);
+    g_assert_cmpuint (mbim_message_command_get_cid (request), ==, MBIM_CID_PROXY_CONTROL_MEMORY_USAGE);
+    g_assert_cmpuint (mbim_message_command_get_command_type (request), ==, MBIM_MESSAGE_COMMAND_TYPE_QUERY);
+    mbim_message_set_transaction_id (request, 0x1234);
+
+    clients = g_array_new (FALSE, FALSE, sizeof (MbimProxyClientMemoryUsage));
+    g_array_append_vals (clients, client_memory_usage, G_N_ELEMENTS (client_memory_usage));
+
+    response = _mbim_proxy_helper_memory_usage_response_new (request, &device_memory_usage, clients);
+    g_assert (response != NULL);
+    g_assert_cmpuint (mbim_message_get_message_type (response), ==, MBIM_MESSAGE_TYPE_COMMAND_DONE);
+    g_assert_cmpuint (mbim_message_get_transaction_id (response), ==, 0x1234);
+    g_assert_cmpuint (mbim_message_command_done_get_cid (response), ==, MBIM_CID_PROXY_CONTROL_MEMORY_USAGE);
+    g_assert (mbim_message_response_get_result (response, MBIM_MESSAGE_TYPE_COMMAND_DONE, NULL));
+
+    result = _mbim_proxy_helper_memory_usage_response_parse (response, &parsed_device_memory_usage, &parsed_clients, &error);
+    g_assert_no_error (error);
+    g_assert (result);
+    g_assert (memcmp (&parsed_device_memory_usage, &device_memory_usage, sizeof (device_memory_usage)) == 0);
+    g_assert_cmpuint (parsed_clients->len, ==, G_N_ELEMENTS (client_memory_usage));
+    g_assert (memcmp (parsed_clients->data, client_memory_usage, sizeof (client_memory_usage)) == 0);
+
+    g_array_unref (parsed_clients);
+    g_array_unref (clients);
+    mbim_message_unref (response);
+    mbim_message_unref (request);
+}
+
+static void
+test_memory_usage_parse_no_clients (void)
+{
+    MbimMessage *request;
+    MbimMessage *response;
+    GError *error = NULL;
+    MbimDeviceMemoryUsage device_memory_usage = { 1, 2, 3, 4, 5, 6 };
+    GArray *parsed_clients = NULL;
+    gboolean result;
+
+    request = _mbim_proxy_helper_memory_usage_query_new ();
+    response = _mbim_proxy_helper_memory_usage_response_new (request, &device_memory_usage, NULL);
+
+    result = _mbim_proxy_helper_memory_usage_response_parse (response, NULL, &parsed_clients, &error);
+    g_assert_no_error (error);
+    g_assert (result);
+    g_assert_cmpuint (parsed_clients->len, ==, 0);
+
+    /* The request itself is not a valid response */
+    result = _mbim_proxy_helper_memory_usage_response_parse (request, NULL, NULL, &error);
+    g_assert_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_INVALID_MESSAGE);
+    g_assert (!result);
+    g_clear_error (&error);
+
+    g_array_unref (parsed_clients);
+    mbim_message_unref (response);
+    mbim_message_unref (request);
+}
+
+/*****************************************************************************/
+
 int main (int argc, char **argv)
 {
     g_test_init (&argc, &argv, NULL);
@@ -409,6 +563,11 @@ int main (int argc, char **argv)
     g_test_add_func ("/libmbim-glib/proxy/merge/same-service",         test_merge_list_same_service);
     g_test_add_func ("/libmbim-glib/proxy/merge/different-services",   test_merge_list_different_services);
     g_test_add_func ("/libmbim-glib/proxy/merge/merged-services",      test_merge_list_merged_services);
+    g_test_add_func ("/libmbim-glib/proxy/configuration/basic",        test_configuration_parse_basic);
+    g_test_add_func ("/libmbim-glib/proxy/configuration/extended",     test_configuration_parse_extended);
+    g_test_add_func ("/libmbim-glib/proxy/transport",                  test_transport_parse);
+    g_test_add_func ("/libmbim-glib/proxy/memory-usage",               test_memory_usage_parse);
+    g_test_add_func ("/libmbim-glib/proxy/memory-usage/no-clients",    test_memory_usage_parse_no_clients);
 
     return g_test_run ();
 }
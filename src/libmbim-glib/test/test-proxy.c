@@ -0,0 +1,551 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * Tests of the proxy, with its clients in the same process. The proxy socket
+ * is abstract, so the tests run in their own network namespace, not to clash
+ * with a system-wide mbim-proxy. Both creating the namespace and connecting
+ * to the proxy require root privileges; otherwise the tests are skipped.
+ */
+
+#include <config.h>
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gio/gio.h>
+
+#include "mbim-device.h"
+#include "mbim-proxy.h"
+#include "mbim-basic-connect.h"
+
+#include "test-fake-modem.h"
+
+#define TIMEOUT_SECS 5
+
+#define CLIENT_MEMORY_LIMIT 16384
+#define N_INDICATIONS       20000
+/* Size of the indications sent by the fake modem, which have an empty
+ * information buffer */
+#define INDICATION_SIZE     44
+
+static gboolean proxy_available;
+
+/*****************************************************************************/
+
+static void
+async_ready (GObject       *source,
+             GAsyncResult  *res,
+             GAsyncResult **out_res)
+{
+    *out_res = g_object_ref (res);
+}
+
+static GAsyncResult *
+async_wait (GAsyncResult **res)
+{
+    while (!*res)
+        g_main_context_iteration (NULL, TRUE);
+    return *res;
+}
+
+static MbimProxy *
+proxy_new (gboolean device_threads)
+{
+    g_autoptr(GError) error = NULL;
+    MbimProxy        *proxy;
+
+    proxy = mbim_proxy_new (&error);
+    g_assert_no_error (error);
+    mbim_proxy_set_device_threads (proxy, device_threads);
+    return proxy;
+}
+
+/* The proxy counters may be updated in the device threads, so wait for the
+ * expected ones instead of checking them right away */
+static void
+proxy_wait (MbimProxy *proxy,
+            guint      n_devices,
+            guint      n_clients)
+{
+    gint64 deadline;
+
+    deadline = g_get_monotonic_time () + (TIMEOUT_SECS * G_USEC_PER_SEC);
+    while (mbim_proxy_get_n_devices (proxy) != n_devices ||
+           mbim_proxy_get_n_clients (proxy) != n_clients) {
+        g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+        if (!g_main_context_iteration (NULL, FALSE))
+            g_usleep (10000);
+    }
+}
+
+static guint64
+proxy_get_client_memory_usage (MbimProxy                  *proxy,
+                               MbimProxyClientMemoryUsage *out_usage)
+{
+    g_autoptr(GArray) usage = NULL;
+
+    usage = mbim_proxy_get_client_memory_usage (proxy);
+    g_assert_cmpuint (usage->len, ==, 1);
+    *out_usage = g_array_index (usage, MbimProxyClientMemoryUsage, 0);
+    return (out_usage->receive_buffer +
+            out_usage->pending_requests +
+            out_usage->outbound +
+            out_usage->subscriptions);
+}
+
+/* Wait, without iterating the main context so that the client doesn't read
+ * anything, until the queue of messages to send to the client is full */
+static void
+proxy_wait_outbound_full (MbimProxy *proxy)
+{
+    MbimProxyClientMemoryUsage usage;
+    gint64                     deadline;
+
+    deadline = g_get_monotonic_time () + (TIMEOUT_SECS * G_USEC_PER_SEC);
+    proxy_get_client_memory_usage (proxy, &usage);
+    while (usage.outbound + INDICATION_SIZE <= CLIENT_MEMORY_LIMIT) {
+        g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+        g_usleep (10000);
+        proxy_get_client_memory_usage (proxy, &usage);
+    }
+    g_assert_cmpuint (usage.outbound_peak, <=, CLIENT_MEMORY_LIMIT);
+}
+
+static MbimDevice *
+device_new (FakeModem *modem)
+{
+    g_autoptr(GFile)        file = NULL;
+    g_autoptr(GAsyncResult) res = NULL;
+    g_autoptr(GError)       error = NULL;
+    MbimDevice             *device;
+
+    file = g_file_new_for_path (fake_modem_get_path (modem));
+    mbim_device_new (file, NULL, (GAsyncReadyCallback)async_ready, &res);
+    device = mbim_device_new_finish (async_wait (&res), &error);
+    g_assert_no_error (error);
+    return device;
+}
+
+static void
+device_open (MbimDevice *device)
+{
+    g_autoptr(GAsyncResult) res = NULL;
+    g_autoptr(GError)       error = NULL;
+
+    mbim_device_open_full (device, MBIM_DEVICE_OPEN_FLAGS_PROXY, TIMEOUT_SECS, NULL, (GAsyncReadyCallback)async_ready, &res);
+    g_assert (mbim_device_open_full_finish (device, async_wait (&res), &error));
+    g_assert_no_error (error);
+}
+
+static void
+device_close (MbimDevice *device)
+{
+    g_autoptr(GAsyncResult) res = NULL;
+    g_autoptr(GError)       error = NULL;
+
+    mbim_device_close (device, TIMEOUT_SECS, NULL, (GAsyncReadyCallback)async_ready, &res);
+    g_assert (mbim_device_close_finish (device, async_wait (&res), &error));
+    g_assert_no_error (error);
+}
+
+static void
+device_query (MbimDevice *device)
+{
+    g_autoptr(MbimMessage)  request = NULL;
+    g_autoptr(MbimMessage)  response = NULL;
+    g_autoptr(GAsyncResult) res = NULL;
+    g_autoptr(GError)       error = NULL;
+
+    request = mbim_message_radio_state_query_new (NULL);
+    mbim_device_command (device, request, TIMEOUT_SECS, NULL, (GAsyncReadyCallback)async_ready, &res);
+    response = mbim_device_command_finish (device, async_wait (&res), &error);
+    g_assert_no_error (error);
+    g_assert (mbim_message_response_get_result (response, MBIM_MESSAGE_TYPE_COMMAND_DONE, &error));
+    g_assert_no_error (error);
+}
+
+/*****************************************************************************/
+
+static void
+test_device_threads_untrack (void)
+{
+    g_autoptr(MbimProxy)    proxy = NULL;
+    g_autoptr(FakeModem)    modem = NULL;
+    g_autoptr(MbimDevice)   device = NULL;
+    g_autoptr(MbimMessage)  request = NULL;
+    g_autoptr(MbimMessage)  response = NULL;
+    g_autoptr(GAsyncResult) res = NULL;
+    g_autoptr(GError)       error = NULL;
+    guint                   n_commands;
+    guint                   i;
+
+    if (!proxy_available) {
+        g_test_skip ("proxy not available");
+        return;
+    }
+
+    proxy = proxy_new (TRUE);
+    modem = fake_modem_new ();
+
+    device = device_new (modem);
+    device_open (device);
+    proxy_wait (proxy, 1, 1);
+    for (i = 0; i < 10; i++)
+        device_query (device);
+
+    /* A request in flight when the device goes away is aborted in the device
+     * thread, before the thread is stopped */
+    fake_modem_set_silent (modem, TRUE);
+    n_commands = fake_modem_get_n_commands (modem);
+    request = mbim_message_radio_state_query_new (NULL);
+    mbim_device_command (device, request, 1, NULL, (GAsyncReadyCallback)async_ready, &res);
+    while (fake_modem_get_n_commands (modem) == n_commands) {
+        if (!g_main_context_iteration (NULL, FALSE))
+            g_usleep (10000);
+    }
+    fake_modem_unplug (modem);
+    proxy_wait (proxy, 0, 0);
+    response = mbim_device_command_finish (device, async_wait (&res), &error);
+    g_assert (!response);
+    g_assert (error);
+    g_clear_object (&device);
+
+    /* The device plugged back is handled in a new device thread */
+    fake_modem_set_silent (modem, FALSE);
+    fake_modem_plug (modem);
+    device = device_new (modem);
+    device_open (device);
+    proxy_wait (proxy, 1, 1);
+    for (i = 0; i < 10; i++)
+        device_query (device);
+    device_close (device);
+    g_clear_object (&device);
+    proxy_wait (proxy, 1, 0);
+}
+
+/*****************************************************************************/
+
+#define N_BUSY_REQUESTS 20
+
+static void
+test_client_memory_limit_busy (void)
+{
+    g_autoptr(MbimProxy)       proxy = NULL;
+    g_autoptr(FakeModem)       modem = NULL;
+    g_autoptr(MbimDevice)      device = NULL;
+    GAsyncResult              *results[N_BUSY_REQUESTS] = { NULL };
+    MbimProxyClientMemoryUsage usage;
+    guint                      n_success = 0;
+    guint                      n_busy = 0;
+    guint                      i;
+
+    if (!proxy_available) {
+        g_test_skip ("proxy not available");
+        return;
+    }
+
+    proxy = proxy_new (FALSE);
+    modem = fake_modem_new ();
+
+    device = device_new (modem);
+    device_open (device);
+    proxy_wait (proxy, 1, 1);
+
+    /* Room for a few requests only, which the modem takes long to reply */
+    mbim_proxy_set_client_memory_limit (proxy, proxy_get_client_memory_usage (proxy, &usage) + 1024);
+    fake_modem_set_response_delay (modem, 1500);
+
+    for (i = 0; i < N_BUSY_REQUESTS; i++) {
+        g_autoptr(MbimMessage) request = NULL;
+
+        request = mbim_message_radio_state_query_new (NULL);
+        mbim_device_command (device, request, TIMEOUT_SECS, NULL, (GAsyncReadyCallback)async_ready, &results[i]);
+    }
+
+    for (i = 0; i < N_BUSY_REQUESTS; i++) {
+        g_autoptr(MbimMessage) response = NULL;
+        g_autoptr(GError)      error = NULL;
+
+        response = mbim_device_command_finish (device, async_wait (&results[i]), &error);
+        g_assert_no_error (error);
+        if (mbim_message_response_get_result (response, MBIM_MESSAGE_TYPE_COMMAND_DONE, &error))
+            n_success++;
+        else {
+            g_assert_error (error, MBIM_STATUS_ERROR, MBIM_STATUS_ERROR_BUSY);
+            n_busy++;
+        }
+        g_object_unref (results[i]);
+    }
+    g_assert_cmpuint (n_success, >, 0);
+    g_assert_cmpuint (n_busy, >, 0);
+
+    /* Requests are accepted again once the pending ones are done */
+    fake_modem_set_response_delay (modem, 0);
+    device_query (device);
+    device_close (device);
+}
+
+static void
+indication_cb (MbimDevice  *device,
+               MbimMessage *message,
+               guint       *n_indications)
+{
+    (*n_indications)++;
+}
+
+static void
+test_client_memory_limit_indications (void)
+{
+    g_autoptr(MbimProxy)       proxy = NULL;
+    g_autoptr(FakeModem)       modem = NULL;
+    g_autoptr(MbimDevice)      device = NULL;
+    MbimProxyClientMemoryUsage usage;
+    guint                      n_indications = 0;
+    gint64                     deadline;
+
+    if (!proxy_available) {
+        g_test_skip ("proxy not available");
+        return;
+    }
+
+    /* The client is handled in a device thread, so the proxy keeps on
+     * running while the main context isn't iterated */
+    proxy = proxy_new (TRUE);
+    modem = fake_modem_new ();
+
+    device = device_new (modem);
+    device_open (device);
+    proxy_wait (proxy, 1, 1);
+    g_signal_connect (device, MBIM_DEVICE_SIGNAL_INDICATE_STATUS, G_CALLBACK (indication_cb), &n_indications);
+
+    mbim_proxy_set_client_memory_limit (proxy, CLIENT_MEMORY_LIMIT);
+    g_test_expect_message ("Mbim", G_LOG_LEVEL_WARNING, "*couldn't forward indication*");
+    fake_modem_send_indications (modem, N_INDICATIONS);
+    proxy_wait_outbound_full (proxy);
+
+    /* Indications are dropped, but the client is kept */
+    g_assert_cmpuint (mbim_proxy_get_n_clients (proxy), ==, 1);
+
+    /* Let the client read everything queued, and make sure the modem has
+     * sent all the indications by waiting for a response sent after them */
+    deadline = g_get_monotonic_time () + (TIMEOUT_SECS * G_USEC_PER_SEC);
+    do {
+        g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+        g_main_context_iteration (NULL, FALSE);
+        proxy_get_client_memory_usage (proxy, &usage);
+    } while (usage.outbound > 0);
+    device_query (device);
+    g_test_assert_expected_messages ();
+
+    g_assert_cmpuint (n_indications, >, 0);
+    g_assert_cmpuint (n_indications, <, N_INDICATIONS);
+    device_close (device);
+}
+
+static void
+test_client_memory_limit_disconnect (void)
+{
+    g_autoptr(MbimProxy)    proxy = NULL;
+    g_autoptr(FakeModem)    modem = NULL;
+    g_autoptr(MbimDevice)   device = NULL;
+    g_autoptr(MbimMessage)  request = NULL;
+    g_autoptr(MbimMessage)  response = NULL;
+    g_autoptr(GAsyncResult) res = NULL;
+    g_autoptr(GError)       error = NULL;
+    gint64                  deadline;
+
+    if (!proxy_available) {
+        g_test_skip ("proxy not available");
+        return;
+    }
+
+    proxy = proxy_new (TRUE);
+    modem = fake_modem_new ();
+
+    device = device_new (modem);
+    device_open (device);
+    proxy_wait (proxy, 1, 1);
+
+    /* Fill the queue of the client with indications, so that there is no
+     * room left for the response */
+    mbim_proxy_set_client_memory_limit (proxy, CLIENT_MEMORY_LIMIT);
+    g_test_expect_message ("Mbim", G_LOG_LEVEL_WARNING, "*couldn't forward indication*");
+    g_test_expect_message ("Mbim", G_LOG_LEVEL_WARNING, "*couldn't send response back to client*");
+    fake_modem_send_indications (modem, N_INDICATIONS);
+    proxy_wait_outbound_full (proxy);
+
+    request = mbim_message_radio_state_query_new (NULL);
+    mbim_device_command (device, request, TIMEOUT_SECS, NULL, (GAsyncReadyCallback)async_ready, &res);
+
+    /* Still without reading anything */
+    deadline = g_get_monotonic_time () + (TIMEOUT_SECS * G_USEC_PER_SEC);
+    while (mbim_proxy_get_n_clients (proxy) > 0) {
+        g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+        g_usleep (10000);
+    }
+    g_test_assert_expected_messages ();
+
+    response = mbim_device_command_finish (device, async_wait (&res), &error);
+    g_assert (!response);
+    g_assert (error);
+    proxy_wait (proxy, 1, 0);
+}
+
+static void
+test_client_outbound_overflow (void)
+{
+    g_autoptr(MbimProxy)  proxy = NULL;
+    g_autoptr(FakeModem)  modem = NULL;
+    g_autoptr(MbimDevice) device = NULL;
+    gint64                deadline;
+
+    if (!proxy_available) {
+        g_test_skip ("proxy not available");
+        return;
+    }
+
+    proxy = proxy_new (TRUE);
+    modem = fake_modem_new ();
+
+    device = device_new (modem);
+    device_open (device);
+    proxy_wait (proxy, 1, 1);
+
+    /* Without a memory limit, a client not reading at all is disconnected
+     * once the default maximum of pending messages is reached */
+    g_test_expect_message ("Mbim", G_LOG_LEVEL_WARNING, "*couldn't forward indication*");
+    g_test_expect_message ("Mbim", G_LOG_LEVEL_WARNING, "*client not reading its messages*");
+    fake_modem_send_indications (modem, (4 * 1024 * 1024) / INDICATION_SIZE + N_INDICATIONS);
+
+    deadline = g_get_monotonic_time () + (2 * TIMEOUT_SECS * G_USEC_PER_SEC);
+    while (mbim_proxy_get_n_clients (proxy) > 0) {
+        g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+        g_usleep (10000);
+    }
+    g_test_assert_expected_messages ();
+    proxy_wait (proxy, 1, 0);
+}
+
+/*****************************************************************************/
+
+#define N_HANDOFF_INDICATIONS 2000
+
+typedef struct {
+    GMainContext  *context;
+    MbimProxy     *proxy;
+    volatile gint  ready;
+    volatile gint  running;
+} HandoffThread;
+
+/* The new proxy runs in its own thread, as the running one needs the main
+ * context to be iterated during the handoff */
+static gpointer
+handoff_thread (HandoffThread *ctx)
+{
+    g_autoptr(GError) error = NULL;
+
+    g_main_context_push_thread_default (ctx->context);
+    ctx->proxy = mbim_proxy_new_from_handoff (&error);
+    g_assert_no_error (error);
+    g_atomic_int_set (&ctx->ready, TRUE);
+
+    while (g_atomic_int_get (&ctx->running))
+        g_main_context_iteration (ctx->context, TRUE);
+
+    g_clear_object (&ctx->proxy);
+    g_main_context_pop_thread_default (ctx->context);
+    return NULL;
+}
+
+static void
+handed_off_cb (MbimProxy *proxy,
+               gboolean  *handed_off)
+{
+    *handed_off = TRUE;
+}
+
+static void
+test_handoff_fragmented_indications (void)
+{
+    g_autoptr(MbimProxy)  proxy = NULL;
+    g_autoptr(FakeModem)  modem = NULL;
+    g_autoptr(MbimDevice) device = NULL;
+    g_autoptr(GError)     error = NULL;
+    HandoffThread         handoff;
+    GThread              *thread;
+    gboolean              handed_off = FALSE;
+    guint                 n_indications = 0;
+    gint64                deadline;
+
+    if (!proxy_available) {
+        g_test_skip ("proxy not available");
+        return;
+    }
+
+    proxy = proxy_new (FALSE);
+    g_assert (mbim_proxy_enable_handoff (proxy, &error));
+    g_assert_no_error (error);
+    g_signal_connect (proxy, MBIM_PROXY_SIGNAL_HANDED_OFF, G_CALLBACK (handed_off_cb), &handed_off);
+    modem = fake_modem_new ();
+
+    device = device_new (modem);
+    device_open (device);
+    proxy_wait (proxy, 1, 1);
+    g_signal_connect (device, MBIM_DEVICE_SIGNAL_INDICATE_STATUS, G_CALLBACK (indication_cb), &n_indications);
+
+    /* Every indication is sent in two fragments, and the handoff happens
+     * while they keep on coming; none of them must be lost */
+    fake_modem_set_max_control_transfer (modem, 32);
+    fake_modem_send_indications (modem, N_HANDOFF_INDICATIONS);
+
+    memset (&handoff, 0, sizeof (handoff));
+    handoff.context = g_main_context_new ();
+    handoff.running = TRUE;
+    thread = g_thread_new ("handoff", (GThreadFunc)handoff_thread, &handoff);
+
+    deadline = g_get_monotonic_time () + (2 * TIMEOUT_SECS * G_USEC_PER_SEC);
+    while (!handed_off || !g_atomic_int_get (&handoff.ready) || n_indications < N_HANDOFF_INDICATIONS) {
+        g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+        if (!g_main_context_iteration (NULL, FALSE))
+            g_usleep (10000);
+    }
+    g_assert_cmpuint (n_indications, ==, N_HANDOFF_INDICATIONS);
+    g_assert_cmpuint (mbim_proxy_get_n_devices (proxy), ==, 0);
+    g_assert_cmpuint (mbim_proxy_get_n_clients (proxy), ==, 0);
+    proxy_wait (handoff.proxy, 1, 1);
+
+    /* The client keeps on working with the new proxy */
+    device_query (device);
+    device_close (device);
+    proxy_wait (handoff.proxy, 1, 0);
+
+    g_atomic_int_set (&handoff.running, FALSE);
+    g_main_context_wakeup (handoff.context);
+    g_thread_join (thread);
+    g_main_context_unref (handoff.context);
+}
+
+/*****************************************************************************/
+
+int main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    /* Clients disconnected by the proxy may still be writing */
+    signal (SIGPIPE, SIG_IGN);
+
+    proxy_available = (geteuid () == 0 && unshare (CLONE_NEWNET) == 0);
+
+    g_test_add_func ("/libmbim-glib/proxy/device-threads-untrack", test_device_threads_untrack);
+    g_test_add_func ("/libmbim-glib/proxy/client-memory-limit-busy", test_client_memory_limit_busy);
+    g_test_add_func ("/libmbim-glib/proxy/client-memory-limit-indications", test_client_memory_limit_indications);
+    g_test_add_func ("/libmbim-glib/proxy/client-memory-limit-disconnect", test_client_memory_limit_disconnect);
+    g_test_add_func ("/libmbim-glib/proxy/client-outbound-overflow", test_client_outbound_overflow);
+    g_test_add_func ("/libmbim-glib/proxy/handoff-fragmented-indications", test_handoff_fragmented_indications);
+
+    return g_test_run ();
+}
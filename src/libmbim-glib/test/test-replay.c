@@ -0,0 +1,158 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <config.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#include "mbim-common.h"
+#include "mbim-capture.h"
+#include "mbim-replay.h"
+
+/*****************************************************************************/
+
+/* Basic Connect device caps query, transaction 5 */
+static const guint8 command[] = {
+    0x03, 0x00, 0x00, 0x00, 0x30, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xa2, 0x89, 0xcc, 0x33, 0xbc, 0xbb, 0x8b, 0x4f,
+    0xb6, 0xb0, 0x13, 0x3e, 0xc2, 0xaa, 0xe6, 0xdf,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+/* Its response */
+static const guint8 command_done[] = {
+    0x03, 0x00, 0x00, 0x80, 0x30, 0x00, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xa2, 0x89, 0xcc, 0x33, 0xbc, 0xbb, 0x8b, 0x4f,
+    0xb6, 0xb0, 0x13, 0x3e, 0xc2, 0xaa, 0xe6, 0xdf,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+/* Basic Connect signal state indication */
+static const guint8 indication[] = {
+    0x07, 0x00, 0x00, 0x80, 0x2c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xa2, 0x89, 0xcc, 0x33, 0xbc, 0xbb, 0x8b, 0x4f,
+    0xb6, 0xb0, 0x13, 0x3e, 0xc2, 0xaa, 0xe6, 0xdf,
+    0x0b, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+static void
+test_load_log (void)
+{
+    g_autoptr(GError)      error = NULL;
+    g_autoptr(MbimReplay)  replay = NULL;
+    g_autofree gchar      *path = NULL;
+    g_autofree gchar      *sent = NULL;
+    g_autofree gchar      *received = NULL;
+    g_autofree gchar      *contents = NULL;
+    gint                   fd;
+
+    fd = g_file_open_tmp ("test-replay-XXXXXX.log", &path, &error);
+    g_assert_no_error (error);
+    close (fd);
+
+    sent = mbim_common_str_hex (command, sizeof (command), ':');
+    received = mbim_common_str_hex (command_done, sizeof (command_done), ':');
+    contents = g_strdup_printf ("[18 Oct 2026, 10:00:00] [Debug] [/dev/cdc-wdm0] sent message...\n"
+                                "<<<<<< RAW:\n"
+                                "<<<<<<   length = %u\n"
+                                "<<<<<<   data   = %s\n"
+                                "\n"
+                                "[18 Oct 2026, 10:00:02] [Debug] [/dev/cdc-wdm0] received message...\n"
+                                ">>>>>> RAW:\n"
+                                ">>>>>>   length = %u\n"
+                                ">>>>>>   data   = %s\n"
+                                "[18 Oct 2026, 10:00:03] [Debug] [/dev/cdc-wdm0] received message...\n"
+                                ">>>>>> RAW:\n"
+                                ">>>>>>   length = 1024\n"
+                                ">>>>>>   data   = 07:00:00:80:00:04:00:00...\n",
+                                (guint) sizeof (command), sent,
+                                (guint) sizeof (command_done), received);
+    g_assert (g_file_set_contents (path, contents, -1, &error));
+
+    /* Truncated messages are ignored */
+    replay = _mbim_replay_new_from_file (path, 0, &error);
+    g_assert_no_error (error);
+    g_assert_cmpuint (_mbim_replay_get_n_messages (replay), ==, 2);
+    g_assert_cmpint (_mbim_replay_get_duration (replay), ==, 2 * G_USEC_PER_SEC);
+
+    g_unlink (path);
+}
+
+static void
+replay_ready (GObject              *source,
+              GAsyncResult         *res,
+              MbimReplayStatistics *statistics)
+{
+    g_autoptr(GError) error = NULL;
+
+    g_assert (_mbim_replay_run_finish (NULL, res, statistics, &error));
+    g_assert_no_error (error);
+}
+
+static void
+test_replay (void)
+{
+    g_autoptr(GError)      error = NULL;
+    g_autoptr(MbimReplay)  replay = NULL;
+    g_autoptr(MbimCapture) capture = NULL;
+    g_autoptr(MbimDevice)  device = NULL;
+    g_autoptr(GFile)       file = NULL;
+    g_autofree gchar      *path = NULL;
+    MbimReplayStatistics   statistics = { 0 };
+    MbimDeviceStatistics   device_statistics;
+    guint32                interface_id;
+    gint                   fd;
+
+    fd = g_file_open_tmp ("test-replay-XXXXXX.pcapng", &path, &error);
+    g_assert_no_error (error);
+    close (fd);
+
+    capture = _mbim_capture_new (path, 0, 1, &error);
+    g_assert_no_error (error);
+    interface_id = _mbim_capture_add_interface (capture, "/dev/cdc-wdm0");
+    _mbim_capture_add (capture, interface_id, MBIM_CAPTURE_DIRECTION_OUT, command, sizeof (command));
+    _mbim_capture_add (capture, interface_id, MBIM_CAPTURE_DIRECTION_IN, indication, sizeof (indication));
+    _mbim_capture_add (capture, interface_id, MBIM_CAPTURE_DIRECTION_IN, command_done, sizeof (command_done));
+    _mbim_capture_flush (capture);
+
+    replay = _mbim_replay_new_from_file (path, interface_id, &error);
+    g_assert_no_error (error);
+    g_assert_cmpuint (_mbim_replay_get_n_messages (replay), ==, 3);
+
+    file = g_file_new_for_path (path);
+    device = g_object_new (MBIM_TYPE_DEVICE, MBIM_DEVICE_FILE, file, NULL);
+
+    /* The response is sent with the transaction ID used by the device */
+    _mbim_replay_run (replay, device, 0.0, 5, NULL, (GAsyncReadyCallback)replay_ready, &statistics);
+    while (statistics.n_responses + statistics.n_errors == 0)
+        g_main_context_iteration (NULL, TRUE);
+
+    g_assert_cmpuint (statistics.n_commands, ==, 1);
+    g_assert_cmpuint (statistics.n_responses, ==, 1);
+    g_assert_cmpuint (statistics.n_errors, ==, 0);
+    g_assert_cmpuint (statistics.n_indications, ==, 1);
+    g_assert_cmpuint (statistics.n_skipped, ==, 0);
+
+    mbim_device_get_statistics (device, &device_statistics, NULL);
+    g_assert_cmpuint (device_statistics.messages_out, ==, 1);
+    g_assert_cmpuint (device_statistics.messages_in, ==, 2);
+
+    g_unlink (path);
+}
+
+/*****************************************************************************/
+
+int main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/libmbim-glib/replay/load-log", test_load_log);
+    g_test_add_func ("/libmbim-glib/replay/run", test_replay);
+
+    return g_test_run ();
+}
@@ -0,0 +1,262 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <config.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "mbim-shm-channel.h"
+#include "mbim-errors.h"
+#include "mbim-error-types.h"
+
+/*****************************************************************************/
+
+#if defined HAVE_MEMFD_CREATE
+
+static gboolean
+doorbell_rung (MbimShmChannel *channel)
+{
+    GPollFD pollfd;
+
+    pollfd.fd = _mbim_shm_channel_get_fd (channel);
+    pollfd.events = G_IO_IN;
+    pollfd.revents = 0;
+    return (g_poll (&pollfd, 1, 0) == 1);
+}
+
+static gsize
+channel_write (MbimShmChannel *channel,
+               const guint8   *data,
+               gsize           data_length)
+{
+    GError *error = NULL;
+    gsize written = 0;
+
+    g_assert (_mbim_shm_channel_write (channel, data, data_length, &written, &error));
+    g_assert_no_error (error);
+    return written;
+}
+
+static void
+channel_pair_new (MbimShmChannel **out_proxy,
+                  MbimShmChannel **out_client)
+{
+    MbimShmChannel *proxy;
+    MbimShmChannel *client;
+    GError *error = NULL;
+    gint memfd = -1;
+    gint local_fd = -1;
+    gint remote_fd = -1;
+
+    proxy = _mbim_shm_channel_new (&error);
+    g_assert_no_error (error);
+    g_assert (proxy);
+
+    /* The fds are duplicated when passed over the socket */
+    _mbim_shm_channel_get_peer_fds (proxy, &memfd, &local_fd, &remote_fd);
+    client = _mbim_shm_channel_new_from_fds (dup (memfd), dup (local_fd), dup (remote_fd), &error);
+    g_assert_no_error (error);
+    g_assert (client);
+
+    *out_proxy = proxy;
+    *out_client = client;
+}
+
+#endif
+
+static void
+test_roundtrip (void)
+{
+#if defined HAVE_MEMFD_CREATE
+    MbimShmChannel *proxy = NULL;
+    MbimShmChannel *client = NULL;
+    GByteArray *buffer;
+    static const guint8 request[] = { 0x01, 0x02, 0x03, 0x04, 0x05 };
+    static const guint8 response[] = { 0x0A, 0x0B, 0x0C };
+
+    channel_pair_new (&proxy, &client);
+    buffer = g_byte_array_new ();
+
+    /* Client to proxy */
+    g_assert_cmpuint (channel_write (client, request, sizeof (request)), ==, sizeof (request));
+    g_assert (!doorbell_rung (proxy));
+    _mbim_shm_channel_notify (client);
+    g_assert (doorbell_rung (proxy));
+    _mbim_shm_channel_acknowledge (proxy);
+    g_assert (!doorbell_rung (proxy));
+    g_assert_cmpuint (_mbim_shm_channel_read (proxy, buffer), ==, sizeof (request));
+    g_assert_cmpuint (buffer->len, ==, sizeof (request));
+    g_assert (memcmp (buffer->data, request, sizeof (request)) == 0);
+    g_assert_cmpuint (_mbim_shm_channel_read (proxy, buffer), ==, 0);
+
+    /* Proxy to client */
+    g_byte_array_set_size (buffer, 0);
+    g_assert_cmpuint (channel_write (proxy, response, sizeof (response)), ==, sizeof (response));
+    _mbim_shm_channel_notify (proxy);
+    g_assert (doorbell_rung (client));
+    g_assert_cmpuint (_mbim_shm_channel_read (client, buffer), ==, sizeof (response));
+    g_assert (memcmp (buffer->data, response, sizeof (response)) == 0);
+
+    g_byte_array_unref (buffer);
+    _mbim_shm_channel_free (client);
+    _mbim_shm_channel_free (proxy);
+#else
+    g_test_skip ("memfd not supported");
+#endif
+}
+
+static void
+test_full_ring (void)
+{
+#if defined HAVE_MEMFD_CREATE
+    MbimShmChannel *proxy = NULL;
+    MbimShmChannel *client = NULL;
+    GByteArray *buffer;
+    guint8 *data;
+    gsize data_length;
+    gsize i;
+
+    channel_pair_new (&proxy, &client);
+    buffer = g_byte_array_new ();
+
+    data_length = MBIM_SHM_CHANNEL_RING_SIZE + 100;
+    data = g_malloc (data_length);
+    for (i = 0; i < data_length; i++)
+        data[i] = (guint8) i;
+
+    /* Move the ring offsets so that the data wraps around the end */
+    g_assert_cmpuint (channel_write (client, data, 10), ==, 10);
+    g_assert_cmpuint (_mbim_shm_channel_read (proxy, buffer), ==, 10);
+    g_byte_array_set_size (buffer, 0);
+
+    /* Only the ring size fits */
+    g_assert_cmpuint (channel_write (client, data, data_length), ==, MBIM_SHM_CHANNEL_RING_SIZE);
+    g_assert_cmpuint (channel_write (client, &data[MBIM_SHM_CHANNEL_RING_SIZE], 100), ==, 0);
+
+    /* Reading releases the space and wakes up the waiting writer */
+    g_assert (!doorbell_rung (client));
+    g_assert_cmpuint (_mbim_shm_channel_read (proxy, buffer), ==, MBIM_SHM_CHANNEL_RING_SIZE);
+    g_assert (doorbell_rung (client));
+    _mbim_shm_channel_acknowledge (client);
+
+    /* And the rest is written afterwards */
+    g_assert_cmpuint (channel_write (client, &data[MBIM_SHM_CHANNEL_RING_SIZE], 100), ==, 100);
+    g_assert_cmpuint (_mbim_shm_channel_read (proxy, buffer), ==, 100);
+    g_assert_cmpuint (buffer->len, ==, data_length);
+    g_assert (memcmp (buffer->data, data, data_length) == 0);
+
+    g_free (data);
+    g_byte_array_unref (buffer);
+    _mbim_shm_channel_free (client);
+    _mbim_shm_channel_free (proxy);
+#else
+    g_test_skip ("memfd not supported");
+#endif
+}
+
+static void
+test_proxy_handoff (void)
+{
+#if defined HAVE_MEMFD_CREATE
+    MbimShmChannel *proxy = NULL;
+    MbimShmChannel *new_proxy;
+    MbimShmChannel *client = NULL;
+    GByteArray *buffer;
+    GError *error = NULL;
+    gint memfd = -1;
+    gint local_fd = -1;
+    gint remote_fd = -1;
+    static const guint8 request[] = { 0x01, 0x02, 0x03 };
+    static const guint8 response[] = { 0x0A, 0x0B };
+
+    channel_pair_new (&proxy, &client);
+    buffer = g_byte_array_new ();
+
+    /* Request pending in the ring while the channel is handed off */
+    g_assert_cmpuint (channel_write (client, request, sizeof (request)), ==, sizeof (request));
+    _mbim_shm_channel_notify (client);
+
+    _mbim_shm_channel_get_fds (proxy, &memfd, &local_fd, &remote_fd);
+    new_proxy = _mbim_shm_channel_new_proxy_from_fds (dup (memfd), dup (local_fd), dup (remote_fd), &error);
+    g_assert_no_error (error);
+    g_assert (new_proxy);
+    _mbim_shm_channel_free (proxy);
+
+    g_assert (doorbell_rung (new_proxy));
+    _mbim_shm_channel_acknowledge (new_proxy);
+    g_assert_cmpuint (_mbim_shm_channel_read (new_proxy, buffer), ==, sizeof (request));
+    g_assert (memcmp (buffer->data, request, sizeof (request)) == 0);
+
+    g_byte_array_set_size (buffer, 0);
+    g_assert_cmpuint (channel_write (new_proxy, response, sizeof (response)), ==, sizeof (response));
+    _mbim_shm_channel_notify (new_proxy);
+    g_assert (doorbell_rung (client));
+    g_assert_cmpuint (_mbim_shm_channel_read (client, buffer), ==, sizeof (response));
+    g_assert (memcmp (buffer->data, response, sizeof (response)) == 0);
+
+    g_byte_array_unref (buffer);
+    _mbim_shm_channel_free (client);
+    _mbim_shm_channel_free (new_proxy);
+#else
+    g_test_skip ("memfd not supported");
+#endif
+}
+
+static void
+test_corrupted_ring (void)
+{
+#if defined HAVE_MEMFD_CREATE
+    MbimShmChannel *proxy = NULL;
+    MbimShmChannel *client = NULL;
+    GError *error = NULL;
+    gint memfd = -1;
+    gint local_fd = -1;
+    gint remote_fd = -1;
+    guint8 *map;
+    gint *tail;
+    gsize written = 0;
+    static const guint8 request[] = { 0x01, 0x02, 0x03 };
+
+    channel_pair_new (&proxy, &client);
+
+    /* The proxy moves the tail of the client to proxy ring ahead of the head,
+     * which is at offset 64 of the first ring header */
+    _mbim_shm_channel_get_fds (proxy, &memfd, &local_fd, &remote_fd);
+    map = mmap (NULL, 128, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    g_assert (map != MAP_FAILED);
+    tail = (gint *)(map + 64);
+    g_atomic_int_set (tail, 1000);
+
+    g_assert (!_mbim_shm_channel_write (client, request, sizeof (request), &written, &error));
+    g_assert_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED);
+    g_assert_cmpuint (written, ==, 0);
+    g_clear_error (&error);
+
+    /* The channel stays broken even if the counters are fixed */
+    g_atomic_int_set (tail, 0);
+    g_assert (!_mbim_shm_channel_write (client, request, sizeof (request), &written, &error));
+    g_assert_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED);
+    g_clear_error (&error);
+
+    munmap (map, 128);
+    _mbim_shm_channel_free (client);
+    _mbim_shm_channel_free (proxy);
+#else
+    g_test_skip ("memfd not supported");
+#endif
+}
+
+/*****************************************************************************/
+
+int main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/libmbim-glib/shm-channel/roundtrip", test_roundtrip);
+    g_test_add_func ("/libmbim-glib/shm-channel/full-ring", test_full_ring);
+    g_test_add_func ("/libmbim-glib/shm-channel/proxy-handoff", test_proxy_handoff);
+    g_test_add_func ("/libmbim-glib/shm-channel/corrupted-ring", test_corrupted_ring);
+
+    return g_test_run ();
+}
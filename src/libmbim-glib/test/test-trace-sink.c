@@ -0,0 +1,235 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <config.h>
+
+#include "mbim-utils.h"
+
+/*****************************************************************************/
+
+typedef struct {
+    GPtrArray *records;
+    /* Set to block the sink in the first record */
+    gboolean   block;
+    gint       blocked;
+    gint       released;
+} TestContext;
+
+static void
+trace_sink_func (gint64          timestamp,
+                 GLogLevelFlags  log_level,
+                 const gchar    *message,
+                 gpointer        user_data)
+{
+    TestContext *ctx = user_data;
+
+    g_assert_cmpint (timestamp, >, 0);
+
+    if (ctx->block && !g_atomic_int_get (&ctx->blocked)) {
+        g_atomic_int_set (&ctx->blocked, TRUE);
+        while (!g_atomic_int_get (&ctx->released))
+            g_usleep (1000);
+    }
+
+    g_ptr_array_add (ctx->records,
+                     g_strdup_printf ("%s%s",
+                                      log_level == G_LOG_LEVEL_WARNING ? "W " : "",
+                                      message));
+}
+
+static void
+test_order (void)
+{
+    TestContext  ctx = { 0 };
+    guint        i;
+
+    ctx.records = g_ptr_array_new_with_free_func (g_free);
+
+    g_assert (!mbim_utils_trace_sink_push (G_LOG_LEVEL_DEBUG, "not running"));
+
+    g_assert (mbim_utils_trace_sink_start (256, trace_sink_func, &ctx));
+    g_assert (!mbim_utils_trace_sink_start (256, trace_sink_func, &ctx));
+
+    for (i = 0; i < 100; i++) {
+        g_autofree gchar *message = NULL;
+
+        message = g_strdup_printf ("record %u", i);
+        g_assert (mbim_utils_trace_sink_push (G_LOG_LEVEL_DEBUG, message));
+    }
+
+    /* Stopping writes all pending records */
+    mbim_utils_trace_sink_stop ();
+    g_assert (!mbim_utils_trace_sink_push (G_LOG_LEVEL_DEBUG, "stopped"));
+
+    g_assert_cmpuint (ctx.records->len, ==, 100);
+    for (i = 0; i < 100; i++) {
+        g_autofree gchar *expected = NULL;
+
+        expected = g_strdup_printf ("record %u", i);
+        g_assert_cmpstr (g_ptr_array_index (ctx.records, i), ==, expected);
+    }
+
+    g_ptr_array_unref (ctx.records);
+}
+
+static void
+test_raw (void)
+{
+    static const guint8 buffer [] = { 0x00, 0xDE, 0xAD, 0xC0, 0xDE };
+    TestContext         ctx = { 0 };
+
+    ctx.records = g_ptr_array_new_with_free_func (g_free);
+
+    g_assert (!mbim_utils_trace_sink_push_raw (G_LOG_LEVEL_DEBUG, "data = ", buffer, sizeof (buffer), G_MAXSIZE));
+
+    g_assert (mbim_utils_trace_sink_start (16, trace_sink_func, &ctx));
+    g_assert (mbim_utils_trace_sink_push_raw (G_LOG_LEVEL_DEBUG, "data = ", buffer, sizeof (buffer), G_MAXSIZE));
+    g_assert (mbim_utils_trace_sink_push_raw (G_LOG_LEVEL_DEBUG, "data = ", buffer, sizeof (buffer), 2));
+    g_assert (mbim_utils_trace_sink_push_raw (G_LOG_LEVEL_DEBUG, "data = ", buffer, 0, 2));
+    mbim_utils_trace_sink_stop ();
+
+    g_assert_cmpuint (ctx.records->len, ==, 3);
+    g_assert_cmpstr (g_ptr_array_index (ctx.records, 0), ==, "data = 00:DE:AD:C0:DE\n");
+    g_assert_cmpstr (g_ptr_array_index (ctx.records, 1), ==, "data = 00:DE...\n");
+    g_assert_cmpstr (g_ptr_array_index (ctx.records, 2), ==, "data = \n");
+
+    g_ptr_array_unref (ctx.records);
+}
+
+static void
+test_dropped (void)
+{
+    TestContext ctx = { 0 };
+    guint       dropped;
+    guint       i;
+
+    ctx.records = g_ptr_array_new_with_free_func (g_free);
+    ctx.block = TRUE;
+    dropped = mbim_utils_trace_sink_get_dropped ();
+
+    g_assert (mbim_utils_trace_sink_start (4, trace_sink_func, &ctx));
+
+    /* Wait until the sink is blocked writing the first record */
+    g_assert (mbim_utils_trace_sink_push (G_LOG_LEVEL_DEBUG, "first"));
+    while (!g_atomic_int_get (&ctx.blocked))
+        g_usleep (1000);
+
+    /* Fill the queue, and then some; pushing never blocks */
+    for (i = 0; i < 7; i++) {
+        g_autofree gchar *message = NULL;
+
+        message = g_strdup_printf ("record %u", i);
+        g_assert (mbim_utils_trace_sink_push (G_LOG_LEVEL_DEBUG, message));
+    }
+    g_assert_cmpuint (mbim_utils_trace_sink_get_dropped () - dropped, ==, 3);
+
+    g_atomic_int_set (&ctx.released, TRUE);
+    mbim_utils_trace_sink_stop ();
+
+    g_assert_cmpuint (ctx.records->len, ==, 6);
+    g_assert_cmpstr (g_ptr_array_index (ctx.records, 0), ==, "first");
+    for (i = 0; i < 4; i++) {
+        g_autofree gchar *expected = NULL;
+
+        expected = g_strdup_printf ("record %u", i);
+        g_assert_cmpstr (g_ptr_array_index (ctx.records, i + 1), ==, expected);
+    }
+    g_assert_cmpstr (g_ptr_array_index (ctx.records, 5), ==, "W 3 trace records dropped");
+
+    g_ptr_array_unref (ctx.records);
+}
+
+#define CONCURRENT_PRODUCERS 4
+#define CONCURRENT_RECORDS   1000
+
+static gint concurrent_accepted;
+
+static gpointer
+concurrent_producer (gpointer user_data)
+{
+    guint i;
+
+    for (i = 0; i < CONCURRENT_RECORDS; i++) {
+        if (mbim_utils_trace_sink_push (G_LOG_LEVEL_DEBUG, "record"))
+            g_atomic_int_inc (&concurrent_accepted);
+    }
+    return NULL;
+}
+
+static void
+test_concurrent_stop (void)
+{
+    TestContext  ctx = { 0 };
+    GThread     *threads[CONCURRENT_PRODUCERS];
+    guint        i;
+
+    ctx.records = g_ptr_array_new_with_free_func (g_free);
+    concurrent_accepted = 0;
+
+    g_assert (mbim_utils_trace_sink_start (CONCURRENT_PRODUCERS * CONCURRENT_RECORDS, trace_sink_func, &ctx));
+    for (i = 0; i < CONCURRENT_PRODUCERS; i++)
+        threads[i] = g_thread_new ("producer", concurrent_producer, NULL);
+
+    /* Stopping while producers are queueing writes every accepted record */
+    mbim_utils_trace_sink_stop ();
+    for (i = 0; i < CONCURRENT_PRODUCERS; i++)
+        g_thread_join (threads[i]);
+    g_assert_cmpuint (ctx.records->len, ==, (guint) g_atomic_int_get (&concurrent_accepted));
+
+    /* Stopping again does nothing */
+    mbim_utils_trace_sink_stop ();
+
+    g_ptr_array_unref (ctx.records);
+}
+
+static gint concurrent_started;
+
+static gpointer
+concurrent_starter (TestContext *ctx)
+{
+    if (mbim_utils_trace_sink_start (16, trace_sink_func, ctx))
+        g_atomic_int_inc (&concurrent_started);
+    return NULL;
+}
+
+static void
+test_concurrent_start (void)
+{
+    TestContext  ctx = { 0 };
+    GThread     *threads[CONCURRENT_PRODUCERS];
+    guint        i;
+
+    ctx.records = g_ptr_array_new_with_free_func (g_free);
+    concurrent_started = 0;
+
+    /* Only one of the sinks started at once is kept running */
+    for (i = 0; i < CONCURRENT_PRODUCERS; i++)
+        threads[i] = g_thread_new ("starter", (GThreadFunc) concurrent_starter, &ctx);
+    for (i = 0; i < CONCURRENT_PRODUCERS; i++)
+        g_thread_join (threads[i]);
+    g_assert_cmpint (g_atomic_int_get (&concurrent_started), ==, 1);
+
+    g_assert (mbim_utils_trace_sink_push (G_LOG_LEVEL_DEBUG, "record"));
+    mbim_utils_trace_sink_stop ();
+    g_assert (!mbim_utils_trace_sink_push (G_LOG_LEVEL_DEBUG, "record"));
+
+    g_assert_cmpuint (ctx.records->len, ==, 1);
+    g_assert_cmpstr (g_ptr_array_index (ctx.records, 0), ==, "record");
+
+    g_ptr_array_unref (ctx.records);
+}
+
+/*****************************************************************************/
+
+int main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/libmbim-glib/trace-sink/order", test_order);
+    g_test_add_func ("/libmbim-glib/trace-sink/raw", test_raw);
+    g_test_add_func ("/libmbim-glib/trace-sink/dropped", test_dropped);
+    g_test_add_func ("/libmbim-glib/trace-sink/concurrent-stop", test_concurrent_stop);
+    g_test_add_func ("/libmbim-glib/trace-sink/concurrent-start", test_concurrent_start);
+
+    return g_test_run ();
+}
@@ -0,0 +1,257 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#include <config.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include "mbim-uring-channel.h"
+#include "mbim-errors.h"
+#include "mbim-error-types.h"
+
+/*****************************************************************************/
+
+typedef struct {
+    GByteArray *received;
+    gboolean    eof;
+    gssize      status;
+} ReadContext;
+
+static gboolean
+read_cb (const guint8 *data,
+         gssize        length,
+         ReadContext  *ctx)
+{
+    if (length <= 0) {
+        ctx->eof = TRUE;
+        ctx->status = length;
+        return FALSE;
+    }
+    g_byte_array_append (ctx->received, data, length);
+    return TRUE;
+}
+
+static MbimUringChannel *
+channel_new (gint fds[2])
+{
+    MbimUringChannel *channel;
+    GError *error = NULL;
+
+    g_assert_cmpint (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds), ==, 0);
+    g_assert_cmpint (fcntl (fds[0], F_SETFL, O_NONBLOCK), ==, 0);
+
+    channel = _mbim_uring_channel_new (fds[0], 4096, &error);
+    if (!channel) {
+        /* e.g. io_uring disabled in the running kernel */
+        g_test_skip (error->message);
+        g_error_free (error);
+        close (fds[0]);
+        close (fds[1]);
+    }
+    return channel;
+}
+
+static void
+test_write_order (void)
+{
+    MbimUringChannel *channel;
+    GError *error = NULL;
+    gint fds[2];
+    guint8 buffer[64];
+    gsize total = 0;
+    guint i;
+
+    channel = channel_new (fds);
+    if (!channel)
+        return;
+
+    /* Queued writes are submitted as a single batch, and must arrive in
+     * the same order */
+    for (i = 0; i < 16; i++) {
+        guint8 value[4];
+
+        memset (value, i, sizeof (value));
+        _mbim_uring_channel_write (channel, value, sizeof (value));
+    }
+    g_assert (_mbim_uring_channel_flush (channel, 1000, &error));
+    g_assert_no_error (error);
+
+    while (total < sizeof (buffer)) {
+        gssize n;
+
+        n = read (fds[1], &buffer[total], sizeof (buffer) - total);
+        g_assert_cmpint (n, >, 0);
+        total += n;
+    }
+
+    for (i = 0; i < sizeof (buffer); i++)
+        g_assert_cmpuint (buffer[i], ==, i / 4);
+
+    _mbim_uring_channel_free (channel);
+    close (fds[0]);
+    close (fds[1]);
+}
+
+static void
+test_read (void)
+{
+    MbimUringChannel *channel;
+    GMainContext *context;
+    GSource *source;
+    ReadContext ctx = { 0 };
+    static const guint8 message[] = { 0x01, 0x02, 0x03, 0x04, 0x05 };
+    gint fds[2];
+    guint i;
+
+    channel = channel_new (fds);
+    if (!channel)
+        return;
+
+    context = g_main_context_new ();
+    ctx.received = g_byte_array_new ();
+    source = _mbim_uring_channel_create_source (channel);
+    g_source_set_callback (source, (GSourceFunc)read_cb, &ctx, NULL);
+    g_source_attach (source, context);
+
+    /* Several messages, read either at once or in multiple completions */
+    for (i = 0; i < 4; i++)
+        g_assert_cmpint (write (fds[1], message, sizeof (message)), ==, sizeof (message));
+    while (ctx.received->len < 4 * sizeof (message))
+        g_main_context_iteration (context, TRUE);
+
+    for (i = 0; i < 4; i++)
+        g_assert (memcmp (&ctx.received->data[i * sizeof (message)], message, sizeof (message)) == 0);
+
+    /* EOF removes the source */
+    close (fds[1]);
+    while (!ctx.eof)
+        g_main_context_iteration (context, TRUE);
+    g_assert (g_source_is_destroyed (source));
+
+    g_source_unref (source);
+    _mbim_uring_channel_free (channel);
+    g_main_context_unref (context);
+    g_byte_array_unref (ctx.received);
+    close (fds[0]);
+}
+
+static void
+test_write_error (void)
+{
+    MbimUringChannel *channel;
+    GMainContext *context;
+    GSource *source;
+    ReadContext ctx = { 0 };
+    GError *error = NULL;
+    static const guint8 message[] = { 0x01, 0x02, 0x03, 0x04, 0x05 };
+    gint fds[2];
+
+    channel = channel_new (fds);
+    if (!channel)
+        return;
+
+    /* Writes fail with EPIPE */
+    g_assert_cmpint (shutdown (fds[0], SHUT_WR), ==, 0);
+    _mbim_uring_channel_write (channel, message, sizeof (message));
+    g_assert (!_mbim_uring_channel_flush (channel, 1000, &error));
+    g_assert_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_FAILED);
+    g_clear_error (&error);
+
+    /* The failure is reported through the read callback */
+    context = g_main_context_new ();
+    ctx.received = g_byte_array_new ();
+    source = _mbim_uring_channel_create_source (channel);
+    g_source_set_callback (source, (GSourceFunc)read_cb, &ctx, NULL);
+    g_source_attach (source, context);
+    while (!ctx.eof)
+        g_main_context_iteration (context, TRUE);
+    g_assert_cmpint (ctx.status, <, 0);
+    g_assert (g_source_is_destroyed (source));
+
+    g_source_unref (source);
+    _mbim_uring_channel_free (channel);
+    g_main_context_unref (context);
+    g_byte_array_unref (ctx.received);
+    close (fds[0]);
+    close (fds[1]);
+}
+
+static void
+test_free_pending_writes (void)
+{
+    MbimUringChannel *channel;
+    GError *error = NULL;
+    GByteArray *received;
+    guint8 buffer[4096];
+    gsize filled = 0;
+    gint64 start;
+    gint fds[2];
+    guint i;
+
+    channel = channel_new (fds);
+    if (!channel)
+        return;
+
+    /* Nobody reads at the other end, so the writes can't complete */
+    memset (buffer, 0xff, sizeof (buffer));
+    for (;;) {
+        gssize n;
+
+        n = write (fds[0], buffer, sizeof (buffer));
+        if (n < 0)
+            break;
+        filled += n;
+    }
+
+    for (i = 0; i < 4; i++) {
+        memset (buffer, i, sizeof (buffer));
+        _mbim_uring_channel_write (channel, buffer, sizeof (buffer));
+    }
+    g_assert (!_mbim_uring_channel_flush (channel, 0, &error));
+    g_assert_error (error, MBIM_CORE_ERROR, MBIM_CORE_ERROR_TIMEOUT);
+    g_clear_error (&error);
+
+    /* The writes in flight are cancelled instead of waited for */
+    start = g_get_monotonic_time ();
+    _mbim_uring_channel_free (channel);
+    g_assert_cmpint (g_get_monotonic_time () - start, <, G_USEC_PER_SEC);
+    close (fds[0]);
+
+    /* Whatever was written is in order */
+    received = g_byte_array_new ();
+    for (;;) {
+        gssize n;
+
+        n = read (fds[1], buffer, sizeof (buffer));
+        if (n <= 0)
+            break;
+        g_byte_array_append (received, buffer, n);
+    }
+    g_assert_cmpuint (received->len, >=, filled);
+    g_assert_cmpuint (received->len, <=, filled + 4 * sizeof (buffer));
+    for (i = filled; i < received->len; i++)
+        g_assert_cmpuint (received->data[i], ==, (i - filled) / sizeof (buffer));
+
+    g_byte_array_unref (received);
+    close (fds[1]);
+}
+
+/*****************************************************************************/
+
+int main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    /* Writes to a shut down socket must fail instead of killing us */
+    signal (SIGPIPE, SIG_IGN);
+
+    g_test_add_func ("/libmbim-glib/uring-channel/write-order", test_write_order);
+    g_test_add_func ("/libmbim-glib/uring-channel/read", test_read);
+    g_test_add_func ("/libmbim-glib/uring-channel/write-error", test_write_error);
+    g_test_add_func ("/libmbim-glib/uring-channel/free-pending-writes", test_free_pending_writes);
+
+    return g_test_run ();
+}
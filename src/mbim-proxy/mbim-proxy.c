@@ -13,6 +13,8 @@
 #include <stdlib.h>
 #include <locale.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include <glib.h>
 #include <glib/gprintf.h>
@@ -26,6 +28,9 @@
 
 #define EMPTY_TIMEOUT_DEFAULT 300
 
+/* First file descriptor passed by socket activation, see sd_listen_fds(3) */
+#define LISTEN_FDS_START 3
+
 /* Globals */
 static GMainLoop *loop;
 static MbimProxy *proxy;
@@ -38,6 +43,14 @@ static gboolean verbose_full_flag;
 static gboolean version_flag;
 static gboolean no_exit_flag;
 static gint     empty_timeout = -1;
+static gboolean device_threads_flag;
+static gboolean handoff_flag;
+static gint     ready_fd = -1;
+static gchar   *capture_path;
+static gint64   capture_max_size;
+static gint     capture_max_files = 5;
+static gint     trace_queue_size = 4096;
+static gint64   client_memory_limit;
 
 static GOptionEntry main_entries[] = {
     { "no-exit", 0, 0, G_OPTION_ARG_NONE, &no_exit_flag,
@@ -48,6 +61,38 @@ static GOptionEntry main_entries[] = {
       "If no clients/devices, exit after this timeout. If set to 0, equivalent to --no-exit.",
       "[SECS]"
     },
+    { "device-threads", 0, 0, G_OPTION_ARG_NONE, &device_threads_flag,
+      "Handle each device and its clients in a separate thread",
+      NULL
+    },
+    { "handoff", 0, 0, G_OPTION_ARG_NONE, &handoff_flag,
+      "Take over the devices and clients of a running proxy, if any, and allow being taken over",
+      NULL
+    },
+    { "capture", 0, 0, G_OPTION_ARG_FILENAME, &capture_path,
+      "Capture the control traffic of all devices into a pcapng file",
+      "[PATH]"
+    },
+    { "capture-max-size", 0, 0, G_OPTION_ARG_INT64, &capture_max_size,
+      "Rotate the capture file once it reaches this size. If set to 0, never rotate it (default).",
+      "[BYTES]"
+    },
+    { "capture-max-files", 0, 0, G_OPTION_ARG_INT, &capture_max_files,
+      "Maximum number of capture files kept when rotating (default: 5)",
+      "[N]"
+    },
+    { "client-memory-limit", 0, 0, G_OPTION_ARG_INT64, &client_memory_limit,
+      "Maximum memory used on behalf of each client, rejecting requests and discarding indications if exceeded. If set to 0, unlimited (default).",
+      "[BYTES]"
+    },
+    { "trace-queue-size", 0, 0, G_OPTION_ARG_INT, &trace_queue_size,
+      "Maximum number of verbose log records waiting to be written, dropping new ones if exceeded. If set to 0, write them synchronously (default: 4096).",
+      "[N]"
+    },
+    { "ready-fd", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_INT, &ready_fd,
+      "Notify readiness by writing to this file descriptor once the socket is listening",
+      "[FD]"
+    },
     { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose_flag,
       "Run action with verbose logs, including the debug ones",
       NULL
@@ -75,10 +120,9 @@ quit_cb (gpointer user_data)
 }
 
 static void
-log_handler (const gchar    *log_domain,
-             GLogLevelFlags  log_level,
-             const gchar    *message,
-             gpointer        user_data)
+log_print (gint64          timestamp,
+           GLogLevelFlags  log_level,
+           const gchar    *message)
 {
     const gchar *log_level_str;
     time_t       now;
@@ -114,10 +158,7 @@ log_handler (const gchar    *log_domain,
         g_assert_not_reached ();
     }
 
-    if (!verbose_flag && !verbose_full_flag && !err)
-        return;
-
-    now = time ((time_t *) NULL);
+    now = (time_t) (timestamp / G_USEC_PER_SEC);
     local_time = localtime (&now);
     strftime (time_str, 64, "%d %b %Y, %H:%M:%S", local_time);
 
@@ -128,6 +169,35 @@ log_handler (const gchar    *log_domain,
                message);
 }
 
+static void
+trace_sink_func (gint64          timestamp,
+                 GLogLevelFlags  log_level,
+                 const gchar    *message,
+                 gpointer        user_data)
+{
+    log_print (timestamp, log_level, message);
+}
+
+static void
+log_handler (const gchar    *log_domain,
+             GLogLevelFlags  log_level,
+             const gchar    *message,
+             gpointer        user_data)
+{
+    gboolean err;
+
+    err = !!(log_level & (G_LOG_LEVEL_WARNING | G_LOG_LEVEL_CRITICAL | G_LOG_LEVEL_ERROR | G_LOG_FLAG_FATAL));
+    if (!verbose_flag && !verbose_full_flag && !err)
+        return;
+
+    /* Warnings and errors are printed right away, everything else goes
+     * through the trace sink thread if running */
+    if (!err && mbim_utils_trace_sink_push (log_level, message))
+        return;
+
+    log_print (g_get_real_time (), log_level, message);
+}
+
 G_GNUC_NORETURN
 static void
 print_version_and_exit (void)
@@ -198,12 +268,73 @@ proxy_n_devices_changed (MbimProxy *_proxy)
     }
 }
 
+static void
+proxy_handed_off (MbimProxy *_proxy)
+{
+    g_debug ("proxy handed off, exiting...");
+
+    /* Devices and clients are about to be released, which doesn't mean the
+     * proxy is unused */
+    g_signal_handlers_disconnect_by_func (proxy, proxy_n_clients_changed, NULL);
+    g_signal_handlers_disconnect_by_func (proxy, proxy_n_devices_changed, NULL);
+    if (timeout_id) {
+        g_source_remove (timeout_id);
+        timeout_id = 0;
+    }
+
+    if (loop)
+        g_main_loop_quit (loop);
+}
+
+/*****************************************************************************/
+
+static gint
+get_listen_fd (void)
+{
+    const gchar *listen_pid;
+    const gchar *listen_fds;
+    gint         fd = -1;
+
+    /* Socket activation: a single already listening socket is expected */
+    listen_pid = g_getenv ("LISTEN_PID");
+    listen_fds = g_getenv ("LISTEN_FDS");
+    if (listen_pid && listen_fds &&
+        g_ascii_strtoll (listen_pid, NULL, 10) == (gint64) getpid ()) {
+        if (g_ascii_strtoll (listen_fds, NULL, 10) == 1)
+            fd = LISTEN_FDS_START;
+        else
+            g_warning ("unexpected number of sockets passed: %s", listen_fds);
+    }
+
+    /* Don't pass them to any child process */
+    g_unsetenv ("LISTEN_PID");
+    g_unsetenv ("LISTEN_FDS");
+    g_unsetenv ("LISTEN_FDNAMES");
+
+    return fd;
+}
+
+static void
+notify_ready (void)
+{
+    if (ready_fd < 0)
+        return;
+
+    /* A single byte is enough; the process spawning us only waits for the fd
+     * to become readable */
+    if (write (ready_fd, "1", 1) < 0)
+        g_debug ("couldn't notify readiness: %s", g_strerror (errno));
+    close (ready_fd);
+    ready_fd = -1;
+}
+
 /*****************************************************************************/
 
 int main (int argc, char **argv)
 {
     g_autoptr(GError)         error = NULL;
     g_autoptr(GOptionContext) context = NULL;
+    gint                      listen_fd;
 
     setlocale (LC_ALL, "");
 
@@ -231,6 +362,13 @@ int main (int argc, char **argv)
         mbim_utils_set_show_personal_info (TRUE);
     }
 
+    /* Write logs from a separate thread so that a slow output never blocks
+     * the proxy; the sink is also flushed when exiting early on errors */
+    if ((verbose_flag || verbose_full_flag) &&
+        trace_queue_size > 0 &&
+        mbim_utils_trace_sink_start ((guint) trace_queue_size, trace_sink_func, NULL))
+        atexit (mbim_utils_trace_sink_stop);
+
     /* Setup signals */
     g_unix_signal_add (SIGINT,  quit_cb, NULL);
     g_unix_signal_add (SIGHUP,  quit_cb, NULL);
@@ -240,13 +378,70 @@ int main (int argc, char **argv)
     if (empty_timeout < 0)
         empty_timeout = EMPTY_TIMEOUT_DEFAULT;
 
+    if (handoff_flag && device_threads_flag) {
+        g_printerr ("error: cannot specify --handoff and --device-threads at the same time\n");
+        exit (EXIT_FAILURE);
+    }
+
     /* Setup proxy */
-    proxy = mbim_proxy_new (&error);
+    listen_fd = get_listen_fd ();
+    if (handoff_flag) {
+        proxy = mbim_proxy_new_from_handoff (&error);
+        if (proxy) {
+            /* The listening socket comes from the previous proxy */
+            if (listen_fd >= 0)
+                close (listen_fd);
+        } else if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_REFUSED)) {
+            g_debug ("no running proxy to take over");
+            g_clear_error (&error);
+        } else {
+            g_printerr ("error: couldn't take over running proxy: %s\n", error->message);
+            exit (EXIT_FAILURE);
+        }
+    }
+    if (!proxy) {
+        if (listen_fd >= 0)
+            proxy = mbim_proxy_new_with_listen_fd (listen_fd, &error);
+        else
+            proxy = mbim_proxy_new (&error);
+    }
     if (!proxy) {
         g_printerr ("error: %s\n", error->message);
         exit (EXIT_FAILURE);
     }
 
+    if (handoff_flag) {
+        if (!mbim_proxy_enable_handoff (proxy, &error)) {
+            g_printerr ("error: couldn't enable handoff: %s\n", error->message);
+            exit (EXIT_FAILURE);
+        }
+        g_signal_connect (proxy,
+                          MBIM_PROXY_SIGNAL_HANDED_OFF,
+                          G_CALLBACK (proxy_handed_off),
+                          NULL);
+    }
+
+    if (device_threads_flag)
+        mbim_proxy_set_device_threads (proxy, TRUE);
+
+    if (client_memory_limit < 0) {
+        g_printerr ("error: invalid client memory limit\n");
+        exit (EXIT_FAILURE);
+    }
+    if (client_memory_limit > 0)
+        mbim_proxy_set_client_memory_limit (proxy, (guint64) client_memory_limit);
+
+    if (capture_path) {
+        if (capture_max_size < 0 || capture_max_files <= 0) {
+            g_printerr ("error: invalid capture limits\n");
+            exit (EXIT_FAILURE);
+        }
+        if (!mbim_proxy_start_capture (proxy, capture_path, (guint64) capture_max_size, (guint) capture_max_files, &error)) {
+            g_printerr ("error: couldn't start capture: %s\n", error->message);
+            exit (EXIT_FAILURE);
+        }
+    }
+
     /* Don't exit the proxy when no clients/devices are found */
     if (!no_exit_flag && empty_timeout != 0) {
         g_debug ("proxy will exit after %d secs if unused", empty_timeout);
@@ -262,6 +457,9 @@ int main (int argc, char **argv)
     } else
         g_debug ("proxy will remain running if unused");
 
+    /* Clients may connect right away */
+    notify_ready ();
+
     /* Loop */
     loop = g_main_loop_new (NULL, FALSE);
     g_main_loop_run (loop);
@@ -270,6 +468,8 @@ int main (int argc, char **argv)
     /* Cleanup; releases socket and such */
     g_object_unref (proxy);
 
+    mbim_utils_trace_sink_stop ();
+
     g_debug ("exiting 'mbim-proxy'...");
 
     return EXIT_SUCCESS;
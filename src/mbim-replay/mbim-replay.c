@@ -0,0 +1,278 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * mbim-replay -- Replay captured MBIM sessions against the library
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <locale.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gprintf.h>
+#include <gio/gio.h>
+
+#include "mbim-device.h"
+#include "mbim-replay.h"
+
+#define PROGRAM_NAME    "mbim-replay"
+#define PROGRAM_VERSION PACKAGE_VERSION
+
+#define COMMAND_TIMEOUT_DEFAULT 30
+
+/* Globals */
+static GMainLoop *loop;
+static guint      n_indications;
+
+/* Main options */
+static gdouble   speed = 1.0;
+static gboolean  fast_flag;
+static gint      interface_id;
+static gint      command_timeout = COMMAND_TIMEOUT_DEFAULT;
+static gint      iterations = 1;
+static gboolean  verbose_flag;
+static gboolean  version_flag;
+static gchar   **files;
+
+static GOptionEntry main_entries[] = {
+    { "speed", 's', 0, G_OPTION_ARG_DOUBLE, &speed,
+      "Replay with the recorded timing scaled by this factor (default: 1.0, as recorded)",
+      "[FACTOR]"
+    },
+    { "fast", 'f', 0, G_OPTION_ARG_NONE, &fast_flag,
+      "Replay as fast as possible, ignoring the recorded timing",
+      NULL
+    },
+    { "interface", 'i', 0, G_OPTION_ARG_INT, &interface_id,
+      "Interface (device) to replay from a pcapng capture (default: 0)",
+      "[N]"
+    },
+    { "timeout", 't', 0, G_OPTION_ARG_INT, &command_timeout,
+      "Timeout for each replayed command (default: 30)",
+      "[SECS]"
+    },
+    { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+      "Number of times to replay the session (default: 1)",
+      "[N]"
+    },
+    { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose_flag,
+      "Run action with verbose logs, including the debug ones",
+      NULL
+    },
+    { "version", 'V', 0, G_OPTION_ARG_NONE, &version_flag,
+      "Print version",
+      NULL
+    },
+    { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &files,
+      NULL,
+      "[FILE]"
+    },
+    { NULL, 0, 0, 0, NULL, NULL, NULL }
+};
+
+static void
+log_handler (const gchar    *log_domain,
+             GLogLevelFlags  log_level,
+             const gchar    *message,
+             gpointer        user_data)
+{
+    const gchar *log_level_str;
+    gboolean     err = FALSE;
+
+    switch (log_level) {
+    case G_LOG_LEVEL_WARNING:
+        log_level_str = "-Warning **";
+        err = TRUE;
+        break;
+
+    case G_LOG_LEVEL_CRITICAL:
+    case G_LOG_FLAG_FATAL:
+    case G_LOG_LEVEL_ERROR:
+        log_level_str = "-Error **";
+        err = TRUE;
+        break;
+
+    case G_LOG_LEVEL_DEBUG:
+        log_level_str = "[Debug]";
+        break;
+
+    case G_LOG_LEVEL_MESSAGE:
+    case G_LOG_LEVEL_INFO:
+        log_level_str = "";
+        break;
+
+    case G_LOG_LEVEL_MASK:
+    case G_LOG_FLAG_RECURSION:
+    default:
+        g_assert_not_reached ();
+    }
+
+    if (!verbose_flag && !err)
+        return;
+
+    g_fprintf (err ? stderr : stdout,
+               "%s %s\n",
+               log_level_str,
+               message);
+}
+
+static void
+print_version_and_exit (void)
+{
+    g_print ("\n"
+             PROGRAM_NAME " " PROGRAM_VERSION "\n"
+             "Copyright (C) 2013-2021 Aleksander Morgado\n"
+             "License GPLv2+: GNU GPL version 2 or later <http://gnu.org/licenses/gpl-2.0.html>\n"
+             "This is free software: you are free to change and redistribute it.\n"
+             "There is NO WARRANTY, to the extent permitted by law.\n"
+             "\n");
+    exit (EXIT_SUCCESS);
+}
+
+/*****************************************************************************/
+
+typedef struct {
+    MbimReplay           *replay;
+    gboolean              success;
+    MbimReplayStatistics  statistics;
+} RunResult;
+
+static void
+device_indication_cb (MbimDevice  *device,
+                      MbimMessage *indication)
+{
+    n_indications++;
+}
+
+static void
+replay_ready (GObject      *source,
+              GAsyncResult *res,
+              RunResult    *result)
+{
+    g_autoptr(GError) error = NULL;
+
+    result->success = _mbim_replay_run_finish (result->replay, res, &result->statistics, &error);
+    if (!result->success)
+        g_printerr ("error: replay failed: %s\n", error->message);
+    g_main_loop_quit (loop);
+}
+
+static gboolean
+run (MbimReplay  *replay,
+     const gchar *path,
+     guint        iteration)
+{
+    g_autoptr(MbimDevice) device = NULL;
+    g_autoptr(GFile)      file = NULL;
+    MbimDeviceStatistics  device_statistics;
+    RunResult             result = { 0 };
+    gint64                start;
+    gint64                elapsed;
+
+    result.replay = replay;
+
+    /* The capture file stands in for the control port path */
+    file = g_file_new_for_path (path);
+    device = g_object_new (MBIM_TYPE_DEVICE,
+                           MBIM_DEVICE_FILE, file,
+                           NULL);
+    g_signal_connect (device,
+                      MBIM_DEVICE_SIGNAL_INDICATE_STATUS,
+                      G_CALLBACK (device_indication_cb),
+                      NULL);
+
+    n_indications = 0;
+    start = g_get_monotonic_time ();
+    _mbim_replay_run (replay,
+                      device,
+                      fast_flag ? 0.0 : speed,
+                      (guint) command_timeout,
+                      NULL,
+                      (GAsyncReadyCallback)replay_ready,
+                      &result);
+    g_main_loop_run (loop);
+    elapsed = g_get_monotonic_time () - start;
+
+    if (!result.success)
+        return FALSE;
+
+    mbim_device_get_statistics (device, &device_statistics, NULL);
+
+    g_print ("[%u] replayed %u messages in %.3f ms (%.0f msg/s)\n"
+             "\tcommands:    %u (%u responses, %u errors)\n"
+             "\tindications: %u sent, %u received\n"
+             "\tskipped:     %u\n"
+             "\tdevice:      %" G_GUINT64_FORMAT " bytes in, %" G_GUINT64_FORMAT " messages in, "
+             "%" G_GUINT64_FORMAT " reassemblies, %" G_GUINT64_FORMAT " validation failures\n",
+             iteration,
+             _mbim_replay_get_n_messages (replay),
+             elapsed / 1000.0,
+             _mbim_replay_get_n_messages (replay) / MAX (elapsed / (gdouble) G_USEC_PER_SEC, 1e-6),
+             result.statistics.n_commands,
+             result.statistics.n_responses,
+             result.statistics.n_errors,
+             result.statistics.n_indications,
+             n_indications,
+             result.statistics.n_skipped,
+             device_statistics.bytes_in,
+             device_statistics.messages_in,
+             device_statistics.reassemblies,
+             device_statistics.validation_failures);
+    return TRUE;
+}
+
+int main (int argc, char **argv)
+{
+    g_autoptr(GError)         error = NULL;
+    g_autoptr(GOptionContext) context = NULL;
+    g_autoptr(MbimReplay)     replay = NULL;
+    gint                      i;
+
+    setlocale (LC_ALL, "");
+
+    /* Setup option context, process it and destroy it */
+    context = g_option_context_new ("- Replay captured MBIM sessions");
+    g_option_context_add_main_entries (context, main_entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("error: %s\n", error->message);
+        exit (EXIT_FAILURE);
+    }
+
+    if (version_flag)
+        print_version_and_exit ();
+
+    g_log_set_handler (NULL, G_LOG_LEVEL_MASK, log_handler, NULL);
+    g_log_set_handler ("Mbim", G_LOG_LEVEL_MASK, log_handler, NULL);
+
+    if (!files || !files[0] || files[1]) {
+        g_printerr ("error: a single capture file must be given\n");
+        exit (EXIT_FAILURE);
+    }
+
+    if (speed < 0 || interface_id < 0 || command_timeout <= 0 || iterations <= 0) {
+        g_printerr ("error: invalid arguments\n");
+        exit (EXIT_FAILURE);
+    }
+
+    replay = _mbim_replay_new_from_file (files[0], (guint) interface_id, &error);
+    if (!replay) {
+        g_printerr ("error: couldn't load capture: %s\n", error->message);
+        exit (EXIT_FAILURE);
+    }
+
+    g_print ("loaded %u messages spanning %.3f s\n",
+             _mbim_replay_get_n_messages (replay),
+             _mbim_replay_get_duration (replay) / (gdouble) G_USEC_PER_SEC);
+
+    loop = g_main_loop_new (NULL, FALSE);
+    for (i = 0; i < iterations; i++) {
+        if (!run (replay, files[0], (guint) i))
+            exit (EXIT_FAILURE);
+    }
+    g_main_loop_unref (loop);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,498 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * End-to-end benchmark of the proxy: an in-process MbimProxy, running in its
+ * own thread, serves a simulated modem (mbim-sim) to several MbimDevice
+ * clients in proxy mode, each one keeping a fixed number of commands in
+ * flight. The results are reported in JSON.
+ *
+ * The benchmark runs in its own network namespace, so that the abstract proxy
+ * socket is private and doesn't clash with a system-wide mbim-proxy. Both
+ * creating the namespace and running the proxy require root privileges;
+ * otherwise the benchmark is skipped.
+ */
+
+#include "config.h"
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include <libmbim-glib.h>
+
+#define EXIT_SKIP 77
+
+#define COMMAND_TIMEOUT_SECS 10
+#define OPEN_TIMEOUT_SECS    30
+
+/* Main options */
+static gchar    *sim_path;
+static gint      n_clients = 4;
+static gint      n_commands = 1000;
+static gint      concurrency = 4;
+static gchar    *latency_str;
+static gint      indication_interval;
+static gint      indication_size = 1;
+static gboolean  shared_memory_flag;
+static gchar    *output_path;
+
+static GOptionEntry entries[] = {
+    { "sim", 0, 0, G_OPTION_ARG_FILENAME, &sim_path,
+      "Path to the mbim-sim program", "[PATH]"
+    },
+    { "clients", 'c', 0, G_OPTION_ARG_INT, &n_clients,
+      "Number of concurrent clients (default: 4)", "[N]"
+    },
+    { "commands", 'n', 0, G_OPTION_ARG_INT, &n_commands,
+      "Number of commands issued by each client (default: 1000)", "[N]"
+    },
+    { "concurrency", 'j', 0, G_OPTION_ARG_INT, &concurrency,
+      "Number of commands in flight in each client (default: 4)", "[N]"
+    },
+    { "latency", 0, 0, G_OPTION_ARG_STRING, &latency_str,
+      "Response latency of the simulated modem, as given to mbim-sim (default: fixed:0)", "[SPEC]"
+    },
+    { "indication-interval", 0, 0, G_OPTION_ARG_INT, &indication_interval,
+      "Interval between bursts of indications, in milliseconds (default: disabled)", "[MS]"
+    },
+    { "indication-size", 0, 0, G_OPTION_ARG_INT, &indication_size,
+      "Number of indications in each burst (default: 1)", "[N]"
+    },
+    { "shared-memory", 0, 0, G_OPTION_ARG_NONE, &shared_memory_flag,
+      "Exchange messages with the proxy over shared memory", NULL
+    },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output_path,
+      "Write the JSON results to the given file instead of stdout", "[PATH]"
+    },
+    { NULL, 0, 0, 0, NULL, NULL, NULL }
+};
+
+/*****************************************************************************/
+/* Proxy thread */
+
+typedef struct {
+    GMutex        mutex;
+    GCond         cond;
+    gboolean      ready;
+    GError       *error;
+    GMainContext *context;
+    GMainLoop    *loop;
+    gint64        cpu_time;
+} ProxyThread;
+
+static gint64
+thread_cpu_time (void)
+{
+    struct timespec ts;
+
+    if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+        return 0;
+    return ((gint64) ts.tv_sec * G_USEC_PER_SEC) + (ts.tv_nsec / 1000);
+}
+
+static gpointer
+proxy_thread_run (ProxyThread *thread)
+{
+    g_autoptr(MbimProxy) proxy = NULL;
+    GError              *error = NULL;
+
+    g_main_context_push_thread_default (thread->context);
+
+    proxy = mbim_proxy_new (&error);
+
+    g_mutex_lock (&thread->mutex);
+    thread->error = error;
+    thread->ready = TRUE;
+    g_cond_signal (&thread->cond);
+    g_mutex_unlock (&thread->mutex);
+
+    if (proxy) {
+        g_main_loop_run (thread->loop);
+        g_clear_object (&proxy);
+    }
+
+    thread->cpu_time = thread_cpu_time ();
+    g_main_context_pop_thread_default (thread->context);
+    return NULL;
+}
+
+/*****************************************************************************/
+/* Clients */
+
+typedef struct {
+    MbimDevice *device;
+    guint       sent;
+    guint       completed;
+    guint       indications;
+} Client;
+
+static GMainLoop *loop;
+static GArray    *latencies;
+static guint      n_errors;
+static guint      n_clients_done;
+static guint      n_clients_open;
+
+static void client_send (Client *client);
+
+typedef struct {
+    Client *client;
+    gint64  start;
+} Request;
+
+static void
+command_ready (MbimDevice   *device,
+               GAsyncResult *res,
+               Request      *request)
+{
+    g_autoptr(MbimMessage) response = NULL;
+    g_autoptr(GError)      error = NULL;
+    Client                *client;
+    gint64                 latency;
+
+    latency = g_get_monotonic_time () - request->start;
+    client = request->client;
+    g_slice_free (Request, request);
+
+    response = mbim_device_command_finish (device, res, &error);
+    if (!response || !mbim_message_response_get_result (response, MBIM_MESSAGE_TYPE_COMMAND_DONE, &error)) {
+        g_debug ("command failed: %s", error->message);
+        n_errors++;
+    } else
+        g_array_append_val (latencies, latency);
+
+    client->completed++;
+    if (client->completed == (guint) n_commands) {
+        if (++n_clients_done == (guint) n_clients)
+            g_main_loop_quit (loop);
+        return;
+    }
+    client_send (client);
+}
+
+static void
+client_send (Client *client)
+{
+    g_autoptr(MbimMessage) message = NULL;
+    Request               *request;
+
+    if (client->sent == (guint) n_commands)
+        return;
+
+    message = mbim_message_signal_state_query_new (NULL);
+    request = g_slice_new (Request);
+    request->client = client;
+    request->start = g_get_monotonic_time ();
+    client->sent++;
+    mbim_device_command (client->device,
+                         message,
+                         COMMAND_TIMEOUT_SECS,
+                         NULL,
+                         (GAsyncReadyCallback)command_ready,
+                         request);
+}
+
+static void
+client_indication_cb (MbimDevice  *device,
+                      MbimMessage *indication,
+                      Client      *client)
+{
+    client->indications++;
+}
+
+static void
+client_open_ready (MbimDevice   *device,
+                   GAsyncResult *res,
+                   Client       *client)
+{
+    g_autoptr(GError) error = NULL;
+
+    if (!mbim_device_open_full_finish (device, res, &error))
+        g_error ("couldn't open device through the proxy: %s", error->message);
+
+    if (++n_clients_open == (guint) n_clients)
+        g_main_loop_quit (loop);
+}
+
+static void
+client_new_ready (GObject      *source,
+                  GAsyncResult *res,
+                  Client       *client)
+{
+    g_autoptr(GError) error = NULL;
+
+    client->device = mbim_device_new_finish (res, &error);
+    if (!client->device)
+        g_error ("couldn't create device: %s", error->message);
+
+    g_signal_connect (client->device,
+                      MBIM_DEVICE_SIGNAL_INDICATE_STATUS,
+                      G_CALLBACK (client_indication_cb),
+                      client);
+    mbim_device_open_full (client->device,
+                           MBIM_DEVICE_OPEN_FLAGS_PROXY |
+                           (shared_memory_flag ? MBIM_DEVICE_OPEN_FLAGS_PROXY_SHARED_MEMORY : 0),
+                           OPEN_TIMEOUT_SECS,
+                           NULL,
+                           (GAsyncReadyCallback)client_open_ready,
+                           client);
+}
+
+/*****************************************************************************/
+
+static gint
+compare_latency (gconstpointer a,
+                 gconstpointer b)
+{
+    gint64 la = *(const gint64 *)a;
+    gint64 lb = *(const gint64 *)b;
+
+    return (la > lb) - (la < lb);
+}
+
+static gint64
+percentile (gdouble p)
+{
+    guint i;
+
+    if (!latencies->len)
+        return 0;
+    i = (guint) (p * (latencies->len - 1) + 0.5);
+    return g_array_index (latencies, gint64, i);
+}
+
+/* Resident set size and its peak, in kB */
+static void
+read_rss (guint64 *rss,
+          guint64 *rss_peak)
+{
+    g_autofree gchar  *contents = NULL;
+    g_auto(GStrv)      lines = NULL;
+    guint              i;
+
+    *rss = 0;
+    *rss_peak = 0;
+    if (!g_file_get_contents ("/proc/self/status", &contents, NULL, NULL))
+        return;
+
+    lines = g_strsplit (contents, "\n", -1);
+    for (i = 0; lines[i]; i++) {
+        if (g_str_has_prefix (lines[i], "VmRSS:"))
+            *rss = g_ascii_strtoull (lines[i] + strlen ("VmRSS:"), NULL, 10);
+        else if (g_str_has_prefix (lines[i], "VmHWM:"))
+            *rss_peak = g_ascii_strtoull (lines[i] + strlen ("VmHWM:"), NULL, 10);
+    }
+}
+
+static GSubprocess *
+sim_start (const gchar  *port_path,
+           GError      **error)
+{
+    g_autoptr(GPtrArray)        argv = NULL;
+    g_autoptr(GSubprocess)      sim = NULL;
+    g_autoptr(GDataInputStream) stream = NULL;
+    g_autofree gchar           *line = NULL;
+    g_autofree gchar           *interval = NULL;
+    g_autofree gchar           *size = NULL;
+
+    argv = g_ptr_array_new ();
+    g_ptr_array_add (argv, sim_path);
+    g_ptr_array_add (argv, (gpointer) "--link");
+    g_ptr_array_add (argv, (gpointer) port_path);
+    if (latency_str) {
+        g_ptr_array_add (argv, (gpointer) "--latency");
+        g_ptr_array_add (argv, latency_str);
+    }
+    if (indication_interval > 0) {
+        interval = g_strdup_printf ("%d", indication_interval);
+        size = g_strdup_printf ("%d", indication_size);
+        g_ptr_array_add (argv, (gpointer) "--storm-interval");
+        g_ptr_array_add (argv, interval);
+        g_ptr_array_add (argv, (gpointer) "--storm-size");
+        g_ptr_array_add (argv, size);
+    }
+    g_ptr_array_add (argv, NULL);
+
+    sim = g_subprocess_newv ((const gchar * const *) argv->pdata, G_SUBPROCESS_FLAGS_STDOUT_PIPE, error);
+    if (!sim)
+        return NULL;
+
+    /* The simulator prints the port path once it's ready */
+    stream = g_data_input_stream_new (g_subprocess_get_stdout_pipe (sim));
+    line = g_data_input_stream_read_line (stream, NULL, NULL, error);
+    if (!line) {
+        if (error && !*error)
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "simulator exited");
+        g_subprocess_force_exit (sim);
+        return NULL;
+    }
+
+    return g_steal_pointer (&sim);
+}
+
+int main (int argc, char **argv)
+{
+    g_autoptr(GOptionContext) context = NULL;
+    g_autoptr(GError)         error = NULL;
+    g_autoptr(GSubprocess)    sim = NULL;
+    g_autoptr(GFile)          file = NULL;
+    g_autofree gchar         *dir = NULL;
+    g_autofree gchar         *port_path = NULL;
+    g_autoptr(GString)        json = NULL;
+    ProxyThread               proxy_thread = { 0 };
+    GThread                  *thread;
+    Client                   *clients;
+    guint64                   rss;
+    guint64                   rss_peak;
+    guint                     n_indications = 0;
+    gint64                    start;
+    gint64                    elapsed;
+    gint                      i;
+
+    context = g_option_context_new ("- benchmark the proxy end to end");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("error: %s\n", error->message);
+        return EXIT_FAILURE;
+    }
+
+    if (!sim_path || n_clients <= 0 || n_commands <= 0 || concurrency <= 0 ||
+        indication_interval < 0 || indication_size <= 0) {
+        g_printerr ("error: invalid arguments\n");
+        return EXIT_FAILURE;
+    }
+
+    if (unshare (CLONE_NEWNET) < 0) {
+        g_printerr ("skipped: couldn't create a private network namespace: %s\n", g_strerror (errno));
+        return EXIT_SKIP;
+    }
+
+    dir = g_dir_make_tmp ("bench-proxy-XXXXXX", &error);
+    if (!dir) {
+        g_printerr ("error: %s\n", error->message);
+        return EXIT_FAILURE;
+    }
+    port_path = g_build_filename (dir, "cdc-wdm0", NULL);
+
+    sim = sim_start (port_path, &error);
+    if (!sim) {
+        g_printerr ("error: couldn't start the simulator: %s\n", error->message);
+        return EXIT_FAILURE;
+    }
+
+    /* Proxy */
+    g_mutex_init (&proxy_thread.mutex);
+    g_cond_init (&proxy_thread.cond);
+    proxy_thread.context = g_main_context_new ();
+    proxy_thread.loop = g_main_loop_new (proxy_thread.context, FALSE);
+    thread = g_thread_new ("proxy", (GThreadFunc)proxy_thread_run, &proxy_thread);
+    g_mutex_lock (&proxy_thread.mutex);
+    while (!proxy_thread.ready)
+        g_cond_wait (&proxy_thread.cond, &proxy_thread.mutex);
+    g_mutex_unlock (&proxy_thread.mutex);
+    if (proxy_thread.error) {
+        g_printerr ("skipped: couldn't create proxy: %s\n", proxy_thread.error->message);
+        g_thread_join (thread);
+        g_subprocess_force_exit (sim);
+        return EXIT_SKIP;
+    }
+
+    /* Clients */
+    loop = g_main_loop_new (NULL, FALSE);
+    latencies = g_array_sized_new (FALSE, FALSE, sizeof (gint64), (guint) (n_clients * n_commands));
+    clients = g_new0 (Client, n_clients);
+    file = g_file_new_for_path (port_path);
+    for (i = 0; i < n_clients; i++)
+        mbim_device_new (file, NULL, (GAsyncReadyCallback)client_new_ready, &clients[i]);
+    g_main_loop_run (loop);
+
+    start = g_get_monotonic_time ();
+    for (i = 0; i < n_clients; i++) {
+        gint j;
+
+        for (j = 0; j < concurrency; j++)
+            client_send (&clients[i]);
+    }
+    g_main_loop_run (loop);
+    elapsed = g_get_monotonic_time () - start;
+
+    for (i = 0; i < n_clients; i++) {
+        n_indications += clients[i].indications;
+        g_object_unref (clients[i].device);
+    }
+    g_free (clients);
+
+    g_main_loop_quit (proxy_thread.loop);
+    g_thread_join (thread);
+    read_rss (&rss, &rss_peak);
+
+    g_subprocess_send_signal (sim, SIGTERM);
+    g_subprocess_wait (sim, NULL, NULL);
+    g_unlink (port_path);
+    g_rmdir (dir);
+
+    g_array_sort (latencies, compare_latency);
+    json = g_string_new (NULL);
+    g_string_append_printf (json,
+                            "{\n"
+                            "  \"version\": \"" PACKAGE_VERSION "\",\n"
+                            "  \"clients\": %d,\n"
+                            "  \"commands\": %d,\n"
+                            "  \"concurrency\": %d,\n"
+                            "  \"shared_memory\": %s,\n"
+                            "  \"requests\": %u,\n"
+                            "  \"errors\": %u,\n"
+                            "  \"indications\": %u,\n"
+                            "  \"elapsed_s\": %.3f,\n"
+                            "  \"requests_per_sec\": %.0f,\n"
+                            "  \"latency_us\": { \"p50\": %" G_GINT64_FORMAT ", \"p99\": %" G_GINT64_FORMAT ", "
+                            "\"p99.9\": %" G_GINT64_FORMAT ", \"max\": %" G_GINT64_FORMAT " },\n"
+                            "  \"proxy_cpu_s\": %.3f,\n"
+                            "  \"rss_kb\": %" G_GUINT64_FORMAT ",\n"
+                            "  \"rss_peak_kb\": %" G_GUINT64_FORMAT "\n"
+                            "}\n",
+                            n_clients,
+                            n_commands,
+                            concurrency,
+                            shared_memory_flag ? "true" : "false",
+                            latencies->len,
+                            n_errors,
+                            n_indications,
+                            elapsed / (gdouble) G_USEC_PER_SEC,
+                            latencies->len / MAX (elapsed / (gdouble) G_USEC_PER_SEC, 1e-6),
+                            percentile (0.50),
+                            percentile (0.99),
+                            percentile (0.999),
+                            percentile (1.0),
+                            proxy_thread.cpu_time / (gdouble) G_USEC_PER_SEC,
+                            rss,
+                            rss_peak);
+
+    g_array_unref (latencies);
+    g_main_loop_unref (loop);
+    g_main_loop_unref (proxy_thread.loop);
+    g_main_context_unref (proxy_thread.context);
+    g_clear_error (&proxy_thread.error);
+    g_mutex_clear (&proxy_thread.mutex);
+    g_cond_clear (&proxy_thread.cond);
+
+    if (output_path) {
+        if (!g_file_set_contents (output_path, json->str, json->len, &error)) {
+            g_printerr ("error: couldn't write results: %s\n", error->message);
+            return EXIT_FAILURE;
+        }
+    } else
+        g_print ("%s", json->str);
+
+    return (n_errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,837 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * mbim-sim -- Software MBIM modem simulator for load testing
+ */
+
+#include "config.h"
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <locale.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gprintf.h>
+#include <glib-unix.h>
+
+#include <libmbim-glib.h>
+
+#include "mbim-sim-responses.h"
+
+#define PROGRAM_NAME    "mbim-sim"
+#define PROGRAM_VERSION PACKAGE_VERSION
+
+#define MAX_CONTROL_TRANSFER_DEFAULT 4096
+#define MIN_CONTROL_TRANSFER         64
+
+/* Message header (12 bytes) plus fragment header (8 bytes) */
+#define FRAGMENT_HEADER_SIZE 20
+/* Fragment header plus service (16 bytes), CID (4 bytes) and command type
+ * (4 bytes) */
+#define COMMAND_HEADER_SIZE (FRAGMENT_HEADER_SIZE + 24)
+
+/* Maximum amount of data waiting for the host to read it; anything else
+ * sent meanwhile (e.g. indication storms) is discarded */
+#define MAX_OUTPUT_SIZE (1024 * 1024)
+
+/* Globals */
+static GMainLoop  *loop;
+static gint        master_fd = -1;
+static gint        slave_fd = -1;
+static GByteArray *input;
+static GByteArray *output;
+static guint       output_id;
+static gboolean    opened;
+static GRand      *rand_generator;
+
+/* First fragment of the command being received */
+static struct {
+    gboolean valid;
+    guint32  transaction_id;
+    MbimUuid service_id;
+    guint32  cid;
+    guint32  command_type;
+} pending_command;
+
+typedef enum {
+    LATENCY_FIXED,
+    LATENCY_UNIFORM,
+    LATENCY_EXPONENTIAL,
+} LatencyDistribution;
+
+static LatencyDistribution latency_distribution = LATENCY_FIXED;
+static gdouble             latency_a;
+static gdouble             latency_b;
+
+static struct {
+    guint64 commands;
+    guint64 responses;
+    guint64 dropped;
+    guint64 errors;
+    guint64 unsupported;
+    guint64 indications;
+    guint64 fragments;
+    guint64 overflows;
+} statistics;
+
+/* Main options */
+static gchar    *link_str;
+static gint      max_control_transfer = MAX_CONTROL_TRANSFER_DEFAULT;
+static gchar    *latency_str;
+static gdouble   drop_rate;
+static gdouble   error_rate;
+static gint      storm_interval;
+static gint      storm_size = 1;
+static gint      seed = -1;
+static gboolean  verbose_flag;
+static gboolean  version_flag;
+
+static GOptionEntry main_entries[] = {
+    { "link", 'l', 0, G_OPTION_ARG_FILENAME, &link_str,
+      "Create a symlink to the simulated control port at the given path, which may only replace another symlink",
+      "[PATH]"
+    },
+    { "max-control-transfer", 'm', 0, G_OPTION_ARG_INT, &max_control_transfer,
+      "Split messages in fragments of at most this size (default: 4096)",
+      "[BYTES]"
+    },
+    { "latency", 0, 0, G_OPTION_ARG_STRING, &latency_str,
+      "Response latency, in milliseconds (default: fixed:0)",
+      "[fixed:MS|uniform:MIN:MAX|exponential:MEAN]"
+    },
+    { "drop-rate", 0, 0, G_OPTION_ARG_DOUBLE, &drop_rate,
+      "Probability of not replying to a command (default: 0)",
+      "[0.0-1.0]"
+    },
+    { "error-rate", 0, 0, G_OPTION_ARG_DOUBLE, &error_rate,
+      "Probability of replying to a command with a function error (default: 0)",
+      "[0.0-1.0]"
+    },
+    { "storm-interval", 0, 0, G_OPTION_ARG_INT, &storm_interval,
+      "Send a burst of indications at this interval, in milliseconds (default: disabled)",
+      "[MS]"
+    },
+    { "storm-size", 0, 0, G_OPTION_ARG_INT, &storm_size,
+      "Number of indications in each burst (default: 1)",
+      "[N]"
+    },
+    { "seed", 0, 0, G_OPTION_ARG_INT, &seed,
+      "Seed for the random generator, for reproducible runs",
+      "[N]"
+    },
+    { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose_flag,
+      "Run action with verbose logs, including the debug ones",
+      NULL
+    },
+    { "version", 'V', 0, G_OPTION_ARG_NONE, &version_flag,
+      "Print version",
+      NULL
+    },
+    { NULL, 0, 0, 0, NULL, NULL, NULL }
+};
+
+static void
+log_handler (const gchar    *log_domain,
+             GLogLevelFlags  log_level,
+             const gchar    *message,
+             gpointer        user_data)
+{
+    const gchar *log_level_str;
+    gboolean     err = FALSE;
+
+    switch (log_level) {
+    case G_LOG_LEVEL_WARNING:
+        log_level_str = "-Warning **";
+        err = TRUE;
+        break;
+
+    case G_LOG_LEVEL_CRITICAL:
+    case G_LOG_FLAG_FATAL:
+    case G_LOG_LEVEL_ERROR:
+        log_level_str = "-Error **";
+        err = TRUE;
+        break;
+
+    case G_LOG_LEVEL_DEBUG:
+        log_level_str = "[Debug]";
+        break;
+
+    case G_LOG_LEVEL_MESSAGE:
+    case G_LOG_LEVEL_INFO:
+        log_level_str = "";
+        break;
+
+    case G_LOG_LEVEL_MASK:
+    case G_LOG_FLAG_RECURSION:
+    default:
+        g_assert_not_reached ();
+    }
+
+    if (!verbose_flag && !err)
+        return;
+
+    g_fprintf (err ? stderr : stdout,
+               "%s %s\n",
+               log_level_str,
+               message);
+}
+
+static void
+print_version_and_exit (void)
+{
+    g_print ("\n"
+             PROGRAM_NAME " " PROGRAM_VERSION "\n"
+             "Copyright (C) 2013-2021 Aleksander Morgado\n"
+             "License GPLv2+: GNU GPL version 2 or later <http://gnu.org/licenses/gpl-2.0.html>\n"
+             "This is free software: you are free to change and redistribute it.\n"
+             "There is NO WARRANTY, to the extent permitted by law.\n"
+             "\n");
+    exit (EXIT_SUCCESS);
+}
+
+/*****************************************************************************/
+/* Latency */
+
+static gboolean
+parse_latency (const gchar *str)
+{
+    g_auto(GStrv) split = NULL;
+    guint         n;
+    gchar        *end;
+
+    split = g_strsplit (str, ":", -1);
+    n = g_strv_length (split);
+    if (n < 2)
+        return FALSE;
+
+    errno = 0;
+    latency_a = g_ascii_strtod (split[1], &end);
+    if (errno || *end || latency_a < 0)
+        return FALSE;
+
+    if (g_str_equal (split[0], "fixed") && n == 2)
+        latency_distribution = LATENCY_FIXED;
+    else if (g_str_equal (split[0], "exponential") && n == 2)
+        latency_distribution = LATENCY_EXPONENTIAL;
+    else if (g_str_equal (split[0], "uniform") && n == 3) {
+        latency_distribution = LATENCY_UNIFORM;
+        latency_b = g_ascii_strtod (split[2], &end);
+        if (errno || *end || latency_b < latency_a)
+            return FALSE;
+    } else
+        return FALSE;
+
+    return TRUE;
+}
+
+static guint
+latency_sample (void)
+{
+    gdouble ms;
+
+    switch (latency_distribution) {
+    case LATENCY_UNIFORM:
+        ms = g_rand_double_range (rand_generator, latency_a, latency_b);
+        break;
+    case LATENCY_EXPONENTIAL:
+        /* Inverse transform sampling, avoiding log (0) */
+        ms = -latency_a * log (1.0 - g_rand_double (rand_generator));
+        break;
+    case LATENCY_FIXED:
+    default:
+        ms = latency_a;
+        break;
+    }
+
+    return (guint) (ms + 0.5);
+}
+
+/*****************************************************************************/
+/* Output */
+
+static gboolean output_ready (gint fd, GIOCondition condition, gpointer user_data);
+
+static void
+output_flush (void)
+{
+    while (output->len > 0) {
+        gssize written;
+
+        written = write (master_fd, output->data, output->len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                /* Wait until the host reads */
+                if (!output_id)
+                    output_id = g_unix_fd_add (master_fd, G_IO_OUT, output_ready, NULL);
+                return;
+            }
+            g_warning ("couldn't write to the control port: %s", g_strerror (errno));
+            g_byte_array_set_size (output, 0);
+            break;
+        }
+        g_byte_array_remove_range (output, 0, (guint) written);
+    }
+
+    if (output_id) {
+        g_source_remove (output_id);
+        output_id = 0;
+    }
+}
+
+static gboolean
+output_ready (gint          fd,
+              GIOCondition  condition,
+              gpointer      user_data)
+{
+    output_id = 0;
+    output_flush ();
+    return G_SOURCE_REMOVE;
+}
+
+/* Whether there is room for the given amount of data in the output buffer,
+ * counting the discarded data otherwise */
+static gboolean
+output_reserve (guint32 size)
+{
+    if (output->len + size <= MAX_OUTPUT_SIZE)
+        return TRUE;
+
+    g_debug ("discarding %u bytes: host not reading (%u bytes pending)", size, output->len);
+    statistics.overflows++;
+    return FALSE;
+}
+
+static void
+append_guint32 (GByteArray *array,
+                guint32     value)
+{
+    value = GUINT32_TO_LE (value);
+    g_byte_array_append (array, (const guint8 *)&value, 4);
+}
+
+/* Send the given body (everything after the fragment header), split in as
+ * many fragments as the max control transfer requires; returns FALSE if it
+ * had to be discarded */
+static gboolean
+send_fragmented (guint32       type,
+                 guint32       transaction_id,
+                 const guint8 *body,
+                 guint32       body_length)
+{
+    guint32 max_chunk;
+    guint32 total;
+    guint32 i;
+
+    max_chunk = (guint32) max_control_transfer - FRAGMENT_HEADER_SIZE;
+    total = MAX (1, (body_length + max_chunk - 1) / max_chunk);
+    if (!output_reserve (body_length + (total * FRAGMENT_HEADER_SIZE)))
+        return FALSE;
+
+    for (i = 0; i < total; i++) {
+        guint32 chunk;
+
+        chunk = MIN (max_chunk, body_length - (i * max_chunk));
+        append_guint32 (output, type);
+        append_guint32 (output, FRAGMENT_HEADER_SIZE + chunk);
+        append_guint32 (output, transaction_id);
+        append_guint32 (output, total);
+        append_guint32 (output, i);
+        g_byte_array_append (output, &body[i * max_chunk], chunk);
+    }
+    statistics.fragments += total;
+
+    output_flush ();
+    return TRUE;
+}
+
+static gboolean
+send_message (MbimMessage *message)
+{
+    const guint8 *raw;
+    guint32       raw_length;
+
+    raw = mbim_message_get_raw (message, &raw_length, NULL);
+    if (!output_reserve (raw_length))
+        return FALSE;
+    g_byte_array_append (output, raw, raw_length);
+    output_flush ();
+    return TRUE;
+}
+
+/*****************************************************************************/
+/* Responses */
+
+static const MbimSimResponse *
+lookup_response (MbimService service,
+                 guint32     cid)
+{
+    guint i;
+
+    for (i = 0; i < mbim_sim_responses_n; i++) {
+        if (mbim_sim_responses[i].service == service && mbim_sim_responses[i].cid == cid)
+            return &mbim_sim_responses[i];
+    }
+    return NULL;
+}
+
+typedef struct {
+    guint32     type;
+    guint32     transaction_id;
+    GByteArray *body;
+} Reply;
+
+static void
+reply_free (Reply *reply)
+{
+    g_byte_array_unref (reply->body);
+    g_slice_free (Reply, reply);
+}
+
+static void
+reply_send (Reply *reply)
+{
+    if (!opened) {
+        g_debug ("not sending reply to transaction %u: closed", reply->transaction_id);
+        return;
+    }
+
+    if (reply->type == MBIM_MESSAGE_TYPE_FUNCTION_ERROR) {
+        g_autoptr(MbimMessage) message = NULL;
+
+        message = mbim_message_function_error_new (reply->transaction_id, MBIM_PROTOCOL_ERROR_UNKNOWN);
+        if (send_message (message))
+            statistics.errors++;
+        return;
+    }
+
+    if (send_fragmented (reply->type, reply->transaction_id, reply->body->data, reply->body->len))
+        statistics.responses++;
+}
+
+static gboolean
+reply_timeout (Reply *reply)
+{
+    reply_send (reply);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+handle_command (guint32         transaction_id,
+                const MbimUuid *service_id,
+                guint32         cid,
+                guint32         command_type)
+{
+    const MbimSimResponse *entry;
+    Reply                 *reply;
+    MbimService            service;
+    guint32                status;
+    gdouble                r;
+    guint                  delay;
+
+    statistics.commands++;
+    service = mbim_uuid_to_service (service_id);
+
+    r = g_rand_double (rand_generator);
+    if (r < drop_rate) {
+        g_debug ("dropping command %s/%u (transaction %u)",
+                 mbim_service_get_string (service), cid, transaction_id);
+        statistics.dropped++;
+        return;
+    }
+
+    reply = g_slice_new0 (Reply);
+    reply->transaction_id = transaction_id;
+    reply->body = g_byte_array_new ();
+
+    if (r < drop_rate + error_rate)
+        reply->type = MBIM_MESSAGE_TYPE_FUNCTION_ERROR;
+    else {
+        reply->type = MBIM_MESSAGE_TYPE_COMMAND_DONE;
+        entry = lookup_response (service, cid);
+        /* Commands are only supported with the types the message allows */
+        if (entry &&
+            !(command_type == MBIM_MESSAGE_COMMAND_TYPE_SET ? entry->set :
+              command_type == MBIM_MESSAGE_COMMAND_TYPE_QUERY ? entry->query :
+              FALSE)) {
+            g_debug ("unsupported %s command type %u", entry->name, command_type);
+            entry = NULL;
+        }
+        if (!entry)
+            statistics.unsupported++;
+        status = entry ? MBIM_STATUS_ERROR_NONE : MBIM_STATUS_ERROR_NO_DEVICE_SUPPORT;
+
+        g_byte_array_append (reply->body, (const guint8 *)service_id, sizeof (MbimUuid));
+        append_guint32 (reply->body, cid);
+        append_guint32 (reply->body, status);
+        if (entry && entry->response) {
+            append_guint32 (reply->body, entry->response_size);
+            g_byte_array_append (reply->body, entry->response, entry->response_size);
+        } else
+            append_guint32 (reply->body, 0);
+    }
+
+    delay = latency_sample ();
+    if (!delay) {
+        reply_send (reply);
+        reply_free (reply);
+        return;
+    }
+
+    g_timeout_add_full (G_PRIORITY_DEFAULT,
+                        delay,
+                        (GSourceFunc)reply_timeout,
+                        reply,
+                        (GDestroyNotify)reply_free);
+}
+
+/*****************************************************************************/
+/* Indication storms */
+
+static gboolean
+storm_timeout (void)
+{
+    static guint          next;
+    g_autoptr(GByteArray) body = NULL;
+    gint                  i;
+
+    if (!opened)
+        return G_SOURCE_CONTINUE;
+
+    body = g_byte_array_new ();
+    for (i = 0; i < storm_size; i++) {
+        const MbimSimResponse *entry = NULL;
+        guint                  n;
+
+        /* Cycle through all messages with notifications */
+        for (n = 0; n < mbim_sim_responses_n; n++) {
+            entry = &mbim_sim_responses[next++ % mbim_sim_responses_n];
+            if (entry->notification)
+                break;
+        }
+        if (!entry || !entry->notification)
+            break;
+
+        g_byte_array_set_size (body, 0);
+        g_byte_array_append (body, (const guint8 *)mbim_uuid_from_service (entry->service), sizeof (MbimUuid));
+        append_guint32 (body, entry->cid);
+        append_guint32 (body, entry->notification_size);
+        g_byte_array_append (body, entry->notification, entry->notification_size);
+        if (send_fragmented (MBIM_MESSAGE_TYPE_INDICATE_STATUS, 0, body->data, body->len))
+            statistics.indications++;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/*****************************************************************************/
+/* Input */
+
+static void
+process_message (const guint8 *data,
+                 guint32       length)
+{
+    g_autoptr(MbimMessage) message = NULL;
+    g_autoptr(MbimMessage) reply = NULL;
+    guint32                total;
+    guint32                current;
+    guint32                cid;
+    guint32                command_type;
+
+    message = mbim_message_new (data, length);
+
+    switch ((guint) mbim_message_get_message_type (message)) {
+    case MBIM_MESSAGE_TYPE_OPEN:
+        g_debug ("open (transaction %u)", mbim_message_get_transaction_id (message));
+        opened = TRUE;
+        reply = mbim_message_open_done_new (mbim_message_get_transaction_id (message), MBIM_STATUS_ERROR_NONE);
+        send_message (reply);
+        return;
+
+    case MBIM_MESSAGE_TYPE_CLOSE:
+        g_debug ("close (transaction %u)", mbim_message_get_transaction_id (message));
+        opened = FALSE;
+        reply = mbim_message_close_done_new (mbim_message_get_transaction_id (message), MBIM_STATUS_ERROR_NONE);
+        send_message (reply);
+        return;
+
+    case MBIM_MESSAGE_TYPE_COMMAND:
+        if (!opened) {
+            reply = mbim_message_function_error_new (mbim_message_get_transaction_id (message), MBIM_PROTOCOL_ERROR_NOT_OPENED);
+            send_message (reply);
+            return;
+        }
+
+        if (length < FRAGMENT_HEADER_SIZE)
+            return;
+        memcpy (&total, &data[12], 4);
+        memcpy (&current, &data[16], 4);
+        total = GUINT32_FROM_LE (total);
+        current = GUINT32_FROM_LE (current);
+
+        /* The reply only depends on the service and CID in the first
+         * fragment, so just keep those and wait for the last one. The
+         * message getters can't be used here, as they require the full
+         * message. */
+        if (current == 0) {
+            pending_command.valid = FALSE;
+            if (length < COMMAND_HEADER_SIZE)
+                return;
+            memcpy (&pending_command.service_id, &data[FRAGMENT_HEADER_SIZE], sizeof (MbimUuid));
+            memcpy (&cid, &data[FRAGMENT_HEADER_SIZE + 16], 4);
+            pending_command.cid = GUINT32_FROM_LE (cid);
+            memcpy (&command_type, &data[FRAGMENT_HEADER_SIZE + 20], 4);
+            pending_command.command_type = GUINT32_FROM_LE (command_type);
+            pending_command.transaction_id = mbim_message_get_transaction_id (message);
+            pending_command.valid = TRUE;
+        } else if (pending_command.valid &&
+                   pending_command.transaction_id != mbim_message_get_transaction_id (message)) {
+            g_debug ("ignoring fragment of unexpected transaction %u (expected %u)",
+                     mbim_message_get_transaction_id (message), pending_command.transaction_id);
+            return;
+        }
+        if (pending_command.valid && current + 1 >= total) {
+            pending_command.valid = FALSE;
+            handle_command (pending_command.transaction_id,
+                            &pending_command.service_id,
+                            pending_command.cid,
+                            pending_command.command_type);
+        }
+        return;
+
+    default:
+        g_debug ("ignoring message of type %s", mbim_message_type_get_string (mbim_message_get_message_type (message)));
+        return;
+    }
+}
+
+static gboolean
+input_ready (gint          fd,
+             GIOCondition  condition,
+             gpointer      user_data)
+{
+    guint8 buffer[4096];
+    gssize n_read;
+
+    n_read = read (fd, buffer, sizeof (buffer));
+    if (n_read < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return G_SOURCE_CONTINUE;
+        g_warning ("couldn't read from the control port: %s", g_strerror (errno));
+        g_main_loop_quit (loop);
+        return G_SOURCE_REMOVE;
+    }
+    g_byte_array_append (input, buffer, (guint) n_read);
+
+    /* The pty is a byte stream, split it in messages */
+    while (input->len >= 12) {
+        guint32 length;
+
+        memcpy (&length, &input->data[4], 4);
+        length = GUINT32_FROM_LE (length);
+        if (length < 12) {
+            g_warning ("discarding invalid input: message length %u", length);
+            g_byte_array_set_size (input, 0);
+            break;
+        }
+        if (input->len < length)
+            break;
+
+        process_message (input->data, length);
+        g_byte_array_remove_range (input, 0, length);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/*****************************************************************************/
+
+/* Only symlinks are replaced or removed, as whatever else is found at the
+ * given path (e.g. a real control port) isn't ours */
+static gboolean
+link_remove (GError **error)
+{
+    struct stat st;
+
+    if (lstat (link_str, &st) < 0) {
+        if (errno == ENOENT)
+            return TRUE;
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't check '%s': %s", link_str, g_strerror (errno));
+        return FALSE;
+    }
+
+    if (!S_ISLNK (st.st_mode)) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                     "'%s' exists and is not a symlink", link_str);
+        return FALSE;
+    }
+
+    if (unlink (link_str) < 0 && errno != ENOENT) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't remove '%s': %s", link_str, g_strerror (errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+open_pty (GError **error)
+{
+    struct termios  tio;
+    const gchar    *slave_path;
+
+    master_fd = posix_openpt (O_RDWR | O_NOCTTY);
+    if (master_fd < 0 || grantpt (master_fd) < 0 || unlockpt (master_fd) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't create pty: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    slave_path = ptsname (master_fd);
+
+    /* Keep the slave open ourselves, so that the master doesn't see a hangup
+     * every time the host closes the control port */
+    slave_fd = open (slave_path, O_RDWR | O_NOCTTY);
+    if (slave_fd < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't open pty slave: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    /* MBIM messages are binary, no line discipline processing */
+    if (tcgetattr (slave_fd, &tio) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't get pty attributes: %s", g_strerror (errno));
+        return FALSE;
+    }
+    cfmakeraw (&tio);
+    if (tcsetattr (slave_fd, TCSANOW, &tio) < 0) {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                     "couldn't set pty attributes: %s", g_strerror (errno));
+        return FALSE;
+    }
+
+    if (!g_unix_set_fd_nonblocking (master_fd, TRUE, error))
+        return FALSE;
+
+    if (link_str) {
+        if (!link_remove (error)) {
+            g_prefix_error (error, "couldn't create link: ");
+            return FALSE;
+        }
+        if (symlink (slave_path, link_str) < 0) {
+            g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                         "couldn't create link: %s", g_strerror (errno));
+            return FALSE;
+        }
+    }
+
+    /* Let whoever started us know that the port is ready */
+    g_print ("%s\n", link_str ? link_str : slave_path);
+    fflush (stdout);
+    return TRUE;
+}
+
+static gboolean
+quit_cb (void)
+{
+    g_main_loop_quit (loop);
+    return G_SOURCE_REMOVE;
+}
+
+int main (int argc, char **argv)
+{
+    g_autoptr(GError)         error = NULL;
+    g_autoptr(GOptionContext) context = NULL;
+    guint                     storm_id = 0;
+
+    setlocale (LC_ALL, "");
+
+    /* Setup option context, process it and destroy it */
+    context = g_option_context_new ("- Simulate an MBIM modem");
+    g_option_context_add_main_entries (context, main_entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("error: %s\n", error->message);
+        exit (EXIT_FAILURE);
+    }
+
+    if (version_flag)
+        print_version_and_exit ();
+
+    g_log_set_handler (NULL, G_LOG_LEVEL_MASK, log_handler, NULL);
+    g_log_set_handler ("Mbim", G_LOG_LEVEL_MASK, log_handler, NULL);
+    if (verbose_flag)
+        mbim_utils_set_traces_enabled (TRUE);
+
+    if (max_control_transfer < MIN_CONTROL_TRANSFER || max_control_transfer > G_MAXUINT16 ||
+        drop_rate < 0 || error_rate < 0 || drop_rate + error_rate > 1.0 ||
+        storm_interval < 0 || storm_size <= 0) {
+        g_printerr ("error: invalid arguments\n");
+        exit (EXIT_FAILURE);
+    }
+
+    if (latency_str && !parse_latency (latency_str)) {
+        g_printerr ("error: invalid latency: '%s'\n", latency_str);
+        exit (EXIT_FAILURE);
+    }
+
+    rand_generator = (seed >= 0) ? g_rand_new_with_seed ((guint32) seed) : g_rand_new ();
+    input = g_byte_array_new ();
+    output = g_byte_array_new ();
+
+    if (!open_pty (&error)) {
+        g_printerr ("error: %s\n", error->message);
+        exit (EXIT_FAILURE);
+    }
+
+    loop = g_main_loop_new (NULL, FALSE);
+    g_unix_fd_add (master_fd, G_IO_IN, input_ready, NULL);
+    g_unix_signal_add (SIGINT, (GSourceFunc)quit_cb, NULL);
+    g_unix_signal_add (SIGTERM, (GSourceFunc)quit_cb, NULL);
+    if (storm_interval > 0)
+        storm_id = g_timeout_add ((guint) storm_interval, (GSourceFunc)storm_timeout, NULL);
+
+    g_main_loop_run (loop);
+
+    if (storm_id)
+        g_source_remove (storm_id);
+    g_main_loop_unref (loop);
+
+    g_print ("commands:    %" G_GUINT64_FORMAT " (%" G_GUINT64_FORMAT " unsupported)\n"
+             "responses:   %" G_GUINT64_FORMAT "\n"
+             "dropped:     %" G_GUINT64_FORMAT "\n"
+             "errors:      %" G_GUINT64_FORMAT "\n"
+             "indications: %" G_GUINT64_FORMAT "\n"
+             "fragments:   %" G_GUINT64_FORMAT "\n"
+             "overflows:   %" G_GUINT64_FORMAT "\n",
+             statistics.commands,
+             statistics.unsupported,
+             statistics.responses,
+             statistics.dropped,
+             statistics.errors,
+             statistics.indications,
+             statistics.fragments,
+             statistics.overflows);
+
+    if (link_str && !link_remove (&error))
+        g_warning ("%s", error->message);
+    g_byte_array_unref (input);
+    g_byte_array_unref (output);
+    g_rand_free (rand_generator);
+    close (slave_fd);
+    close (master_fd);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,256 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+/*
+ * End-to-end test of the simulator: mbimcli runs several commands against a
+ * simulated modem, and a MbimDevice checks that commands are only supported
+ * with the command types their messages allow. The --link option is also
+ * checked to never replace anything but a symlink.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include <libmbim-glib.h>
+
+#define TIMEOUT_SECS 10
+
+/* Main options */
+static gchar *sim_path;
+static gchar *mbimcli_path;
+
+static GOptionEntry entries[] = {
+    { "sim", 0, 0, G_OPTION_ARG_FILENAME, &sim_path,
+      "Path to the mbim-sim program", "[PATH]"
+    },
+    { "mbimcli", 0, 0, G_OPTION_ARG_FILENAME, &mbimcli_path,
+      "Path to the mbimcli program", "[PATH]"
+    },
+    { NULL, 0, 0, 0, NULL, NULL, NULL }
+};
+
+/* Commands run with mbimcli, one invocation each */
+static const gchar *mbimcli_commands[] = {
+    "--query-device-caps",
+    "--query-subscriber-ready-status",
+    "--query-radio-state",
+    "--set-radio-state=on",
+};
+
+/*****************************************************************************/
+
+static GSubprocess *
+sim_start (const gchar  *port_path,
+           GError      **error)
+{
+    g_autoptr(GSubprocess)      sim = NULL;
+    g_autoptr(GDataInputStream) stream = NULL;
+    g_autofree gchar           *line = NULL;
+
+    sim = g_subprocess_new (G_SUBPROCESS_FLAGS_STDOUT_PIPE, error,
+                            sim_path, "--link", port_path, NULL);
+    if (!sim)
+        return NULL;
+
+    /* The simulator prints the port path once it's ready */
+    stream = g_data_input_stream_new (g_subprocess_get_stdout_pipe (sim));
+    line = g_data_input_stream_read_line (stream, NULL, NULL, error);
+    if (!line) {
+        if (error && !*error)
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "simulator exited");
+        g_subprocess_force_exit (sim);
+        return NULL;
+    }
+
+    return g_steal_pointer (&sim);
+}
+
+/* Whatever is found at the link path must be left untouched unless it's a
+ * symlink */
+static gboolean
+check_link_not_replaced (const gchar  *port_path,
+                         GError      **error)
+{
+    g_autoptr(GSubprocess) sim = NULL;
+    g_autofree gchar      *contents = NULL;
+
+    if (!g_file_set_contents (port_path, "not a port", -1, error))
+        return FALSE;
+
+    sim = g_subprocess_new (G_SUBPROCESS_FLAGS_STDOUT_SILENCE | G_SUBPROCESS_FLAGS_STDERR_SILENCE, error,
+                            sim_path, "--link", port_path, NULL);
+    if (!sim || !g_subprocess_wait (sim, NULL, error))
+        return FALSE;
+
+    if (g_subprocess_get_successful (sim)) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "simulator replaced a regular file");
+        return FALSE;
+    }
+
+    if (!g_file_get_contents (port_path, &contents, NULL, error))
+        return FALSE;
+    if (!g_str_equal (contents, "not a port")) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "regular file modified");
+        return FALSE;
+    }
+
+    return (g_unlink (port_path) == 0);
+}
+
+static gboolean
+run_mbimcli (const gchar  *port_path,
+             const gchar  *command,
+             GError      **error)
+{
+    g_autoptr(GSubprocess) mbimcli = NULL;
+
+    mbimcli = g_subprocess_new (G_SUBPROCESS_FLAGS_STDOUT_SILENCE, error,
+                                mbimcli_path, "-d", port_path, command, NULL);
+    if (!mbimcli || !g_subprocess_wait_check (mbimcli, NULL, error)) {
+        g_prefix_error (error, "mbimcli %s failed: ", command);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+device_new_ready (GObject       *source,
+                  GAsyncResult  *res,
+                  GAsyncResult **out_res)
+{
+    *out_res = g_object_ref (res);
+}
+
+static MbimMessage *
+device_caps_command (MbimDevice              *device,
+                     MbimMessageCommandType   command_type,
+                     GError                 **error)
+{
+    g_autoptr(MbimMessage) request = NULL;
+    g_autoptr(MbimMessage) response = NULL;
+
+    request = mbim_message_command_new (0, MBIM_SERVICE_BASIC_CONNECT, MBIM_CID_BASIC_CONNECT_DEVICE_CAPS, command_type);
+    response = mbim_device_command_sync (device, request, TIMEOUT_SECS, NULL, error);
+    if (!response || !mbim_message_response_get_result (response, MBIM_MESSAGE_TYPE_COMMAND_DONE, error))
+        return NULL;
+    return g_steal_pointer (&response);
+}
+
+/* Device caps can be queried, but not set */
+static gboolean
+check_command_types (const gchar  *port_path,
+                     GError      **error)
+{
+    g_autoptr(GFile)        file = NULL;
+    g_autoptr(GAsyncResult) res = NULL;
+    g_autoptr(MbimDevice)   device = NULL;
+    g_autoptr(MbimMessage)  response = NULL;
+    g_autoptr(GError)       inner_error = NULL;
+
+    file = g_file_new_for_path (port_path);
+    mbim_device_new (file, NULL, (GAsyncReadyCallback)device_new_ready, &res);
+    while (!res)
+        g_main_context_iteration (NULL, TRUE);
+    device = mbim_device_new_finish (res, error);
+    if (!device || !mbim_device_open_sync (device, MBIM_DEVICE_OPEN_FLAGS_NONE, TIMEOUT_SECS, NULL, error))
+        return FALSE;
+
+    response = device_caps_command (device, MBIM_MESSAGE_COMMAND_TYPE_QUERY, error);
+    if (!response)
+        return FALSE;
+    g_clear_pointer (&response, mbim_message_unref);
+
+    response = device_caps_command (device, MBIM_MESSAGE_COMMAND_TYPE_SET, &inner_error);
+    if (response || !g_error_matches (inner_error, MBIM_STATUS_ERROR, MBIM_STATUS_ERROR_NO_DEVICE_SUPPORT)) {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "device caps set not reported as unsupported: %s",
+                     inner_error ? inner_error->message : "succeeded");
+        return FALSE;
+    }
+
+    return mbim_device_close_sync (device, TIMEOUT_SECS, NULL, error);
+}
+
+int main (int argc, char **argv)
+{
+    g_autoptr(GOptionContext) context = NULL;
+    g_autoptr(GError)         error = NULL;
+    g_autoptr(GSubprocess)    sim = NULL;
+    g_autofree gchar         *dir = NULL;
+    g_autofree gchar         *port_path = NULL;
+    gboolean                  success = TRUE;
+    guint                     i;
+
+    context = g_option_context_new ("- test the simulator with mbimcli");
+    g_option_context_add_main_entries (context, entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_printerr ("error: %s\n", error->message);
+        return EXIT_FAILURE;
+    }
+
+    if (!sim_path || !mbimcli_path) {
+        g_printerr ("error: invalid arguments\n");
+        return EXIT_FAILURE;
+    }
+
+    dir = g_dir_make_tmp ("test-mbim-sim-XXXXXX", &error);
+    if (!dir) {
+        g_printerr ("error: %s\n", error->message);
+        return EXIT_FAILURE;
+    }
+    port_path = g_build_filename (dir, "cdc-wdm0", NULL);
+
+    if (!check_link_not_replaced (port_path, &error)) {
+        g_printerr ("error: %s\n", error ? error->message : g_strerror (errno));
+        success = FALSE;
+        goto out;
+    }
+
+    /* A stale symlink, e.g. left by a previous run, is replaced */
+    if (symlink ("/nonexistent", port_path) < 0) {
+        g_printerr ("error: couldn't create symlink: %s\n", g_strerror (errno));
+        success = FALSE;
+        goto out;
+    }
+
+    sim = sim_start (port_path, &error);
+    if (!sim) {
+        g_printerr ("error: couldn't start the simulator: %s\n", error->message);
+        success = FALSE;
+        goto out;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS (mbimcli_commands) && success; i++) {
+        if (!run_mbimcli (port_path, mbimcli_commands[i], &error)) {
+            g_printerr ("error: %s\n", error->message);
+            success = FALSE;
+        }
+    }
+
+    if (success && !check_command_types (port_path, &error)) {
+        g_printerr ("error: %s\n", error->message);
+        success = FALSE;
+    }
+
+    /* The simulator removes its own symlink when exiting */
+    g_subprocess_send_signal (sim, SIGTERM);
+    g_subprocess_wait (sim, NULL, NULL);
+    if (g_file_test (port_path, G_FILE_TEST_IS_SYMLINK)) {
+        g_printerr ("error: symlink left behind\n");
+        success = FALSE;
+    }
+
+out:
+    g_unlink (port_path);
+    g_rmdir (dir);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -38,14 +38,19 @@ static gboolean operation_status;
 /* Main options */
 static gchar *device_str;
 static gboolean device_open_proxy_flag;
+static gboolean device_open_proxy_shm_flag;
 static gboolean device_open_ms_mbimex_v2_flag;
 static gboolean device_open_ms_mbimex_v3_flag;
+static gboolean device_open_fast_flag;
+static gboolean device_open_pipelined_flag;
 static gchar *no_open_str;
 static gboolean no_close_flag;
 static gboolean noop_flag;
+static gboolean query_proxy_memory_usage_flag;
 static gboolean verbose_flag;
 static gboolean verbose_full_flag;
 static gboolean silent_flag;
+static gint trace_queue_size;
 static gboolean version_flag;
 
 static GOptionEntry main_entries[] = {
@@ -57,6 +62,10 @@ static GOptionEntry main_entries[] = {
       "Request to use the 'mbim-proxy' proxy",
       NULL
     },
+    { "device-open-proxy-shm", 0, 0, G_OPTION_ARG_NONE, &device_open_proxy_shm_flag,
+      "Request to use shared memory to talk to the 'mbim-proxy' proxy",
+      NULL
+    },
     { "device-open-ms-mbimex-v2", 0, 0, G_OPTION_ARG_NONE, &device_open_ms_mbimex_v2_flag,
       "Request to enable Microsoft MBIMEx v2.0 support",
       NULL
@@ -65,6 +74,14 @@ static GOptionEntry main_entries[] = {
       "Request to enable Microsoft MBIMEx v3.0 support",
       NULL
     },
+    { "device-open-fast", 0, 0, G_OPTION_ARG_NONE, &device_open_fast_flag,
+      "Request to use the cached results of previous open operations",
+      NULL
+    },
+    { "device-open-pipelined", 0, 0, G_OPTION_ARG_NONE, &device_open_pipelined_flag,
+      "Request to run the queries after the open operation in parallel",
+      NULL
+    },
     { "no-open", 0, 0, G_OPTION_ARG_STRING, &no_open_str,
       "Do not explicitly open the MBIM device before running the command",
       "[Transaction ID]"
@@ -77,6 +94,10 @@ static GOptionEntry main_entries[] = {
       "Don't run any command",
       NULL
     },
+    { "query-proxy-memory-usage", 0, 0, G_OPTION_ARG_NONE, &query_proxy_memory_usage_flag,
+      "Query the memory used by the 'mbim-proxy' for the device and its clients",
+      NULL
+    },
     { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose_flag,
       "Run action with verbose logs, including the debug ones",
       NULL
@@ -89,6 +110,10 @@ static GOptionEntry main_entries[] = {
       "Run action with no logs; not even the error/warning ones",
       NULL
     },
+    { "trace-queue-size", 0, 0, G_OPTION_ARG_INT, &trace_queue_size,
+      "Write verbose logs from a separate thread, with at most this many records waiting. If set to 0, write them synchronously (default).",
+      "[N]"
+    },
     { "version", 'V', 0, G_OPTION_ARG_NONE, &version_flag,
       "Print version",
       NULL
@@ -119,10 +144,9 @@ signals_handler (gpointer psignum)
 }
 
 static void
-log_handler (const gchar *log_domain,
-             GLogLevelFlags log_level,
-             const gchar *message,
-             gpointer user_data)
+log_print (gint64 timestamp,
+           GLogLevelFlags log_level,
+           const gchar *message)
 {
     const gchar *log_level_str;
     time_t now;
@@ -130,11 +154,7 @@ log_handler (const gchar *log_domain,
     struct tm *local_time;
     gboolean err;
 
-    /* Nothing to do if we're silent */
-    if (silent_flag)
-        return;
-
-    now = time ((time_t *) NULL);
+    now = (time_t) (timestamp / G_USEC_PER_SEC);
     local_time = localtime (&now);
     strftime (time_str, 64, "%d %b %Y, %H:%M:%S", local_time);
     err = FALSE;
@@ -167,9 +187,6 @@ log_handler (const gchar *log_domain,
         g_assert_not_reached ();
     }
 
-    if (!verbose_flag && !verbose_full_flag && !err)
-        return;
-
     g_fprintf (err ? stderr : stdout,
                "[%s] %s %s\n",
                time_str,
@@ -177,6 +194,39 @@ log_handler (const gchar *log_domain,
                message);
 }
 
+static void
+trace_sink_func (gint64 timestamp,
+                 GLogLevelFlags log_level,
+                 const gchar *message,
+                 gpointer user_data)
+{
+    log_print (timestamp, log_level, message);
+}
+
+static void
+log_handler (const gchar *log_domain,
+             GLogLevelFlags log_level,
+             const gchar *message,
+             gpointer user_data)
+{
+    gboolean err;
+
+    /* Nothing to do if we're silent */
+    if (silent_flag)
+        return;
+
+    err = !!(log_level & (G_LOG_LEVEL_WARNING | G_LOG_LEVEL_CRITICAL | G_LOG_LEVEL_ERROR));
+    if (!verbose_flag && !verbose_full_flag && !err)
+        return;
+
+    /* Warnings and errors are printed right away, everything else goes
+     * through the trace sink thread if running */
+    if (!err && mbim_utils_trace_sink_push (log_level, message))
+        return;
+
+    log_print (g_get_real_time (), log_level, message);
+}
+
 G_GNUC_NORETURN
 static void
 print_version_and_exit (void)
@@ -244,6 +294,49 @@ mbimcli_async_operation_done (gboolean reported_operation_status)
                        NULL);
 }
 
+static void
+query_proxy_memory_usage_ready (MbimDevice   *dev,
+                                GAsyncResult *res)
+{
+    g_autoptr(GError)      error = NULL;
+    g_autoptr(GArray)      client_memory_usage = NULL;
+    MbimDeviceMemoryUsage  device_memory_usage;
+    guint                  i;
+
+    if (!mbim_device_query_proxy_memory_usage_finish (dev, res, &device_memory_usage, &client_memory_usage, &error)) {
+        g_printerr ("error: couldn't query proxy memory usage: %s\n", error->message);
+        mbimcli_async_operation_done (FALSE);
+        return;
+    }
+
+    g_print ("[%s] Proxy memory usage (current/peak bytes):\n"
+             "\t        Device receive buffer: '%" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT "'\n"
+             "\t Device pending transactions: '%" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT "'\n"
+             "\t              Device outbound: '%" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT "'\n",
+             mbim_device_get_path_display (dev),
+             device_memory_usage.receive_buffer, device_memory_usage.receive_buffer_peak,
+             device_memory_usage.pending_transactions, device_memory_usage.pending_transactions_peak,
+             device_memory_usage.outbound, device_memory_usage.outbound_peak);
+
+    for (i = 0; i < client_memory_usage->len; i++) {
+        const MbimProxyClientMemoryUsage *client;
+
+        client = &g_array_index (client_memory_usage, MbimProxyClientMemoryUsage, i);
+        g_print ("\t[client %" G_GUINT64_FORMAT "]\n"
+                 "\t               Receive buffer: '%" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT "'\n"
+                 "\t             Pending requests: '%" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT "'\n"
+                 "\t                     Outbound: '%" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT "'\n"
+                 "\t                Subscriptions: '%" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT "'\n",
+                 client->client_id,
+                 client->receive_buffer, client->receive_buffer_peak,
+                 client->pending_requests, client->pending_requests_peak,
+                 client->outbound, client->outbound_peak,
+                 client->subscriptions, client->subscriptions_peak);
+    }
+
+    mbimcli_async_operation_done (TRUE);
+}
+
 static void
 device_open_ready (MbimDevice   *dev,
                    GAsyncResult *res)
@@ -265,6 +358,16 @@ device_open_ready (MbimDevice   *dev,
         return;
     }
 
+    /* Proxy memory usage query? */
+    if (query_proxy_memory_usage_flag) {
+        mbim_device_query_proxy_memory_usage (dev,
+                                              10,
+                                              cancellable,
+                                              (GAsyncReadyCallback) query_proxy_memory_usage_ready,
+                                              NULL);
+        return;
+    }
+
     /* Link management action? */
     if (mbimcli_link_management_options_enabled ()) {
         mbimcli_link_management_run (dev, cancellable);
@@ -365,10 +468,16 @@ device_new_ready (GObject      *unused,
     /* Setup device open flags */
     if (device_open_proxy_flag)
         open_flags |= MBIM_DEVICE_OPEN_FLAGS_PROXY;
+    if (device_open_proxy_shm_flag)
+        open_flags |= (MBIM_DEVICE_OPEN_FLAGS_PROXY | MBIM_DEVICE_OPEN_FLAGS_PROXY_SHARED_MEMORY);
     if (device_open_ms_mbimex_v2_flag)
         open_flags |= MBIM_DEVICE_OPEN_FLAGS_MS_MBIMEX_V2;
     if (device_open_ms_mbimex_v3_flag)
         open_flags |= MBIM_DEVICE_OPEN_FLAGS_MS_MBIMEX_V3;
+    if (device_open_fast_flag)
+        open_flags |= MBIM_DEVICE_OPEN_FLAGS_FAST_OPEN;
+    if (device_open_pipelined_flag)
+        open_flags |= MBIM_DEVICE_OPEN_FLAGS_PIPELINED;
 
     /* Open the device */
     mbim_device_open_full (device,
@@ -468,6 +577,15 @@ parse_actions (void)
     if (noop_flag)
         actions_enabled++;
 
+    /* Proxy memory usage */
+    if (query_proxy_memory_usage_flag) {
+        if (!device_open_proxy_flag && !device_open_proxy_shm_flag) {
+            g_printerr ("error: --query-proxy-memory-usage requires the 'mbim-proxy'\n");
+            exit (EXIT_FAILURE);
+        }
+        actions_enabled++;
+    }
+
     /* Cannot mix actions from different services */
     if (actions_enabled > 1) {
         g_printerr ("error: cannot execute multiple actions of different services\n");
@@ -537,6 +655,12 @@ int main (int argc, char **argv)
         mbim_utils_set_show_personal_info (TRUE);
     }
 
+    /* The sink is also flushed when exiting early on errors */
+    if ((verbose_flag || verbose_full_flag) &&
+        trace_queue_size > 0 &&
+        mbim_utils_trace_sink_start ((guint) trace_queue_size, trace_sink_func, NULL))
+        atexit (mbim_utils_trace_sink_stop);
+
     /* No device path given? */
     if (!device_str) {
         g_printerr ("error: no device path specified\n");
@@ -567,5 +691,7 @@ int main (int argc, char **argv)
         g_object_unref (device);
     g_main_loop_unref (loop);
 
+    mbim_utils_trace_sink_stop ();
+
     return (operation_status ? EXIT_SUCCESS : EXIT_FAILURE);
 }